@@ -0,0 +1,1277 @@
+/* live-f1
+ *
+ * archive.c - compact archives of a session's changes
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "clock.h"
+#include "display.h"
+#include "intern.h"
+#include "packet.h"
+#include "record.h"
+#include "session.h"
+#include "archive.h"
+
+
+/* Number of fastest lap strings, and room for strings to begin with */
+#define NUM_FL         4
+#define ARCHIVE_STRINGS 256
+
+
+/**
+ * ArchiveRecord:
+ *
+ * Kinds of record in an archive.  Each is a byte giving the kind in the
+ * low four bits (and for those with a value, its ArchiveValue in the
+ * high four), followed by:
+ *
+ * REC_TIME: milliseconds since the last REC_TIME or REC_RESET,
+ * REC_RESET: milliseconds since the start; the state is emptied and
+ *   the whole of it follows,
+ * REC_CARS: number of cars,
+ * REC_NUMBER: ArchiveField byte and the value, zig-zag encoded,
+ * REC_STRING: fastest lap string number and the value,
+ * REC_POSITION: car number and position bytes,
+ * REC_ATOM: the cell, ((car - 1) * LAST_CAR_PACKET + atom type) * 16
+ *   + colour, and the value.
+ *
+ * Numbers are varints, seven bits to a byte with the top bit set on all
+ * but the last.  Records from one REC_TIME or REC_RESET up to the next
+ * are a group, all applied at once.
+ **/
+typedef enum {
+	REC_TIME,
+	REC_RESET,
+	REC_CARS,
+	REC_NUMBER,
+	REC_STRING,
+	REC_POSITION,
+	REC_ATOM
+} ArchiveRecord;
+
+/**
+ * ArchiveValue:
+ *
+ * How the text of an atom or string is stored: not at all if it's
+ * empty, as a varint if it's a number, lap time (milliseconds) or
+ * decimal (preceded by a byte with the number of places and whether it
+ * has a plus sign), otherwise as the varint index of the string in the
+ * archive's string table.  Text is only stored as a number if it can be
+ * printed back exactly.  VALUE_SAME means only the colour of an atom
+ * changed, and the text isn't stored at all.
+ **/
+typedef enum {
+	VALUE_EMPTY,
+	VALUE_INT,
+	VALUE_TIME,
+	VALUE_DECIMAL,
+	VALUE_STRING,
+	VALUE_SAME
+} ArchiveValue;
+
+/**
+ * ArchiveField:
+ *
+ * Numbers in the state stored by REC_NUMBER records; FIELD_CLOCK is
+ * whether the session clock is running, since when it started depends
+ * on when it's replayed.
+ **/
+typedef enum {
+	FIELD_EVENT_NO,
+	FIELD_EVENT_TYPE,
+	FIELD_LAPS_COMPLETED,
+	FIELD_TOTAL_LAPS,
+	FIELD_FLAG,
+	FIELD_TRACK_TEMP,
+	FIELD_AIR_TEMP,
+	FIELD_HUMIDITY,
+	FIELD_WIND_SPEED,
+	FIELD_WIND_DIRECTION,
+	FIELD_PRESSURE,
+	FIELD_REMAINING_TIME,
+	FIELD_CLOCK,
+	LAST_FIELD
+} ArchiveField;
+
+/**
+ * ArchiveImage:
+ *
+ * Copy of the state kept while writing an archive, so that only what
+ * changed need be written.
+ **/
+typedef struct {
+	long long numbers[LAST_FIELD];
+	char      fl[NUM_FL][16];
+	int       num_cars;
+	int       position[MAX_CARS];
+	CarAtom   atoms[MAX_CARS][LAST_CAR_PACKET];
+} ArchiveImage;
+
+/**
+ * ArchivePoint:
+ * @ms: milliseconds since the start,
+ * @offset: offset of the REC_RESET record in the archive.
+ *
+ * Place an archive can be replayed from.
+ **/
+typedef struct {
+	unsigned long long ms;
+	size_t             offset;
+} ArchivePoint;
+
+/**
+ * ArchiveTables:
+ * @strings: string table, only for one read back,
+ * @points: seek index.
+ *
+ * Tables at the end of an archive, being written or read back; the
+ * strings of one being written are interned in a pool instead.
+ **/
+typedef struct {
+	char         **strings;
+	size_t         nstrings, strings_sz;
+	ArchivePoint  *points;
+	size_t         npoints, points_sz;
+} ArchiveTables;
+
+/**
+ * Record:
+ *
+ * A record read back from an archive; @arg is the car number or field,
+ * @number any number and @text any value, unless @same is set.
+ **/
+typedef struct {
+	ArchiveRecord      kind;
+	int                arg, type, data, same;
+	long long          number;
+	char               text[16];
+} Record;
+
+
+/* Forward prototypes */
+static void           write_group    (void);
+static void           make_image     (ArchiveImage *img,
+				      const CurrentState *state);
+static long long      get_field      (const CurrentState *state,
+				      ArchiveField field);
+static void           set_field      (CurrentState *state, ArchiveField field,
+				      long long value);
+static const char    *fl_string      (const CurrentState *state, int i);
+static void           set_fl_string  (CurrentState *state, int i,
+				      const char *text);
+static void           put_byte       (int c);
+static void           put_varint     (unsigned long long value);
+static void           put_record     (ArchiveRecord kind, const char *text,
+				      unsigned int arg);
+static void           add_string     (ArchiveTables *tables, char *str);
+static void           add_point      (ArchiveTables *tables,
+				      unsigned long long ms, size_t offset);
+static ArchiveValue   classify       (const char *text,
+				      unsigned long long *value, int *flags);
+static void           format_value   (ArchiveValue type,
+				      unsigned long long value, int flags,
+				      char *text);
+static const unsigned char *get_varint (const unsigned char *ptr,
+					const unsigned char *end,
+					unsigned long long *value);
+static const unsigned char *get_record (const unsigned char *ptr,
+					const unsigned char *end,
+					Record *rec);
+
+
+/* Lengths of the fastest lap strings */
+static const size_t fl_len[NUM_FL] = {
+	FL_CAR_LEN, FL_DRIVER_LEN, FL_TIME_LEN, FL_LAP_LEN
+};
+
+
+/* Archive being written, and the name it's renamed to once finished */
+static FILE          *archive_file = NULL;
+static char          *archive_name = NULL, *archive_tmp = NULL;
+static unsigned long long archive_offset = 0;
+
+/* State as of the last group written, and as of the latest block for
+ * the group waiting to be written, which is for time @group_ms
+ */
+static ArchiveImage  *prev = NULL, *next = NULL;
+static unsigned long long last_ms = 0, point_ms = 0, group_ms = 0;
+static int            group_waiting = FALSE;
+
+/* Strings and places to replay from, being written and read; an
+ * archive can be replayed to write another
+ */
+static StringPool    *archive_strings = NULL;
+static ArchiveTables  written, loaded;
+
+
+/**
+ * open_archive:
+ * @filename: file to write the archive to.
+ *
+ * Begins writing an archive of the session being replayed, which is
+ * converted as fast as it can be parsed; archive_state() is called
+ * after each block, and close_archive() at the end.  Nothing is drawn
+ * meanwhile.
+ *
+ * The archive holds only the changes to the state, so replaying it
+ * needs neither decryption nor parsing of the data stream, and it's
+ * a fraction of the size of the recording.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_archive (const char *filename)
+{
+	static CurrentState nothing;
+	unsigned char       hdr[ARCHIVE_HEADER_LEN];
+
+	archive_name = strdup (filename);
+	archive_tmp = malloc (strlen (filename) + 5);
+	if ((! archive_name) || (! archive_tmp))
+		abort ();
+	strcpy (archive_tmp, filename);
+	strcat (archive_tmp, ".tmp");
+
+	archive_file = fopen (archive_tmp, "w");
+	if (! archive_file)
+		return 1;
+
+	prev = malloc (sizeof (ArchiveImage));
+	next = malloc (sizeof (ArchiveImage));
+	if ((! prev) || (! next))
+		abort ();
+
+	archive_strings = new_string_pool (ARCHIVE_STRINGS);
+
+	/* Filled in by close_archive() */
+	memset (hdr, 0, sizeof (hdr));
+	fwrite (hdr, 1, sizeof (hdr), archive_file);
+	archive_offset = sizeof (hdr);
+
+	show_state (&nothing);
+
+	return 0;
+}
+
+/**
+ * archiving:
+ *
+ * Returns: TRUE if we're writing an archive.
+ **/
+int
+archiving (void)
+{
+	return (archive_file != NULL);
+}
+
+/**
+ * archive_state:
+ * @state: application state structure,
+ * @ms: milliseconds since the start of the session.
+ *
+ * Called after each block; blocks at the same time make up one group,
+ * so the state is only written once the time moves on (or the archive
+ * is closed), and then only what changed since the last group.
+ **/
+void
+archive_state (const CurrentState *state,
+	       unsigned long long  ms)
+{
+	if (! archive_file)
+		return;
+
+	if (group_waiting && (ms != group_ms))
+		write_group ();
+
+	make_image (next, state);
+	group_ms = ms;
+	group_waiting = TRUE;
+}
+
+/**
+ * write_group:
+ *
+ * Writes the group waiting, the changes from the state as of the last
+ * group to that as of the latest block.  Every ARCHIVE_SEEK_INTERVAL
+ * seconds the whole state is written instead, and that place added to
+ * the seek index.
+ **/
+static void
+write_group (void)
+{
+	ArchiveImage       *img;
+	unsigned long long  ms = group_ms;
+	unsigned int        cell;
+	int                 timed, i, j;
+
+	group_waiting = FALSE;
+
+	if ((! written.npoints)
+	    || (ms >= point_ms + ARCHIVE_SEEK_INTERVAL * 1000)) {
+		add_point (&written, ms, archive_offset);
+		put_byte (REC_RESET);
+		put_varint (ms);
+
+		memset (prev, 0, sizeof (ArchiveImage));
+		last_ms = point_ms = ms;
+		timed = TRUE;
+	} else {
+		timed = FALSE;
+	}
+
+#define BEGIN_CHANGE()				\
+	if (! timed) {				\
+		put_byte (REC_TIME);		\
+		put_varint (ms - last_ms);	\
+		last_ms = ms;			\
+		timed = TRUE;			\
+	}
+
+	if (next->num_cars != prev->num_cars) {
+		BEGIN_CHANGE ();
+		put_byte (REC_CARS);
+		put_varint (next->num_cars);
+	}
+
+	for (i = 0; i < LAST_FIELD; i++) {
+		long long value = next->numbers[i];
+
+		if (value == prev->numbers[i])
+			continue;
+
+		BEGIN_CHANGE ();
+		put_byte (REC_NUMBER);
+		put_byte (i);
+		put_varint (((unsigned long long) value << 1) ^ (value >> 63));
+	}
+
+	for (i = 0; i < NUM_FL; i++) {
+		if (! strcmp (next->fl[i], prev->fl[i]))
+			continue;
+
+		BEGIN_CHANGE ();
+		put_record (REC_STRING, next->fl[i], i);
+	}
+
+	for (i = 0; i < next->num_cars; i++) {
+		if (next->position[i] == prev->position[i])
+			continue;
+
+		BEGIN_CHANGE ();
+		put_byte (REC_POSITION);
+		put_byte (i + 1);
+		put_byte (next->position[i]);
+	}
+
+	for (i = 0; i < next->num_cars; i++) {
+		for (j = 0; j < LAST_CAR_PACKET; j++) {
+			const CarAtom *atom = &next->atoms[i][j];
+
+			if ((atom->data == prev->atoms[i][j].data)
+			    && (! strcmp (atom->text, prev->atoms[i][j].text)))
+				continue;
+
+			/* Colours fit in four bits */
+			BEGIN_CHANGE ();
+			cell = ((i * LAST_CAR_PACKET + j) << 4) | (atom->data & 0x0f);
+			if (! strcmp (atom->text, prev->atoms[i][j].text)) {
+				put_byte (REC_ATOM | (VALUE_SAME << 4));
+				put_varint (cell);
+			} else {
+				put_record (REC_ATOM, atom->text, cell);
+			}
+		}
+	}
+
+#undef BEGIN_CHANGE
+
+	img = prev;
+	prev = next;
+	next = img;
+}
+
+/**
+ * close_archive:
+ *
+ * Finishes the archive by writing the string table and seek index after
+ * the records, and then the header saying where they are; the archive
+ * only replaces any existing file once it's complete.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+close_archive (void)
+{
+	unsigned char      hdr[ARCHIVE_HEADER_LEN];
+	unsigned long long strings_offset, index_offset;
+	size_t             i, nstrings;
+	int                ret = 0;
+
+	if (! archive_file)
+		return 0;
+
+	if (group_waiting)
+		write_group ();
+
+	/* The empty string is never in the table, so each string's
+	 * index is one less than its handle
+	 */
+	nstrings = string_count (archive_strings) - 1;
+
+	strings_offset = archive_offset;
+	put_varint (nstrings);
+	for (i = 0; i < nstrings; i++) {
+		const char *str = string_text (archive_strings, i + 1);
+		size_t      len = strlen (str);
+
+		put_varint (len);
+		fwrite (str, 1, len, archive_file);
+		archive_offset += len;
+	}
+	free_string_pool (archive_strings);
+	archive_strings = NULL;
+
+	index_offset = archive_offset;
+	put_varint (written.npoints);
+	for (i = 0; i < written.npoints; i++) {
+		const ArchivePoint *point = &written.points[i];
+
+		put_varint (point->ms - (i ? point[-1].ms : 0));
+		put_varint (point->offset - (i ? point[-1].offset : 0));
+	}
+
+	memset (hdr, 0, sizeof (hdr));
+	memcpy (hdr, ARCHIVE_MAGIC, 8);
+	put_le (hdr + 8, ARCHIVE_VERSION, 4);
+	put_le (hdr + 16, strings_offset, 8);
+	put_le (hdr + 24, index_offset, 8);
+
+	if (fseek (archive_file, 0, SEEK_SET)
+	    || (fwrite (hdr, 1, sizeof (hdr), archive_file) != sizeof (hdr)))
+		ret = 1;
+	if (fclose (archive_file))
+		ret = 1;
+	archive_file = NULL;
+
+	if (ret || rename (archive_tmp, archive_name)) {
+		unlink (archive_tmp);
+		return 1;
+	}
+
+	info (1, _("Archived %u strings and %u seek points in %llu bytes\n"),
+	      (unsigned int) nstrings, (unsigned int) written.npoints,
+	      archive_offset);
+	return 0;
+}
+
+
+/**
+ * make_image:
+ * @img: image to fill,
+ * @state: application state structure.
+ *
+ * Copies the parts of @state that are archived into @img.
+ **/
+static void
+make_image (ArchiveImage       *img,
+	    const CurrentState *state)
+{
+	int i, j;
+
+	memset (img, 0, sizeof (ArchiveImage));
+
+	for (i = 0; i < LAST_FIELD; i++)
+		img->numbers[i] = get_field (state, i);
+
+	for (i = 0; i < NUM_FL; i++) {
+		const char *str = fl_string (state, i);
+
+		if (str)
+			memcpy (img->fl[i], str, fl_len[i]);
+	}
+
+	img->num_cars = MIN (state->num_cars, MAX_CARS);
+	for (i = 0; i < img->num_cars; i++) {
+		img->position[i] = state->car_position[i];
+		for (j = 0; j < LAST_CAR_PACKET; j++)
+			get_atom (state, i + 1, j, &img->atoms[i][j]);
+	}
+}
+
+/**
+ * get_field:
+ * @state: application state structure,
+ * @field: number wanted.
+ *
+ * Returns: the number in @state.
+ **/
+static long long
+get_field (const CurrentState *state,
+	   ArchiveField        field)
+{
+	switch (field) {
+	case FIELD_EVENT_NO:
+		return state->event_no;
+	case FIELD_EVENT_TYPE:
+		return state->event_type;
+	case FIELD_LAPS_COMPLETED:
+		return state->laps_completed;
+	case FIELD_TOTAL_LAPS:
+		return state->total_laps;
+	case FIELD_FLAG:
+		return state->flag;
+	case FIELD_TRACK_TEMP:
+		return state->track_temp;
+	case FIELD_AIR_TEMP:
+		return state->air_temp;
+	case FIELD_HUMIDITY:
+		return state->humidity;
+	case FIELD_WIND_SPEED:
+		return state->wind_speed;
+	case FIELD_WIND_DIRECTION:
+		return state->wind_direction;
+	case FIELD_PRESSURE:
+		return state->pressure;
+	case FIELD_REMAINING_TIME:
+		return state->remaining_time;
+	case FIELD_CLOCK:
+		return (state->epoch_time != 0);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * set_field:
+ * @state: application state structure,
+ * @field: number to set,
+ * @value: value to set it to.
+ *
+ * Sets the number in @state; the session clock, when running, is taken
+ * to have been set now.
+ **/
+static void
+set_field (CurrentState *state,
+	   ArchiveField  field,
+	   long long     value)
+{
+	switch (field) {
+	case FIELD_EVENT_NO:
+		state->event_no = value;
+		break;
+	case FIELD_EVENT_TYPE:
+		state->event_type = value;
+		break;
+	case FIELD_LAPS_COMPLETED:
+		state->laps_completed = value;
+		break;
+	case FIELD_TOTAL_LAPS:
+		state->total_laps = value;
+		break;
+	case FIELD_FLAG:
+		state->flag = value;
+		break;
+	case FIELD_TRACK_TEMP:
+		state->track_temp = value;
+		break;
+	case FIELD_AIR_TEMP:
+		state->air_temp = value;
+		break;
+	case FIELD_HUMIDITY:
+		state->humidity = value;
+		break;
+	case FIELD_WIND_SPEED:
+		state->wind_speed = value;
+		break;
+	case FIELD_WIND_DIRECTION:
+		state->wind_direction = value;
+		break;
+	case FIELD_PRESSURE:
+		state->pressure = value;
+		break;
+	case FIELD_REMAINING_TIME:
+		state->remaining_time = value;
+		if (state->epoch_time)
+			state->epoch_time = now_seconds ();
+		break;
+	case FIELD_CLOCK:
+		state->epoch_time = value ? now_seconds () : 0;
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * fl_string:
+ * @state: application state structure,
+ * @i: which fastest lap string.
+ *
+ * Returns: the fastest lap string, which may be NULL.
+ **/
+static const char *
+fl_string (const CurrentState *state,
+	   int                 i)
+{
+	switch (i) {
+	case 0:
+		return state->fl_car;
+	case 1:
+		return (state->strings
+			? string_text (state->strings, state->fl_driver)
+			: NULL);
+	case 2:
+		return state->fl_time;
+	default:
+		return state->fl_lap;
+	}
+}
+
+/**
+ * set_fl_string:
+ * @state: application state structure,
+ * @i: which fastest lap string,
+ * @text: what to set it to.
+ *
+ * Sets one of the fastest lap strings, cutting @text short if it's too
+ * long; does nothing if there's nowhere to put it yet.
+ **/
+static void
+set_fl_string (CurrentState *state,
+	       int           i,
+	       const char   *text)
+{
+	char *str;
+
+	switch (i) {
+	case 0:
+		str = state->fl_car;
+		break;
+	case 1:
+		if (state->strings)
+			state->fl_driver = intern_text (state, text, fl_len[i]);
+		return;
+	case 2:
+		str = state->fl_time;
+		break;
+	default:
+		str = state->fl_lap;
+		break;
+	}
+
+	if (! str)
+		return;
+
+	memset (str, 0, fl_len[i]);
+	memcpy (str, text, MIN (strlen (text), fl_len[i]));
+}
+
+
+/**
+ * put_byte:
+ * @c: byte to write.
+ *
+ * Writes a byte to the archive.
+ **/
+static void
+put_byte (int c)
+{
+	putc (c, archive_file);
+	archive_offset++;
+}
+
+/**
+ * put_varint:
+ * @value: number to write.
+ *
+ * Writes a number to the archive, seven bits at a time starting with
+ * the lowest.
+ **/
+static void
+put_varint (unsigned long long value)
+{
+	while (value >= 0x80) {
+		put_byte ((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+
+	put_byte (value);
+}
+
+/**
+ * put_record:
+ * @kind: kind of record,
+ * @text: value,
+ * @arg: number between the kind and the value.
+ *
+ * Writes a record with a value, choosing how to store it.
+ **/
+static void
+put_record (ArchiveRecord  kind,
+	    const char    *text,
+	    unsigned int   arg)
+{
+	unsigned long long value = 0;
+	ArchiveValue       type;
+	int                flags = 0;
+
+	type = classify (text, &value, &flags);
+
+	put_byte (kind | (type << 4));
+	put_varint (arg);
+
+	switch (type) {
+	case VALUE_EMPTY:
+	case VALUE_SAME:
+		break;
+	case VALUE_DECIMAL:
+		put_byte (flags);
+		/* fall through */
+	case VALUE_INT:
+	case VALUE_TIME:
+		put_varint (value);
+		break;
+	case VALUE_STRING:
+		put_varint (intern_string (archive_strings, text,
+					   ATOM_TEXT_LEN) - 1);
+		break;
+	}
+}
+
+/**
+ * add_string:
+ * @tables: tables to add to,
+ * @str: string.
+ *
+ * Adds @str to the end of the string table.
+ **/
+static void
+add_string (ArchiveTables *tables,
+	    char          *str)
+{
+	if (tables->nstrings == tables->strings_sz) {
+		tables->strings_sz = (tables->strings_sz
+				      ? tables->strings_sz * 2 : 64);
+		tables->strings = realloc (tables->strings, (sizeof (char *)
+							     * tables->strings_sz));
+		if (! tables->strings)
+			abort ();
+	}
+
+	tables->strings[tables->nstrings++] = str;
+}
+
+/**
+ * add_point:
+ * @tables: tables to add to,
+ * @ms: milliseconds since the start,
+ * @offset: offset in the archive.
+ *
+ * Adds a place to replay from to the seek index.
+ **/
+static void
+add_point (ArchiveTables      *tables,
+	   unsigned long long  ms,
+	   size_t              offset)
+{
+	if (tables->npoints == tables->points_sz) {
+		tables->points_sz = (tables->points_sz
+				     ? tables->points_sz * 2 : 64);
+		tables->points = realloc (tables->points, (sizeof (ArchivePoint)
+							   * tables->points_sz));
+		if (! tables->points)
+			abort ();
+	}
+
+	tables->points[tables->npoints].ms = ms;
+	tables->points[tables->npoints].offset = offset;
+	tables->npoints++;
+}
+
+/**
+ * classify:
+ * @text: text of an atom or string,
+ * @value: pointer to store number in,
+ * @flags: pointer to store extra information in.
+ *
+ * Works out how @text can be stored; it's tried as each kind of number
+ * in turn, and only stored as one if printing it again with
+ * format_value() gives back exactly the same text.
+ *
+ * Returns: how to store @text.
+ **/
+static ArchiveValue
+classify (const char         *text,
+	  unsigned long long *value,
+	  int                *flags)
+{
+	unsigned int  mins, secs, msecs;
+	const char   *dot, *digits;
+	char          check[32];
+	size_t        len, places;
+
+	*flags = 0;
+
+	len = strlen (text);
+	if (! len)
+		return VALUE_EMPTY;
+
+	if ((len <= 9) && (strspn (text, "0123456789") == len)) {
+		*value = strtoull (text, NULL, 10);
+		format_value (VALUE_INT, *value, 0, check);
+		if (! strcmp (check, text))
+			return VALUE_INT;
+	}
+
+	if ((len <= 9)
+	    && (sscanf (text, "%u:%u.%u", &mins, &secs, &msecs) == 3)) {
+		*value = mins * 60000ULL + secs * 1000ULL + msecs;
+		format_value (VALUE_TIME, *value, 0, check);
+		if (! strcmp (check, text))
+			return VALUE_TIME;
+	}
+
+	digits = (text[0] == '+') ? text + 1 : text;
+	dot = strchr (digits, '.');
+	places = dot ? strlen (dot + 1) : 0;
+	if (dot && (places >= 1) && (places <= 3) && (len <= 9)
+	    && (strspn (digits, "0123456789") == (size_t) (dot - digits))
+	    && (strspn (dot + 1, "0123456789") == places)) {
+		*flags = ((text[0] == '+') << 2) | (places - 1);
+		*value = strtoull (digits, NULL, 10);
+		while (places--)
+			*value *= 10;
+		*value += strtoull (dot + 1, NULL, 10);
+
+		format_value (VALUE_DECIMAL, *value, *flags, check);
+		if (! strcmp (check, text))
+			return VALUE_DECIMAL;
+	}
+
+	return VALUE_STRING;
+}
+
+/**
+ * format_value:
+ * @type: how the value is stored,
+ * @value: number stored,
+ * @flags: extra information stored,
+ * @text: buffer of at least 32 bytes to print into.
+ *
+ * Prints a number stored by classify() back as text.
+ **/
+static void
+format_value (ArchiveValue        type,
+	      unsigned long long  value,
+	      int                 flags,
+	      char               *text)
+{
+	unsigned long long div = 1;
+	int                places;
+
+	switch (type) {
+	case VALUE_INT:
+		sprintf (text, "%llu", value);
+		break;
+	case VALUE_TIME:
+		sprintf (text, "%llu:%02llu.%03llu", value / 60000,
+			 (value / 1000) % 60, value % 1000);
+		break;
+	case VALUE_DECIMAL:
+		for (places = (flags & 3) + 1; places; places--)
+			div *= 10;
+		sprintf (text, "%s%llu.%0*llu", (flags & 4) ? "+" : "",
+			 value / div, (flags & 3) + 1, value % div);
+		break;
+	default:
+		text[0] = 0;
+		break;
+	}
+}
+
+
+/**
+ * load_archive:
+ * @map: archive, mapped into memory,
+ * @size: size of @map,
+ * @end: pointer to store the end of the records in.
+ *
+ * Reads the string table and seek index of an archive, so that its
+ * records can be applied with apply_archive().
+ *
+ * Returns: 0 on success, non-zero if it's not an archive we can read.
+ **/
+int
+load_archive (const unsigned char *map,
+	      size_t               size,
+	      size_t              *end)
+{
+	unsigned long long   strings_offset, index_offset, count, value;
+	const unsigned char *ptr, *limit = map + size;
+	size_t               i;
+
+	if ((size < ARCHIVE_HEADER_LEN) || memcmp (map, ARCHIVE_MAGIC, 8)
+	    || (get_le (map + 8, 4) != ARCHIVE_VERSION))
+		return 1;
+
+	strings_offset = get_le (map + 16, 8);
+	index_offset = get_le (map + 24, 8);
+	if ((strings_offset < ARCHIVE_HEADER_LEN)
+	    || (index_offset < strings_offset) || (index_offset > size))
+		return 1;
+
+	ptr = get_varint (map + strings_offset, limit, &count);
+	for (i = 0; ptr && (i < count); i++) {
+		char *str;
+
+		ptr = get_varint (ptr, limit, &value);
+		if ((! ptr) || (value > (unsigned long long) (limit - ptr)))
+			return 1;
+
+		str = malloc (value + 1);
+		if (! str)
+			abort ();
+		memcpy (str, ptr, value);
+		str[value] = 0;
+		ptr += value;
+
+		add_string (&loaded, str);
+	}
+
+	ptr = get_varint (map + index_offset, limit, &count);
+	for (i = 0; ptr && (i < count); i++) {
+		unsigned long long ms, offset;
+
+		ptr = get_varint (ptr, limit, &ms);
+		if (ptr)
+			ptr = get_varint (ptr, limit, &offset);
+		if (! ptr)
+			return 1;
+
+		add_point (&loaded, (i ? loaded.points[i - 1].ms : 0) + ms,
+			   (i ? loaded.points[i - 1].offset : 0) + offset);
+	}
+
+	if (! ptr)
+		return 1;
+
+	*end = strings_offset;
+	return 0;
+}
+
+/**
+ * next_archive_group:
+ * @map: archive, mapped into memory,
+ * @end: end of the records,
+ * @offset: offset of the group, updated to that of the next,
+ * @len: pointer to store length of the group in,
+ * @ms: milliseconds since the start, updated to the group's.
+ *
+ * Finds the extent of the group of records at @offset, for indexing an
+ * archive before it's replayed.
+ *
+ * Returns: TRUE if there was a group at @offset.
+ **/
+int
+next_archive_group (const unsigned char *map,
+		    size_t               end,
+		    size_t              *offset,
+		    size_t              *len,
+		    unsigned long long  *ms)
+{
+	const unsigned char *ptr = map + *offset, *next_ptr;
+	Record               rec;
+
+	ptr = get_record (ptr, map + end, &rec);
+	if (! ptr)
+		return FALSE;
+
+	if (rec.kind == REC_RESET) {
+		*ms = rec.number;
+	} else if (rec.kind == REC_TIME) {
+		*ms += rec.number;
+	}
+
+	while ((next_ptr = get_record (ptr, map + end, &rec)) != NULL) {
+		if ((rec.kind == REC_TIME) || (rec.kind == REC_RESET))
+			break;
+
+		ptr = next_ptr;
+	}
+
+	*len = ptr - (map + *offset);
+	*offset = ptr - map;
+	return TRUE;
+}
+
+/**
+ * find_archive_point:
+ * @ms: milliseconds since the start.
+ *
+ * Finds the last place before @ms the archive can be replayed from, by
+ * binary search of its seek index.
+ *
+ * Returns: offset of the group to replay from.
+ **/
+size_t
+find_archive_point (unsigned long long ms)
+{
+	size_t lo = 0, hi = loaded.npoints;
+
+	if (! loaded.npoints)
+		return ARCHIVE_HEADER_LEN;
+
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (loaded.points[mid].ms <= ms) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return loaded.points[lo].offset;
+}
+
+/**
+ * apply_archive:
+ * @state: application state structure,
+ * @buf: group of records,
+ * @len: length of @buf.
+ *
+ * Applies a group of records to @state, then updates the display:
+ * the whole board if the cars or their positions changed, otherwise
+ * only the cells that did.
+ **/
+void
+apply_archive (CurrentState        *state,
+	       const unsigned char *buf,
+	       size_t               len)
+{
+	static unsigned char dirty[MAX_CARS][LAST_CAR_PACKET];
+	const unsigned char *end = buf + len;
+	Record               rec;
+	int                  board = 0, status = 0, clock = 0, cells = 0;
+	int                  i, j;
+
+	while ((buf = get_record (buf, end, &rec)) != NULL) {
+		switch (rec.kind) {
+		case REC_TIME:
+			break;
+		case REC_RESET:
+			set_num_cars (state, 0);
+			for (i = 0; i < LAST_FIELD; i++)
+				set_field (state, i, 0);
+			for (i = 0; i < NUM_FL; i++)
+				set_fl_string (state, i, "");
+
+			board = status = 1;
+			break;
+		case REC_CARS:
+			set_num_cars (state, MIN (rec.number, MAX_CARS));
+			board = 1;
+			break;
+		case REC_NUMBER:
+			set_field (state, rec.arg, rec.number);
+			if ((rec.arg == FIELD_REMAINING_TIME)
+			    || (rec.arg == FIELD_CLOCK)) {
+				clock = 1;
+			} else {
+				status = 1;
+			}
+			break;
+		case REC_STRING:
+			if (rec.arg >= NUM_FL)
+				break;
+
+			set_fl_string (state, rec.arg, rec.text);
+			status = 1;
+			break;
+		case REC_POSITION:
+			if ((rec.arg < 1) || (rec.arg > state->num_cars))
+				break;
+
+			state->car_position[rec.arg - 1] = rec.number;
+			board = 1;
+			break;
+		case REC_ATOM:
+			if ((rec.arg < 1) || (rec.arg > state->num_cars)
+			    || (rec.type >= LAST_CAR_PACKET))
+				break;
+
+			set_atom (state, rec.arg, rec.type, rec.data,
+				  rec.same ? NULL : rec.text);
+
+			if (! cells)
+				memset (dirty, 0, sizeof (dirty));
+			dirty[rec.arg - 1][rec.type] = cells = 1;
+			break;
+		}
+	}
+
+	if (board) {
+		clear_board (state);
+	} else if (cells) {
+		for (i = 0; i < state->num_cars; i++)
+			for (j = 0; j < LAST_CAR_PACKET; j++)
+				if (dirty[i][j])
+					update_cell (state, i + 1, j);
+	}
+
+	if (status)
+		update_status (state);
+	if (clock)
+		update_time (state);
+}
+
+/**
+ * get_varint:
+ * @ptr: varint to read,
+ * @end: end of the data,
+ * @value: pointer to store number in.
+ *
+ * Returns: pointer after the varint, or NULL if it runs past @end.
+ **/
+static const unsigned char *
+get_varint (const unsigned char *ptr,
+	    const unsigned char *end,
+	    unsigned long long  *value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while ((ptr < end) && (shift < 64)) {
+		*value |= (unsigned long long) (*ptr & 0x7f) << shift;
+		if (! (*(ptr++) & 0x80))
+			return ptr;
+
+		shift += 7;
+	}
+
+	return NULL;
+}
+
+/**
+ * get_record:
+ * @ptr: record to read,
+ * @end: end of the data,
+ * @rec: record to fill.
+ *
+ * Returns: pointer after the record, or NULL if there isn't a whole one.
+ **/
+static const unsigned char *
+get_record (const unsigned char *ptr,
+	    const unsigned char *end,
+	    Record              *rec)
+{
+	unsigned long long value;
+	ArchiveValue       type;
+	int                flags = 0;
+
+	if (ptr >= end)
+		return NULL;
+
+	memset (rec, 0, sizeof (Record));
+	rec->kind = *ptr & 0x0f;
+	type = *(ptr++) >> 4;
+
+	switch (rec->kind) {
+	case REC_TIME:
+	case REC_RESET:
+	case REC_CARS:
+		ptr = get_varint (ptr, end, &value);
+		rec->number = value;
+		return ptr;
+	case REC_NUMBER:
+		if (ptr >= end)
+			return NULL;
+		rec->arg = *(ptr++);
+
+		ptr = get_varint (ptr, end, &value);
+		rec->number = (long long) (value >> 1) ^ -(long long) (value & 1);
+		return ptr;
+	case REC_POSITION:
+		if (end - ptr < 2)
+			return NULL;
+		rec->arg = ptr[0];
+		rec->number = ptr[1];
+		return ptr + 2;
+	case REC_STRING:
+		ptr = get_varint (ptr, end, &value);
+		if (! ptr)
+			return NULL;
+		rec->arg = value;
+		break;
+	case REC_ATOM:
+		ptr = get_varint (ptr, end, &value);
+		if (! ptr)
+			return NULL;
+		rec->arg = (value >> 4) / LAST_CAR_PACKET + 1;
+		rec->type = (value >> 4) % LAST_CAR_PACKET;
+		rec->data = value & 0x0f;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (type == VALUE_SAME) {
+		rec->same = TRUE;
+		return ptr;
+	} else if (type == VALUE_DECIMAL) {
+		if (ptr >= end)
+			return NULL;
+		flags = *(ptr++);
+	}
+
+	if (type != VALUE_EMPTY) {
+		ptr = get_varint (ptr, end, &value);
+		if (! ptr)
+			return NULL;
+	}
+
+	if (type == VALUE_STRING) {
+		if (value < loaded.nstrings) {
+			strncpy (rec->text, loaded.strings[value],
+				 sizeof (rec->text) - 1);
+			rec->text[sizeof (rec->text) - 1] = 0;
+		}
+	} else {
+		char text[32];
+
+		format_value (type, value, flags, text);
+		strncpy (rec->text, text, sizeof (rec->text) - 1);
+		rec->text[sizeof (rec->text) - 1] = 0;
+	}
+
+	return ptr;
+}
@@ -0,0 +1,57 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_ARCHIVE_H
+#define LIVE_F1_ARCHIVE_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/* Identifies an archive, followed by the version */
+#define ARCHIVE_MAGIC      "LIVEF1AR"
+#define ARCHIVE_VERSION    1
+
+/* Size of the file header */
+#define ARCHIVE_HEADER_LEN 32
+
+/* Seconds between the places an archive can be replayed from */
+#define ARCHIVE_SEEK_INTERVAL 60
+
+
+SJR_BEGIN_EXTERN
+
+int    open_archive       (const char *filename);
+int    archiving          (void);
+void   archive_state      (const CurrentState *state, unsigned long long ms);
+int    close_archive      (void);
+
+int    load_archive       (const unsigned char *map, size_t size,
+			   size_t *end);
+int    next_archive_group (const unsigned char *map, size_t end,
+			   size_t *offset, size_t *len,
+			   unsigned long long *ms);
+size_t find_archive_point (unsigned long long ms);
+void   apply_archive      (CurrentState *state, const unsigned char *buf,
+			   size_t len);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_ARCHIVE_H */
@@ -0,0 +1,636 @@
+/* live-f1
+ *
+ * checkpoint.c - copies of the state for jumping around in time
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "intern.h"
+#include "packet.h"
+#include "session.h"
+#include "stream.h"
+#include "checkpoint.h"
+
+
+/* Number of checkpoints in a group, only the first is complete */
+#define GROUP_SIZE 16
+
+
+/**
+ * CheckpointKind:
+ *
+ * Whether an encoded checkpoint holds every atom, or only those that
+ * changed since the checkpoint before.
+ **/
+typedef enum {
+	CHECKPOINT_FULL,
+	CHECKPOINT_DELTA
+} CheckpointKind;
+
+/**
+ * CheckpointScalars:
+ *
+ * Everything in the state that's a plain number, along with the stream
+ * parser's; these are always copied in full, there's not enough to be
+ * worth doing otherwise.
+ **/
+typedef struct {
+	unsigned int key, salt, frame, event_no;
+	EventType    event_type;
+	time_t       remaining_time, epoch_time;
+	unsigned int laps_completed, total_laps;
+	FlagStatus   flag;
+
+	int          track_temp, air_temp, humidity;
+	int          wind_speed, wind_direction, pressure;
+
+	int          num_cars;
+
+	size_t       pbuf_len;
+	unsigned int crypt_offset;
+} CheckpointScalars;
+
+/**
+ * CheckpointImage:
+ *
+ * The state decoded from a checkpoint, in fixed-size arrays so that one
+ * can be compared with the next.
+ **/
+typedef struct checkpoint_image {
+	CheckpointScalars s;
+	unsigned char     pbuf[129];
+
+	char              fl_car[FL_CAR_LEN], fl_driver[FL_DRIVER_LEN];
+	char              fl_time[FL_TIME_LEN], fl_lap[FL_LAP_LEN];
+
+	int               position[MAX_CARS];
+	CarAtom           atoms[MAX_CARS][LAST_CAR_PACKET];
+} CheckpointImage;
+
+
+/* Forward prototypes */
+static void           make_image   (CheckpointImage *img,
+				    const CurrentState *state);
+static void           apply_image  (const CheckpointImage *img,
+				    CurrentState *state, StreamContext *ctx);
+static void           encode_image (CheckpointGroup *group,
+				    const CheckpointImage *img,
+				    const CheckpointImage *prev);
+static void           decode_image (CheckpointImage *img,
+				    const unsigned char *ptr);
+static unsigned char *reserve      (CheckpointGroup *group, size_t len);
+static void           drop_group   (Checkpoints *cps);
+
+
+/* Scratch image for the checkpoint being taken or restored */
+static CheckpointImage *scratch = NULL;
+
+
+/**
+ * init_checkpoints:
+ * @cps: checkpoints to initialise,
+ * @seconds: seconds between checkpoints,
+ * @packets: most packets between checkpoints,
+ * @limit: most memory to use.
+ *
+ * Initialises @cps; checkpoint_due() then says when another should be
+ * taken.  When the memory used goes over @limit the oldest group of
+ * checkpoints is forgotten.
+ **/
+void
+init_checkpoints (Checkpoints  *cps,
+		  unsigned int  seconds,
+		  unsigned int  packets,
+		  size_t        limit)
+{
+	memset (cps, 0, sizeof (Checkpoints));
+	cps->interval = seconds * 1000000000ULL;
+	cps->packets = packets;
+	cps->limit = limit;
+
+	if (! scratch) {
+		scratch = malloc (sizeof (CheckpointImage));
+		if (! scratch)
+			abort ();
+	}
+}
+
+/**
+ * checkpoint_due:
+ * @cps: checkpoints,
+ * @timestamp: time of the block just parsed.
+ *
+ * Checkpoints are taken every so often, or every so many packets if
+ * that's sooner, but never before the latest one (after jumping back).
+ *
+ * Returns: TRUE if it's time to take another checkpoint.
+ **/
+int
+checkpoint_due (const Checkpoints  *cps,
+		unsigned long long  timestamp)
+{
+	if (! cps->last)
+		return TRUE;
+	if (timestamp <= cps->last_time)
+		return FALSE;
+
+	return ((timestamp - cps->last_time >= cps->interval)
+		|| (stream_packets () - cps->last_packets >= cps->packets));
+}
+
+/**
+ * take_checkpoint:
+ * @cps: checkpoints,
+ * @state: application state structure,
+ * @timestamp: time of the block just parsed,
+ * @position: where to carry on parsing after restoring it.
+ *
+ * Takes a checkpoint of @state and of the stream parser's context as
+ * they are now.  Most checkpoints only hold the atoms that changed since
+ * the one before, which between checkpoints is few of them.
+ **/
+void
+take_checkpoint (Checkpoints        *cps,
+		 const CurrentState *state,
+		 unsigned long long  timestamp,
+		 unsigned long long  position)
+{
+	CheckpointGroup *group;
+	CheckpointImage *img;
+	Checkpoint      *cp;
+	size_t           used;
+
+	if (state->num_cars > MAX_CARS)
+		return;
+
+	make_image (scratch, state);
+
+	group = cps->ngroups ? &cps->groups[cps->ngroups - 1] : NULL;
+	if ((! group) || (! cps->last) || (group->npoints >= GROUP_SIZE)) {
+		cps->groups = realloc (cps->groups, (sizeof (CheckpointGroup)
+						     * (cps->ngroups + 1)));
+		if (! cps->groups)
+			abort ();
+
+		group = &cps->groups[cps->ngroups++];
+		memset (group, 0, sizeof (CheckpointGroup));
+	}
+
+	if (group->npoints == group->sz) {
+		cps->memory -= group->sz * sizeof (Checkpoint);
+		group->sz = group->sz ? group->sz * 2 : 4;
+		group->points = realloc (group->points,
+					 sizeof (Checkpoint) * group->sz);
+		if (! group->points)
+			abort ();
+		cps->memory += group->sz * sizeof (Checkpoint);
+	}
+
+	used = group->size;
+	cp = &group->points[group->npoints++];
+	cp->timestamp = timestamp;
+	cp->position = position;
+	cp->offset = group->len;
+	encode_image (group, scratch, (group->npoints > 1) ? cps->last : NULL);
+	cps->memory += group->size - used;
+
+	/* The one just taken is what the next is compared with */
+	img = cps->last;
+	cps->last = scratch;
+	scratch = img;
+	if (! scratch) {
+		scratch = malloc (sizeof (CheckpointImage));
+		if (! scratch)
+			abort ();
+	}
+
+	cps->last_time = timestamp;
+	cps->last_packets = stream_packets ();
+
+	while ((cps->memory > cps->limit) && (cps->ngroups > 1))
+		drop_group (cps);
+}
+
+/**
+ * find_checkpoint:
+ * @cps: checkpoints,
+ * @timestamp: time wanted,
+ * @position: earliest position that can be parsed from.
+ *
+ * Finds the latest checkpoint at or before @timestamp which can still
+ * be parsed from; if they're all after @timestamp, the earliest that
+ * can be is found instead.
+ *
+ * Returns: checkpoint found, or NULL if there are none.
+ **/
+const Checkpoint *
+find_checkpoint (const Checkpoints  *cps,
+		 unsigned long long  timestamp,
+		 unsigned long long  position)
+{
+	const Checkpoint *found = NULL;
+	size_t            i;
+
+	for (i = 0; i < cps->ngroups; i++) {
+		const CheckpointGroup *group = &cps->groups[i];
+		size_t                 lo = 0, hi = group->npoints;
+
+		if (group->points[group->npoints - 1].position < position)
+			continue;
+
+		if (group->points[0].timestamp > timestamp) {
+			if (! found)
+				for (lo = 0; lo < group->npoints; lo++)
+					if (group->points[lo].position
+					    >= position)
+						return &group->points[lo];
+			break;
+		}
+
+		/* Last in the group at or before the time */
+		while (hi - lo > 1) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (group->points[mid].timestamp <= timestamp) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+
+		if (group->points[lo].position >= position) {
+			found = &group->points[lo];
+		} else if (! found) {
+			for (; lo < group->npoints; lo++)
+				if (group->points[lo].position >= position)
+					return &group->points[lo];
+		}
+	}
+
+	return found;
+}
+
+/**
+ * restore_checkpoint:
+ * @cps: checkpoints,
+ * @cp: checkpoint to restore,
+ * @state: state structure to restore into,
+ * @ctx: stream parser context to restore into.
+ *
+ * Replaces the contents of @state with those saved in @cp, decoding
+ * the first checkpoint in its group and then each change since.  Only
+ * the strings which never change (host, e-mail address and so on) are
+ * left as they were.
+ **/
+void
+restore_checkpoint (const Checkpoints *cps,
+		    const Checkpoint  *cp,
+		    CurrentState      *state,
+		    StreamContext     *ctx)
+{
+	const CheckpointGroup *group = NULL;
+	size_t                 i;
+
+	for (i = 0; i < cps->ngroups; i++) {
+		group = &cps->groups[i];
+		if ((cp >= group->points)
+		    && (cp < group->points + group->npoints))
+			break;
+	}
+
+	if (i == cps->ngroups)
+		return;
+
+	for (i = 0; &group->points[i] <= cp; i++)
+		decode_image (scratch, group->arena + group->points[i].offset);
+
+	apply_image (scratch, state, ctx);
+}
+
+/**
+ * drop_checkpoints:
+ * @cps: checkpoints,
+ * @position: earliest position that can still be parsed from.
+ *
+ * Forgets groups of checkpoints that can no longer be parsed from.
+ **/
+void
+drop_checkpoints (Checkpoints        *cps,
+		  unsigned long long  position)
+{
+	while (cps->ngroups
+	       && (cps->groups[0].points[cps->groups[0].npoints - 1].position
+		   < position))
+		drop_group (cps);
+}
+
+
+/**
+ * make_image:
+ * @img: image to fill,
+ * @state: application state structure.
+ *
+ * Copies @state and the stream parser's context into @img.
+ **/
+static void
+make_image (CheckpointImage    *img,
+	    const CurrentState *state)
+{
+	StreamContext ctx;
+	int           i, j;
+
+	memset (img, 0, sizeof (CheckpointImage));
+
+	img->s.key = state->key;
+	img->s.salt = state->salt;
+	img->s.frame = state->frame;
+	img->s.event_no = state->event_no;
+	img->s.event_type = state->event_type;
+	img->s.remaining_time = state->remaining_time;
+	img->s.epoch_time = state->epoch_time;
+	img->s.laps_completed = state->laps_completed;
+	img->s.total_laps = state->total_laps;
+	img->s.flag = state->flag;
+	img->s.track_temp = state->track_temp;
+	img->s.air_temp = state->air_temp;
+	img->s.humidity = state->humidity;
+	img->s.wind_speed = state->wind_speed;
+	img->s.wind_direction = state->wind_direction;
+	img->s.pressure = state->pressure;
+	img->s.num_cars = state->num_cars;
+
+	save_stream (&ctx);
+	img->s.pbuf_len = ctx.pbuf_len;
+	img->s.crypt_offset = ctx.crypt_offset;
+	memcpy (img->pbuf, ctx.pbuf, ctx.pbuf_len);
+
+	if (state->fl_car)
+		memcpy (img->fl_car, state->fl_car, FL_CAR_LEN);
+	if (state->strings)
+		memcpy (img->fl_driver,
+			string_text (state->strings, state->fl_driver),
+			FL_DRIVER_LEN);
+	if (state->fl_time)
+		memcpy (img->fl_time, state->fl_time, FL_TIME_LEN);
+	if (state->fl_lap)
+		memcpy (img->fl_lap, state->fl_lap, FL_LAP_LEN);
+
+	for (i = 0; i < state->num_cars; i++) {
+		img->position[i] = state->car_position[i];
+		for (j = 0; j < LAST_CAR_PACKET; j++)
+			get_atom (state, i + 1, j, &img->atoms[i][j]);
+	}
+}
+
+/**
+ * apply_image:
+ * @img: image to copy from,
+ * @state: state structure to replace the contents of,
+ * @ctx: stream parser context to fill.
+ *
+ * Replaces the contents of @state with @img, in the same memory the
+ * packet handlers use.
+ **/
+static void
+apply_image (const CheckpointImage *img,
+	     CurrentState          *state,
+	     StreamContext         *ctx)
+{
+	int i, j;
+
+	state->key = img->s.key;
+	state->key_pending = 0;
+	state->salt = img->s.salt;
+	state->decryption_failure = 0;
+	state->frame = img->s.frame;
+	state->event_no = img->s.event_no;
+	state->event_type = img->s.event_type;
+	state->remaining_time = img->s.remaining_time;
+	state->epoch_time = img->s.epoch_time;
+	state->laps_completed = img->s.laps_completed;
+	state->total_laps = img->s.total_laps;
+	state->flag = img->s.flag;
+	state->track_temp = img->s.track_temp;
+	state->air_temp = img->s.air_temp;
+	state->humidity = img->s.humidity;
+	state->wind_speed = img->s.wind_speed;
+	state->wind_direction = img->s.wind_direction;
+	state->pressure = img->s.pressure;
+
+	ctx->pbuf_len = img->s.pbuf_len;
+	ctx->crypt_offset = img->s.crypt_offset;
+	memcpy (ctx->pbuf, img->pbuf, img->s.pbuf_len);
+
+	reset_session (state);
+	memcpy (state->fl_car, img->fl_car, FL_CAR_LEN);
+	state->fl_driver = intern_text (state, img->fl_driver, FL_DRIVER_LEN);
+	memcpy (state->fl_time, img->fl_time, FL_TIME_LEN);
+	memcpy (state->fl_lap, img->fl_lap, FL_LAP_LEN);
+
+	set_num_cars (state, img->s.num_cars);
+	for (i = 0; i < state->num_cars; i++) {
+		state->car_position[i] = img->position[i];
+		for (j = 0; j < LAST_CAR_PACKET; j++)
+			set_atom (state, i + 1, j, img->atoms[i][j].data,
+				  img->atoms[i][j].text);
+	}
+}
+
+/**
+ * encode_image:
+ * @group: group to add to,
+ * @img: image to encode,
+ * @prev: image of the checkpoint before, or NULL.
+ *
+ * Adds @img to the end of the group's arena: its kind, the numbers,
+ * any partial packet, the fastest lap strings and car positions, then
+ * either every atom or (when @prev is given) those that differ from it,
+ * each as its car, type, colour, length and text.
+ **/
+static void
+encode_image (CheckpointGroup       *group,
+	      const CheckpointImage *img,
+	      const CheckpointImage *prev)
+{
+	unsigned char *ptr;
+	size_t         len, count_offset;
+	unsigned int   count = 0;
+	int            i, j;
+
+	len = (1 + sizeof (CheckpointScalars) + img->s.pbuf_len
+	       + FL_CAR_LEN + FL_DRIVER_LEN + FL_TIME_LEN + FL_LAP_LEN
+	       + img->s.num_cars + 2);
+	ptr = reserve (group, len);
+
+	*(ptr++) = prev ? CHECKPOINT_DELTA : CHECKPOINT_FULL;
+	memcpy (ptr, &img->s, sizeof (CheckpointScalars));
+	ptr += sizeof (CheckpointScalars);
+	memcpy (ptr, img->pbuf, img->s.pbuf_len);
+	ptr += img->s.pbuf_len;
+
+	memcpy (ptr, img->fl_car, FL_CAR_LEN);
+	ptr += FL_CAR_LEN;
+	memcpy (ptr, img->fl_driver, FL_DRIVER_LEN);
+	ptr += FL_DRIVER_LEN;
+	memcpy (ptr, img->fl_time, FL_TIME_LEN);
+	ptr += FL_TIME_LEN;
+	memcpy (ptr, img->fl_lap, FL_LAP_LEN);
+	ptr += FL_LAP_LEN;
+
+	for (i = 0; i < img->s.num_cars; i++)
+		*(ptr++) = img->position[i];
+
+	/* Filled in once we know how many atoms there are */
+	count_offset = group->len - 2;
+
+	for (i = 0; i < img->s.num_cars; i++) {
+		for (j = 0; j < LAST_CAR_PACKET; j++) {
+			const CarAtom *atom = &img->atoms[i][j];
+			size_t         text_len;
+
+			if (prev && (atom->data == prev->atoms[i][j].data)
+			    && (! strcmp (atom->text,
+					  prev->atoms[i][j].text)))
+				continue;
+
+			text_len = strnlen (atom->text, sizeof (atom->text) - 1);
+			ptr = reserve (group, 4 + text_len);
+			*(ptr++) = i;
+			*(ptr++) = j;
+			*(ptr++) = atom->data;
+			*(ptr++) = text_len;
+			memcpy (ptr, atom->text, text_len);
+			count++;
+		}
+	}
+
+	group->arena[count_offset] = count & 0xff;
+	group->arena[count_offset + 1] = count >> 8;
+}
+
+/**
+ * decode_image:
+ * @img: image to update,
+ * @ptr: encoded checkpoint.
+ *
+ * Decodes a checkpoint encoded by encode_image() into @img; when it
+ * only holds the changes, @img must hold the checkpoint before.
+ **/
+static void
+decode_image (CheckpointImage     *img,
+	      const unsigned char *ptr)
+{
+	unsigned int count;
+	int          i;
+
+	if (*(ptr++) == CHECKPOINT_FULL)
+		memset (img, 0, sizeof (CheckpointImage));
+
+	memcpy (&img->s, ptr, sizeof (CheckpointScalars));
+	ptr += sizeof (CheckpointScalars);
+	memcpy (img->pbuf, ptr, img->s.pbuf_len);
+	ptr += img->s.pbuf_len;
+
+	memcpy (img->fl_car, ptr, FL_CAR_LEN);
+	ptr += FL_CAR_LEN;
+	memcpy (img->fl_driver, ptr, FL_DRIVER_LEN);
+	ptr += FL_DRIVER_LEN;
+	memcpy (img->fl_time, ptr, FL_TIME_LEN);
+	ptr += FL_TIME_LEN;
+	memcpy (img->fl_lap, ptr, FL_LAP_LEN);
+	ptr += FL_LAP_LEN;
+
+	for (i = 0; i < img->s.num_cars; i++)
+		img->position[i] = *(ptr++);
+
+	/* make_image() leaves the cars we no longer have empty, so the
+	 * changes since the checkpoint before don't include them
+	 */
+	for (i = img->s.num_cars; i < MAX_CARS; i++) {
+		img->position[i] = 0;
+		memset (img->atoms[i], 0, sizeof (img->atoms[i]));
+	}
+
+	count = ptr[0] | (ptr[1] << 8);
+	ptr += 2;
+
+	while (count--) {
+		CarAtom *atom = &img->atoms[ptr[0]][ptr[1]];
+
+		atom->data = ptr[2];
+		memcpy (atom->text, ptr + 4, ptr[3]);
+		atom->text[ptr[3]] = 0;
+		ptr += 4 + ptr[3];
+	}
+}
+
+/**
+ * reserve:
+ * @group: group to add to,
+ * @len: number of bytes needed.
+ *
+ * Makes room for @len more bytes at the end of the group's arena.
+ *
+ * Returns: pointer to the bytes.
+ **/
+static unsigned char *
+reserve (CheckpointGroup *group,
+	 size_t           len)
+{
+	unsigned char *ptr;
+
+	if (group->len + len > group->size) {
+		group->size = MAX (group->size * 2, group->len + len);
+		group->arena = realloc (group->arena, group->size);
+		if (! group->arena)
+			abort ();
+	}
+
+	ptr = group->arena + group->len;
+	group->len += len;
+
+	return ptr;
+}
+
+/**
+ * drop_group:
+ * @cps: checkpoints.
+ *
+ * Forgets the oldest group of checkpoints.
+ **/
+static void
+drop_group (Checkpoints *cps)
+{
+	CheckpointGroup *group = &cps->groups[0];
+
+	cps->memory -= group->size + group->sz * sizeof (Checkpoint);
+	free (group->arena);
+	free (group->points);
+
+	memmove (cps->groups, cps->groups + 1,
+		 sizeof (CheckpointGroup) * --cps->ngroups);
+}
@@ -0,0 +1,115 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_CHECKPOINT_H
+#define LIVE_F1_CHECKPOINT_H
+
+#include "live-f1.h"
+#include "stream.h"
+
+
+/* Default seconds between checkpoints, and most packets between them */
+#define CHECKPOINT_SECONDS 10
+#define CHECKPOINT_PACKETS 2000
+
+/**
+ * Checkpoint:
+ * @timestamp: time of the block the state was taken after,
+ * @position: where to carry on parsing from, meaning up to the caller,
+ * @offset: offset of the encoded state in its group's arena.
+ *
+ * A copy of the state at a point in the data stream; restoring it and
+ * parsing from @position gets the state anywhere after.
+ **/
+typedef struct {
+	unsigned long long timestamp;
+	unsigned long long position;
+	size_t             offset;
+} Checkpoint;
+
+/**
+ * CheckpointGroup:
+ * @arena: encoded checkpoints,
+ * @len: bytes used in @arena,
+ * @size: bytes allocated for @arena,
+ * @points: checkpoints in the group,
+ * @npoints: number of @points,
+ * @sz: number of @points allocated.
+ *
+ * The first checkpoint of a group holds the whole state, the others
+ * only what changed since the one before; so a group is only any use
+ * as a whole, and is forgotten as one.
+ **/
+typedef struct {
+	unsigned char *arena;
+	size_t         len, size;
+
+	Checkpoint    *points;
+	size_t         npoints, sz;
+} CheckpointGroup;
+
+/**
+ * Checkpoints:
+ * @groups: groups of checkpoints, oldest first,
+ * @ngroups: number of @groups,
+ * @memory: memory used by @groups,
+ * @limit: most memory to use,
+ * @interval: time between checkpoints, in nanoseconds,
+ * @packets: most packets between checkpoints,
+ * @last_time: timestamp of the latest checkpoint,
+ * @last_packets: packets parsed at the latest checkpoint,
+ * @last: state at the latest checkpoint.
+ *
+ * Checkpoints taken of the state as the data stream is parsed, in the
+ * order they were taken.
+ **/
+typedef struct {
+	CheckpointGroup          *groups;
+	size_t                    ngroups;
+	size_t                    memory, limit;
+
+	unsigned long long        interval, packets;
+	unsigned long long        last_time, last_packets;
+	struct checkpoint_image  *last;
+} Checkpoints;
+
+
+SJR_BEGIN_EXTERN
+
+void              init_checkpoints   (Checkpoints *cps, unsigned int seconds,
+				      unsigned int packets, size_t limit);
+int               checkpoint_due     (const Checkpoints *cps,
+				      unsigned long long timestamp);
+void              take_checkpoint    (Checkpoints *cps,
+				      const CurrentState *state,
+				      unsigned long long timestamp,
+				      unsigned long long position);
+const Checkpoint *find_checkpoint    (const Checkpoints *cps,
+				      unsigned long long timestamp,
+				      unsigned long long position);
+void              restore_checkpoint (const Checkpoints *cps,
+				      const Checkpoint *cp,
+				      CurrentState *state,
+				      StreamContext *ctx);
+void              drop_checkpoints   (Checkpoints *cps,
+				      unsigned long long position);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_CHECKPOINT_H */
@@ -0,0 +1,137 @@
+/* live-f1
+ *
+ * clock.c - the time as far as the session is concerned
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <time.h>
+
+#include "live-f1.h"
+#include "clock.h"
+
+
+/* Forward prototypes */
+static unsigned long long virtual_clock (void);
+
+
+/* Clock in use, the real one unless replaying */
+static unsigned long long (*clock_func) (void) = real_ns;
+
+/* Time of the virtual clock (nanoseconds) */
+static unsigned long long virtual_now = VIRTUAL_CLOCK_EPOCH;
+
+
+/**
+ * use_real_clock:
+ *
+ * Makes the session time the monotonic time of the system, as it is
+ * when watching live.
+ **/
+void
+use_real_clock (void)
+{
+	clock_func = real_ns;
+}
+
+/**
+ * use_virtual_clock:
+ *
+ * Makes the session time only move when set_virtual_clock() is called,
+ * so that it follows the recording being played back rather than the
+ * time it takes to play it back; starts at VIRTUAL_CLOCK_EPOCH.
+ **/
+void
+use_virtual_clock (void)
+{
+	clock_func = virtual_clock;
+	virtual_now = VIRTUAL_CLOCK_EPOCH;
+}
+
+/**
+ * set_virtual_clock:
+ * @ns: nanoseconds since the start of the session.
+ *
+ * Sets the virtual clock, which may go backwards when jumping around a
+ * recording.
+ **/
+void
+set_virtual_clock (unsigned long long ns)
+{
+	virtual_now = VIRTUAL_CLOCK_EPOCH + ns;
+}
+
+/**
+ * now_ns:
+ *
+ * Anything that times the session (its clock, how long since the
+ * server was last heard from) asks here rather than the system, so
+ * that played back sessions keep their own time.
+ *
+ * Returns: session time in nanoseconds, from an arbitrary start.
+ **/
+unsigned long long
+now_ns (void)
+{
+	return clock_func ();
+}
+
+/**
+ * now_seconds:
+ *
+ * Returns: session time in seconds, from an arbitrary start but never
+ * zero.
+ **/
+time_t
+now_seconds (void)
+{
+	return (time_t) (clock_func () / 1000000000ULL);
+}
+
+/**
+ * real_ns:
+ *
+ * Anything that times the program itself rather than the session (the
+ * frame rate, how long something took, when a recording's data
+ * arrived) asks here, so it takes real time even when replaying.
+ *
+ * Returns: monotonic system time in nanoseconds.
+ **/
+unsigned long long
+real_ns (void)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/**
+ * virtual_clock:
+ *
+ * Returns: time the virtual clock was last set to, in nanoseconds.
+ **/
+static unsigned long long
+virtual_clock (void)
+{
+	return virtual_now;
+}
@@ -0,0 +1,46 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_CLOCK_H
+#define LIVE_F1_CLOCK_H
+
+#include <time.h>
+
+#include "live-f1.h"
+
+
+/* Where the virtual clock starts (nanoseconds); like the monotonic
+ * clock it's never zero, which means a session clock that's stopped
+ */
+#define VIRTUAL_CLOCK_EPOCH 1000000000ULL
+
+
+SJR_BEGIN_EXTERN
+
+void               use_real_clock    (void);
+void               use_virtual_clock (void);
+void               set_virtual_clock (unsigned long long ns);
+
+unsigned long long now_ns            (void);
+time_t             now_seconds       (void);
+unsigned long long real_ns           (void);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_CLOCK_H */
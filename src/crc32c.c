@@ -0,0 +1,246 @@
+/* live-f1
+ *
+ * crc32c.c - CRC-32C (Castagnoli) checksums
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__)) \
+	&& defined (HAVE_NMMINTRIN_H)
+# include <nmmintrin.h>
+# define HAVE_SSE42_CRC32C 1
+#elif defined (__ARM_FEATURE_CRC32)
+# include <arm_acle.h>
+# define HAVE_ARM_CRC32C 1
+#endif
+
+#include "live-f1.h"
+#include "crc32c.h"
+
+
+/* Reversed CRC-32C polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+
+/* Forward prototypes */
+static unsigned int crc32c_sw    (unsigned int crc, const unsigned char *buf,
+				  size_t len);
+#ifdef HAVE_SSE42_CRC32C
+static unsigned int crc32c_sse42 (unsigned int crc, const unsigned char *buf,
+				  size_t len);
+#endif /* HAVE_SSE42_CRC32C */
+
+
+/* Tables for the software version, eight bytes at a time */
+static uint32_t crc_table[8][256];
+
+/* Implementation in use, chosen by init_crc32c() */
+static unsigned int (*crc_func) (unsigned int, const unsigned char *,
+				 size_t) = NULL;
+
+
+/**
+ * init_crc32c:
+ *
+ * Chooses how checksums are calculated: with the CPU's own instruction
+ * where there is one (SSE 4.2 on x86, the CRC extension on ARMv8), and
+ * otherwise from tables.  Called by crc32c() the first time, but should
+ * be called before starting any threads that use it.
+ **/
+void
+init_crc32c (void)
+{
+	int i, j;
+
+	if (crc_func)
+		return;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+
+		crc_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = ((crc_table[j - 1][i] >> 8)
+					   ^ crc_table[0][crc_table[j - 1][i]
+							  & 0xff]);
+
+#if defined (HAVE_SSE42_CRC32C)
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse4.2")) {
+		crc_func = crc32c_sse42;
+		return;
+	}
+#endif /* HAVE_SSE42_CRC32C */
+
+	crc_func = crc32c_sw;
+}
+
+/**
+ * crc32c:
+ * @crc: checksum of the data before, or 0,
+ * @buf: data to checksum,
+ * @len: length of @buf.
+ *
+ * Calculates the CRC-32C of @buf, carrying on from @crc so that data in
+ * more than one piece can be checksummed.
+ *
+ * Returns: checksum.
+ **/
+unsigned int
+crc32c (unsigned int         crc,
+	const unsigned char *buf,
+	size_t               len)
+{
+	if (! crc_func)
+		init_crc32c ();
+
+	return crc_func (crc, buf, len);
+}
+
+
+/**
+ * crc32c_sw:
+ * @crc: checksum of the data before, or 0,
+ * @buf: data to checksum,
+ * @len: length of @buf.
+ *
+ * Calculates the checksum eight bytes at a time from the tables, or
+ * with the ARMv8 CRC instructions when we were built for them.
+ *
+ * Returns: checksum.
+ **/
+static unsigned int
+crc32c_sw (unsigned int         crc,
+	   const unsigned char *buf,
+	   size_t               len)
+{
+	uint32_t c = ~crc;
+
+#ifdef HAVE_ARM_CRC32C
+	while (len && ((uintptr_t) buf & 7)) {
+		c = __crc32cb (c, *(buf++));
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy (&word, buf, sizeof (word));
+		c = __crc32cd (c, word);
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		c = __crc32cb (c, *(buf++));
+#else /* HAVE_ARM_CRC32C */
+	while (len && ((uintptr_t) buf & 7)) {
+		c = crc_table[0][(c ^ *(buf++)) & 0xff] ^ (c >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint32_t lo = c ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16)
+				   | ((uint32_t) buf[3] << 24));
+		uint32_t hi = (buf[4] | (buf[5] << 8) | (buf[6] << 16)
+			       | ((uint32_t) buf[7] << 24));
+
+		c = (crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff]
+		     ^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+		     ^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff]
+		     ^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24]);
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		c = crc_table[0][(c ^ *(buf++)) & 0xff] ^ (c >> 8);
+#endif /* HAVE_ARM_CRC32C */
+
+	return ~c;
+}
+
+#ifdef HAVE_SSE42_CRC32C
+/**
+ * crc32c_sse42:
+ * @crc: checksum of the data before, or 0,
+ * @buf: data to checksum,
+ * @len: length of @buf.
+ *
+ * Calculates the checksum with the SSE 4.2 CRC32 instruction, eight
+ * bytes at a time on 64-bit processors.  Only called once we know the
+ * processor has it.
+ *
+ * Returns: checksum.
+ **/
+static unsigned int __attribute__ ((target ("sse4.2")))
+crc32c_sse42 (unsigned int         crc,
+	      const unsigned char *buf,
+	      size_t               len)
+{
+#ifdef __x86_64__
+	uint64_t c = (uint32_t) ~crc;
+#else /* __x86_64__ */
+	uint32_t c = ~crc;
+#endif /* __x86_64__ */
+
+	while (len && ((uintptr_t) buf & 7)) {
+		c = _mm_crc32_u8 (c, *(buf++));
+		len--;
+	}
+
+#ifdef __x86_64__
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy (&word, buf, sizeof (word));
+		c = _mm_crc32_u64 (c, word);
+		buf += 8;
+		len -= 8;
+	}
+#endif /* __x86_64__ */
+
+	while (len >= 4) {
+		uint32_t word;
+
+		memcpy (&word, buf, sizeof (word));
+		c = _mm_crc32_u32 (c, word);
+		buf += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		c = _mm_crc32_u8 (c, *(buf++));
+
+	return ~(uint32_t) c;
+}
+#endif /* HAVE_SSE42_CRC32C */
@@ -37,8 +37,27 @@
 #include <regex.h>
 
 #include "live-f1.h"
+#include "clock.h"
 #include "packet.h" /* for packet type */
 #include "display.h"
+#include "flight.h"
+#include "intern.h"
+#include "replay.h"
+#include "session.h"
+#include "timeshift.h"
+#include "trend.h"
+
+
+/* Bits in dirty_cells for every atom of a car */
+#define ALL_CELLS ((1U << LAST_CAR_PACKET) - 1)
+
+
+/* How far the arrow and page keys seek (ms) */
+#define SEEK_STEP      30000
+#define SEEK_PAGE_STEP 300000
+
+/* Seconds the trends in the status window cover */
+#define TREND_SPAN 1800
 
 
 /* Colours to be allocated, note that this mostly matches the data stream
@@ -65,11 +84,18 @@ typedef enum {
 /* Forward prototypes */
 static void _update_cell (CurrentState *state, int car, int type);
 static void _update_time (CurrentState *state);
+static void _update_trends (CurrentState *state);
+static void _update_status (CurrentState *state);
+static void draw_frame   (void);
+static void do_update    (void);
 
 
 /* Curses display running */
 int cursed = 0;
 
+/* State being shown, when there's more than one */
+static CurrentState *shown = NULL;
+
 /* Number of lines being used for the board */
 static int nlines = 0;
 
@@ -81,6 +107,28 @@ static WINDOW *boardwin = NULL;
 static WINDOW *statwin = NULL;
 static WINDOW *popupwin = NULL;
 
+/* Whether the screen updates are being held back, and if there are any */
+static int held = 0;
+static int pending = 0;
+
+/* Cells of the board waiting to be drawn, a bit for each atom of each
+ * car; rows of the board waiting to be cleared before they are; and
+ * whether the status window and the clock are waiting to be drawn
+ */
+static unsigned int       dirty_cells[CAR_SLOTS];
+static unsigned long long dirty_rows = 0;
+static int                dirty_status = 0, dirty_time = 0;
+
+/* State the waiting changes are to be drawn from */
+static CurrentState *dirty_state = NULL;
+
+/* Least time between frames (ns), when the last was drawn, and how
+ * many have been
+ */
+static unsigned long long frame_interval = 1000000000ULL / DISPLAY_FRAME_RATE;
+static unsigned long long last_frame = 0;
+static unsigned long      frames = 0;
+
 
 /**
  * open_display:
@@ -152,6 +200,28 @@ open_display (void)
 	cursed = 1;
 }
 
+/**
+ * show_state:
+ * @state: application state structure.
+ *
+ * Where there's more than one copy of the state (one time shifted
+ * behind the live one), selects which the board shows; changes to any
+ * other are then not drawn.  Redraws the board from @state, if it's
+ * been drawn already.
+ **/
+void
+show_state (CurrentState *state)
+{
+	shown = state;
+
+	memset (dirty_cells, 0, sizeof (dirty_cells));
+	dirty_rows = 0;
+	dirty_state = state;
+
+	if (cursed)
+		clear_board (state);
+}
+
 /**
  * clear_board;
  * @state: application state structure.
@@ -164,9 +234,17 @@ clear_board (CurrentState *state)
 {
 	int i, j;
 
+	if (shown && (state != shown))
+		return;
+
 	open_display ();
 	close_popup ();
 
+	/* Everything is drawn from scratch */
+	memset (dirty_cells, 0, sizeof (dirty_cells));
+	dirty_rows = 0;
+	dirty_state = state;
+
 	if (boardwin)
 		delwin (boardwin);
 
@@ -222,7 +300,7 @@ clear_board (CurrentState *state)
 	}
 
 	wnoutrefresh (boardwin);
-	doupdate ();
+	do_update ();
 
 	if (statwin) {
 		delwin (statwin);
@@ -248,7 +326,6 @@ _update_cell (CurrentState *state,
 	      int           type)
 {
 	int                  y, x, sz, align, attr;
-	CarAtom             *atom;
 	unsigned const char *text;
 	size_t               len, pad;
 
@@ -441,9 +518,8 @@ _update_cell (CurrentState *state,
 		return;
 	}
 
-	atom = &state->car_info[car - 1][type];
-	attr = attrs[atom->data];
-	text = atom->text;
+	attr = attrs[state->cars->colour[type][car - 1]];
+	text = (unsigned const char *) atom_text (state, car, type);
 
 	if (text[0] == 0xE2) text = "*";
 
@@ -476,24 +552,26 @@ _update_cell (CurrentState *state,
  * @car: car number to update,
  * @type: atom to update.
  *
- * Update a particular cell on the board, with the necessary information
- * available in the state structure.  Intended for external code as it
- * updates the display when done.
+ * Marks a particular cell on the board to be drawn in the next frame,
+ * from the information in the state structure at the time.  Intended
+ * for external code; however many times a cell changes between frames,
+ * it's only drawn once.
  **/
 void
 update_cell (CurrentState *state,
 	     int           car,
 	     int           type)
 {
+	if (shown && (state != shown))
+		return;
+
 	if (! cursed)
 		clear_board (state);
 	close_popup ();
 
-	_update_cell (state, car, type);
-
-	_update_time (state);
- 	wnoutrefresh (boardwin);
-	doupdate ();
+	dirty_cells[car - 1] |= 1U << type;
+	dirty_time = 1;
+	dirty_state = state;
 }
 
 /**
@@ -501,24 +579,22 @@ update_cell (CurrentState *state,
  * @state: application state structure,
  * @car: car number to update.
  *
- * Update the entire row for the given car, and the display when done.
+ * Marks the entire row for the given car to be drawn in the next frame.
  **/
 void
 update_car (CurrentState *state,
 	    int           car)
 {
-	int i;
+	if (shown && (state != shown))
+		return;
 
 	if (! cursed)
 		clear_board (state);
 	close_popup ();
 
-	for (i = 0; i < LAST_CAR_PACKET; i++)
-		_update_cell (state, car, i);
-
-	_update_time (state);
- 	wnoutrefresh (boardwin);
-	doupdate ();
+	dirty_cells[car - 1] = ALL_CELLS;
+	dirty_time = 1;
+	dirty_state = state;
 }
 
 /**
@@ -526,7 +602,8 @@ update_car (CurrentState *state,
  * @state: application state structure,
  * @car: car number to update.
  *
- * Clear the car from the board, updating the display when done.
+ * Marks the row the car is in to be cleared in the next frame, before
+ * any cells are drawn.
  **/
 void
 clear_car (CurrentState *state,
@@ -534,6 +611,9 @@ clear_car (CurrentState *state,
 {
 	int y;
 
+	if (shown && (state != shown))
+		return;
+
 	if (! cursed)
 		clear_board (state);
 
@@ -545,12 +625,9 @@ clear_car (CurrentState *state,
 
 	close_popup ();
 
-	wmove (boardwin, y, 0);
-	wclrtoeol (boardwin);
-
-	_update_time (state);
-	wnoutrefresh (boardwin);
-	doupdate ();
+	dirty_rows |= 1ULL << y;
+	dirty_time = 1;
+	dirty_state = state;
 }
 
 /**
@@ -576,16 +653,32 @@ draw_bar (WINDOW *win, int len)
  * update_status:
  * @state: application state structure,
  *
- * Update the status window, creating it if necessary.  Updates the
- * display when done.
+ * Marks the status window to be drawn in the next frame.
  **/
 void
 update_status (CurrentState *state)
 {
+	if (shown && (state != shown))
+		return;
+
 	if (! cursed)
 		clear_board (state);
 	close_popup ();
 
+	dirty_status = 1;
+	dirty_state = state;
+}
+
+/**
+ * _update_status:
+ * @state: application state structure.
+ *
+ * Draws the status window, creating it if necessary and if there's room
+ * for it.  For internal use, does not update the screen.
+ **/
+static void
+_update_status (CurrentState *state)
+{
 	/* Put the window down the side if we have enough room */
 	if (! statwin) {
 		if (COLS < 80)
@@ -628,6 +721,12 @@ update_status (CurrentState *state)
 	wclrtoeol (statwin);
 	switch (state->event_type) {
 	case RACE_EVENT:
+		/* Total laps comes from a web service that may not answer */
+		if (! state->total_laps) {
+			wprintw (statwin, "LAP %6d", state->laps_completed);
+			break;
+		}
+
 		switch (state->total_laps - state->laps_completed) {
 		case 0:
 			wprintw (statwin, "%10s", "FINISHED");
@@ -702,6 +801,9 @@ update_status (CurrentState *state)
 	wmove (statwin, wline, 6);
 	waddch (statwin, '.');
 */
+	/* Weather and pace over the last half hour */
+	_update_trends (state);
+
 	/* Update fastest lap line (race only) */
 
 	if (state->event_type == RACE_EVENT)
@@ -709,18 +811,15 @@ update_status (CurrentState *state)
 		wmove (boardwin, nlines - 1, 3);
 		wattrset (boardwin, attrs[COLOUR_RECORD]);
 		wclrtoeol (boardwin);
-		wprintw(boardwin, "%2s %-14s %4s %4s %8s", state->fl_car, state->fl_driver, "LAP", state->fl_lap, state->fl_time);
+		wprintw(boardwin, "%2s %-14s %4s %4s %8s", state->fl_car, string_text (state->strings, state->fl_driver), "LAP", state->fl_lap, state->fl_time);
 	}
 
 	/* Update session clock */
 	
 	_update_time (state);
 
-	/* Refresh display */
-
 	wnoutrefresh (statwin);
 	wnoutrefresh (boardwin);
-	doupdate ();
 }
 
 /**
@@ -745,7 +844,7 @@ _update_time (CurrentState *state)
 	{
 		remaining = state->remaining_time;
 	} else if (state->epoch_time) {
-		remaining = MAX ((state->epoch_time + state->remaining_time) - time (NULL), 0);
+		remaining = MAX ((state->epoch_time + state->remaining_time) - now_seconds (), 0);
 	} else {
 		remaining = state->remaining_time;
 	}
@@ -767,23 +866,242 @@ _update_time (CurrentState *state)
 	wnoutrefresh (statwin);
 }
 
+/**
+ * _update_trends:
+ * @state: application state structure.
+ *
+ * Shows the temperatures and humidity in the status window, with the
+ * range they've been in over the last TREND_SPAN seconds, and in a race
+ * the best lap anyone has done in the last TREND_LAP_WINDOW seconds.
+ * Lines are left blank until there's something to show.
+ **/
+static void
+_update_trends (CurrentState *state)
+{
+	static const struct {
+		int         type;
+		const char *label;
+	} readings[] = {
+		{ WEATHER_TRACK_TEMP, N_("Track") },
+		{ WEATHER_AIR_TEMP,   N_("Air") },
+		{ WEATHER_HUMIDITY,   N_("Humid") },
+	};
+	HistoryBucket summary;
+	int           line, i;
+
+	wattrset (statwin, attrs[COLOUR_DATA]);
+	for (i = 5; i < 17; i++) {
+		wmove (statwin, i, 0);
+		wclrtoeol (statwin);
+	}
+
+	line = 5;
+	for (i = 0; i < sizeof (readings) / sizeof (readings[0]); i++) {
+		if (weather_trend (state, readings[i].type, TREND_SPAN,
+				   &summary)) {
+			mvwprintw (statwin, line, 0, "%-6s%4d",
+				   _(readings[i].label), summary.last);
+			mvwprintw (statwin, line + 1, 0, "%4d-%-4d",
+				   summary.min, summary.max);
+		}
+		line += 3;
+	}
+
+	if ((state->event_type == RACE_EVENT)
+	    && lap_time_trend (state, TREND_LAP_WINDOW, &summary)) {
+		mvwprintw (statwin, line, 0, "%s", _("Best lap"));
+		mvwprintw (statwin, line + 1, 0, "%2d:%02d.%03d",
+			   summary.min / 60000, (summary.min / 1000) % 60,
+			   summary.min % 1000);
+	}
+}
+
 /**
  * update_time:
  * @state: application state structure.
  *
- * External function to update the time, unlike most display functions this
- * one doesn't clear an open popup as it's not possible for them to ever
- * cover the time.  It also doesn't open the display if not already done.
+ * External function to mark the time to be drawn in the next frame,
+ * unlike most display functions this one doesn't clear an open popup as
+ * it's not possible for them to ever cover the time.  It also doesn't
+ * open the display if not already done.
  **/
 void
 update_time (CurrentState *state)
 {
-	if ((! cursed) || (! statwin))
+	if ((! cursed) || (shown && (state != shown)))
 		return;
 
-	_update_time (state);
+	dirty_time = 1;
+	dirty_state = state;
+}
 
-	doupdate ();
+/**
+ * do_update:
+ *
+ * Notes that windows have been drawn in, for the next frame to put on
+ * the screen.
+ **/
+static void
+do_update (void)
+{
+	pending = 1;
+}
+
+/**
+ * set_frame_rate:
+ * @rate: most frames to draw a second, or 0 for no limit.
+ *
+ * Sets how often tick_display() draws a frame; without a limit, one is
+ * drawn at the end of every block of the data stream.
+ **/
+void
+set_frame_rate (int rate)
+{
+	frame_interval = (rate > 0) ? 1000000000ULL / rate : 0;
+}
+
+/**
+ * tick_display:
+ *
+ * Called from the main loop after each block of the data stream, and
+ * at least every tenth of a second when nothing is happening; draws a
+ * frame with whatever has changed, unless the last one was drawn too
+ * recently or updates are being held back by hold_display().  How much
+ * is sent to the terminal is then bound by the frame rate, however
+ * fast packets arrive.
+ **/
+void
+tick_display (void)
+{
+	unsigned long long now;
+
+	if ((! cursed) || held)
+		return;
+
+	now = real_ns ();
+	if (frame_interval && (now - last_frame < frame_interval))
+		return;
+
+	draw_frame ();
+	last_frame = now;
+}
+
+/**
+ * display_frames:
+ *
+ * Returns: number of frames put on the screen.
+ **/
+unsigned long
+display_frames (void)
+{
+	return frames;
+}
+
+/**
+ * draw_frame:
+ *
+ * Clears the rows and draws the cells marked since the last frame, then
+ * the status window and the clock if they were marked, and puts them
+ * on the screen with a single doupdate().  A row that's cleared takes
+ * whichever car is now in it with it, so that car is drawn again in
+ * full.
+ **/
+static void
+draw_frame (void)
+{
+	CurrentState *state = dirty_state;
+	int           car, type, y, drawn = 0;
+
+	if (state && boardwin && dirty_rows) {
+		for (y = 1; y < nlines; y++) {
+			if (! (dirty_rows & (1ULL << y)))
+				continue;
+
+			wmove (boardwin, y, 0);
+			wclrtoeol (boardwin);
+
+			for (car = 1; car <= state->num_cars; car++)
+				if (state->car_position[car - 1] == y)
+					dirty_cells[car - 1] = ALL_CELLS;
+		}
+
+		dirty_rows = 0;
+		drawn = 1;
+	}
+
+	if (state && boardwin) {
+		for (car = 1; car <= state->num_cars; car++) {
+			unsigned int cells = dirty_cells[car - 1];
+
+			if (! cells)
+				continue;
+
+			dirty_cells[car - 1] = 0;
+			for (type = 0; type < LAST_CAR_PACKET; type++)
+				if (cells & (1U << type))
+					_update_cell (state, car, type);
+
+			drawn = 1;
+		}
+	}
+	memset (dirty_cells, 0, sizeof (dirty_cells));
+
+	if (state && dirty_status) {
+		_update_status (state);
+		drawn = 1;
+	} else if (state && dirty_time && statwin) {
+		_update_time (state);
+		drawn = 1;
+	}
+	dirty_status = dirty_time = 0;
+
+	if (drawn) {
+		if (boardwin)
+			wnoutrefresh (boardwin);
+
+		/* Keep anything new underneath an open popup */
+		if (popupwin) {
+			touchwin (popupwin);
+			wnoutrefresh (popupwin);
+		}
+	}
+
+	if (drawn || pending) {
+		doupdate ();
+		frames++;
+	}
+	pending = 0;
+}
+
+/**
+ * hold_display:
+ * @hold: TRUE to hold back updates.
+ *
+ * Holds back (or stops holding back) screen updates, so that when data
+ * is arriving faster than anyone could read it we don't spend all our
+ * time drawing; the windows are still kept up to date, and the screen
+ * catches up with them whenever flush_display() is called.
+ **/
+void
+hold_display (int hold)
+{
+	held = hold;
+	if (! held)
+		flush_display ();
+}
+
+/**
+ * flush_display:
+ *
+ * Draws a frame with any changes held back, straight away.
+ **/
+void
+flush_display (void)
+{
+	if (! cursed)
+		return;
+
+	draw_frame ();
 }
 
 /**
@@ -814,17 +1132,63 @@ close_display (void)
  *
  * Checks for a key press on the keyboard and handles it; this includes
  * keys that should quit the app (Enter, Escape, q, etc.) and pseudo-keys
- * like the resize event.
+ * like the resize event.  When replaying, the arrow and page keys seek
+ * backwards and forwards through the recording; otherwise they rewind
+ * and fast-forward the live data stream, which space pauses and End
+ * returns to.  D dumps the flight recorder of the live data stream.
  *
  * Returns: 0 if none were pressed, 1 if one was, -1 if should quit.
  **/
 int
 handle_keys (CurrentState *state)
 {
+	int key;
+
 	if (! cursed)
 		return 0;
 
-	switch (getch ()) {
+	key = getch ();
+	if (replaying ()) {
+		switch (key) {
+		case KEY_LEFT:
+			replay_seek (state, replay_position () - SEEK_STEP);
+			return 1;
+		case KEY_RIGHT:
+			replay_seek (state, replay_position () + SEEK_STEP);
+			return 1;
+		case KEY_PPAGE:
+			replay_seek (state, replay_position () - SEEK_PAGE_STEP);
+			return 1;
+		case KEY_NPAGE:
+			replay_seek (state, replay_position () + SEEK_PAGE_STEP);
+			return 1;
+		}
+	} else if (timeshifting ()) {
+		switch (key) {
+		case ' ':
+		case 'p':
+		case 'P':
+			pause_timeshift ();
+			return 1;
+		case KEY_LEFT:
+			shift_timeshift (-SEEK_STEP);
+			return 1;
+		case KEY_RIGHT:
+			shift_timeshift (SEEK_STEP);
+			return 1;
+		case KEY_PPAGE:
+			shift_timeshift (-SEEK_PAGE_STEP);
+			return 1;
+		case KEY_NPAGE:
+			shift_timeshift (SEEK_PAGE_STEP);
+			return 1;
+		case KEY_END:
+			live_timeshift ();
+			return 1;
+		}
+	}
+
+	switch (key) {
 	case KEY_ENTER:
 	case '\r':
 	case '\n':
@@ -835,6 +1199,13 @@ handle_keys (CurrentState *state)
 	case KEY_RESIZE:
 		clear_board (state);
 		return 1;
+	case 'd':
+	case 'D':
+		if (replaying ())
+			return 0;
+
+		dump_flight (_("asked for"), TRUE);
+		return 1;
 	default:
 		return 0;
 	}
@@ -968,4 +1339,6 @@ close_popup (void)
 		redrawwin (statwin);
 		wnoutrefresh (statwin);
 	}
+
+	do_update ();
 }
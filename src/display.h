@@ -24,6 +24,10 @@
 #include "packet.h"
 
 
+/* Most frames to draw a second, by default */
+#define DISPLAY_FRAME_RATE 10
+
+
 SJR_BEGIN_EXTERN
 
 /* Curses display running */
@@ -34,6 +38,14 @@ void open_display  (void);
 void close_display (void);
 int  handle_keys   (CurrentState *state);
 
+void hold_display  (int hold);
+void flush_display (void);
+void tick_display  (void);
+
+void          set_frame_rate (int rate);
+unsigned long display_frames (void);
+
+void show_state    (CurrentState *state);
 void clear_board   (CurrentState *state);
 void update_cell   (CurrentState *state, int car, int type);
 void update_car    (CurrentState *state, int car);
@@ -0,0 +1,350 @@
+/* live-f1
+ *
+ * export.c - board exported to shared memory
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "live-f1-board.h"
+#include "clock.h"
+#include "intern.h"
+#include "session.h"
+#include "export.h"
+
+
+/* Forward prototypes */
+static unsigned long long begin_update (void);
+static void               end_update   (unsigned long long started);
+static void               copy_status  (const CurrentState *state);
+static void               copy_cars    (const CurrentState *state);
+static void               copy_atom    (const CurrentState *state, int car,
+					int type);
+
+
+/* Board in shared memory, and the state it's a copy of */
+static LiveF1Board        *board = NULL;
+static const CurrentState *exported = NULL;
+
+/* How long updates have taken */
+static unsigned long long total_ns = 0, worst_ns = 0;
+
+
+/**
+ * open_export:
+ * @name: name of the shared memory segment,
+ * @state: application state structure to export.
+ *
+ * Creates (or takes over) the shared memory segment @name, which other
+ * programs can map to read the board from; see live-f1-board.h.  The
+ * segment is left behind when we exit, so that readers can tell from
+ * the time of the last update that we've gone rather than lose it.
+ *
+ * Returns: 0 on success, -1 on error with errno set.
+ **/
+int
+open_export (const char         *name,
+	     const CurrentState *state)
+{
+	void *map;
+	int   fd, saved;
+
+	fd = shm_open (name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate (fd, sizeof (LiveF1Board)) < 0)
+		goto error;
+
+	map = mmap (NULL, sizeof (LiveF1Board), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto error;
+
+	close (fd);
+
+	/* Readers check the version before anything else, so make sure
+	 * they don't see a new one until the rest is cleared
+	 */
+	board = map;
+	__atomic_store_n (&board->magic, 0, __ATOMIC_RELEASE);
+	memset ((char *) board + sizeof (board->magic), 0,
+		sizeof (LiveF1Board) - sizeof (board->magic));
+	board->version = LIVE_F1_BOARD_VERSION;
+	board->size = sizeof (LiveF1Board);
+	__atomic_store_n (&board->magic, LIVE_F1_BOARD_MAGIC,
+			  __ATOMIC_RELEASE);
+
+	exported = state;
+	return 0;
+error:
+	saved = errno;
+	close (fd);
+	errno = saved;
+	return -1;
+}
+
+/**
+ * exporting:
+ *
+ * Returns: whether the board is being exported.
+ **/
+int
+exporting (void)
+{
+	return board != NULL;
+}
+
+/**
+ * export_state:
+ * @state: application state structure.
+ *
+ * Copies everything on the board to shared memory; called from the main
+ * loop after each block of the data stream, to catch changes that don't
+ * come from a packet (reconnecting, seeking around a replay).
+ **/
+void
+export_state (const CurrentState *state)
+{
+	unsigned long long started;
+
+	if ((! board) || (state != exported))
+		return;
+
+	started = begin_update ();
+	copy_status (state);
+	copy_cars (state);
+	end_update (started);
+}
+
+/**
+ * export_packet:
+ * @state: application state structure,
+ * @packet: packet just handled.
+ *
+ * Copies whatever @packet changed to shared memory, straight after it's
+ * been handled so that readers see it without waiting for the end of
+ * the block: a single atom, the positions, or the few status fields.
+ * A new event or car changes everything, and is copied in full.
+ **/
+void
+export_packet (const CurrentState *state,
+	       const Packet       *packet)
+{
+	unsigned long long started;
+
+	if ((! board) || (state != exported))
+		return;
+
+	started = begin_update ();
+	if ((! state->arena) || (board->num_cars != (unsigned) state->num_cars)
+	    || ((! packet->car) && (packet->type == SYS_EVENT_ID))) {
+		copy_status (state);
+		copy_cars (state);
+	} else if (! packet->car) {
+		copy_status (state);
+	} else if (packet->type == CAR_POSITION_UPDATE) {
+		int i;
+
+		for (i = 0; i < state->num_cars; i++)
+			board->position[i] = state->car_position[i];
+	} else if (packet->type < LAST_CAR_PACKET) {
+		copy_atom (state, packet->car, packet->type);
+	}
+	end_update (started);
+}
+
+/**
+ * export_stats:
+ * @stats: structure to fill.
+ *
+ * Fills @stats with how many updates have been made to the exported
+ * board and how long they took.
+ **/
+void
+export_stats (ExportStats *stats)
+{
+	stats->updates = board ? board->updates : 0;
+	stats->total_ns = total_ns;
+	stats->worst_ns = worst_ns;
+}
+
+
+/**
+ * begin_update:
+ *
+ * Makes the sequence number odd, so readers know to wait, before
+ * anything on the board is changed.
+ *
+ * Returns: time the update started.
+ **/
+static unsigned long long
+begin_update (void)
+{
+	unsigned long long started;
+
+	started = real_ns ();
+	__atomic_store_n (&board->seq, board->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	return started;
+}
+
+/**
+ * end_update:
+ * @started: time the update started.
+ *
+ * Makes the sequence number even again once the board has been changed,
+ * so readers know they can copy it.
+ **/
+static void
+end_update (unsigned long long started)
+{
+	unsigned long long now, took;
+
+	now = real_ns ();
+	board->updates++;
+	board->updated_ns = now;
+	__atomic_store_n (&board->seq, board->seq + 1, __ATOMIC_RELEASE);
+
+	took = now - started;
+	total_ns += took;
+	if (took > worst_ns)
+		worst_ns = took;
+}
+
+/**
+ * copy_status:
+ * @state: application state structure.
+ *
+ * Copies the event, clock, flag, weather and fastest lap to the board.
+ * The session clock is given in the system's monotonic time, which is
+ * what readers have; it only differs from ours when replaying.
+ **/
+static void
+copy_status (const CurrentState *state)
+{
+	board->event_no = state->event_no;
+	board->event_type = state->event_type;
+	board->flag = state->flag;
+
+	board->remaining_time = state->remaining_time;
+	if (state->epoch_time) {
+		board->clock_running = 1;
+		board->clock_ns = (real_ns () - now_ns ()
+				   + state->epoch_time * 1000000000ULL);
+	} else {
+		board->clock_running = 0;
+		board->clock_ns = real_ns ();
+	}
+
+	board->laps_completed = state->laps_completed;
+	board->total_laps = state->total_laps;
+
+	board->track_temp = state->track_temp;
+	board->air_temp = state->air_temp;
+	board->humidity = state->humidity;
+	board->wind_speed = state->wind_speed;
+	board->wind_direction = state->wind_direction;
+	board->pressure = state->pressure;
+
+	if (state->arena) {
+		memcpy (board->fl_car, state->fl_car, FL_CAR_LEN);
+		memcpy (board->fl_driver,
+			string_text (state->strings, state->fl_driver),
+			FL_DRIVER_LEN);
+		memcpy (board->fl_time, state->fl_time, FL_TIME_LEN);
+		memcpy (board->fl_lap, state->fl_lap, FL_LAP_LEN);
+	} else {
+		memset (board->fl_car, 0, sizeof (board->fl_car));
+		memset (board->fl_driver, 0, sizeof (board->fl_driver));
+		memset (board->fl_time, 0, sizeof (board->fl_time));
+		memset (board->fl_lap, 0, sizeof (board->fl_lap));
+	}
+}
+
+/**
+ * copy_cars:
+ * @state: application state structure.
+ *
+ * Copies the positions and every atom of every car to the board, and
+ * clears whatever's left over from cars there no longer are.
+ **/
+static void
+copy_cars (const CurrentState *state)
+{
+	int num_cars, car, type;
+
+	num_cars = state->arena ? state->num_cars : 0;
+	board->num_cars = num_cars;
+
+	memset (board->position, 0, sizeof (board->position));
+	for (car = 1; car <= num_cars; car++)
+		board->position[car - 1] = state->car_position[car - 1];
+
+	for (type = 0; type < LAST_CAR_PACKET; type++) {
+		if (num_cars) {
+			memcpy (board->colour[type], state->cars->colour[type],
+				num_cars);
+			memcpy (board->value[type], state->cars->value[type],
+				sizeof (int) * num_cars);
+		}
+		for (car = 1; car <= num_cars; car++)
+			memcpy (board->text[type][car - 1],
+				atom_text (state, car, type), ATOM_TEXT_LEN);
+
+		memset (board->colour[type] + num_cars, 0,
+			CAR_SLOTS - num_cars);
+		for (car = num_cars; car < CAR_SLOTS; car++)
+			board->value[type][car] = NO_VALUE;
+		memset (board->text[type] + num_cars, 0,
+			ATOM_TEXT_LEN * (CAR_SLOTS - num_cars));
+	}
+}
+
+/**
+ * copy_atom:
+ * @state: application state structure,
+ * @car: car number,
+ * @type: atom type.
+ *
+ * Copies a single atom of a single car to the board.
+ **/
+static void
+copy_atom (const CurrentState *state,
+	   int                 car,
+	   int                 type)
+{
+	board->colour[type][car - 1] = state->cars->colour[type][car - 1];
+	board->value[type][car - 1] = state->cars->value[type][car - 1];
+	memcpy (board->text[type][car - 1], atom_text (state, car, type),
+		ATOM_TEXT_LEN);
+}
@@ -0,0 +1,691 @@
+/* live-f1
+ *
+ * feedgen.c - generate synthetic data streams
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#if HAVE_GETOPT_H
+# include <getopt.h>
+#else /* HAVE_GETOPT_H */
+# include <unistd.h>
+# define getopt_long(argc, argv, optstring, longopts, longindex) \
+		getopt ((argc), (argv), (optstring))
+#endif /* HAVE_GETOPT_H */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "packet.h"
+#include "wire.h"
+
+
+/* Key used when none is given */
+#define DEFAULT_KEY 0x12345678
+
+/* Most cars the header has room for */
+#define MAX_CARS 31
+
+
+/* Forward prototypes */
+static void print_version  (void);
+static void print_usage    (void);
+static int  open_output    (const char *filename, const char *address);
+static void generate       (void);
+static void key_frame      (unsigned int frame);
+static void random_atom    (void);
+static void swap_cars      (void);
+static void car_atom       (int car, int type);
+static void commentary     (void);
+static void session_clock  (unsigned int elapsed);
+static void put_packet     (int car, int type, int data,
+			    const char *payload, int len, int encrypted);
+static int  flush_output   (void);
+
+
+/* Program name */
+const char *program_name = NULL;
+
+/* How verbose to be */
+static int verbosity = 0;
+
+/* Command-line options */
+static const char opts[] = "vk:o:c:";
+static const struct option longopts[] = {
+	{ "key",	required_argument, NULL, 'k' },
+	{ "output",	required_argument, NULL, 'o' },
+	{ "connect",	required_argument, NULL, 0400 + 'c' },
+	{ "cars",	required_argument, NULL, 'c' },
+	{ "event",	required_argument, NULL, 0400 + 'e' },
+	{ "event-no",	required_argument, NULL, 0400 + 'n' },
+	{ "atoms",	required_argument, NULL, 0400 + 'a' },
+	{ "commentary",	required_argument, NULL, 0400 + 'm' },
+	{ "key-frames",	required_argument, NULL, 0400 + 'f' },
+	{ "duration",	required_argument, NULL, 0400 + 'd' },
+	{ "rate",	required_argument, NULL, 0400 + 'r' },
+	{ "seed",	required_argument, NULL, 0400 + 's' },
+	{ "verbose",	no_argument, NULL, 'v' },
+	{ "help",	no_argument, NULL, 0400 + 'h' },
+	{ "version",	no_argument, NULL, 0400 + 'v' },
+	{ NULL,		no_argument, NULL, 0 }
+};
+
+/* Settings */
+static unsigned int key = DEFAULT_KEY;
+static EventType    event_type = RACE_EVENT;
+static unsigned int event_no = 1;
+static int          num_cars = 24;
+static double       atom_rate = 50.0;
+static double       commentary_rate = 6.0;
+static unsigned int key_frame_interval = 60;
+static unsigned int duration = 7200;
+static unsigned int rate = 0;
+static unsigned int seed = 1;
+
+/* Where the stream goes, and how much has gone */
+static int                out_fd = -1;
+static unsigned long long out_total = 0;
+static struct timespec    out_start;
+
+/* Stream not yet written */
+static unsigned char *buf = NULL;
+static size_t         buf_len = 0, buf_sz = 0;
+
+/* Encryption state */
+static unsigned int salt = CRYPTO_SEED;
+
+/* Order of the cars; car index at each position */
+static int order[MAX_CARS];
+
+/* Number of atoms for this type of event */
+static int num_atoms;
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	const char *filename = "-", *address = NULL;
+	int         opt;
+
+	setlocale (LC_ALL, "");
+	bindtextdomain (PACKAGE, LOCALEDIR);
+	textdomain (PACKAGE);
+
+	program_name = argv[0];
+
+	while ((opt = getopt_long (argc, argv, opts, longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'k':
+			key = strtoul (optarg, NULL, 16);
+			break;
+		case 'o':
+			filename = optarg;
+			break;
+		case 0400 + 'c':
+			address = optarg;
+			break;
+		case 'c':
+			num_cars = atoi (optarg);
+			if ((num_cars < 1) || (num_cars > MAX_CARS)) {
+				fprintf (stderr, "%s: %s\n", program_name,
+					 _("number of cars must be 1 to 31"));
+				return 1;
+			}
+			break;
+		case 0400 + 'e':
+			if (! strcmp (optarg, "race")) {
+				event_type = RACE_EVENT;
+			} else if (! strcmp (optarg, "practice")) {
+				event_type = PRACTICE_EVENT;
+			} else if (! strcmp (optarg, "qualifying")) {
+				event_type = QUALIFYING_EVENT;
+			} else {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("unknown event type"), optarg);
+				return 1;
+			}
+			break;
+		case 0400 + 'n':
+			event_no = strtoul (optarg, NULL, 10);
+			break;
+		case 0400 + 'a':
+			atom_rate = strtod (optarg, NULL);
+			break;
+		case 0400 + 'm':
+			commentary_rate = strtod (optarg, NULL);
+			break;
+		case 0400 + 'f':
+			key_frame_interval = strtoul (optarg, NULL, 10);
+			if (! key_frame_interval)
+				key_frame_interval = 1;
+			break;
+		case 0400 + 'd':
+			duration = strtoul (optarg, NULL, 10);
+			break;
+		case 0400 + 'r':
+			rate = strtoul (optarg, NULL, 10);
+			break;
+		case 0400 + 's':
+			seed = strtoul (optarg, NULL, 10);
+			break;
+		case 'v':
+			verbosity++;
+			break;
+		case 0400 + 'h':
+			print_usage ();
+			return 0;
+		case 0400 + 'v':
+			print_version ();
+			return 0;
+		case '?':
+			fprintf (stderr,
+				 _("Try `%s --help' for more information.\n"),
+				 program_name);
+			return 1;
+		}
+	}
+
+	switch (event_type) {
+	case RACE_EVENT:
+		num_atoms = LAST_RACE_ATOM;
+		break;
+	case PRACTICE_EVENT:
+		num_atoms = LAST_PRACTICE;
+		break;
+	case QUALIFYING_EVENT:
+		num_atoms = LAST_QUALIFYING;
+		break;
+	}
+
+	if (open_output (filename, address))
+		return 1;
+
+	generate ();
+
+	info (1, _("Wrote %llu bytes\n"), out_total);
+
+	return 0;
+}
+
+/**
+ * info:
+ * @irrelevance: minimum verbosity level to output the message,
+ * @format: format string for vfprintf.
+ *
+ * Print the formatted message to standard error if verbosity is high
+ * enough; standard output may well be the stream.
+ **/
+int
+info (int         irrelevance,
+      const char *format, ...)
+{
+	va_list ap;
+	int     ret;
+
+	if (verbosity < irrelevance)
+		return 0;
+
+	va_start (ap, format);
+	ret = vfprintf (stderr, format, ap);
+	va_end (ap);
+
+	return ret;
+}
+
+/**
+ * print_version:
+ *
+ * Print the program version to standard output.
+ **/
+static void
+print_version (void)
+{
+	printf ("%s-feedgen %s\n", PACKAGE, VERSION);
+}
+
+/**
+ * print_usage:
+ *
+ * Print the program usage to standard output.
+ **/
+static void
+print_usage (void)
+{
+	printf (_("Usage: %s [OPTION]...\n"), program_name);
+	printf (_("Generates a synthetic, encrypted, live timing data stream for testing\n"
+		  "the client and servers with.\n"));
+	printf ("\n");
+	printf (_("Options:\n"
+		  "  -o, --output=FILE          write the stream to FILE (default is\n"
+		  "                             standard output).\n"
+		  "      --connect=HOST:PORT    write the stream to a TCP connection.\n"
+		  "  -k, --key=KEY              key to encrypt with, in hexadecimal.\n"
+		  "  -c, --cars=NUM             number of cars, up to 31.\n"
+		  "      --event=TYPE           race, practice or qualifying.\n"
+		  "      --event-no=NUM         event number.\n"
+		  "      --atoms=NUM            car updates per second.\n"
+		  "      --commentary=NUM       commentary lines per minute.\n"
+		  "      --key-frames=SECS      seconds between key frames.\n"
+		  "      --duration=SECS        length of the session, 0 for ever.\n"
+		  "      --rate=BYTES           write BYTES per second rather than\n"
+		  "                             as fast as possible.\n"
+		  "      --seed=NUM             seed for the random updates.\n"
+		  "  -v, --verbose              increase verbosity for each time repeated.\n"
+		  "      --help                 display this help and exit.\n"
+		  "      --version              output version information and exit.\n"));
+	printf ("\n");
+	printf (_("Report bugs to <%s>\n"), PACKAGE_BUGREPORT);
+}
+
+
+/**
+ * open_output:
+ * @filename: file to write to, or "-" for standard output,
+ * @address: HOST:PORT to connect to instead, or NULL.
+ *
+ * Opens the place the stream is to be written to.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+open_output (const char *filename,
+	     const char *address)
+{
+	if (address) {
+		struct addrinfo  hints, *res, *addr;
+		char            *host, *port;
+		int              ret;
+
+		host = strdup (address);
+		port = strrchr (host, ':');
+		if (! port) {
+			fprintf (stderr, "%s: %s: %s\n", program_name, address,
+				 _("expected HOST:PORT"));
+			return 1;
+		}
+		*(port++) = '\0';
+
+		memset (&hints, 0, sizeof (hints));
+		hints.ai_socktype = SOCK_STREAM;
+
+		ret = getaddrinfo (host, port, &hints, &res);
+		if (ret) {
+			fprintf (stderr, "%s: %s: %s\n", program_name, address,
+				 gai_strerror (ret));
+			return 1;
+		}
+
+		for (addr = res; addr; addr = addr->ai_next) {
+			out_fd = socket (addr->ai_family, addr->ai_socktype,
+					 addr->ai_protocol);
+			if (out_fd < 0)
+				continue;
+
+			if (connect (out_fd, addr->ai_addr,
+				     addr->ai_addrlen) == 0)
+				break;
+
+			close (out_fd);
+			out_fd = -1;
+		}
+
+		freeaddrinfo (res);
+		free (host);
+	} else if (strcmp (filename, "-")) {
+		out_fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	} else {
+		out_fd = STDOUT_FILENO;
+	}
+
+	if (out_fd < 0) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 address ? address : filename, strerror (errno));
+		return 1;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &out_start);
+
+	return 0;
+}
+
+/**
+ * generate:
+ *
+ * Generates the stream one second of session time at a time: a
+ * timestamp, then the car updates and commentary due in that second,
+ * with a key frame at each interval.
+ **/
+static void
+generate (void)
+{
+	unsigned int elapsed, frame = 1;
+	double       atoms = 0.0, lines = 0.0;
+	char         payload[16];
+	int          i;
+
+	for (i = 0; i < num_cars; i++)
+		order[i] = i + 1;
+
+	/* Event start, the odd byte then the number */
+	sprintf (payload, "\001%u", event_no);
+	put_packet (0, SYS_EVENT_ID, (strlen (payload) << 3) | event_type,
+		    payload, strlen (payload), FALSE);
+	salt = CRYPTO_SEED;
+
+	for (elapsed = 0; (! duration) || (elapsed < duration); elapsed++) {
+		if (! (elapsed % key_frame_interval))
+			key_frame (frame++);
+
+		payload[0] = elapsed & 0xff;
+		payload[1] = (elapsed >> 8) & 0xff;
+		put_packet (0, SYS_TIMESTAMP, 0, payload, 2, TRUE);
+
+		if (! (elapsed % 60))
+			session_clock (elapsed);
+
+		for (atoms += atom_rate; atoms >= 1.0; atoms -= 1.0)
+			random_atom ();
+		for (lines += commentary_rate / 60.0; lines >= 1.0;
+		     lines -= 1.0)
+			commentary ();
+
+		if (flush_output ())
+			return;
+	}
+}
+
+/**
+ * key_frame:
+ * @frame: key frame number.
+ *
+ * Emits a key frame marker, after which the salt is reset, and then
+ * everything a client needs to draw the board from scratch.
+ **/
+static void
+key_frame (unsigned int frame)
+{
+	char payload[4];
+	int  len = 0, i, j;
+
+	do {
+		payload[len] = (frame >> (len * 8)) & 0xff;
+		len++;
+	} while ((len < 4) && (frame >> (len * 8)));
+
+	put_packet (0, SYS_KEY_FRAME, len << 3, payload, len, FALSE);
+	salt = CRYPTO_SEED;
+
+	info (2, _("Key frame %u\n"), frame);
+
+	for (i = 0; i < num_cars; i++) {
+		put_packet (order[i], CAR_POSITION_UPDATE, i + 1, NULL, 0,
+			    FALSE);
+		for (j = 1; j < num_atoms; j++)
+			car_atom (order[i], j);
+	}
+}
+
+/**
+ * random_atom:
+ *
+ * Emits an update to a random atom of a random car, now and again
+ * swapping two cars over as well.
+ **/
+static void
+random_atom (void)
+{
+	if (rand_r (&seed) % 20 == 0) {
+		swap_cars ();
+	} else {
+		car_atom (rand_r (&seed) % num_cars + 1,
+			  rand_r (&seed) % (num_atoms - 1) + 1);
+	}
+}
+
+/**
+ * swap_cars:
+ *
+ * Swaps two adjacent cars in the order, emitting the position updates
+ * and position atoms for both.
+ **/
+static void
+swap_cars (void)
+{
+	int pos, car;
+
+	if (num_cars < 2)
+		return;
+
+	pos = rand_r (&seed) % (num_cars - 1);
+	car = order[pos];
+	order[pos] = order[pos + 1];
+	order[pos + 1] = car;
+
+	put_packet (order[pos], CAR_POSITION_UPDATE, pos + 1, NULL, 0, FALSE);
+	put_packet (order[pos + 1], CAR_POSITION_UPDATE, pos + 2, NULL, 0,
+		    FALSE);
+	car_atom (order[pos], 1);
+	car_atom (order[pos + 1], 1);
+}
+
+/**
+ * car_atom:
+ * @car: car index,
+ * @type: atom type.
+ *
+ * Emits a plausible value for the atom; only the position, number and
+ * driver need to be right, everything else is a time, gap or count
+ * according to the type of the atom.
+ **/
+static void
+car_atom (int car,
+	  int type)
+{
+	char text[16];
+	int  pos, colour;
+
+	for (pos = 0; order[pos] != car; pos++)
+		;
+
+	colour = rand_r (&seed) % 8;
+
+	switch (type) {
+	case 1:
+		sprintf (text, "%d", pos + 1);
+		break;
+	case 2:
+		sprintf (text, "%d", car);
+		break;
+	case 3:
+		sprintf (text, "%c. DRIVER%d", 'A' + (car - 1) % 26, car);
+		break;
+	default:
+		switch (rand_r (&seed) % 3) {
+		case 0:
+			sprintf (text, "1:%02d.%03d", rand_r (&seed) % 60,
+				 rand_r (&seed) % 1000);
+			break;
+		case 1:
+			sprintf (text, "%d.%d", rand_r (&seed) % 60,
+				 rand_r (&seed) % 10);
+			break;
+		default:
+			sprintf (text, "%d", rand_r (&seed) % 70);
+			break;
+		}
+		break;
+	}
+
+	put_packet (car, type, (strlen (text) << 3) | colour,
+		    text, strlen (text), TRUE);
+}
+
+/**
+ * commentary:
+ *
+ * Emits a line of commentary; the first two bytes are flags we don't
+ * understand but the real feed has.
+ **/
+static void
+commentary (void)
+{
+	char text[128];
+	int  len;
+
+	len = snprintf (text, sizeof (text),
+			"\001\001Car %d is now %d.%d seconds behind car %d.",
+			rand_r (&seed) % num_cars + 1, rand_r (&seed) % 30,
+			rand_r (&seed) % 10, rand_r (&seed) % num_cars + 1);
+
+	put_packet (0, SYS_COMMENTARY, len, text, len, TRUE);
+}
+
+/**
+ * session_clock:
+ * @elapsed: seconds since the start of the session.
+ *
+ * Emits the session clock and a couple of weather readings, which are
+ * sent once a minute.
+ **/
+static void
+session_clock (unsigned int elapsed)
+{
+	unsigned int remaining;
+	char         text[16];
+
+	remaining = (duration > elapsed ? duration - elapsed : 0);
+	sprintf (text, "%u:%02u:%02u", remaining / 3600,
+		 (remaining / 60) % 60, remaining % 60);
+	put_packet (0, SYS_WEATHER, (strlen (text) << 3) | WEATHER_SESSION_CLOCK,
+		    text, strlen (text), TRUE);
+
+	sprintf (text, "%d", 30 + rand_r (&seed) % 10);
+	put_packet (0, SYS_WEATHER, (strlen (text) << 3) | WEATHER_TRACK_TEMP,
+		    text, strlen (text), TRUE);
+	sprintf (text, "%d", 20 + rand_r (&seed) % 10);
+	put_packet (0, SYS_WEATHER, (strlen (text) << 3) | WEATHER_AIR_TEMP,
+		    text, strlen (text), TRUE);
+}
+
+/**
+ * put_packet:
+ * @car: car index, or zero for system packets,
+ * @type: packet type,
+ * @data: header data field,
+ * @payload: payload,
+ * @len: length of @payload,
+ * @encrypted: whether to encrypt @payload.
+ *
+ * Adds the packet to the output buffer, encrypting the payload with
+ * the current salt if needed.
+ **/
+static void
+put_packet (int         car,
+	    int         type,
+	    int         data,
+	    const char *payload,
+	    int         len,
+	    int         encrypted)
+{
+	if (buf_len + len + 2 > buf_sz) {
+		buf_sz = (buf_len + len + 2) * 2;
+		buf = realloc (buf, buf_sz);
+		if (! buf)
+			abort ();
+	}
+
+	encode_header (buf + buf_len, car, type, data);
+	buf_len += 2;
+
+	if (len) {
+		memcpy (buf + buf_len, payload, len);
+		if (encrypted)
+			crypt_bytes (key, &salt, buf + buf_len, len);
+		buf_len += len;
+	}
+}
+
+/**
+ * flush_output:
+ *
+ * Writes out the buffered stream, first waiting until it's due if
+ * we're keeping to a rate.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+flush_output (void)
+{
+	size_t off = 0;
+
+	if (rate) {
+		struct timespec now, due;
+		long long       ns;
+
+		ns = (long long) (out_total * 1000000000ULL / rate);
+		due.tv_sec = out_start.tv_sec + ns / 1000000000;
+		due.tv_nsec = out_start.tv_nsec + ns % 1000000000;
+		if (due.tv_nsec >= 1000000000) {
+			due.tv_sec++;
+			due.tv_nsec -= 1000000000;
+		}
+
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		if ((due.tv_sec > now.tv_sec)
+		    || ((due.tv_sec == now.tv_sec)
+			&& (due.tv_nsec > now.tv_nsec)))
+			clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME,
+					 &due, NULL);
+	}
+
+	while (off < buf_len) {
+		ssize_t len;
+
+		len = write (out_fd, buf + off, buf_len - off);
+		if ((len < 0) && (errno == EINTR)) {
+			continue;
+		} else if (len < 0) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 _("error writing stream"), strerror (errno));
+			return 1;
+		}
+
+		off += len;
+	}
+
+	out_total += buf_len;
+	buf_len = 0;
+
+	return 0;
+}
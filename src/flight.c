@@ -0,0 +1,408 @@
+/* live-f1
+ *
+ * flight.c - keeping the most recent data in case something goes wrong
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "clock.h"
+#include "crc32c.h"
+#include "record.h"
+#include "stream.h"
+#include "wire.h"
+#include "flight.h"
+
+
+/**
+ * FlightFrame:
+ * @source: where the data came from,
+ * @flags: frame flags,
+ * @arg: key frame or event number,
+ * @key: decryption key when it arrived,
+ * @salt: decryption salt when it arrived,
+ * @skip: bytes at the start finishing off a packet from an earlier
+ *   block,
+ * @skip_crypt: bytes the salt moves on by once that packet is parsed,
+ * @timestamp: monotonic time it arrived, in nanoseconds,
+ * @offset: where the data is, counting every byte ever kept,
+ * @len: length of the data.
+ *
+ * Frame of data kept by the flight recorder; the data itself is always
+ * in one piece in the ring.
+ **/
+typedef struct {
+	RecordSource       source;
+	int                flags;
+	unsigned int       arg;
+	unsigned int       key, salt;
+	size_t             skip, skip_crypt;
+	unsigned long long timestamp;
+	unsigned long long offset;
+	size_t             len;
+} FlightFrame;
+
+
+/* Forward prototypes */
+static void fatal_signal (int sig);
+static int  write_dump   (char *name, unsigned long *count);
+static int  put_frame    (int fd, RecordSource source, int flags,
+			  unsigned int arg, unsigned long long timestamp,
+			  const unsigned char *buf, size_t len);
+static int  put_all      (int fd, const unsigned char *buf, size_t len);
+
+
+/* Ring of data, and of the frames it's in */
+static unsigned char      flight_buf[FLIGHT_MEMORY];
+static FlightFrame        flight_frames[FLIGHT_FRAMES];
+static unsigned long long flight_head = 0;
+static unsigned long      nflight = 0;
+
+/* Dumps so far, the name they're given and when the last was */
+static unsigned int       ndumps = 0;
+static char               dump_prefix[64] = "live-f1-flight-";
+static time_t             last_dump = 0;
+
+
+/**
+ * init_flight:
+ *
+ * Arranges for the flight recorder to be dumped if we crash; it's
+ * otherwise always running, and costs a copy of each block.
+ **/
+void
+init_flight (void)
+{
+	struct sigaction act;
+
+	init_crc32c ();
+	snprintf (dump_prefix, sizeof (dump_prefix), "live-f1-flight-%d-",
+		  (int) getpid ());
+
+	memset (&act, 0, sizeof (act));
+	act.sa_handler = fatal_signal;
+	act.sa_flags = SA_RESETHAND;
+	sigemptyset (&act.sa_mask);
+
+	sigaction (SIGSEGV, &act, NULL);
+	sigaction (SIGBUS, &act, NULL);
+	sigaction (SIGFPE, &act, NULL);
+	sigaction (SIGILL, &act, NULL);
+	sigaction (SIGABRT, &act, NULL);
+}
+
+/**
+ * flight_frame:
+ * @state: application state structure,
+ * @source: where the data came from,
+ * @flags: frame flags,
+ * @arg: key frame or event number,
+ * @ts: monotonic time the data was received, or NULL for now,
+ * @buf: data received,
+ * @len: length of @buf.
+ *
+ * Keeps a frame of data received from the network, along with the
+ * decryption key and salt to parse it with, which must be called
+ * before it's parsed.  Once FLIGHT_MEMORY bytes or FLIGHT_FRAMES
+ * frames have been kept, the oldest are forgotten.
+ **/
+void
+flight_frame (const CurrentState    *state,
+	      RecordSource           source,
+	      int                    flags,
+	      unsigned int           arg,
+	      const struct timespec *ts,
+	      const unsigned char   *buf,
+	      size_t                 len)
+{
+	FlightFrame    *ff;
+	size_t          pos;
+
+	if (len > FLIGHT_MEMORY)
+		return;
+
+	/* Rather than wrap, begin again at the start of the ring */
+	pos = flight_head % FLIGHT_MEMORY;
+	if (pos + len > FLIGHT_MEMORY) {
+		flight_head += FLIGHT_MEMORY - pos;
+		pos = 0;
+	}
+
+	ff = &flight_frames[nflight % FLIGHT_FRAMES];
+	ff->source = source;
+	ff->flags = flags;
+	ff->arg = arg;
+	ff->key = state->key;
+	ff->salt = state->salt;
+	ff->skip = ff->skip_crypt = 0;
+	if (source == SOURCE_STREAM)
+		ff->skip = stream_partial (buf, len, &ff->skip_crypt);
+	ff->timestamp = (ts ? (ts->tv_sec * 1000000000ULL) + ts->tv_nsec
+			 : real_ns ());
+	ff->offset = flight_head;
+	ff->len = len;
+
+	if (len)
+		memcpy (flight_buf + pos, buf, len);
+	flight_head += len;
+
+	/* A crash while we were still copying shouldn't dump half */
+	__atomic_store_n (&nflight, nflight + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * dump_flight:
+ * @reason: why, for the message,
+ * @asked: TRUE if the user asked for it.
+ *
+ * Writes what the flight recorder has kept to a new file in the
+ * current directory, as a recording that can be played back with
+ * --replay.  Dumps the user didn't ask for are made at most every
+ * FLIGHT_DUMP_INTERVAL seconds, since whatever caused one is likely to
+ * carry on for a while.
+ **/
+void
+dump_flight (const char *reason,
+	     int         asked)
+{
+	char          name[sizeof (dump_prefix) + 16];
+	unsigned long count;
+	time_t        now;
+
+	now = now_seconds ();
+	if ((! asked) && last_dump
+	    && (now - last_dump < FLIGHT_DUMP_INTERVAL))
+		return;
+	last_dump = now;
+
+	if (write_dump (name, &count)) {
+		info (0, _("Unable to save flight recording %s: %s\n"),
+		      name, strerror (errno));
+		return;
+	}
+
+	info (asked ? 0 : 1, _("Saved the last %lu frames to %s (%s)\n"),
+	      count, name, reason);
+}
+
+
+/**
+ * fatal_signal:
+ * @sig: signal received.
+ *
+ * Dumps the flight recorder on the way out after a crash; only calls
+ * functions that are safe from a signal handler.
+ **/
+static void
+fatal_signal (int sig)
+{
+	char          name[sizeof (dump_prefix) + 16];
+	unsigned long count;
+
+	write_dump (name, &count);
+	raise (sig);
+}
+
+/**
+ * write_dump:
+ * @name: buffer to store the file name in,
+ * @count: pointer to store the number of frames written in.
+ *
+ * Writes the frames still in the ring to the next dump file.  The
+ * recording begins with a SOURCE_CRYPT frame so that it can be parsed
+ * from the middle of the data stream, followed by the first block with
+ * a whole packet, from that packet on; key frames begun before that
+ * are left out.  Safe to call from a signal handler.
+ *
+ * Returns: 0 on success, non-zero on failure with errno set.
+ **/
+static int
+write_dump (char          *name,
+	    unsigned long *count)
+{
+	unsigned char hdr[RECORD_HEADER_LEN];
+	unsigned long first, last, i;
+	unsigned int  num, key_frame = 0;
+	int           fd, crypt = FALSE, ndigits = 0;
+	char          digits[12], *ptr;
+
+	/* Put the name together without stdio */
+	num = ++ndumps;
+	do {
+		digits[ndigits++] = '0' + (num % 10);
+		num /= 10;
+	} while (num);
+
+	strcpy (name, dump_prefix);
+	ptr = name + strlen (name);
+	while (ndigits)
+		*(ptr++) = digits[--ndigits];
+	strcpy (ptr, ".lf1");
+
+	*count = 0;
+	fd = open (name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return 1;
+
+	memcpy (hdr, RECORD_MAGIC, 8);
+	put_le (hdr + 8, RECORD_VERSION, 4);
+	put_le (hdr + 12, 0, 4);
+	if (put_all (fd, hdr, sizeof (hdr)))
+		goto error;
+
+	last = __atomic_load_n (&nflight, __ATOMIC_ACQUIRE);
+	first = (last > FLIGHT_FRAMES) ? last - FLIGHT_FRAMES : 0;
+	while ((first < last) && (flight_head > FLIGHT_MEMORY)
+	       && (flight_frames[first % FLIGHT_FRAMES].offset
+		   < flight_head - FLIGHT_MEMORY))
+		first++;
+
+	for (i = first; i < last; i++) {
+		const FlightFrame   *ff = &flight_frames[i % FLIGHT_FRAMES];
+		const unsigned char *buf;
+		size_t               len;
+
+		buf = flight_buf + (ff->offset % FLIGHT_MEMORY);
+		len = ff->len;
+
+		if ((ff->source == SOURCE_STREAM) && (! crypt)) {
+			unsigned char data[8];
+			unsigned int  salt = ff->salt;
+			size_t        j;
+
+			if (ff->skip >= len)
+				continue;
+
+			for (j = 0; ff->key && (j < ff->skip_crypt); j++)
+				salt = next_salt (salt, ff->key);
+
+			put_le (data, ff->key, 4);
+			put_le (data + 4, salt, 4);
+			if (put_frame (fd, SOURCE_CRYPT, 0, 0, ff->timestamp,
+				       data, sizeof (data)))
+				goto error;
+
+			buf += ff->skip;
+			len -= ff->skip;
+			crypt = TRUE;
+		} else if (ff->source == SOURCE_KEY_FRAME) {
+			if (ff->flags & FRAME_FIRST) {
+				key_frame = ff->arg;
+			} else if (ff->arg != key_frame) {
+				continue;
+			}
+		}
+
+		if (put_frame (fd, ff->source, ff->flags, ff->arg,
+			       ff->timestamp, buf, len))
+			goto error;
+		(*count)++;
+	}
+
+	if (close (fd) < 0)
+		return 1;
+
+	return 0;
+error:
+	close (fd);
+	return 1;
+}
+
+/**
+ * put_frame:
+ * @fd: file to write to,
+ * @source: where the data came from,
+ * @flags: frame flags,
+ * @arg: key frame or event number,
+ * @timestamp: monotonic time the data was received, in nanoseconds,
+ * @buf: data,
+ * @len: length of @buf.
+ *
+ * Writes a frame of a recording.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+put_frame (int                  fd,
+	   RecordSource         source,
+	   int                  flags,
+	   unsigned int         arg,
+	   unsigned long long   timestamp,
+	   const unsigned char *buf,
+	   size_t               len)
+{
+	unsigned char hdr[FRAME_HEADER_LEN];
+	Frame         frame;
+
+	frame.source = source;
+	frame.flags = flags;
+	frame.arg = arg;
+	frame.len = len;
+	frame.timestamp = timestamp;
+
+	encode_frame (hdr, &frame, buf);
+	if (put_all (fd, hdr, sizeof (hdr)) || put_all (fd, buf, len))
+		return 1;
+
+	return 0;
+}
+
+/**
+ * put_all:
+ * @fd: file to write to,
+ * @buf: data to write,
+ * @len: length of @buf.
+ *
+ * Returns: 0 once all of @buf is written, non-zero on failure.
+ **/
+static int
+put_all (int                  fd,
+	 const unsigned char *buf,
+	 size_t               len)
+{
+	while (len) {
+		ssize_t ret;
+
+		ret = write (fd, buf, len);
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;
+		} else if (ret < 0) {
+			return 1;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
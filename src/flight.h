@@ -0,0 +1,47 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_FLIGHT_H
+#define LIVE_F1_FLIGHT_H
+
+#include <time.h>
+
+#include "live-f1.h"
+#include "record.h"
+
+
+/* Bytes of the most recent data kept, and most frames */
+#define FLIGHT_MEMORY (1024 * 1024)
+#define FLIGHT_FRAMES 8192
+
+/* Fewest seconds between dumps that weren't asked for */
+#define FLIGHT_DUMP_INTERVAL 60
+
+
+SJR_BEGIN_EXTERN
+
+void init_flight  (void);
+void flight_frame (const CurrentState *state, RecordSource source,
+		   int flags, unsigned int arg, const struct timespec *ts,
+		   const unsigned char *buf, size_t len);
+void dump_flight  (const char *reason, int asked);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_FLIGHT_H */
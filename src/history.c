@@ -0,0 +1,231 @@
+/* live-f1
+ *
+ * history.c - series of values kept in bounded memory
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include "live-f1.h"
+#include "history.h"
+
+
+/* Forward prototypes */
+static void fold_sample  (History *history);
+static void merge_bucket (HistoryBucket *summary, const HistoryBucket *bucket);
+
+
+/**
+ * init_history:
+ * @history: series to initialise,
+ * @window: span to keep each value for,
+ * @width: span each summary of older values covers.
+ *
+ * Makes @history an empty series.  @window and @width are in whatever
+ * the series is indexed by, usually seconds of session time.
+ **/
+void
+init_history (History *history,
+	      int      window,
+	      int      width)
+{
+	history->window = window;
+	history->width = MAX (width, 1);
+	clear_history (history);
+}
+
+/**
+ * clear_history:
+ * @history: series to clear.
+ *
+ * Forgets every value in @history.
+ **/
+void
+clear_history (History *history)
+{
+	history->samples_start = history->samples_len = 0;
+	history->buckets_start = history->buckets_len = 0;
+}
+
+/**
+ * append_history:
+ * @history: series to add to,
+ * @x: when @value was seen,
+ * @value: value seen.
+ *
+ * Adds a value to the end of @history, summarising any that have now
+ * fallen out of the window (or out of the room there is for them), and
+ * forgetting the oldest summary if there's no room for another.  Each
+ * value is only ever summarised once, so this takes constant time.
+ *
+ * If @x is before the last value, time has gone backwards (we've
+ * jumped back in a recording) and the series starts again.
+ **/
+void
+append_history (History *history,
+		int      x,
+		int      value)
+{
+	HistorySample *sample;
+
+	if (history->samples_len) {
+		sample = &history->samples[(history->samples_start
+					    + history->samples_len - 1)
+					   % HISTORY_SAMPLES];
+		if (x < sample->x)
+			clear_history (history);
+	}
+
+	while (history->samples_len
+	       && ((history->samples_len == HISTORY_SAMPLES)
+		   || (history->samples[history->samples_start].x
+		       <= x - history->window)))
+		fold_sample (history);
+
+	sample = &history->samples[(history->samples_start
+				    + history->samples_len++)
+				   % HISTORY_SAMPLES];
+	sample->x = x;
+	sample->value = value;
+}
+
+/**
+ * summary_history:
+ * @history: series to summarise,
+ * @from: earliest value to include,
+ * @summary: structure to fill.
+ *
+ * Summarises the values in @history seen at or after @from: the least,
+ * greatest and last of them, and how many there were.  @summary->x is
+ * set to when the first was seen.  Summaries of older values are only
+ * included if the span they cover starts at or after @from.
+ *
+ * Returns: number of values summarised.
+ **/
+int
+summary_history (const History *history,
+		 int            from,
+		 HistoryBucket *summary)
+{
+	unsigned int i;
+
+	summary->x = summary->min = summary->max = summary->last = 0;
+	summary->count = 0;
+
+	for (i = 0; i < history->buckets_len; i++) {
+		const HistoryBucket *bucket;
+
+		bucket = &history->buckets[(history->buckets_start + i)
+					   % HISTORY_BUCKETS];
+		if (bucket->x >= from)
+			merge_bucket (summary, bucket);
+	}
+
+	for (i = 0; i < history->samples_len; i++) {
+		const HistorySample *sample;
+		HistoryBucket        bucket;
+
+		sample = &history->samples[(history->samples_start + i)
+					   % HISTORY_SAMPLES];
+		if (sample->x < from)
+			continue;
+
+		bucket.x = sample->x;
+		bucket.min = bucket.max = bucket.last = sample->value;
+		bucket.count = 1;
+		merge_bucket (summary, &bucket);
+	}
+
+	return summary->count;
+}
+
+
+/**
+ * fold_sample:
+ * @history: series to fold into.
+ *
+ * Takes the oldest value out of the full resolution tier, and adds it
+ * to the summary of the span it falls in; starting a new one if it's
+ * the first value in that span, and dropping the oldest summary if
+ * that's full.
+ **/
+static void
+fold_sample (History *history)
+{
+	HistorySample *sample;
+	HistoryBucket *bucket = NULL;
+	int            x;
+
+	sample = &history->samples[history->samples_start];
+	history->samples_start = (history->samples_start + 1) % HISTORY_SAMPLES;
+	history->samples_len--;
+
+	x = sample->x - (((sample->x % history->width) + history->width)
+			 % history->width);
+
+	if (history->buckets_len)
+		bucket = &history->buckets[(history->buckets_start
+					    + history->buckets_len - 1)
+					   % HISTORY_BUCKETS];
+
+	if ((! bucket) || (bucket->x != x)) {
+		if (history->buckets_len == HISTORY_BUCKETS) {
+			history->buckets_start = ((history->buckets_start + 1)
+						  % HISTORY_BUCKETS);
+			history->buckets_len--;
+		}
+
+		bucket = &history->buckets[(history->buckets_start
+					    + history->buckets_len++)
+					   % HISTORY_BUCKETS];
+		bucket->x = x;
+		bucket->min = bucket->max = sample->value;
+		bucket->count = 0;
+	}
+
+	bucket->min = MIN (bucket->min, sample->value);
+	bucket->max = MAX (bucket->max, sample->value);
+	bucket->last = sample->value;
+	bucket->count++;
+}
+
+/**
+ * merge_bucket:
+ * @summary: summary to add to,
+ * @bucket: summary to add.
+ *
+ * Adds the values summarised by @bucket, which are later than those
+ * already in @summary, to @summary.
+ **/
+static void
+merge_bucket (HistoryBucket       *summary,
+	      const HistoryBucket *bucket)
+{
+	if (! summary->count) {
+		*summary = *bucket;
+		return;
+	}
+
+	summary->min = MIN (summary->min, bucket->min);
+	summary->max = MAX (summary->max, bucket->max);
+	summary->last = bucket->last;
+	summary->count += bucket->count;
+}
@@ -0,0 +1,92 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_HISTORY_H
+#define LIVE_F1_HISTORY_H
+
+#include "live-f1.h"
+
+
+/* Samples kept at full resolution, and summaries of older ones */
+#define HISTORY_SAMPLES 128
+#define HISTORY_BUCKETS 128
+
+/**
+ * HistorySample:
+ * @x: when the value was seen (seconds, laps, ...),
+ * @value: value seen.
+ *
+ * One value at full resolution.
+ **/
+typedef struct {
+	int x, value;
+} HistorySample;
+
+/**
+ * HistoryBucket:
+ * @x: start of the span the bucket covers,
+ * @min: least value seen in it,
+ * @max: greatest value seen in it,
+ * @last: last value seen in it,
+ * @count: number of values seen in it.
+ *
+ * Summary of the values seen over a span of a series, once they're too
+ * old to keep each one.
+ **/
+typedef struct {
+	int          x, min, max, last;
+	unsigned int count;
+} HistoryBucket;
+
+/**
+ * History:
+ * @window: span of the series kept at full resolution,
+ * @width: span each bucket covers,
+ * @samples_start: index of the oldest sample,
+ * @samples_len: number of samples,
+ * @buckets_start: index of the oldest bucket,
+ * @buckets_len: number of buckets,
+ * @samples: ring of the latest values,
+ * @buckets: ring of summaries of older values.
+ *
+ * A series of values, kept in two tiers of fixed size: each value over
+ * the last @window, then min, max and last for each @width before that,
+ * and nothing older than HISTORY_BUCKETS of those.  However long it's
+ * kept, it never takes more room than this structure.
+ **/
+typedef struct {
+	int           window, width;
+	unsigned int  samples_start, samples_len;
+	unsigned int  buckets_start, buckets_len;
+	HistorySample samples[HISTORY_SAMPLES];
+	HistoryBucket buckets[HISTORY_BUCKETS];
+} History;
+
+
+SJR_BEGIN_EXTERN
+
+void init_history    (History *history, int window, int width);
+void clear_history   (History *history);
+void append_history  (History *history, int x, int value);
+int  summary_history (const History *history, int from,
+		      HistoryBucket *summary);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_HISTORY_H */
@@ -25,27 +25,85 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <ne_request.h>
 #include <ne_uri.h>
 
 #include "live-f1.h"
+#include "clock.h"
+#include "display.h"
+#include "flight.h"
+#include "job.h"
+#include "record.h"
+#include "replay.h"
 #include "stream.h"
 #include "http.h"
 
 
-/* URLs to important places on the live-timing site */
-#define LOGIN_URL           "/reg/login"
-#define REGISTER_URL        "/reg/registration"
-#define KEY_URL_BASE        "/reg/getkey/"
-#define KEYFRAME_URL_PREFIX "/keyframe"
+/* Seconds to wait for a web server before giving up */
+#define HTTP_TIMEOUT 10
+
+/* Seconds to wait before logging in again after a failure, doubling
+ * each time up to the most; and failures before telling the user
+ */
+#define AUTH_RETRY_MIN    2
+#define AUTH_RETRY_MAX    300
+#define AUTH_RETRY_REPORT 5
+
+
+/**
+ * Body:
+ * @data: data received,
+ * @len: length of @data,
+ * @sz: allocated size of @data.
+ *
+ * Accumulates a response body in memory.
+ **/
+typedef struct {
+	unsigned char *data;
+	size_t         len, sz;
+} Body;
+
+/**
+ * KeyFrameReader:
+ * @userdata: pointer to pass to stream parser,
+ * @frame: key frame number.
+ *
+ * Passed to the reader that records key frame data before parsing it.
+ **/
+typedef struct {
+	void         *userdata;
+	unsigned int  frame;
+} KeyFrameReader;
 
 
 /* Forward prototypes */
+static ne_session *open_session (const char *host);
+static int  fetch_key_frame  (const char *host, unsigned int frame,
+			      ne_block_reader reader, void *userdata);
+static int  append_body      (Body *body, const char *buf, size_t len);
+static int  key_frame_block  (KeyFrameReader *kfr, const char *buf,
+			      size_t len);
 static void parse_cookie_hdr (char **value, const char  *header);
 static int  parse_key_body   (unsigned int *key, const char *buf, size_t len);
 static int  parse_number_body();
 
+static int  auth_retry_delay   (void);
+static void auth_cookie_run    (Job *job);
+static void auth_cookie_done   (Job *job);
+static void decryption_key_run  (Job *job);
+static void decryption_key_done (Job *job);
+static void total_laps_run     (Job *job);
+static void total_laps_done    (Job *job);
+static void key_frame_run      (Job *job);
+static void key_frame_done     (Job *job);
+
+
+/* Failed attempts to log in in a row, and when to try again */
+static int    auth_failures = 0;
+static time_t auth_retry_at = 0;
+
 
 /**
  * numlen:
@@ -65,6 +123,30 @@ numlen (unsigned int number)
 }
 
 
+/**
+ * open_session:
+ * @host: host to contact.
+ *
+ * Creates a new HTTP session for @host with our user agent and timeouts
+ * set, so a dead server can't keep us waiting forever.
+ *
+ * Returns: new session.
+ **/
+static ne_session *
+open_session (const char *host)
+{
+	ne_session *sess;
+
+	sess = ne_session_create ("http", host, 80);
+	ne_set_useragent (sess, PACKAGE_STRING);
+	ne_set_read_timeout (sess, HTTP_TIMEOUT);
+#if HAVE_NE_SET_CONNECT_TIMEOUT
+	ne_set_connect_timeout (sess, HTTP_TIMEOUT);
+#endif
+
+	return sess;
+}
+
 /**
  * obtain_auth_cookie:
  * @host: host to obtain cookie from,
@@ -99,8 +181,7 @@ obtain_auth_cookie (const char *host,
 	free (e_password);
 	free (e_email);
 
-	sess = ne_session_create ("http", host, 80);
-	ne_set_useragent (sess, PACKAGE_STRING);
+	sess = open_session (host);
 
 	/* Create the request */
 	req = ne_request_create (sess, "POST", LOGIN_URL);
@@ -210,8 +291,7 @@ obtain_decryption_key (const char   *host,
 		      + strlen (cookie) + 11);
 	sprintf (url, "%s%u.asp?auth=%s", KEY_URL_BASE, event_no, cookie);
 
-	sess = ne_session_create ("http", host, 80);
-	ne_set_useragent (sess, PACKAGE_STRING);
+	sess = open_session (host);
 
 	/* Create the request */
 	req = ne_request_create (sess, "GET", url);
@@ -279,6 +359,97 @@ int
 obtain_key_frame (const char   *host,
 		  unsigned int  frame,
 		  void         *userdata)
+{
+	KeyFrameReader kfr;
+
+	if (replaying ())
+		return replay_key_frame (frame, userdata);
+
+	kfr.userdata = userdata;
+	kfr.frame = frame;
+
+	/* An empty frame marks the start of the key frame in recordings */
+	flight_frame (userdata, SOURCE_KEY_FRAME, FRAME_FIRST, frame, NULL,
+		      NULL, 0);
+	record_frame (SOURCE_KEY_FRAME, FRAME_FIRST, frame, NULL, NULL, 0);
+
+	return fetch_key_frame (host, frame,
+				(ne_block_reader) key_frame_block, &kfr);
+}
+
+/**
+ * key_frame_block:
+ * @kfr: key frame details,
+ * @buf: data received,
+ * @len: length of @buf.
+ *
+ * Records the block of key frame data, if we're recording, and then
+ * passes it to the stream parser.
+ *
+ * Returns: 0 on success.
+ **/
+static int
+key_frame_block (KeyFrameReader *kfr,
+		 const char     *buf,
+		 size_t          len)
+{
+	flight_frame (kfr->userdata, SOURCE_KEY_FRAME, 0, kfr->frame, NULL,
+		      (const unsigned char *) buf, len);
+	record_frame (SOURCE_KEY_FRAME, 0, kfr->frame, NULL,
+		      (const unsigned char *) buf, len);
+
+	return parse_stream_block (kfr->userdata,
+				   (const unsigned char *) buf, len);
+}
+
+/**
+ * obtain_key_frame_data:
+ * @host: host to obtain key frame from,
+ * @frame: key frame number to obtain,
+ * @len: pointer to store length of data in.
+ *
+ * Obtains the key frame numbered from the website without parsing it,
+ * for passing on elsewhere.
+ *
+ * Returns: newly allocated data, or NULL on failure.
+ **/
+unsigned char *
+obtain_key_frame_data (const char   *host,
+		       unsigned int  frame,
+		       size_t       *len)
+{
+	Body body;
+
+	body.data = NULL;
+	body.len = body.sz = 0;
+
+	if (fetch_key_frame (host, frame, (ne_block_reader) append_body,
+			     &body)) {
+		free (body.data);
+		return NULL;
+	}
+
+	*len = body.len;
+	return body.data ? body.data : malloc (1);
+}
+
+/**
+ * fetch_key_frame:
+ * @host: host to obtain key frame from,
+ * @frame: key frame number to obtain,
+ * @reader: function to pass the data to,
+ * @userdata: pointer to pass to @reader.
+ *
+ * Obtains the key frame numbered from the website, passing the data to
+ * @reader as it arrives.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+fetch_key_frame (const char      *host,
+		 unsigned int     frame,
+		 ne_block_reader  reader,
+		 void            *userdata)
 {
 	ne_session *sess;
 	ne_request *req;
@@ -297,14 +468,11 @@ obtain_key_frame (const char   *host,
 		sprintf (url, "%s.bin", KEYFRAME_URL_PREFIX);
 	}
 
-	sess = ne_session_create ("http", host, 80);
-	ne_set_useragent (sess, PACKAGE_STRING);
+	sess = open_session (host);
 
 	/* Create the request */
 	req = ne_request_create (sess, "GET", url);
-	ne_add_response_body_reader (req, ne_accept_2xx,
-				     (ne_block_reader) parse_stream_block,
-				     userdata);
+	ne_add_response_body_reader (req, ne_accept_2xx, reader, userdata);
 	free (url);
 
 	/* Dispatch the event */
@@ -312,6 +480,14 @@ obtain_key_frame (const char   *host,
 		fprintf (stderr, "%s: %s: %s\n", program_name,
 			 _("key frame request failed"), ne_get_error (sess));
 
+		ne_request_destroy (req);
+		ne_session_destroy (sess);
+		return 1;
+	} else if (ne_get_status (req)->code >= 300) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("key frame request failed"),
+			 ne_get_status (req)->reason_phrase);
+
 		ne_request_destroy (req);
 		ne_session_destroy (sess);
 		return 1;
@@ -325,6 +501,32 @@ obtain_key_frame (const char   *host,
 	return 0;
 }
 
+/**
+ * append_body:
+ * @body: body structure to append to,
+ * @buf: buffer of data received from server,
+ * @len: length of buffer.
+ *
+ * Appends data received from the server to the end of @body.
+ **/
+static int
+append_body (Body       *body,
+	     const char *buf,
+	     size_t      len)
+{
+	if (body->len + len > body->sz) {
+		body->sz = MAX (body->sz * 2, body->len + len);
+		body->data = realloc (body->data, body->sz);
+		if (! body->data)
+			abort ();
+	}
+
+	memcpy (body->data + body->len, buf, len);
+	body->len += len;
+
+	return 0;
+}
+
 /**
  * obtain_total_laps:
  *
@@ -333,17 +535,16 @@ obtain_key_frame (const char   *host,
  * Returns: total obtained on success, or zero on failure.
  **/
 unsigned int
-obtain_total_laps ()
+obtain_total_laps (void)
 {
 	ne_session   *sess;
 	ne_request   *req;
 	unsigned int  total_laps = 0;
 
-	sess = ne_session_create ("http", WEBSERVICE_HOST, 80);
-	ne_set_useragent (sess, PACKAGE_STRING);
+	sess = open_session (WEBSERVICE_HOST);
 
 	/* Create the request */
-	req = ne_request_create (sess, "GET", "/laps.php");
+	req = ne_request_create (sess, "GET", LAPS_URL);
 	ne_add_response_body_reader (req, ne_accept_2xx,
 				     (ne_block_reader) parse_number_body, &total_laps);
 
@@ -384,3 +585,323 @@ parse_number_body (unsigned int *result,
 
 	return 0;
 }
+
+
+/**
+ * request_auth_cookie:
+ * @state: application state structure.
+ *
+ * Obtains the user's authentication cookie in the background, storing it
+ * in @state when it arrives; this allows us to log in at the same time
+ * as connecting to the data stream.  Once the cookie has arrived, the
+ * decryption key is requested if we've already seen the event start.
+ **/
+void
+request_auth_cookie (CurrentState *state)
+{
+	if (start_job (state, auth_cookie_run, auth_cookie_done, 0))
+		return;
+
+	while (! (state->cookie = obtain_auth_cookie (state->auth_host,
+						      state->email,
+						      state->password)))
+		sleep (auth_retry_delay ());
+
+	auth_failures = 0;
+}
+
+/**
+ * retry_auth_cookie:
+ * @state: application state structure.
+ *
+ * Called from the main loop; tries to log in again once the wait after
+ * a failed attempt is over.
+ **/
+void
+retry_auth_cookie (CurrentState *state)
+{
+	if ((! auth_retry_at) || state->cookie
+	    || (now_seconds () < auth_retry_at))
+		return;
+
+	auth_retry_at = 0;
+	request_auth_cookie (state);
+}
+
+/**
+ * auth_retry_delay:
+ *
+ * Counts a failed attempt to log in, telling the user if there have
+ * been a few in a row, so that neither bad credentials nor the login
+ * host being down have us hammering it.
+ *
+ * Returns: seconds to wait before trying again.
+ **/
+static int
+auth_retry_delay (void)
+{
+	int delay;
+
+	delay = AUTH_RETRY_MIN << MIN (auth_failures, 8);
+	if (delay > AUTH_RETRY_MAX)
+		delay = AUTH_RETRY_MAX;
+
+	if (++auth_failures == AUTH_RETRY_REPORT)
+		info (0, _("Unable to log in after %d attempts, "
+			   "still trying at most every %d minutes\n"),
+		      auth_failures, AUTH_RETRY_MAX / 60);
+
+	return delay;
+}
+
+/**
+ * auth_cookie_run:
+ * @job: job being run.
+ *
+ * Logs in, in the background thread, leaving the cookie in @job.
+ **/
+static void
+auth_cookie_run (Job *job)
+{
+	job->str = obtain_auth_cookie (job->state->auth_host,
+				       job->state->email,
+				       job->state->password);
+}
+
+/**
+ * auth_cookie_done:
+ * @job: job that has finished.
+ *
+ * Stores the cookie once logged in, and asks for the decryption key if
+ * it was waiting for it; if the login failed, it's tried again after a
+ * while by retry_auth_cookie().
+ **/
+static void
+auth_cookie_done (Job *job)
+{
+	CurrentState *state = job->state;
+
+	if (! job->str) {
+		auth_retry_at = now_seconds () + auth_retry_delay ();
+		return;
+	}
+
+	state->cookie = job->str;
+	job->str = NULL;
+	auth_failures = 0;
+
+	if (state->key_pending)
+		request_decryption_key (state, state->event_no);
+}
+
+/**
+ * request_decryption_key:
+ * @state: application state structure,
+ * @event_no: official event number.
+ *
+ * Obtains the decryption key for the event in the background; if we
+ * don't have the authentication cookie yet, this is deferred until we
+ * do.  While the key is pending, encrypted packets are queued rather
+ * than handled; once it arrives the board is drawn and the queue
+ * released.
+ **/
+void
+request_decryption_key (CurrentState *state,
+			unsigned int  event_no)
+{
+	state->key_pending = 1;
+
+	/* A recording has the key in it */
+	if (replaying ()) {
+		Job job;
+
+		job.state = state;
+		job.arg = event_no;
+		job.result = replay_key (event_no);
+		decryption_key_done (&job);
+		return;
+	}
+
+	if (! state->cookie)
+		return;
+
+	if (! start_job (state, decryption_key_run, decryption_key_done,
+			 event_no)) {
+		Job job;
+
+		job.state = state;
+		job.arg = event_no;
+		job.result = obtain_decryption_key (state->host, event_no,
+						    state->cookie);
+		decryption_key_done (&job);
+	}
+}
+
+/**
+ * decryption_key_run:
+ * @job: job being run.
+ *
+ * Fetches the decryption key for the event, in the background thread,
+ * leaving it in @job.
+ **/
+static void
+decryption_key_run (Job *job)
+{
+	job->result = obtain_decryption_key (job->state->host, job->arg,
+					     job->state->cookie);
+}
+
+/**
+ * decryption_key_done:
+ * @job: job that has finished.
+ *
+ * Stores the decryption key, unless the event has changed since it was
+ * asked for, keeping a copy with any recording; then draws the board
+ * and releases the packets queued while it was on its way.
+ **/
+static void
+decryption_key_done (Job *job)
+{
+	CurrentState    *state = job->state;
+	static int       first_board = 1;
+
+	/* Stale answer for an event we've since moved on from */
+	if ((! state->key_pending) || (job->arg != state->event_no))
+		return;
+
+	state->key = job->result;
+	state->key_pending = 0;
+
+	/* Keep the key with any recording, so it can be played offline */
+	if (state->key) {
+		unsigned char key[4];
+
+		key[0] = state->key & 0xff;
+		key[1] = (state->key >> 8) & 0xff;
+		key[2] = (state->key >> 16) & 0xff;
+		key[3] = (state->key >> 24) & 0xff;
+		flight_frame (state, SOURCE_KEY, 0, state->event_no, NULL,
+			      key, 4);
+		record_frame (SOURCE_KEY, 0, state->event_no, NULL, key, 4);
+	}
+
+	clear_board (state);
+	release_queued_packets (state);
+
+	if (first_board) {
+		info (1, _("Time to first board: %ld ms\n"),
+		      (long) ((real_ns () - state->start_time) / 1000000));
+		first_board = 0;
+	}
+}
+
+/**
+ * request_total_laps:
+ * @state: application state structure.
+ *
+ * Obtains the total number of laps for the race in the background,
+ * storing it in @state and updating the display whenever it arrives.
+ * Until then (or if it never does), the display falls back to showing
+ * the number of laps completed.
+ **/
+void
+request_total_laps (CurrentState *state)
+{
+	state->total_laps = 0;
+	if (! start_job (state, total_laps_run, total_laps_done,
+			 state->event_no))
+		state->total_laps = obtain_total_laps ();
+}
+
+/**
+ * total_laps_run:
+ * @job: job being run.
+ *
+ * Fetches the total number of laps, in the background thread, leaving
+ * it in @job.
+ **/
+static void
+total_laps_run (Job *job)
+{
+	job->result = obtain_total_laps ();
+}
+
+/**
+ * total_laps_done:
+ * @job: job that has finished.
+ *
+ * Stores the total number of laps, unless the event has changed since
+ * they were asked for, and updates the status window.
+ **/
+static void
+total_laps_done (Job *job)
+{
+	CurrentState *state = job->state;
+
+	/* Stale answer for an event we've since moved on from */
+	if (job->arg && (job->arg != state->event_no))
+		return;
+
+	if (! job->result)
+		info (2, _("Unable to obtain total laps\n"));
+
+	state->total_laps = job->result;
+	if (state->key)
+		update_status (state);
+}
+
+
+/**
+ * record_key_frame:
+ * @state: application state structure,
+ * @frame: key frame number.
+ *
+ * Called at each key frame marker we don't need the key frame for.  If
+ * we're recording, it's fetched in the background and added to the
+ * recording without being parsed, so that a replay can begin again
+ * from any marker rather than only those we happened to fetch.
+ **/
+void
+record_key_frame (CurrentState *state,
+		  unsigned int  frame)
+{
+	if ((! recording ()) || replaying ())
+		return;
+
+	start_job (state, key_frame_run, key_frame_done, frame);
+}
+
+/**
+ * key_frame_run:
+ * @job: job being run.
+ *
+ * Fetches a key frame, in the background thread, leaving it and its
+ * length in @job.
+ **/
+static void
+key_frame_run (Job *job)
+{
+	size_t len = 0;
+
+	job->str = (char *) obtain_key_frame_data (job->state->host,
+						   job->arg, &len);
+	job->result = len;
+}
+
+/**
+ * key_frame_done:
+ * @job: job that has finished.
+ *
+ * Adds the key frame to the recording, marked as its first chunk just
+ * as one fetched for parsing would be.
+ **/
+static void
+key_frame_done (Job *job)
+{
+	if (! job->str)
+		return;
+
+	record_frame (SOURCE_KEY_FRAME, FRAME_FIRST, job->arg, NULL, NULL, 0);
+	record_frame (SOURCE_KEY_FRAME, 0, job->arg, NULL,
+		      (const unsigned char *) job->str, job->result);
+}
@@ -23,6 +23,16 @@
 #include "live-f1.h"
 
 
+/* URLs to important places on the live-timing site */
+#define LOGIN_URL           "/reg/login"
+#define REGISTER_URL        "/reg/registration"
+#define KEY_URL_BASE        "/reg/getkey/"
+#define KEYFRAME_URL_PREFIX "/keyframe"
+
+/* URL of the total laps on the web service host */
+#define LAPS_URL            "/laps.php"
+
+
 SJR_BEGIN_EXTERN
 
 char *       obtain_auth_cookie    (const char *host,
@@ -31,6 +41,15 @@ unsigned int obtain_decryption_key (const char *host, unsigned int event_no,
 				    const char *cookie);
 int          obtain_key_frame      (const char *host, unsigned int frame,
 				    void *unknown);
+unsigned char *obtain_key_frame_data (const char *host, unsigned int frame,
+				      size_t *len);
+unsigned int obtain_total_laps     (void);
+
+void request_auth_cookie    (CurrentState *state);
+void retry_auth_cookie      (CurrentState *state);
+void request_decryption_key (CurrentState *state, unsigned int event_no);
+void request_total_laps     (CurrentState *state);
+void record_key_frame       (CurrentState *state, unsigned int frame);
 
 SJR_END_EXTERN
 
@@ -0,0 +1,409 @@
+/* live-f1
+ *
+ * intern.c - pool of interned strings
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "session.h"
+#include "intern.h"
+
+
+/* Handles are marked by mark_string() with this until swept */
+#define MARKED ((unsigned int) -1)
+
+
+/**
+ * StringPool:
+ * @len: number of strings held,
+ * @size: number of strings there's room for, always a power of two,
+ * @slots: hash table of handles plus one, or zero where empty, twice
+ *   the size,
+ * @text: each string, padded with zeros,
+ * @value: number each string reads as (see atom_value()),
+ * @moved: for each handle, MARKED if it's to be kept by the next
+ *   sweep_strings(), or since the last one, what it's become plus one,
+ * @swept: number of strings held before the last sweep_strings(),
+ * @block: memory all the arrays are in.
+ *
+ * A set of distinct strings, each kept once and known by its index,
+ * its handle.  Strings are no longer than the text of an atom, and
+ * padded out to the same width, so that finding one is a hash and a
+ * fixed-width compare.  Handles stay the same until the pool is
+ * cleared or swept.
+ **/
+struct StringPool {
+	unsigned int   len, size;
+	unsigned int  *slots;
+	char         (*text)[ATOM_TEXT_LEN];
+	int           *value;
+	unsigned int  *moved;
+	unsigned int   swept;
+	void          *block;
+};
+
+
+/* Forward prototypes */
+static void         grow_pool   (StringPool *pool, unsigned int size);
+static void         hash_pool   (StringPool *pool);
+static unsigned int hash_string (const char *padded);
+
+
+/* Strings interned, times looked up, heap allocations made, and times
+ * pools have been swept
+ */
+static unsigned long interned = 0, lookups = 0, allocs = 0, sweeps = 0;
+
+
+/**
+ * new_string_pool:
+ * @size: number of strings to make room for, a power of two.
+ *
+ * Allocates a pool of strings holding only the empty one, whose handle
+ * is EMPTY_STRING.  The pool only goes back to the heap if more than
+ * @size strings are interned without it being cleared or swept.
+ *
+ * Returns: newly allocated pool.
+ **/
+StringPool *
+new_string_pool (unsigned int size)
+{
+	StringPool *pool;
+
+	pool = malloc (sizeof (StringPool));
+	if (! pool)
+		abort ();
+
+	allocs++;
+
+	memset (pool, 0, sizeof (StringPool));
+	grow_pool (pool, size);
+
+	clear_string_pool (pool);
+	return pool;
+}
+
+/**
+ * free_string_pool:
+ * @pool: pool to free.
+ *
+ * Frees @pool and every string in it.
+ **/
+void
+free_string_pool (StringPool *pool)
+{
+	free (pool->block);
+	free (pool);
+}
+
+/**
+ * clear_string_pool:
+ * @pool: pool to clear.
+ *
+ * Forgets every string in @pool but the empty one, ready for the next
+ * event; the room it had is kept.
+ **/
+void
+clear_string_pool (StringPool *pool)
+{
+	memset (pool->slots, 0, sizeof (unsigned int) * pool->size * 2);
+	pool->len = pool->swept = 0;
+
+	intern_string (pool, "", 0);
+}
+
+/**
+ * string_pool_full:
+ * @pool: pool to check.
+ *
+ * Returns: TRUE if there's no room left for another string in @pool
+ * without going to the heap.
+ **/
+int
+string_pool_full (const StringPool *pool)
+{
+	return (pool->len == pool->size);
+}
+
+/**
+ * intern_string:
+ * @pool: pool to look in,
+ * @text: string to look up,
+ * @len: most characters of @text to use.
+ *
+ * Finds @text in @pool, adding it if it isn't there already.  It's cut
+ * short at @len characters, or those an atom has room for if fewer, so
+ * need not be terminated if it's at least that long.  A pool that's
+ * full is doubled in size.
+ *
+ * Returns: handle of the string.
+ **/
+unsigned int
+intern_string (StringPool *pool,
+	       const char *text,
+	       size_t      len)
+{
+	char         padded[ATOM_TEXT_LEN];
+	unsigned int mask, i;
+	size_t       n;
+
+	lookups++;
+
+	memset (padded, 0, sizeof (padded));
+	for (n = 0; (n < len) && (n < ATOM_TEXT_LEN - 1) && text[n]; n++)
+		padded[n] = text[n];
+
+	if (pool->len == pool->size)
+		grow_pool (pool, pool->size * 2);
+
+	mask = pool->size * 2 - 1;
+	for (i = hash_string (padded) & mask; pool->slots[i];
+	     i = (i + 1) & mask) {
+		unsigned int handle = pool->slots[i] - 1;
+
+		if (! memcmp (pool->text[handle], padded, ATOM_TEXT_LEN))
+			return handle;
+	}
+
+	memcpy (pool->text[pool->len], padded, ATOM_TEXT_LEN);
+	pool->value[pool->len] = atom_value (padded);
+	pool->slots[i] = ++pool->len;
+	interned++;
+
+	return pool->len - 1;
+}
+
+/**
+ * string_count:
+ * @pool: pool to count.
+ *
+ * Returns: number of strings in @pool, including the empty one; their
+ * handles are those below this.
+ **/
+unsigned int
+string_count (const StringPool *pool)
+{
+	return pool->len;
+}
+
+/**
+ * string_text:
+ * @pool: pool the string is in,
+ * @handle: handle of the string.
+ *
+ * Returns: the string, which may move when more strings are interned.
+ **/
+const char *
+string_text (const StringPool *pool,
+	     unsigned int      handle)
+{
+	return pool->text[handle];
+}
+
+/**
+ * string_value:
+ * @pool: pool the string is in,
+ * @handle: handle of the string.
+ *
+ * Returns: number the string reads as in thousandths, or NO_VALUE;
+ * worked out once, when it was interned.
+ **/
+int
+string_value (const StringPool *pool,
+	      unsigned int      handle)
+{
+	return pool->value[handle];
+}
+
+/**
+ * mark_string:
+ * @pool: pool the string is in,
+ * @handle: handle of the string.
+ *
+ * Marks a string as still being used, so that the next sweep_strings()
+ * keeps it; handles not in @pool are ignored.
+ **/
+void
+mark_string (StringPool   *pool,
+	     unsigned int  handle)
+{
+	if (handle < pool->len)
+		pool->moved[handle] = MARKED;
+}
+
+/**
+ * sweep_strings:
+ * @pool: pool to sweep.
+ *
+ * Forgets every string but the empty one that hasn't been marked with
+ * mark_string() since the last sweep, and moves those left down to make
+ * room, without going to the heap.  Every handle still held must then
+ * be passed through moved_string(), before any more strings are
+ * interned.
+ **/
+void
+sweep_strings (StringPool *pool)
+{
+	unsigned int i, len = 0;
+
+	pool->moved[EMPTY_STRING] = MARKED;
+	for (i = 0; i < pool->len; i++) {
+		if (pool->moved[i] != MARKED) {
+			pool->moved[i] = 0;
+			continue;
+		}
+
+		memmove (pool->text[len], pool->text[i], ATOM_TEXT_LEN);
+		pool->value[len] = pool->value[i];
+		pool->moved[i] = ++len;
+	}
+
+	pool->swept = pool->len;
+	pool->len = len;
+	hash_pool (pool);
+
+	sweeps++;
+}
+
+/**
+ * moved_string:
+ * @pool: pool the string is in,
+ * @handle: handle of the string before the last sweep_strings().
+ *
+ * Returns: handle of the string now, or EMPTY_STRING if it wasn't
+ * marked and has been forgotten.
+ **/
+unsigned int
+moved_string (const StringPool *pool,
+	      unsigned int      handle)
+{
+	if ((handle >= pool->swept) || (! pool->moved[handle]))
+		return EMPTY_STRING;
+
+	return pool->moved[handle] - 1;
+}
+
+/**
+ * string_stats:
+ * @stats: structure to fill.
+ *
+ * Reports how many strings have been interned, against how many times
+ * they've been looked up.
+ **/
+void
+string_stats (StringStats *stats)
+{
+	stats->strings = interned;
+	stats->lookups = lookups;
+	stats->allocs = allocs;
+	stats->sweeps = sweeps;
+}
+
+
+/**
+ * grow_pool:
+ * @pool: pool to grow,
+ * @size: number of strings to make room for.
+ *
+ * Makes room for more strings in @pool, all in one block from the heap,
+ * and hashes the ones it has again into a table twice the size.
+ **/
+static void
+grow_pool (StringPool  *pool,
+	   unsigned int size)
+{
+	unsigned char *block;
+
+	block = malloc (size * (ATOM_TEXT_LEN + sizeof (int)
+				+ sizeof (unsigned int) * 3));
+	if (! block)
+		abort ();
+
+	allocs++;
+
+	/* Strings first, so they stay aligned */
+	if (pool->len) {
+		memcpy (block, pool->text, ATOM_TEXT_LEN * pool->len);
+		memcpy (block + ATOM_TEXT_LEN * size, pool->value,
+			sizeof (int) * pool->len);
+	}
+	free (pool->block);
+
+	pool->block = block;
+	pool->text = (void *) block;
+	pool->value = (int *) (block + ATOM_TEXT_LEN * size);
+	pool->moved = (unsigned int *) (pool->value + size);
+	pool->slots = pool->moved + size;
+	pool->size = size;
+	pool->swept = 0;
+
+	hash_pool (pool);
+}
+
+/**
+ * hash_pool:
+ * @pool: pool to hash.
+ *
+ * Fills the hash table of @pool again from the strings it has.
+ **/
+static void
+hash_pool (StringPool *pool)
+{
+	unsigned int mask, i, j;
+
+	memset (pool->slots, 0, sizeof (unsigned int) * pool->size * 2);
+
+	mask = pool->size * 2 - 1;
+	for (i = 0; i < pool->len; i++) {
+		for (j = hash_string (pool->text[i]) & mask; pool->slots[j];
+		     j = (j + 1) & mask)
+			;
+
+		pool->slots[j] = i + 1;
+	}
+}
+
+/**
+ * hash_string:
+ * @padded: string padded out to ATOM_TEXT_LEN.
+ *
+ * Mixes the two halves of @padded together.
+ *
+ * Returns: hash of @padded.
+ **/
+static unsigned int
+hash_string (const char *padded)
+{
+	uint64_t lo, hi;
+
+	memcpy (&lo, padded, sizeof (lo));
+	memcpy (&hi, padded + sizeof (lo), sizeof (hi));
+
+	lo = (lo ^ (hi * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+	return (unsigned int) (lo >> 32);
+}
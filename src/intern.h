@@ -0,0 +1,63 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_INTERN_H
+#define LIVE_F1_INTERN_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/* Handle of the empty string, in every pool */
+#define EMPTY_STRING 0
+
+/**
+ * StringStats:
+ * @strings: strings interned, counting each pool separately,
+ * @lookups: times a string has been looked up,
+ * @allocs: heap allocations made for pools,
+ * @sweeps: times pools have been swept to make room.
+ *
+ * How much interning strings has saved.
+ **/
+typedef struct {
+	unsigned long strings, lookups, allocs, sweeps;
+} StringStats;
+
+
+SJR_BEGIN_EXTERN
+
+StringPool * new_string_pool   (unsigned int size);
+void         free_string_pool  (StringPool *pool);
+void         clear_string_pool (StringPool *pool);
+int          string_pool_full  (const StringPool *pool);
+unsigned int intern_string     (StringPool *pool, const char *text,
+				size_t len);
+unsigned int string_count      (const StringPool *pool);
+const char * string_text       (const StringPool *pool, unsigned int handle);
+int          string_value      (const StringPool *pool, unsigned int handle);
+void         mark_string       (StringPool *pool, unsigned int handle);
+void         sweep_strings     (StringPool *pool);
+unsigned int moved_string      (const StringPool *pool, unsigned int handle);
+void         string_stats      (StringStats *stats);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_INTERN_H */
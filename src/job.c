@@ -0,0 +1,193 @@
+/* live-f1
+ *
+ * job.c - background jobs for blocking requests
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "job.h"
+
+
+/* Forward prototypes */
+static void *job_thread (void *data);
+
+
+/* Pipe used to hand finished jobs back to the main loop */
+static int done_pipe[2] = { -1, -1 };
+
+/* Thread that runs the main loop */
+static pthread_t main_thread;
+
+
+/**
+ * init_jobs:
+ *
+ * Sets up the pipe used to return finished jobs to the main loop, must
+ * be called before any job is started.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+init_jobs (void)
+{
+	if (pipe (done_pipe) < 0)
+		return 1;
+
+	fcntl (done_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl (done_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl (done_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	main_thread = pthread_self ();
+
+	return 0;
+}
+
+/**
+ * job_fd:
+ *
+ * Returns: file descriptor that becomes readable when a job has
+ * finished and finish_jobs() should be called.
+ **/
+int
+job_fd (void)
+{
+	return done_pipe[0];
+}
+
+/**
+ * in_job:
+ *
+ * Used by code that may be called from both the main loop and a job
+ * (such as info()) to avoid touching the display from the wrong thread.
+ *
+ * Returns: TRUE if called from a background job, FALSE otherwise.
+ **/
+int
+in_job (void)
+{
+	if (done_pipe[0] < 0)
+		return FALSE;
+
+	return ! pthread_equal (pthread_self (), main_thread);
+}
+
+/**
+ * start_job:
+ * @state: application state structure,
+ * @run: function to call in the background,
+ * @done: function to call from the main loop when finished,
+ * @arg: argument for @run.
+ *
+ * Starts a new background thread to call @run, once that returns the
+ * job is passed back to the main loop and @done called from
+ * finish_jobs().
+ *
+ * Returns: job structure, or NULL if the thread couldn't be started.
+ **/
+Job *
+start_job (CurrentState *state,
+	   JobFunc       run,
+	   JobFunc       done,
+	   unsigned int  arg)
+{
+	pthread_attr_t attr;
+	pthread_t      thread;
+	Job           *job;
+
+	job = malloc (sizeof (Job));
+	if (! job)
+		abort ();
+
+	memset (job, 0, sizeof (Job));
+	job->run = run;
+	job->done = done;
+	job->state = state;
+	job->arg = arg;
+	job->str = NULL;
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create (&thread, &attr, job_thread, job)) {
+		pthread_attr_destroy (&attr);
+		free (job);
+		return NULL;
+	}
+
+	pthread_attr_destroy (&attr);
+
+	return job;
+}
+
+/**
+ * job_thread:
+ * @data: job to run.
+ *
+ * Body of the background thread; runs the job and then writes the
+ * pointer down the pipe so the main loop can pick it up.
+ **/
+static void *
+job_thread (void *data)
+{
+	Job *job = data;
+
+	job->run (job);
+
+	while (write (done_pipe[1], &job, sizeof (job)) < 0) {
+		if (errno != EINTR)
+			abort ();
+	}
+
+	return NULL;
+}
+
+/**
+ * finish_jobs:
+ *
+ * Calls the done function of any jobs that have finished since we were
+ * last called and frees them.  The done function should set the @str
+ * member of the job to NULL if it keeps the string.
+ **/
+void
+finish_jobs (void)
+{
+	Job *job;
+
+	while (read (done_pipe[0], &job, sizeof (job)) == sizeof (job)) {
+		if (job->done)
+			job->done (job);
+
+		if (job->str)
+			free (job->str);
+		free (job);
+	}
+}
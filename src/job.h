@@ -0,0 +1,67 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_JOB_H
+#define LIVE_F1_JOB_H
+
+#include "live-f1.h"
+
+
+/**
+ * Job:
+ * @run: function called in the background thread,
+ * @done: function called from the main loop once @run has returned,
+ * @state: application state structure,
+ * @arg: argument for @run,
+ * @result: numeric result of @run,
+ * @str: string result of @run.
+ *
+ * A blocking operation (usually an HTTP request) performed in its own
+ * thread so that it doesn't hold up the data stream.  @run must not
+ * touch @state other than to read strings that never change once the
+ * job has been started; anything that needs updating is done by @done
+ * which is always called from the main loop.
+ **/
+typedef struct job {
+	void         (*run)  (struct job *job);
+	void         (*done) (struct job *job);
+
+	CurrentState  *state;
+	unsigned int   arg;
+
+	unsigned int   result;
+	char          *str;
+} Job;
+
+typedef void (*JobFunc) (Job *job);
+
+
+SJR_BEGIN_EXTERN
+
+int  init_jobs    (void);
+int  job_fd       (void);
+int  in_job       (void);
+
+Job *start_job    (CurrentState *state, JobFunc run, JobFunc done,
+		   unsigned int arg);
+void finish_jobs  (void);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_JOB_H */
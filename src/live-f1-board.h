@@ -0,0 +1,193 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_BOARD_H
+#define LIVE_F1_BOARD_H
+
+/* The board as exported by live-f1 --export, for other programs on the
+ * same machine to read from shared memory without speaking the Live
+ * Timing protocol.  This header is all they need:
+ *
+ *	const LiveF1Board *shm = live_f1_board_open (LIVE_F1_BOARD_NAME);
+ *	LiveF1Board        board;
+ *
+ *	live_f1_board_read (shm, &board);
+ *
+ * Link with -lrt on older C libraries.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Shared memory segment exported to by default */
+#define LIVE_F1_BOARD_NAME    "/live-f1"
+
+/* Identifies the segment, and the version of the layout below */
+#define LIVE_F1_BOARD_MAGIC   0x3142464cU
+#define LIVE_F1_BOARD_VERSION 1
+
+/* Cars there's room for (car numbers are one more than the index),
+ * atom types, and room for the text of each atom
+ */
+#define LIVE_F1_BOARD_CARS  32
+#define LIVE_F1_BOARD_ATOMS 16
+#define LIVE_F1_BOARD_TEXT  16
+
+/* What an atom's value is when its text isn't a number */
+#define LIVE_F1_BOARD_NO_VALUE -1
+
+/**
+ * LiveF1Board:
+ * @magic: LIVE_F1_BOARD_MAGIC,
+ * @version: LIVE_F1_BOARD_VERSION,
+ * @size: size of the structure,
+ * @seq: odd while being written, changes with every update,
+ * @updates: number of updates,
+ * @updated_ns: CLOCK_MONOTONIC time of the latest update,
+ * @event_no: event number,
+ * @event_type: 1 for a race, 2 practice, 3 qualifying,
+ * @flag: 1 green, 2 yellow, 3 safety car standing by, 4 safety car
+ *   deployed, 5 red,
+ * @clock_running: whether the session clock is running,
+ * @remaining_time: seconds left in the session at @clock_ns,
+ * @clock_ns: CLOCK_MONOTONIC time @remaining_time was right,
+ * @laps_completed: laps completed in a race,
+ * @total_laps: laps in the race,
+ * @track_temp: track temperature (degrees C),
+ * @air_temp: air temperature (degrees C),
+ * @humidity: humidity (percentage),
+ * @wind_speed: wind speed (as live-f1 shows it),
+ * @wind_direction: wind direction (degrees),
+ * @pressure: barometric pressure (as live-f1 shows it),
+ * @fl_car: fastest lap (car number),
+ * @fl_driver: fastest lap (driver's name),
+ * @fl_time: fastest lap (lap time),
+ * @fl_lap: fastest lap (lap number),
+ * @num_cars: number of cars in the event,
+ * @position: position of each car, or zero,
+ * @colour: colour of each atom (as on the board),
+ * @value: number each atom reads as, in thousandths, or
+ *   LIVE_F1_BOARD_NO_VALUE,
+ * @text: text of each atom.
+ *
+ * The atoms are indexed by type (as in the Live Timing protocol, which
+ * depends on @event_type) and then by car number less one.  Strings are
+ * always terminated.
+ **/
+typedef struct {
+	uint32_t magic, version, size, reserved;
+
+	uint32_t seq, pad;
+	uint64_t updates;
+	uint64_t updated_ns;
+
+	uint32_t event_no, event_type, flag, clock_running;
+	int32_t  remaining_time, pad2;
+	uint64_t clock_ns;
+	uint32_t laps_completed, total_laps;
+
+	int32_t  track_temp, air_temp, humidity;
+	int32_t  wind_speed, wind_direction, pressure;
+
+	char     fl_car[4], fl_driver[16], fl_time[12], fl_lap[4];
+
+	uint32_t num_cars;
+	uint8_t  position[LIVE_F1_BOARD_CARS];
+	uint8_t  colour[LIVE_F1_BOARD_ATOMS][LIVE_F1_BOARD_CARS];
+	int32_t  value[LIVE_F1_BOARD_ATOMS][LIVE_F1_BOARD_CARS];
+	char     text[LIVE_F1_BOARD_ATOMS][LIVE_F1_BOARD_CARS]
+		     [LIVE_F1_BOARD_TEXT];
+} LiveF1Board;
+
+
+/**
+ * live_f1_board_open:
+ * @name: name of the shared memory segment.
+ *
+ * Maps the board exported by live-f1 for reading.
+ *
+ * Returns: the board, or NULL if it isn't there or is a different
+ * version.
+ **/
+static inline const LiveF1Board *
+live_f1_board_open (const char *name)
+{
+	const LiveF1Board *board;
+	int                fd;
+
+	fd = shm_open (name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	board = (const LiveF1Board *) mmap (NULL, sizeof (LiveF1Board),
+					     PROT_READ, MAP_SHARED,
+					     fd, 0);
+	close (fd);
+	if (board == MAP_FAILED)
+		return NULL;
+
+	if ((board->magic != LIVE_F1_BOARD_MAGIC)
+	    || (board->version != LIVE_F1_BOARD_VERSION)
+	    || (board->size != sizeof (LiveF1Board))) {
+		munmap ((void *) board, sizeof (LiveF1Board));
+		return NULL;
+	}
+
+	return board;
+}
+
+/**
+ * live_f1_board_read:
+ * @board: board from live_f1_board_open(),
+ * @copy: structure to fill.
+ *
+ * Copies the board as it was between two updates, trying again until
+ * it wasn't being updated while we copied it; updates take well under
+ * a microsecond, so this doesn't wait long and makes no system calls.
+ *
+ * Returns: @copy->seq, which is different if anything has changed.
+ **/
+static inline uint32_t
+live_f1_board_read (const LiveF1Board *board,
+		    LiveF1Board       *copy)
+{
+	for (;;) {
+		uint32_t seq;
+
+		seq = __atomic_load_n (&board->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy (copy, (const void *) board, sizeof (LiveF1Board));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n (&board->seq, __ATOMIC_RELAXED) == seq) {
+			copy->seq = seq;
+			return seq;
+		}
+	}
+}
+
+#endif /* LIVE_F1_BOARD_H */
@@ -67,15 +67,27 @@ typedef enum {
  * @data: data associated with atom,
  * @text: content of atom.
  *
- * Used to hold the current information about a car, there is one CarAtom
- * for each car for each possible packet type that can be received from
- * the server.
+ * One piece of information about a car, as kept in checkpoints and
+ * archives; the state itself keeps them a column at a time, in a
+ * CarTable.
  **/
 typedef struct {
 	int  data;
 	char text[16];
 } CarAtom;
 
+/* Memory for the state of an event, and the information about each
+ * car kept in it; see session.h
+ */
+typedef struct Arena    Arena;
+typedef struct CarTable CarTable;
+
+/* Strings seen during an event, known by handles; see intern.c */
+typedef struct StringPool StringPool;
+
+/* Histories of the weather and lap times; see trend.c */
+typedef struct Trends Trends;
+
 /**
  * CurrentState:
  * @host: hostname to contact,
@@ -84,13 +96,15 @@ typedef struct {
  * @password: user's password,
  * @cookie: user's authorisation cookie,
  * @key: decryption key,
+ * @key_pending: waiting for the decryption key to arrive (0=no,1=yes),
  * @salt: current decryption salt,
  * @decryption_failure: indicates if payload decryption has failed (0=no,1=yes),
  * @frame: last seen key frame,
  * @event_no: event number,
  * @event_type: event type,
  * @remaining_time: time remaining for the event,
- * @epoch_time: epoch time @remaining_time was updated,
+ * @epoch_time: session time (see now_seconds()) @remaining_time was
+ *   updated, or zero while the session clock is stopped,
  * @end_time: time the session will end,
  * @laps_completed: the number of laps completed during the race,
  * @total_laps: the total number of laps for the grand prix,
@@ -102,12 +116,17 @@ typedef struct {
  * @wind_direction: current wind direction (destination in degrees),
  * @pressure: current barometric pressure (millibars),
  * @fl_car: fastest lap (car number),
- * @fl_driver: fastest lap (driver's name),
+ * @fl_driver: fastest lap (driver's name, a handle into @strings),
  * @fl_time: fastest lap (lap time),
  * @fl_lap: fastest lap (lap number),
  * @num_cars: number of cars in the event,
  * @car_position: current position of car,
- * @car_info: arrays of information about each car.
+ * @cars: information about each car,
+ * @arena: memory the fastest lap and cars are kept in (see session.c),
+ * @strings: text of the atoms and fastest lap driver,
+ * @trends: histories of the weather and lap times,
+ * @start_time: monotonic time the client was started (nanoseconds), for
+ *   measuring startup.
  *
  * Holds the current application state so we don't need to pass around
  * a lot of variables or keep them globally.
@@ -116,6 +135,7 @@ typedef struct {
 	char          *host, *auth_host;
 	char          *email, *password, *cookie;
 	unsigned int   key, salt;
+	int            key_pending;
 	int            decryption_failure;
 	unsigned int   frame;
 
@@ -128,11 +148,17 @@ typedef struct {
 	int            track_temp, air_temp, humidity;
 	int            wind_speed, wind_direction, pressure;
 
-	char          *fl_car, *fl_driver, *fl_time, *fl_lap;
+	char          *fl_car, *fl_time, *fl_lap;
+	unsigned int   fl_driver;
 	
 	int            num_cars;
 	int           *car_position;
-	CarAtom      **car_info;
+	CarTable      *cars;
+	Arena         *arena;
+	StringPool    *strings;
+	Trends        *trends;
+
+	unsigned long long start_time;
 } CurrentState;
 
 
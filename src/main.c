@@ -41,15 +41,30 @@
 #include <ne_utils.h>
 
 #include "live-f1.h"
+#include "live-f1-board.h"
+#include "archive.h"
 #include "cfgfile.h"
+#include "clock.h"
 #include "display.h"
+#include "export.h"
+#include "flight.h"
 #include "http.h"
+#include "intern.h"
+#include "job.h"
+#include "publish.h"
+#include "record.h"
+#include "relay.h"
+#include "replay.h"
+#include "session.h"
+#include "snapshot.h"
 #include "stream.h"
+#include "timeshift.h"
 
 
 /* Forward prototypes */
 static void print_version (void);
 static void print_usage (void);
+static void report_record (void);
 
 
 /* Program name */
@@ -58,10 +73,24 @@ const char *program_name = NULL;
 /* How verbose to be */
 static int verbosity = 0;
 
+/* Whether to relay the data stream rather than display it */
+static int relay = 0;
+
 /* Command-line options */
 static const char opts[] = "v";
 static const struct option longopts[] = {
 	{ "verbose",	no_argument, NULL, 'v' },
+	{ "relay",	no_argument, NULL, 0400 + 'r' },
+	{ "record",	required_argument, NULL, 0400 + 'R' },
+	{ "replay",	required_argument, NULL, 0400 + 'P' },
+	{ "verify",	required_argument, NULL, 0400 + 'V' },
+	{ "compact",	required_argument, NULL, 0400 + 'c' },
+	{ "speed",	required_argument, NULL, 0400 + 's' },
+	{ "seek",	required_argument, NULL, 0400 + 'S' },
+	{ "buffer",	required_argument, NULL, 0400 + 'b' },
+	{ "buffer-size", required_argument, NULL, 0400 + 'B' },
+	{ "export",	optional_argument, NULL, 0400 + 'x' },
+	{ "frame-rate",	required_argument, NULL, 0400 + 'f' },
 	{ "help",	no_argument, NULL, 0400 + 'h' },
 	{ "version",	no_argument, NULL, 0400 + 'v' },
 	{ NULL,		no_argument, NULL, 0 }
@@ -74,7 +103,13 @@ main (int   argc,
 {
 	CurrentState *state;
 	const char   *home_dir;
-	char         *config_file;
+	char         *config_file, *snapshot_file;
+	const char   *record_file = NULL, *replay_file = NULL;
+	const char   *compact_file = NULL, *export_name = NULL;
+	double        speed = 1.0;
+	long          seek = -1;
+	long          buffer = TIMESHIFT_MINUTES, buffer_size = TIMESHIFT_MEMORY;
+	long          frame_rate;
 	int           opt, sock;
 
 	setlocale (LC_ALL, "");
@@ -83,11 +118,89 @@ main (int   argc,
 
 	program_name = argv[0];
 
+	state = malloc (sizeof (CurrentState));
+	memset (state, 0, sizeof (CurrentState));
+	state->start_time = real_ns ();
+
 	while ((opt = getopt_long (argc, argv, opts, longopts, NULL)) != -1) {
 		switch (opt) {
 		case 'v':
 			verbosity++;
 			break;
+		case 0400 + 'r':
+			relay = 1;
+			break;
+		case 0400 + 'R':
+			record_file = optarg;
+			break;
+		case 0400 + 'P':
+			replay_file = optarg;
+			break;
+		case 0400 + 'V':
+			return verify_record (optarg) ? 1 : 0;
+		case 0400 + 'c':
+			compact_file = optarg;
+			break;
+		case 0400 + 's':
+			if (! strcmp (optarg, "max")) {
+				speed = 0.0;
+			} else {
+				speed = strtod (optarg, NULL);
+				if (speed <= 0.0) {
+					fprintf (stderr, "%s: %s: %s\n",
+						 program_name,
+						 _("invalid speed"), optarg);
+					return 1;
+				}
+			}
+			break;
+		case 0400 + 'S':
+			seek = strtol (optarg, NULL, 10);
+			if (seek < 0) {
+				fprintf (stderr, "%s: %s: %s\n",
+					 program_name,
+					 _("invalid position"), optarg);
+				return 1;
+			}
+			break;
+		case 0400 + 'b':
+			buffer = strtol (optarg, NULL, 10);
+			if (buffer < 0) {
+				fprintf (stderr, "%s: %s: %s\n",
+					 program_name,
+					 _("invalid number of minutes"), optarg);
+				return 1;
+			}
+			break;
+		case 0400 + 'B':
+			buffer_size = strtol (optarg, NULL, 10);
+			if (buffer_size < 0) {
+				fprintf (stderr, "%s: %s: %s\n",
+					 program_name,
+					 _("invalid size"), optarg);
+				return 1;
+			}
+			break;
+		case 0400 + 'x':
+			export_name = optarg ? optarg : LIVE_F1_BOARD_NAME;
+			if (export_name[0] != '/') {
+				fprintf (stderr, "%s: %s: %s\n",
+					 program_name,
+					 _("name must begin with /"),
+					 export_name);
+				return 1;
+			}
+			break;
+		case 0400 + 'f':
+			frame_rate = strtol (optarg, NULL, 10);
+			if (frame_rate < 0) {
+				fprintf (stderr, "%s: %s: %s\n",
+					 program_name,
+					 _("invalid frame rate"), optarg);
+				return 1;
+			}
+			set_frame_rate (frame_rate);
+			break;
 		case 0400 + 'h':
 			print_usage ();
 			return 0;
@@ -118,16 +231,56 @@ main (int   argc,
 		return 1;
 	}
 
+	/* Compacting replays the session as fast as possible */
+	if (compact_file) {
+		if (! replay_file) {
+			fprintf (stderr, "%s: %s\n", program_name,
+				 _("--compact needs a session to --replay"));
+			return 1;
+		}
+
+		speed = 0.0;
+	}
+
+	if (replay_file && open_replay (replay_file, speed)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, replay_file,
+			 strerror (errno));
+		return 1;
+	}
+
+	if (compact_file && open_archive (compact_file)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, compact_file,
+			 strerror (errno));
+		return 1;
+	}
+
+	if (record_file && open_record (record_file)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, record_file,
+			 strerror (errno));
+		return 1;
+	}
+
+	if (export_name && open_export (export_name, state)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, export_name,
+			 strerror (errno));
+		return 1;
+	}
+
+	if (init_jobs ()) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("unable to create pipe"), strerror (errno));
+		return 1;
+	}
+
+	init_flight ();
 
-	state = malloc (sizeof (CurrentState));
-	memset (state, 0, sizeof (CurrentState));
 	state->host = NULL;
 	state->auth_host = NULL;
 	state->email = NULL;
 	state->password = NULL;
 	state->cookie = NULL;
 	state->car_position = NULL;
-	state->car_info = NULL;
+	state->cars = NULL;
 
 	config_file = malloc (strlen (home_dir) + 7);
 	sprintf (config_file, "%s/.f1rc", home_dir);
@@ -135,7 +288,8 @@ main (int   argc,
 	if (read_config (state, config_file))
 		return 1;
 
-	if ((! state->email) || (! state->password)) {
+	/* Playing back a recording needs no login */
+	if ((! replaying ()) && ((! state->email) || (! state->password))) {
 		if (get_config (state) || write_config (state, config_file))
 			return 1;
 	}
@@ -147,18 +301,42 @@ main (int   argc,
 
 	free (config_file);
 
-	do
-	{
-		state->cookie = obtain_auth_cookie (state->auth_host, state->email, state->password);
+	/* The relay keeps the only real login, and fetches keys and key
+	 * frames once on behalf of its clients.
+	 */
+	if (relay) {
+		request_auth_cookie (state);
+		return run_relay (state);
+	}
+
+	/* Log in and find out how long the race is while we look up and
+	 * connect to the data stream; the decryption key will be requested
+	 * once we have both the cookie and the event number.
+	 */
+	if (! replaying ()) {
+		request_auth_cookie (state);
+		request_total_laps (state);
+
+		open_timeshift (state, buffer_size * 1024 * 1024, buffer);
+
+		/* Put back the board from before we were restarted while
+		 * all that happens
+		 */
+		snapshot_file = malloc (strlen (home_dir) + 10);
+		sprintf (snapshot_file, "%s/.f1state", home_dir);
+
+		open_snapshot (snapshot_file);
+		restore_snapshot (state);
+		free (snapshot_file);
 	}
-	while (! state->cookie);
 
 	for (;;) {
 		int ret;
 
-		sock = open_stream (state->host, 4321);
-		if (sock < 0) {
+		sock = replaying () ? -1 : open_stream (state->host, 4321);
+		if ((sock < 0) && (! replaying ())) {
 			close_display ();
+			close_record ();
 			fprintf (stderr, "%s: %s: %s\n", program_name,
 				 _("unable to open data stream"),
 				 strerror (errno));
@@ -166,13 +344,13 @@ main (int   argc,
 		}
 
 		state->key = 0;
+		state->key_pending = 0;
 		state->frame = 0;
 		state->event_no = 0;
 		state->event_type = RACE_EVENT;
 		state->epoch_time = 0;
 		state->remaining_time = 0;
 		state->laps_completed = 0;
-		state->total_laps = 0;
 		state->flag = GREEN_FLAG;
 
 		state->track_temp = 0;
@@ -182,43 +360,97 @@ main (int   argc,
 		state->pressure = 0;
 		state->wind_direction = 0;
 
-		if (state->fl_car) free (state->fl_car);
-		state->fl_car = calloc(3, sizeof(char));
-		if (state->fl_driver) free (state->fl_driver);
-		state->fl_driver = calloc(15, sizeof(char));
-		if (state->fl_time) free (state->fl_time);
-		state->fl_time = calloc(9, sizeof(char));
-		if (state->fl_lap) free (state->fl_lap);
-		state->fl_lap = calloc(3, sizeof(char));
-		
-		state->num_cars = 0;
-		if (state->car_position) {
-			free (state->car_position);
-			state->car_position = NULL;
-		}
-		if (state->car_info) {
-			free (state->car_info);
-			state->car_info = NULL;
+		reset_session (state);
+		reset_decryption (state);
+		discard_queued_packets ();
+		resume_snapshot (state);
+
+		if (replaying () && (seek >= 0)) {
+			replay_seek (state, seek * 1000);
+			seek = -1;
 		}
 
-		reset_decryption (state);
+		while ((ret = (replaying () ? replay_stream (state)
+			       : read_stream (state, sock))) > 0) {
+			publish_state (state);
+			export_state (state);
+			if (archiving ())
+				archive_state (state, replay_position ());
+			snapshot_state (state, FALSE);
+			if (recording ())
+				report_record ();
 
-		while ((ret = read_stream (state, sock)) > 0) {
 			if (handle_keys (state) < 0) {
+				snapshot_state (state, TRUE);
 				close_display ();
-				close (sock);
+				close_record ();
+				if (sock >= 0)
+					close (sock);
 				return 0;
 			}
+
+			play_timeshift ();
+			retry_auth_cookie (state);
+			tick_display ();
 		}
 
 		if (ret < 0) {
 			close_display ();
+			close_record ();
 			fprintf (stderr, "%s: %s: %s\n", program_name,
 				 _("error reading from data stream"),
 				 strerror (errno));
 			return 2;
 		}
 
+		/* Only reached at the end when replaying flat out */
+		if (replaying ()) {
+			SessionStats stats;
+			StringStats  sstats;
+			PublishStats pstats;
+
+			close_display ();
+			close_record ();
+			if (archiving () && close_archive ()) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 compact_file, strerror (errno));
+				return 2;
+			}
+			replay_summary ();
+			if (display_frames ())
+				info (1, _("Drew %lu frames\n"),
+				      display_frames ());
+			session_stats (&stats);
+			info (1, _("Session state: %lu heap allocations, "
+				   "%lu resets, %lu cars\n"),
+			      stats.allocs, stats.resets, stats.cars);
+			info (1, _("Car atoms: %lu applied, %lu unchanged "
+				   "and ignored\n"),
+			      stats.applied, stats.suppressed);
+			string_stats (&sstats);
+			info (1, _("Interned %lu strings for %lu lookups, "
+				   "in %lu heap allocations, swept %lu times\n"),
+			      sstats.strings, sstats.lookups, sstats.allocs,
+			      sstats.sweeps);
+			publish_stats (&pstats);
+			info (1, _("Published the state %llu times, "
+				   "%llu blocks held up by readers\n"),
+			      pstats.published, pstats.deferred);
+			if (exporting ()) {
+				ExportStats estats;
+
+				export_stats (&estats);
+				info (1, _("Exported the board %llu times, "
+					   "%llu ns each on average, "
+					   "%llu ns at worst\n"),
+				      estats.updates,
+				      (estats.updates
+				       ? estats.total_ns / estats.updates : 0),
+				      estats.worst_ns);
+			}
+			return 0;
+		}
+
 		close (sock);
 		info (1, _("Reconnecting ...\n"));
 	}
@@ -241,6 +473,10 @@ info (int         irrelevance,
 	int     ret;
 
 	if (verbosity >= irrelevance) {
+		/* Background jobs mustn't touch the display */
+		if (cursed && in_job ())
+			return 0;
+
 		va_start (ap, format);
 		if (cursed) {
 			char msg[512];
@@ -261,6 +497,43 @@ info (int         irrelevance,
 }
 
 
+/**
+ * report_record:
+ *
+ * Every RECORD_REPORT_INTERVAL seconds, says whether the recording had
+ * to wait for the disk or drop frames since the last time; or, if
+ * we're being more verbose, how much it has written.
+ **/
+static void
+report_record (void)
+{
+	static unsigned long long last_report = 0;
+	static unsigned long      last_stalls = 0, last_drops = 0;
+	unsigned long long        now;
+	RecordStats               stats;
+
+	now = real_ns ();
+	if (! last_report)
+		last_report = now;
+	if (now - last_report < RECORD_REPORT_INTERVAL * 1000000000ULL)
+		return;
+	last_report = now;
+
+	record_stats (&stats);
+	if ((stats.stalls != last_stalls) || (stats.drops != last_drops)) {
+		info (1, _("Recording waited for the disk %lu times and "
+			   "dropped %lu frames in the last %d seconds\n"),
+		      stats.stalls - last_stalls, stats.drops - last_drops,
+		      RECORD_REPORT_INTERVAL);
+	} else {
+		info (2, _("Recorded %llu bytes, %u chunks waiting for "
+			   "the disk\n"), stats.written, stats.pending);
+	}
+
+	last_stalls = stats.stalls;
+	last_drops = stats.drops;
+}
+
 /**
  * print_version:
  *
@@ -292,6 +565,26 @@ print_usage (void)
 	printf ("\n");
 	printf (_("Options:\n"
 		  "  -v, --verbose              increase verbosity for each time repeated.\n"
+		  "      --relay                serve the data stream to other clients\n"
+		  "                             instead of displaying it.\n"
+		  "      --record=FILE          save everything received to FILE.\n"
+		  "      --replay=FILE          play back a session saved with --record.\n"
+		  "      --verify=FILE          check a recording is intact and exit.\n"
+		  "      --compact=FILE         convert the session being played back to a\n"
+		  "                             smaller archive in FILE, which can itself\n"
+		  "                             be played back.\n"
+		  "      --speed=FACTOR         play back FACTOR times faster than real\n"
+		  "                             time, or `max' for as fast as possible.\n"
+		  "      --seek=SECONDS         begin playing back SECONDS into the session.\n"
+		  "      --buffer=MINUTES       keep MINUTES of the session for pausing and\n"
+		  "                             rewinding, 0 to disable (default 30).\n"
+		  "      --buffer-size=MIB      use no more than MIB megabytes to keep it\n"
+		  "                             (default 8).\n"
+		  "      --export[=NAME]        keep a copy of the board in the shared\n"
+		  "                             memory NAME for other programs to read\n"
+		  "                             (default /live-f1).\n"
+		  "      --frame-rate=FPS       redraw the board at most FPS times a\n"
+		  "                             second, 0 after every block (default 10).\n"
 		  "      --help                 display this help and exit.\n"
 		  "      --version              output version information and exit.\n"));
 	printf ("\n");
@@ -30,9 +30,16 @@
 #include <regex.h>
 
 #include "live-f1.h"
+#include "clock.h"
 #include "display.h"
+#include "flight.h"
 #include "http.h"
+#include "intern.h"
+#include "record.h"
+#include "session.h"
 #include "stream.h"
+#include "timeshift.h"
+#include "trend.h"
 #include "packet.h"
 
 
@@ -42,47 +49,30 @@
  * @packet: decoded packet structure.
  *
  * Handle the car-related packet.
+ *
+ * Returns: FALSE if the packet changed nothing, TRUE otherwise.
  **/
-void
+int
 handle_car_packet (CurrentState *state,
 		   const Packet *packet)
 {
+	int joined = FALSE;
+
 	/* Check whether a new car joined the event; actually, this is
 	 * because we never know in advance how many cars there are, and
 	 * things like practice sessions can probably have more than the
 	 * usual twenty.  (Or we might get another team in the future).
 	 *
-	 * Then increase the size of all the arrays and clear the board.
+	 * Then add the new cars and clear the board.
 	 */
 	if (packet->car > state->num_cars) {
-		int i, j;
-
-		state->car_position = realloc (state->car_position,
-					       sizeof (int) * packet->car);
-		state->car_info = realloc (state->car_info,
-					   sizeof (CarAtom *) * packet->car);
-		if ((! state->car_position) || (! state->car_info))
-			abort ();
-
-		for (i = state->num_cars; i < packet->car; i++) {
-			state->car_position[i] = 0;
-			state->car_info[i] = malloc (sizeof (CarAtom)
-						     * LAST_CAR_PACKET);
-			if (! state->car_info[i])
-				abort ();
-
-			for (j = 0; j < LAST_CAR_PACKET; j++)
-				memset (&state->car_info[i][j], 0,
-					sizeof (CarAtom));
-		}
-
-		state->num_cars = packet->car;
+		set_num_cars (state, packet->car);
 		clear_board (state);
+		joined = TRUE;
 	}
 
 	switch ((CarPacketType) packet->type) {
-		CarAtom *atom;
-		int      i;
+		int i;
 
 	case CAR_POSITION_UPDATE:
 		/* Position Update:
@@ -102,10 +92,10 @@ handle_car_packet (CurrentState *state,
 		state->car_position[packet->car - 1] = packet->data;
 		if (packet->data)
 			update_car (state, packet->car);
-		return;
+		return TRUE;
 	case CAR_POSITION_HISTORY:
 		/* Currently unhandled */
-		return;
+		return FALSE;
 	default:
 		/* Data Atom:
 		 * Format: string.
@@ -128,37 +118,47 @@ handle_car_packet (CurrentState *state,
 			{
 				state->decryption_failure = 0;
 			} else {
+				if ((! state->decryption_failure)
+				    && (! reparsing ()))
+					dump_flight (_("decryption failure"),
+						     FALSE);
 				state->decryption_failure = 1;
 			}
 
 			regfree (&re);
 		}
 
-		/* Store the atom */
+		/* Store the atom, unless it's one we already have */
 
-		atom = &state->car_info[packet->car - 1][packet->type];
-		atom->data = packet->data;
-		if (packet->len >= 0)
-			strcpy (atom->text, (const char *) packet->payload);
+		if (! set_atom (state, packet->car, packet->type, packet->data,
+				((packet->len >= 0)
+				 ? (const char *) packet->payload : NULL)))
+			return joined;
 
 		update_cell (state, packet->car, packet->type);
+		if ((state->event_type == RACE_EVENT)
+		    && (packet->type == RACE_LAP_TIME)
+		    && (state->cars->value[RACE_LAP_TIME][packet->car - 1]
+			>= 0))
+			record_lap_time (state, packet->car,
+					 state->cars->value[RACE_LAP_TIME]
+					 [packet->car - 1]);
 
 		/* This is the only way to grab this information, sadly */
 		if ((state->event_type == RACE_EVENT)
 		    && (state->car_position[packet->car - 1] == 1)
-		    && (packet->type == RACE_INTERVAL)) {
-			unsigned int number = 0;
-
-			for (i = 0; i < packet->len; i++) {
-				number *= 10;
-				number += packet->payload[i] - '0';
-			}
-
-			state->laps_completed = number;
+		    && (packet->type == RACE_INTERVAL)
+		    && (state->cars->value[RACE_INTERVAL][packet->car - 1]
+			>= 0)) {
+			state->laps_completed =
+				state->cars->value[RACE_INTERVAL][packet->car - 1]
+				/ 1000;
 			update_status (state);
 		}
 		break;
 	}
+
+	return TRUE;
 }
 
 /**
@@ -172,6 +172,11 @@ void
 handle_system_packet (CurrentState *state,
 		      const Packet *packet)
 {
+	const CurrentState *live;
+
+	/* Set while parsing again what the live state has already seen */
+	live = reparsing ();
+
 	switch ((SystemPacketType) packet->type) {
 		unsigned int number, i;
 
@@ -190,14 +195,40 @@ handle_system_packet (CurrentState *state,
 			number += packet->payload[i] - '0';
 		}
 
-		state->key = obtain_decryption_key (state->host, number,
-						    state->cookie);
-		state->event_no = number;
+		/* Keep the key if this is the event we already have it
+		 * for (e.g. it's in a key frame) or are already waiting for
+		 * it, otherwise ask for it in the background; encrypted
+		 * packets are queued until it arrives, and any queued for
+		 * the old event are useless.
+		 * The total laps were requested at start up, so only need
+		 * asking again if the event has changed under us.
+		 * When parsing again, the live state did all that already
+		 * and we take its key if it's for the same event.
+		 */
+		if (live) {
+			if ((number != state->event_no) || (! state->key))
+				state->key = ((live->event_no == number)
+					      ? live->key : 0);
+			state->event_no = number;
+		} else if ((number != state->event_no)
+			   || ((! state->key) && (! state->key_pending))) {
+			if (number != state->event_no) {
+				int changed = (state->event_no != 0);
+
+				discard_queued_packets ();
+				state->event_no = number;
+				if (changed)
+					request_total_laps (state);
+			}
+
+			state->key = 0;
+			request_decryption_key (state, number);
+		}
+
 		state->event_type = packet->data;
 		state->epoch_time = 0;
 		state->remaining_time = 0;
 		state->laps_completed = 0;
-		state->total_laps = obtain_total_laps();
 		state->flag = GREEN_FLAG;
 
 		state->track_temp = 0;
@@ -207,27 +238,11 @@ handle_system_packet (CurrentState *state,
 		state->pressure = 0;
 		state->wind_direction = 0;
 		
-		if (state->fl_car) free (state->fl_car);
-		state->fl_car = calloc(3, sizeof(char));
-		if (state->fl_driver) free (state->fl_driver);
-		state->fl_driver = calloc(15, sizeof(char));
-		if (state->fl_time) free (state->fl_time);
-		state->fl_time = calloc(9, sizeof(char));
-		if (state->fl_lap) free (state->fl_lap);
-		state->fl_lap = calloc(3, sizeof(char));
-	
-		state->num_cars = 0;
-		if (state->car_position) {
-			free (state->car_position);
-			state->car_position = NULL;
-		}
-		if (state->car_info) {
-			free (state->car_info);
-			state->car_info = NULL;
-		}
+		reset_session (state);
 		reset_decryption (state);
 
-		clear_board (state);
+		if (state->key)
+			clear_board (state);
 		info (3, _("Begin new event #%d (type: %d)\n"),
 		      state->event_no, state->event_type);
 		break;
@@ -247,12 +262,21 @@ handle_system_packet (CurrentState *state,
 		}
 
 		reset_decryption (state);
+		if (live) {
+			state->frame = number;
+			break;
+		}
+
+		sync_record ();
 		if ((!state->frame) || (state->decryption_failure))
 		{
 			state->frame = number;
 			obtain_key_frame (state->host, number, state);
 			reset_decryption (state);
 		} else {
+			/* A key frame begins with its own marker */
+			if (number != state->frame)
+				record_key_frame (state, number);
 			state->frame = number;
 		}
 
@@ -300,10 +324,10 @@ handle_system_packet (CurrentState *state,
 				total += number;
 
 				if (state->epoch_time)
-					state->epoch_time = time (NULL);
+					state->epoch_time = now_seconds ();
 				state->remaining_time = total;
 			} else {
-				state->epoch_time = time (NULL);
+				state->epoch_time = now_seconds ();
 			}
 
 			close_popup ();
@@ -316,6 +340,7 @@ handle_system_packet (CurrentState *state,
 				number += packet->payload[i] - '0';
 			}
 			state->track_temp = number;
+			record_weather (state, packet->data, number);
 			update_status (state);
 			break;
 		case WEATHER_AIR_TEMP:
@@ -325,6 +350,7 @@ handle_system_packet (CurrentState *state,
 				number += packet->payload[i] - '0';
 			}
 			state->air_temp = number;
+			record_weather (state, packet->data, number);
 			update_status (state);
 			break;
 		case WEATHER_WIND_SPEED:
@@ -337,6 +363,7 @@ handle_system_packet (CurrentState *state,
 				}
 			}
 			state->wind_speed = number;
+			record_weather (state, packet->data, number);
 			update_status (state);
 			break;
 		case WEATHER_HUMIDITY:
@@ -346,6 +373,7 @@ handle_system_packet (CurrentState *state,
 				number += packet->payload[i] - '0';
 			}
 			state->humidity = number;
+			record_weather (state, packet->data, number);
 			update_status (state);
 			break;
 		case WEATHER_PRESSURE:
@@ -358,6 +386,7 @@ handle_system_packet (CurrentState *state,
 				}
 			}
 			state->pressure = number;
+			record_weather (state, packet->data, number);
 			update_status (state);
 			break;
 		case WEATHER_WIND_DIRECTION:
@@ -367,6 +396,7 @@ handle_system_packet (CurrentState *state,
 				number += packet->payload[i] - '0';
 			}
 			state->wind_direction = number;
+			record_weather (state, packet->data, number);
 			update_status (state);
 			break;
 		default:
@@ -387,7 +417,8 @@ handle_system_packet (CurrentState *state,
 			update_status (state);
 			break;
 		case FL_DRIVER:
-			memcpy(state->fl_driver, packet->payload+1, 14);
+			state->fl_driver = intern_text (state,
+				(const char *) packet->payload + 1, 14);
 			update_status (state);
 			break;
 		case FL_TIME:
@@ -430,7 +461,8 @@ handle_system_packet (CurrentState *state,
 		 *
 		 * Plain text copyright notice in the start of the feed.
 		 */
-		info (2, "%s\n", packet->payload);
+		if (! live)
+			info (2, "%s\n", packet->payload);
 		break;
 	case SYS_NOTICE:
 		/* Important System Notice:
@@ -439,7 +471,8 @@ handle_system_packet (CurrentState *state,
 		 * Various important system notices get displayed this
 		 * way.
 		 */
-		info (0, "%s\n", packet->payload);
+		if (! live)
+			info (0, "%s\n", packet->payload);
 		break;
 	default:
 		/* Unhandled event */
@@ -169,7 +169,7 @@ typedef struct {
 
 SJR_BEGIN_EXTERN
 
-void handle_car_packet    (CurrentState *state, const Packet *packet);
+int  handle_car_packet    (CurrentState *state, const Packet *packet);
 void handle_system_packet (CurrentState *state, const Packet *packet);
 
 SJR_END_EXTERN
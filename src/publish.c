@@ -0,0 +1,199 @@
+/* live-f1
+ *
+ * publish.c - copies of the state for other threads to read
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <string.h>
+
+#include "live-f1.h"
+#include "clock.h"
+#include "intern.h"
+#include "session.h"
+#include "publish.h"
+
+
+/**
+ * ViewSlot:
+ * @view: copy of the state,
+ * @readers: number of readers holding @view.
+ *
+ * One of the copies of the state; @readers is on a cache line of its
+ * own, so readers coming and going don't disturb those reading @view.
+ **/
+typedef struct {
+	StateView view;
+	int       readers __attribute__ ((aligned (64)));
+} ViewSlot;
+
+
+/* Copies of the state, and the one most recently published */
+static ViewSlot  slots[PUBLISH_VIEWS];
+static ViewSlot *latest = NULL;
+
+/* Number of copies published, and blocks that couldn't be */
+static unsigned long long published = 0, deferred = 0;
+
+
+/**
+ * publish_state:
+ * @state: application state structure.
+ *
+ * Called from the main loop after each block of the data stream: copies
+ * @state into a free copy and then makes that the one acquire_state()
+ * returns, with a single atomic store.  A copy is free once it's been
+ * replaced and the last reader holding it has released it, which is
+ * the only thing readers and the main loop share; when none is free
+ * the block isn't published, and the next one will be.
+ **/
+void
+publish_state (const CurrentState *state)
+{
+	ViewSlot  *slot = NULL;
+	StateView *view;
+	int        i, j;
+
+	for (i = 0; i < PUBLISH_VIEWS; i++) {
+		if ((&slots[i] != latest)
+		    && (! __atomic_load_n (&slots[i].readers,
+					   __ATOMIC_SEQ_CST))) {
+			slot = &slots[i];
+			break;
+		}
+	}
+
+	if (! slot) {
+		deferred++;
+		return;
+	}
+
+	view = &slot->view;
+	view->version = ++published;
+	view->published = now_ns ();
+
+	view->key = state->key;
+	view->key_pending = state->key_pending;
+	view->frame = state->frame;
+	view->event_no = state->event_no;
+	view->event_type = state->event_type;
+	view->remaining_time = state->remaining_time;
+	view->epoch_time = state->epoch_time;
+	view->laps_completed = state->laps_completed;
+	view->total_laps = state->total_laps;
+	view->flag = state->flag;
+	view->track_temp = state->track_temp;
+	view->air_temp = state->air_temp;
+	view->humidity = state->humidity;
+	view->wind_speed = state->wind_speed;
+	view->wind_direction = state->wind_direction;
+	view->pressure = state->pressure;
+
+	if (state->arena) {
+		memcpy (view->fl_car, state->fl_car, FL_CAR_LEN);
+		memcpy (view->fl_driver,
+			string_text (state->strings, state->fl_driver),
+			FL_DRIVER_LEN);
+		memcpy (view->fl_time, state->fl_time, FL_TIME_LEN);
+		memcpy (view->fl_lap, state->fl_lap, FL_LAP_LEN);
+
+		view->num_cars = state->num_cars;
+		memcpy (view->car_position, state->car_position,
+			sizeof (int) * state->num_cars);
+		memcpy (view->value, state->cars->value, sizeof (view->value));
+		memcpy (view->colour, state->cars->colour,
+			sizeof (view->colour));
+		for (i = 0; i < LAST_CAR_PACKET; i++)
+			for (j = 0; j < state->num_cars; j++)
+				memcpy (view->text[i][j],
+					atom_text (state, j + 1, i),
+					ATOM_TEXT_LEN);
+	} else {
+		memset (view->fl_car, 0, FL_CAR_LEN);
+		memset (view->fl_driver, 0, FL_DRIVER_LEN);
+		memset (view->fl_time, 0, FL_TIME_LEN);
+		memset (view->fl_lap, 0, FL_LAP_LEN);
+
+		view->num_cars = 0;
+	}
+
+	__atomic_store_n (&latest, slot, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * acquire_state:
+ *
+ * Gets the copy of the state most recently published, which can be read
+ * from any thread without locking and won't change until it's released
+ * with release_state().  The main loop carries on regardless of how
+ * many readers there are or how long they take.
+ *
+ * Returns: copy of the state, or NULL if none has been published.
+ **/
+const StateView *
+acquire_state (void)
+{
+	for (;;) {
+		ViewSlot *slot;
+
+		slot = __atomic_load_n (&latest, __ATOMIC_SEQ_CST);
+		if (! slot)
+			return NULL;
+
+		/* Only ours if it was still the latest once we'd said we
+		 * were reading it; otherwise it may be being overwritten
+		 */
+		__atomic_add_fetch (&slot->readers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&latest, __ATOMIC_SEQ_CST) == slot)
+			return &slot->view;
+
+		__atomic_sub_fetch (&slot->readers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+ * release_state:
+ * @view: copy of the state from acquire_state().
+ *
+ * Finishes reading @view, which may then be overwritten.
+ **/
+void
+release_state (const StateView *view)
+{
+	ViewSlot *slot = (ViewSlot *) view;
+
+	__atomic_sub_fetch (&slot->readers, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * publish_stats:
+ * @stats: structure to fill.
+ *
+ * Reports how publishing the state is going; only to be called from the
+ * main loop.
+ **/
+void
+publish_stats (PublishStats *stats)
+{
+	stats->published = published;
+	stats->deferred = deferred;
+}
@@ -0,0 +1,114 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_PUBLISH_H
+#define LIVE_F1_PUBLISH_H
+
+#include <time.h>
+
+#include "live-f1.h"
+#include "session.h"
+
+
+/* Copies of the state there are to publish into; one is the latest,
+ * and the others are free unless readers still hold them
+ */
+#define PUBLISH_VIEWS 4
+
+/**
+ * StateView:
+ * @version: number of the publication, counting from one,
+ * @published: session time it was published (see now_ns()),
+ * @key: decryption key,
+ * @key_pending: waiting for the decryption key,
+ * @frame: last seen key frame,
+ * @event_no: event number,
+ * @event_type: event type,
+ * @remaining_time: time remaining for the event,
+ * @epoch_time: session time @remaining_time was updated, or zero,
+ * @laps_completed: the number of laps completed during the race,
+ * @total_laps: the total number of laps for the grand prix,
+ * @flag: track status or flag,
+ * @track_temp: current track temperature (degrees C),
+ * @air_temp: current air temperature (degrees C),
+ * @humidity: current humidity (percentage),
+ * @wind_speed: current wind speed (meters per second),
+ * @wind_direction: current wind direction (destination in degrees),
+ * @pressure: current barometric pressure (millibars),
+ * @fl_car: fastest lap (car number),
+ * @fl_driver: fastest lap (driver's name),
+ * @fl_time: fastest lap (lap time),
+ * @fl_lap: fastest lap (lap number),
+ * @num_cars: number of cars in the event,
+ * @car_position: current position of each car,
+ * @value: number each atom's text reads as (see CarTable),
+ * @colour: colour of each atom,
+ * @text: text of each atom.
+ *
+ * A copy of the state as it was after a block of the data stream, which
+ * never changes while it's held; see acquire_state().
+ **/
+typedef struct {
+	unsigned long long version, published;
+
+	unsigned int       key;
+	int                key_pending;
+	unsigned int       frame;
+
+	unsigned int       event_no;
+	EventType          event_type;
+	time_t             remaining_time, epoch_time;
+	unsigned int       laps_completed, total_laps;
+	FlagStatus         flag;
+
+	int                track_temp, air_temp, humidity;
+	int                wind_speed, wind_direction, pressure;
+
+	char               fl_car[FL_CAR_LEN], fl_driver[FL_DRIVER_LEN];
+	char               fl_time[FL_TIME_LEN], fl_lap[FL_LAP_LEN];
+
+	int                num_cars;
+	int                car_position[CAR_SLOTS];
+	int                value[LAST_CAR_PACKET][CAR_SLOTS];
+	unsigned char      colour[LAST_CAR_PACKET][CAR_SLOTS];
+	char               text[LAST_CAR_PACKET][CAR_SLOTS][ATOM_TEXT_LEN];
+} StateView;
+
+/**
+ * PublishStats:
+ * @published: copies of the state published,
+ * @deferred: blocks not published because readers held every copy.
+ *
+ * How publishing the state is going.
+ **/
+typedef struct {
+	unsigned long long published, deferred;
+} PublishStats;
+
+
+SJR_BEGIN_EXTERN
+
+void             publish_state (const CurrentState *state);
+const StateView *acquire_state (void);
+void             release_state (const StateView *view);
+void             publish_stats (PublishStats *stats);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_PUBLISH_H */
@@ -0,0 +1,759 @@
+/* live-f1
+ *
+ * record.c - recording the data stream to a file
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "clock.h"
+#include "crc32c.h"
+#include "record.h"
+
+
+/* Size of each chunk frames are collected in, and how many can be
+ * waiting for the disk (4 MiB)
+ */
+#define RECORD_BUFFER (64 * 1024)
+#define RECORD_CHUNKS 64
+
+/* Most milliseconds a frame waits for the disk to catch up before it's
+ * dropped
+ */
+#define RECORD_STALL_MS 20
+
+
+/**
+ * RecordChunk:
+ * @len: bytes of @data used,
+ * @sync: TRUE to sync the file to disk after writing this chunk,
+ * @timestamp: monotonic time the sync was asked for (nanoseconds),
+ * @data: frames, a frame may carry on into the next chunk.
+ *
+ * Piece of the recording handed from the main loop to the writer
+ * thread.
+ **/
+typedef struct {
+	size_t             len;
+	int                sync;
+	unsigned long long timestamp;
+	unsigned char      data[RECORD_BUFFER];
+} RecordChunk;
+
+
+/* Forward prototypes */
+static int   make_room    (size_t len);
+static void  put_bytes    (const unsigned char *buf, size_t len);
+static void  hand_over    (void);
+static int   check_writer (void);
+static void *writer_main  (void *data);
+static void  sync_file    (unsigned long long timestamp);
+static int   write_all    (const unsigned char *buf, size_t len);
+
+
+/* File being recorded to, only written to by the writer thread */
+static int            record_fd = -1;
+static pthread_t      writer_thread;
+
+/* Ring of chunks; the main loop fills the one at @chunk_head and then
+ * moves it on, the writer thread writes the one at @chunk_tail and
+ * then moves that on.  Neither needs a lock, the semaphores are only
+ * for sleeping when there's nothing to do.
+ */
+static RecordChunk   *chunks = NULL;
+static unsigned int   chunk_head = 0, chunk_tail = 0;
+static int            filling = FALSE;
+static sem_t          chunks_ready, chunks_free;
+
+/* Set to stop the writer thread, and by it when a write fails */
+static int            writer_stop = FALSE;
+static int            writer_error = 0;
+
+/* Bytes written to the file so far, by the writer thread */
+static unsigned long long record_written = 0;
+
+/* Frames that waited for the writer thread, and that were dropped */
+static unsigned long  record_stalls = 0, record_drops = 0;
+
+/* Monotonic time the recording was last synced to disk (seconds) */
+static time_t         last_sync = 0;
+
+
+/**
+ * open_record:
+ * @filename: file to record to.
+ *
+ * Creates the file, replacing any existing one, and begins recording
+ * to it; everything received from the data stream, every key frame and
+ * every decryption key is then saved until close_record() is called.
+ * The file is written by a thread of its own, so that a slow disk
+ * never holds up the data stream.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_record (const char *filename)
+{
+	unsigned char hdr[RECORD_HEADER_LEN];
+	sigset_t      mask, old_mask;
+	int           ret;
+
+	record_fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (record_fd < 0)
+		return 1;
+
+	init_crc32c ();
+
+	chunks = malloc (sizeof (RecordChunk) * RECORD_CHUNKS);
+	if (! chunks)
+		abort ();
+
+	sem_init (&chunks_ready, 0, 0);
+	sem_init (&chunks_free, 0, 0);
+	chunk_head = chunk_tail = 0;
+	filling = writer_stop = FALSE;
+	writer_error = 0;
+	record_written = 0;
+	record_stalls = record_drops = 0;
+	last_sync = 0;
+
+	/* Signals are for the main loop, not the writer */
+	sigfillset (&mask);
+	pthread_sigmask (SIG_SETMASK, &mask, &old_mask);
+	ret = pthread_create (&writer_thread, NULL, writer_main, NULL);
+	pthread_sigmask (SIG_SETMASK, &old_mask, NULL);
+	if (ret) {
+		close (record_fd);
+		record_fd = -1;
+		errno = ret;
+		return 1;
+	}
+
+	memcpy (hdr, RECORD_MAGIC, 8);
+	put_le (hdr + 8, RECORD_VERSION, 4);
+	put_le (hdr + 12, 0, 4);
+
+	put_bytes (hdr, sizeof (hdr));
+
+	return 0;
+}
+
+/**
+ * recording:
+ *
+ * Returns: TRUE if we're recording.
+ **/
+int
+recording (void)
+{
+	return (record_fd >= 0);
+}
+
+/**
+ * record_frame:
+ * @source: where the data came from,
+ * @flags: frame flags,
+ * @arg: key frame or event number,
+ * @ts: monotonic time the data was received, or NULL for now,
+ * @buf: data received,
+ * @len: length of @buf.
+ *
+ * Adds a frame to the recording.  This only copies it into the ring of
+ * chunks for the writer thread; if that's full because the disk can't
+ * keep up, we wait at most RECORD_STALL_MS for it and then drop the
+ * frame rather than hold up the data stream.  Replaying across a
+ * dropped frame is garbled until the next key frame, as it would be
+ * had the connection dropped.
+ **/
+void
+record_frame (RecordSource           source,
+	      int                    flags,
+	      unsigned int           arg,
+	      const struct timespec *ts,
+	      const unsigned char   *buf,
+	      size_t                 len)
+{
+	unsigned char hdr[FRAME_HEADER_LEN];
+	Frame         frame;
+
+	if ((record_fd < 0) || check_writer ())
+		return;
+
+	if (make_room (FRAME_HEADER_LEN + len)) {
+		record_drops++;
+		return;
+	}
+
+	frame.source = source;
+	frame.flags = flags;
+	frame.arg = arg;
+	frame.len = len;
+	frame.timestamp = (ts ? (ts->tv_sec * 1000000000ULL) + ts->tv_nsec
+			   : real_ns ());
+
+	encode_frame (hdr, &frame, buf);
+	put_bytes (hdr, sizeof (hdr));
+	put_bytes (buf, len);
+}
+
+/**
+ * flush_record:
+ *
+ * Hands any frames collected so far to the writer thread, called while
+ * we're otherwise idle.
+ **/
+void
+flush_record (void)
+{
+	if ((record_fd < 0) || check_writer ())
+		return;
+
+	if (filling)
+		hand_over ();
+}
+
+/**
+ * sync_record:
+ *
+ * Called at each key frame marker in the data stream.  At most every
+ * RECORD_SYNC_INTERVAL seconds, the writer thread is asked to sync
+ * everything recorded so far to disk once it's written it, then add a
+ * sync frame to say so; if we're killed or the machine crashes,
+ * recover_record() need only look at what follows the last sync frame.
+ **/
+void
+sync_record (void)
+{
+	unsigned long long now;
+	RecordChunk       *chunk;
+
+	if ((record_fd < 0) || check_writer ())
+		return;
+
+	now = real_ns ();
+	if (last_sync && (now / 1000000000ULL - last_sync
+			  < RECORD_SYNC_INTERVAL))
+		return;
+
+	/* Not worth waiting for, there'll be another key frame */
+	if ((! filling) && (chunk_head - __atomic_load_n (&chunk_tail,
+							 __ATOMIC_ACQUIRE)
+			    >= RECORD_CHUNKS))
+		return;
+
+	if (! filling)
+		put_bytes (NULL, 0);
+
+	chunk = &chunks[chunk_head % RECORD_CHUNKS];
+	chunk->sync = TRUE;
+	chunk->timestamp = now;
+	hand_over ();
+
+	last_sync = now / 1000000000ULL;
+}
+
+/**
+ * close_record:
+ *
+ * Hands over anything still collected, waits for the writer thread to
+ * write it all out and stops recording.
+ **/
+void
+close_record (void)
+{
+	if (record_fd < 0)
+		return;
+
+	if (filling)
+		hand_over ();
+
+	__atomic_store_n (&writer_stop, TRUE, __ATOMIC_RELEASE);
+	sem_post (&chunks_ready);
+	pthread_join (writer_thread, NULL);
+
+	fdatasync (record_fd);
+	close (record_fd);
+	record_fd = -1;
+
+	sem_destroy (&chunks_ready);
+	sem_destroy (&chunks_free);
+	free (chunks);
+	chunks = NULL;
+
+	if (record_stalls || record_drops)
+		info (1, _("Recording waited for the disk %lu times and "
+			   "dropped %lu frames\n"),
+		      record_stalls, record_drops);
+}
+
+/**
+ * record_stats:
+ * @stats: structure to fill.
+ *
+ * Reports how the recording is keeping up with the data stream.
+ **/
+void
+record_stats (RecordStats *stats)
+{
+	stats->written = __atomic_load_n (&record_written, __ATOMIC_RELAXED);
+	stats->pending = (chunk_head
+			  - __atomic_load_n (&chunk_tail, __ATOMIC_ACQUIRE));
+	stats->stalls = record_stalls;
+	stats->drops = record_drops;
+}
+
+
+/**
+ * make_room:
+ * @len: bytes about to be added.
+ *
+ * Makes sure there are enough free chunks in the ring for @len more
+ * bytes, waiting at most RECORD_STALL_MS for the writer thread to free
+ * some if there aren't.
+ *
+ * Returns: 0 if there's room, non-zero if there isn't.
+ **/
+static int
+make_room (size_t len)
+{
+	struct timespec deadline;
+	size_t          room = 0, needed;
+
+	if (filling)
+		room = RECORD_BUFFER - chunks[chunk_head % RECORD_CHUNKS].len;
+	needed = ((len > room)
+		  ? (len - room + RECORD_BUFFER - 1) / RECORD_BUFFER : 0);
+	needed += filling;
+
+	if (needed > RECORD_CHUNKS)
+		return 1;
+
+	if (chunk_head - __atomic_load_n (&chunk_tail, __ATOMIC_ACQUIRE)
+	    <= RECORD_CHUNKS - needed)
+		return 0;
+
+	record_stalls++;
+	clock_gettime (CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += RECORD_STALL_MS * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	while (chunk_head - __atomic_load_n (&chunk_tail, __ATOMIC_ACQUIRE)
+	       > RECORD_CHUNKS - needed) {
+		if ((sem_timedwait (&chunks_free, &deadline) < 0)
+		    && (errno == ETIMEDOUT))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * put_bytes:
+ * @buf: data to add,
+ * @len: length of @buf.
+ *
+ * Copies @buf into the chunk being filled, starting new chunks as they
+ * fill up; make_room() must have been called first.  Called with no
+ * data just to make sure there's a chunk being filled.
+ **/
+static void
+put_bytes (const unsigned char *buf,
+	   size_t               len)
+{
+	do {
+		RecordChunk *chunk = &chunks[chunk_head % RECORD_CHUNKS];
+		size_t       count;
+
+		if (! filling) {
+			chunk->len = 0;
+			chunk->sync = FALSE;
+			filling = TRUE;
+		}
+
+		count = MIN (len, RECORD_BUFFER - chunk->len);
+		if (count)
+			memcpy (chunk->data + chunk->len, buf, count);
+		chunk->len += count;
+		buf += count;
+		len -= count;
+
+		if (chunk->len == RECORD_BUFFER)
+			hand_over ();
+	} while (len);
+}
+
+/**
+ * hand_over:
+ *
+ * Passes the chunk being filled to the writer thread.
+ **/
+static void
+hand_over (void)
+{
+	__atomic_store_n (&chunk_head, chunk_head + 1, __ATOMIC_RELEASE);
+	filling = FALSE;
+
+	sem_post (&chunks_ready);
+}
+
+/**
+ * check_writer:
+ *
+ * Checks whether the writer thread has failed to write to the file, in
+ * which case the recording is stopped (the data stream is more
+ * important).  It can't tell us itself since it mustn't touch the
+ * display.
+ *
+ * Returns: 0 if it's still going, non-zero if recording stopped.
+ **/
+static int
+check_writer (void)
+{
+	int error;
+
+	error = __atomic_load_n (&writer_error, __ATOMIC_ACQUIRE);
+	if (! error)
+		return 0;
+
+	info (0, _("Recording stopped: %s\n"), strerror (error));
+	close_record ();
+	return 1;
+}
+
+/**
+ * writer_main:
+ * @data: unused.
+ *
+ * Body of the writer thread; writes each chunk out as it's handed over,
+ * syncing to disk when asked, until close_record() stops it.  Once a
+ * write fails, chunks are simply thrown away.
+ *
+ * Returns: NULL.
+ **/
+static void *
+writer_main (void *data)
+{
+	for (;;) {
+		unsigned int tail = chunk_tail;
+		RecordChunk *chunk;
+
+		while (sem_wait (&chunks_ready) < 0)
+			;
+
+		if (tail == __atomic_load_n (&chunk_head, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n (&writer_stop, __ATOMIC_ACQUIRE))
+				break;
+
+			continue;
+		}
+
+		chunk = &chunks[tail % RECORD_CHUNKS];
+		if ((! writer_error) && (! write_all (chunk->data, chunk->len))
+		    && chunk->sync)
+			sync_file (chunk->timestamp);
+
+		__atomic_store_n (&chunk_tail, tail + 1, __ATOMIC_RELEASE);
+		sem_post (&chunks_free);
+	}
+
+	return NULL;
+}
+
+/**
+ * sync_file:
+ * @timestamp: time the sync was asked for.
+ *
+ * Syncs everything written so far to disk, then writes a sync frame
+ * holding its own offset in the file.  A failure to sync is no reason
+ * to stop recording, we just don't say it was synced.
+ **/
+static void
+sync_file (unsigned long long timestamp)
+{
+	unsigned char hdr[FRAME_HEADER_LEN], data[8];
+	Frame         frame;
+
+	if (fdatasync (record_fd) < 0)
+		return;
+
+	put_le (data, record_written, 8);
+
+	frame.source = SOURCE_SYNC;
+	frame.flags = 0;
+	frame.arg = 0;
+	frame.len = sizeof (data);
+	frame.timestamp = timestamp;
+
+	encode_frame (hdr, &frame, data);
+	if (! write_all (hdr, sizeof (hdr)))
+		write_all (data, sizeof (data));
+}
+
+/**
+ * write_all:
+ * @buf: data to write,
+ * @len: length of @buf.
+ *
+ * Writes all of @buf to the recording, from the writer thread; on
+ * failure, the error is left in writer_error for the main loop.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+write_all (const unsigned char *buf,
+	   size_t               len)
+{
+	while (len) {
+		ssize_t ret;
+
+		ret = write (record_fd, buf, len);
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;
+		} else if (ret < 0) {
+			__atomic_store_n (&writer_error, errno,
+					  __ATOMIC_RELEASE);
+			return -1;
+		}
+
+		buf += ret;
+		len -= ret;
+		__atomic_store_n (&record_written, record_written + ret,
+				  __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+
+/**
+ * verify_record:
+ * @filename: recording to check.
+ *
+ * Checks the CRC of every frame in a recording, reading it through a
+ * mapping in order so that it goes as fast as the disk does.
+ *
+ * Returns: 0 if the whole recording is intact, non-zero otherwise.
+ **/
+int
+verify_record (const char *filename)
+{
+	const unsigned char *map;
+	unsigned long long   start;
+	struct stat          st;
+	unsigned long long   offset;
+	unsigned long        nframes = 0;
+	double               secs;
+	int                  fd;
+
+	fd = open (filename, O_RDONLY);
+	if ((fd < 0) || (fstat (fd, &st) < 0)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 strerror (errno));
+		if (fd >= 0)
+			close (fd);
+		return 1;
+	}
+
+	if (st.st_size < RECORD_HEADER_LEN) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 _("not a recording"));
+		close (fd);
+		return 1;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 strerror (errno));
+		return 1;
+	}
+	madvise ((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+	if (memcmp (map, RECORD_MAGIC, 8)
+	    || (get_le (map + 8, 4) != RECORD_VERSION)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 _("not a recording"));
+		munmap ((void *) map, st.st_size);
+		return 1;
+	}
+
+	init_crc32c ();
+	start = real_ns ();
+
+	offset = RECORD_HEADER_LEN;
+	while (offset + FRAME_HEADER_LEN <= (unsigned long long) st.st_size) {
+		Frame frame;
+
+		decode_frame (&frame, map + offset);
+		if ((frame.len > st.st_size - offset - FRAME_HEADER_LEN)
+		    || (! check_frame (map + offset,
+				       map + offset + FRAME_HEADER_LEN)))
+			break;
+
+		offset += FRAME_HEADER_LEN + frame.len;
+		nframes++;
+	}
+
+	secs = (real_ns () - start) / 1000000000.0;
+	munmap ((void *) map, st.st_size);
+
+	if (offset != (unsigned long long) st.st_size) {
+		printf (_("%s: damaged at offset %llu after %lu frames, "
+			  "the last %llu bytes can't be replayed\n"),
+			filename, offset, nframes,
+			(unsigned long long) st.st_size - offset);
+		return 1;
+	}
+
+	printf (_("%s: %lu frames, %llu bytes OK (%.0f MiB/s)\n"),
+		filename, nframes, offset,
+		secs > 0 ? offset / secs / (1024 * 1024) : 0.0);
+
+	return 0;
+}
+
+/**
+ * recover_record:
+ * @map: recording, mapped into memory,
+ * @size: size of @map.
+ *
+ * Finds where the intact part of a recording ends, should it have been
+ * cut short by the client being killed or the machine crashing.  We
+ * search backwards from the end for the last sync frame, which is
+ * recognised by its checksum and holding its own offset, then check
+ * the frames from there on until one is damaged; so the time taken
+ * depends on the size of the damaged end, not of the recording.
+ *
+ * Returns: length of the intact part of @map.
+ **/
+size_t
+recover_record (const unsigned char *map,
+		size_t               size)
+{
+	size_t offset = RECORD_HEADER_LEN, pos;
+
+	if (size < RECORD_HEADER_LEN)
+		return size;
+
+	for (pos = size - MIN (size, FRAME_HEADER_LEN + 8);
+	     pos > RECORD_HEADER_LEN; pos--) {
+		if ((map[pos] != SOURCE_SYNC)
+		    || map[pos + 1] || map[pos + 2] || map[pos + 3]
+		    || (get_le (map + pos + 8, 4) != 8)
+		    || (get_le (map + pos + FRAME_HEADER_LEN, 8) != pos)
+		    || (! check_frame (map + pos, map + pos + FRAME_HEADER_LEN)))
+			continue;
+
+		offset = pos;
+		break;
+	}
+
+	while (offset + FRAME_HEADER_LEN <= size) {
+		Frame frame;
+
+		decode_frame (&frame, map + offset);
+		if ((frame.len > size - offset - FRAME_HEADER_LEN)
+		    || (! check_frame (map + offset,
+				       map + offset + FRAME_HEADER_LEN)))
+			break;
+
+		offset += FRAME_HEADER_LEN + frame.len;
+	}
+
+	return offset;
+}
+
+
+/**
+ * encode_frame:
+ * @hdr: buffer of FRAME_HEADER_LEN bytes to fill,
+ * @frame: frame to encode,
+ * @buf: data following the header.
+ *
+ * Stores the frame header in the on-disk format, along with the CRC of
+ * it and @buf.
+ **/
+void
+encode_frame (unsigned char       *hdr,
+	      const Frame         *frame,
+	      const unsigned char *buf)
+{
+	hdr[0] = frame->source;
+	hdr[1] = frame->flags;
+	hdr[2] = hdr[3] = 0;
+	put_le (hdr + 4, frame->arg, 4);
+	put_le (hdr + 8, frame->len, 4);
+	put_le (hdr + 12, frame->timestamp, 8);
+	put_le (hdr + 20, crc32c (crc32c (0, hdr, 20), buf, frame->len), 4);
+}
+
+/**
+ * decode_frame:
+ * @frame: frame to fill,
+ * @hdr: FRAME_HEADER_LEN bytes of header.
+ *
+ * Reads a frame header from the on-disk format.
+ **/
+void
+decode_frame (Frame               *frame,
+	      const unsigned char *hdr)
+{
+	frame->source = hdr[0];
+	frame->flags = hdr[1];
+	frame->arg = get_le (hdr + 4, 4);
+	frame->len = get_le (hdr + 8, 4);
+	frame->timestamp = get_le (hdr + 12, 8);
+}
+
+/**
+ * check_frame:
+ * @hdr: FRAME_HEADER_LEN bytes of header,
+ * @buf: data following the header.
+ *
+ * Returns: TRUE if the frame's CRC is right.
+ **/
+int
+check_frame (const unsigned char *hdr,
+	     const unsigned char *buf)
+{
+	return (crc32c (crc32c (0, hdr, 20), buf, get_le (hdr + 8, 4))
+		== get_le (hdr + 20, 4));
+}
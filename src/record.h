@@ -0,0 +1,165 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_RECORD_H
+#define LIVE_F1_RECORD_H
+
+#include <time.h>
+
+#include "live-f1.h"
+
+
+/* Identifies a recording, followed by the version */
+#define RECORD_MAGIC      "LIVEF1RC"
+#define RECORD_VERSION    2
+
+/* Sizes of the file header and each frame header */
+#define RECORD_HEADER_LEN 16
+#define FRAME_HEADER_LEN  24
+
+/* Most seconds between syncing the recording to disk */
+#define RECORD_SYNC_INTERVAL 30
+
+/* Seconds between reports of how the recording is keeping up */
+#define RECORD_REPORT_INTERVAL 60
+
+/* First chunk of a key frame */
+#define FRAME_FIRST       0x01
+
+
+/**
+ * RecordSource:
+ *
+ * Where the data in a frame of the recording came from.
+ **/
+typedef enum {
+	SOURCE_STREAM = 1,
+	SOURCE_KEY_FRAME = 2,
+	SOURCE_KEY = 3,
+	SOURCE_SYNC = 4,
+	SOURCE_CRYPT = 5
+} RecordSource;
+
+/**
+ * Frame:
+ * @source: where the data came from,
+ * @flags: FRAME_FIRST for the first chunk of a key frame,
+ * @arg: key frame number, or event number for a key,
+ * @len: length of the data following the header,
+ * @timestamp: monotonic time the data was received, in nanoseconds.
+ *
+ * Header of each frame of a recording; they're stored little-endian as
+ * a single byte source and flags, two bytes padding, then four byte
+ * arg and len, an eight byte timestamp and the four byte CRC-32C of
+ * the rest of the header and the data.  The file itself begins with
+ * the magic, and a four byte version and flags.
+ *
+ * A key's data is the key as a four byte little-endian number.  A sync
+ * frame's data is its own offset in the file as an eight byte number,
+ * and marks that everything before it had reached the disk when it was
+ * written.  A crypt frame's data is a four byte key and salt to decrypt
+ * the data stream that follows with; dumps of the flight recorder begin
+ * with one, since they begin in the middle of the data stream.
+ **/
+typedef struct {
+	RecordSource       source;
+	int                flags;
+	unsigned int       arg;
+	size_t             len;
+	unsigned long long timestamp;
+} Frame;
+
+/**
+ * RecordStats:
+ * @written: bytes written to the file so far,
+ * @pending: chunks waiting for the writer thread,
+ * @stalls: frames that had to wait for the writer thread to catch up,
+ * @drops: frames dropped because it didn't catch up in time.
+ *
+ * How the recording is keeping up with the data stream.
+ **/
+typedef struct {
+	unsigned long long written;
+	unsigned int       pending;
+	unsigned long      stalls, drops;
+} RecordStats;
+
+
+/**
+ * put_le:
+ * @buf: buffer to store in,
+ * @value: value to store,
+ * @len: number of bytes.
+ *
+ * Stores @value in @buf as a little-endian number @len bytes long.
+ **/
+static inline void
+put_le (unsigned char      *buf,
+	unsigned long long  value,
+	int                 len)
+{
+	while (len--) {
+		*(buf++) = value & 0xff;
+		value >>= 8;
+	}
+}
+
+/**
+ * get_le:
+ * @buf: buffer to read from,
+ * @len: number of bytes.
+ *
+ * Returns: little-endian number @len bytes long from @buf.
+ **/
+static inline unsigned long long
+get_le (const unsigned char *buf,
+	int                  len)
+{
+	unsigned long long value = 0;
+
+	while (len--)
+		value = (value << 8) | buf[len];
+
+	return value;
+}
+
+
+SJR_BEGIN_EXTERN
+
+int  open_record  (const char *filename);
+int  recording    (void);
+void record_frame (RecordSource source, int flags, unsigned int arg,
+		   const struct timespec *ts,
+		   const unsigned char *buf, size_t len);
+void flush_record (void);
+void sync_record  (void);
+void close_record (void);
+void record_stats (RecordStats *stats);
+
+int  verify_record  (const char *filename);
+size_t recover_record (const unsigned char *map, size_t size);
+
+void encode_frame (unsigned char *hdr, const Frame *frame,
+		   const unsigned char *buf);
+void decode_frame (Frame *frame, const unsigned char *hdr);
+int  check_frame  (const unsigned char *hdr, const unsigned char *buf);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_RECORD_H */
@@ -0,0 +1,619 @@
+/* live-f1
+ *
+ * relay.c - relay one data stream to many local clients
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "clock.h"
+#include "http.h"
+#include "job.h"
+#include "packet.h"
+#include "serve.h"
+#include "stream.h"
+#include "wire.h"
+#include "relay.h"
+
+
+/* Number of key frames and keys we keep */
+#define KEY_FRAME_CACHE 4
+#define KEY_CACHE       4
+
+
+/**
+ * WaitKind:
+ *
+ * What a deferred HTTP request is waiting for.
+ **/
+typedef enum {
+	WAIT_KEY_FRAME = 1,
+	WAIT_KEY
+} WaitKind;
+
+/**
+ * CacheStatus:
+ *
+ * Status of an entry in the key frame or key cache.
+ **/
+typedef enum {
+	CACHE_EMPTY,
+	CACHE_WANTED,
+	CACHE_FETCHING,
+	CACHE_VALID
+} CacheStatus;
+
+/**
+ * CachedFrame:
+ * @status: status of entry,
+ * @frame: key frame number,
+ * @data: key frame body,
+ * @len: length of @data.
+ *
+ * Key frame held so clients needn't fetch it from upstream.
+ **/
+typedef struct {
+	CacheStatus    status;
+	unsigned int   frame;
+	unsigned char *data;
+	size_t         len;
+} CachedFrame;
+
+/**
+ * CachedKey:
+ * @status: status of entry,
+ * @event_no: event number,
+ * @key: decryption key.
+ *
+ * Decryption key held so clients needn't fetch it from upstream.
+ **/
+typedef struct {
+	CacheStatus  status;
+	unsigned int event_no, key;
+} CachedKey;
+
+
+/* Forward prototypes */
+static void         relay_block     (const unsigned char *buf, size_t len);
+static void         relay_packet    (const unsigned char *pbuf, size_t len,
+				     unsigned long long pos);
+static void         relay_request   (HttpConn *conn, const char *method,
+				     const char *path);
+static CachedFrame *find_key_frame  (unsigned int frame, int create);
+static void         key_frame_run   (Job *job);
+static void         key_frame_done  (Job *job);
+static CachedKey   *find_key        (unsigned int event_no, int create);
+static void         start_key_jobs  (void);
+static void         key_run         (Job *job);
+static void         key_done        (Job *job);
+
+
+/* State passed to run_relay() */
+static CurrentState *relay_state = NULL;
+
+/* Partial packet from the upstream stream */
+static unsigned char       pkt[129];
+static size_t              pkt_len = 0, pkt_need = 2;
+static unsigned long long  pkt_pos = 0;
+
+/* Most recent key frame marked in the stream */
+static unsigned int        latest_frame = 0;
+
+/* Caches */
+static CachedFrame         frames[KEY_FRAME_CACHE];
+static unsigned int        next_frame = 0;
+static CachedKey           keys[KEY_CACHE];
+static unsigned int        next_key = 0;
+
+
+/**
+ * run_relay:
+ * @state: application state structure.
+ *
+ * Keeps a single connection to the upstream data stream, and serves it
+ * to any number of local clients using the same protocol; key frames and
+ * decryption keys are fetched once and served from memory.  Clients
+ * need only set host and auth-host in their configuration to point at
+ * the relay.
+ *
+ * Never returns unless there's an error.
+ *
+ * Returns: exit status for main().
+ **/
+int
+run_relay (CurrentState *state)
+{
+	struct pollfd *fds = NULL;
+	int            nfds, sock = -1;
+	time_t         last_read = 0;
+
+	relay_state = state;
+
+	if (serve_stream (STREAM_PORT)
+	    || serve_http (HTTP_PORT, relay_request)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("unable to listen for clients"), strerror (errno));
+		return 1;
+	}
+
+	for (;;) {
+		int ret;
+
+		if (sock < 0) {
+			sock = open_stream (state->host, STREAM_PORT);
+			if (sock < 0) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("unable to open data stream"),
+					 strerror (errno));
+				return 2;
+			}
+
+			/* Anything in flight to clients is now garbage */
+			stream_restart ();
+			pkt_len = 0;
+			pkt_need = 2;
+			last_read = now_seconds ();
+		}
+
+		nfds = serve_nfds () + 2;
+		fds = realloc (fds, sizeof (struct pollfd) * nfds);
+		if (! fds)
+			abort ();
+
+		fds[0].fd = sock;
+		fds[0].events = POLLIN;
+		fds[1].fd = job_fd ();
+		fds[1].events = POLLIN;
+		serve_fill (fds + 2);
+
+		ret = poll (fds, nfds, 100);
+		if ((ret < 0) && (errno != EINTR)) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 _("error reading from data stream"),
+				 strerror (errno));
+			return 2;
+		} else if (ret < 0) {
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN)
+			finish_jobs ();
+
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			unsigned char buf[512];
+			ssize_t       len;
+
+			len = read (sock, buf, sizeof (buf));
+			if (len > 0) {
+				relay_block (buf, len);
+				last_read = now_seconds ();
+			} else if ((len == 0) || (errno != EINTR)) {
+				close (sock);
+				sock = -1;
+				info (1, _("Reconnecting ...\n"));
+			}
+		} else if (now_seconds () - last_read >= 1) {
+			unsigned char ping = 0x10;
+
+			/* Wake the server up */
+			if (send (sock, &ping, 1, MSG_NOSIGNAL) < 0) {
+				close (sock);
+				sock = -1;
+				info (1, _("Reconnecting ...\n"));
+			}
+			last_read = now_seconds ();
+		}
+
+		serve_events (fds + 2);
+		retry_auth_cookie (state);
+		start_key_jobs ();
+	}
+}
+
+
+/**
+ * relay_block:
+ * @buf: data read from upstream,
+ * @len: length of @buf.
+ *
+ * Passes the block on to clients, and splits it into packets (without
+ * decrypting them) so we can spot the event start and key frame markers.
+ **/
+static void
+relay_block (const unsigned char *buf,
+	     size_t               len)
+{
+	unsigned long long pos;
+	size_t             i = 0;
+
+	pos = stream_head ();
+
+	while (i < len) {
+		size_t needed;
+
+		if (! pkt_len)
+			pkt_pos = pos + i;
+
+		needed = MIN (len - i, pkt_need - pkt_len);
+		memcpy (pkt + pkt_len, buf + i, needed);
+		pkt_len += needed;
+		i += needed;
+
+		if (pkt_len < pkt_need)
+			break;
+
+		if (pkt_need == 2) {
+			Packet packet;
+
+			decode_header (&packet, pkt);
+			if (packet.len > 0) {
+				pkt_need = packet.len + 2;
+				continue;
+			}
+		}
+
+		relay_packet (pkt, pkt_len, pkt_pos);
+		pkt_len = 0;
+		pkt_need = 2;
+	}
+
+	stream_append (buf, len);
+}
+
+/**
+ * relay_packet:
+ * @pbuf: raw packet,
+ * @len: length of @pbuf,
+ * @pos: position of the packet in the stream.
+ *
+ * Looks at a complete packet from upstream; the event start is kept to
+ * send to new clients, key frame markers become the point they join the
+ * stream and cause the key frame to be fetched.
+ **/
+static void
+relay_packet (const unsigned char *pbuf,
+	      size_t               len,
+	      unsigned long long   pos)
+{
+	Packet       packet;
+	unsigned int number, i;
+
+	decode_header (&packet, pbuf);
+	if (packet.car)
+		return;
+
+	switch ((SystemPacketType) packet.type) {
+	case SYS_EVENT_ID:
+		number = 0;
+		for (i = 3; i < len; i++) {
+			number *= 10;
+			number += pbuf[i] - '0';
+		}
+
+		info (2, _("Relaying event #%u\n"), number);
+		stream_preamble (pbuf, len);
+		find_key (number, TRUE);
+		break;
+	case SYS_KEY_FRAME:
+		number = 0;
+		i = len;
+		while (i > 2) {
+			number <<= 8;
+			number |= pbuf[--i];
+		}
+
+		info (3, _("Key frame %u marked\n"), number);
+		stream_mark (pos);
+		latest_frame = number;
+		find_key_frame (number, TRUE);
+		break;
+	default:
+		break;
+	}
+}
+
+
+/**
+ * relay_request:
+ * @conn: connection the request arrived on,
+ * @method: request method,
+ * @path: request path.
+ *
+ * Answers HTTP requests from clients; logins always succeed (we hold the
+ * only real login), keys and key frames are served from the caches,
+ * with the request deferred if we don't have them yet, or turned away
+ * if there's no room to fetch them.
+ **/
+static void
+relay_request (HttpConn   *conn,
+	       const char *method,
+	       const char *path)
+{
+	CachedFrame  *cf;
+	CachedKey    *ck;
+	unsigned int  number;
+	char          body[16];
+
+	if (! strncmp (path, LOGIN_URL, strlen (LOGIN_URL))) {
+		http_respond (conn, 200, "Set-Cookie: USER=relay; path=/\r\n",
+			      NULL, 0);
+
+	} else if (sscanf (path, KEY_URL_BASE "%u.asp", &number) == 1) {
+		ck = find_key (number, TRUE);
+		if (! ck) {
+			http_respond (conn, 503, NULL, NULL, 0);
+		} else if (ck->status == CACHE_VALID) {
+			sprintf (body, "%08x", ck->key);
+			http_respond (conn, 200, NULL,
+				      (unsigned char *) body, strlen (body));
+		} else {
+			http_defer (conn, WAIT_KEY, number);
+		}
+
+	} else if ((! strcmp (path, KEYFRAME_URL_PREFIX ".bin"))
+		   || (sscanf (path, KEYFRAME_URL_PREFIX "_%u.bin",
+			       &number) == 1)) {
+		/* The zero frame is just the latest one */
+		if (! strcmp (path, KEYFRAME_URL_PREFIX ".bin"))
+			number = latest_frame;
+
+		cf = find_key_frame (number, TRUE);
+		if ((! cf) || (cf->status == CACHE_EMPTY)) {
+			http_respond (conn, 503, NULL, NULL, 0);
+		} else if (cf->status == CACHE_VALID) {
+			http_respond (conn, 200, NULL, cf->data, cf->len);
+		} else {
+			http_defer (conn, WAIT_KEY_FRAME, number);
+		}
+
+	} else {
+		http_respond (conn, 404, NULL, NULL, 0);
+	}
+}
+
+
+/**
+ * find_key_frame:
+ * @frame: key frame number,
+ * @create: whether to fetch it if not found.
+ *
+ * Looks for the key frame in the cache; if not found and @create is
+ * TRUE, the oldest entry is replaced and the key frame fetched in the
+ * background.  Entries still being fetched are never replaced, since
+ * requests are waiting on them; if every one is, there's no room.
+ *
+ * Returns: cache entry, or NULL if not found and either @create is
+ * FALSE or there's no room.
+ **/
+static CachedFrame *
+find_key_frame (unsigned int frame,
+		int          create)
+{
+	CachedFrame *cf;
+	int          i;
+
+	for (i = 0; i < KEY_FRAME_CACHE; i++)
+		if ((frames[i].status != CACHE_EMPTY)
+		    && (frames[i].frame == frame))
+			return &frames[i];
+
+	if (! create)
+		return NULL;
+
+	/* Don't throw away one somebody's waiting for */
+	for (i = 0; i < KEY_FRAME_CACHE; i++) {
+		cf = &frames[next_frame++ % KEY_FRAME_CACHE];
+		if (cf->status != CACHE_FETCHING)
+			break;
+	}
+	if (i == KEY_FRAME_CACHE)
+		return NULL;
+
+	if (cf->data)
+		free (cf->data);
+
+	cf->status = CACHE_FETCHING;
+	cf->frame = frame;
+	cf->data = NULL;
+	cf->len = 0;
+
+	if (! start_job (relay_state, key_frame_run, key_frame_done, frame))
+		cf->status = CACHE_EMPTY;
+
+	return cf;
+}
+
+/**
+ * key_frame_run:
+ * @job: job being run.
+ *
+ * Fetches a key frame from upstream, in the background thread, leaving
+ * it and its length in @job.
+ **/
+static void
+key_frame_run (Job *job)
+{
+	size_t len = 0;
+
+	job->str = (char *) obtain_key_frame_data (job->state->host,
+						   job->arg, &len);
+	job->result = len;
+}
+
+/**
+ * key_frame_done:
+ * @job: job that has finished.
+ *
+ * Keeps the key frame in the cache and answers the requests waiting for
+ * it, or tells them it couldn't be fetched.
+ **/
+static void
+key_frame_done (Job *job)
+{
+	CachedFrame *cf;
+
+	cf = find_key_frame (job->arg, FALSE);
+	if ((! cf) || (cf->status != CACHE_FETCHING))
+		return;
+
+	if (! job->str) {
+		cf->status = CACHE_EMPTY;
+		http_respond_deferred (WAIT_KEY_FRAME, job->arg, 502,
+				       NULL, NULL, 0);
+		return;
+	}
+
+	cf->status = CACHE_VALID;
+	cf->data = (unsigned char *) job->str;
+	cf->len = job->result;
+	job->str = NULL;
+
+	http_respond_deferred (WAIT_KEY_FRAME, job->arg, 200, NULL,
+			       cf->data, cf->len);
+}
+
+
+/**
+ * find_key:
+ * @event_no: event number,
+ * @create: whether to fetch it if not found.
+ *
+ * Looks for the decryption key in the cache; if not found and @create is
+ * TRUE the oldest entry is replaced, and the key fetched once we have
+ * the authentication cookie.  Entries still wanted or being fetched
+ * are never replaced, since requests are waiting on them; if every one
+ * is, there's no room.
+ *
+ * Returns: cache entry, or NULL if not found and either @create is
+ * FALSE or there's no room.
+ **/
+static CachedKey *
+find_key (unsigned int event_no,
+	  int          create)
+{
+	CachedKey *ck;
+	int        i;
+
+	for (i = 0; i < KEY_CACHE; i++)
+		if ((keys[i].status != CACHE_EMPTY)
+		    && (keys[i].event_no == event_no))
+			return &keys[i];
+
+	if (! create)
+		return NULL;
+
+	for (i = 0; i < KEY_CACHE; i++) {
+		ck = &keys[next_key++ % KEY_CACHE];
+		if ((ck->status != CACHE_WANTED)
+		    && (ck->status != CACHE_FETCHING))
+			break;
+	}
+	if (i == KEY_CACHE)
+		return NULL;
+
+	ck->status = CACHE_WANTED;
+	ck->event_no = event_no;
+	ck->key = 0;
+
+	start_key_jobs ();
+
+	return ck;
+}
+
+/**
+ * start_key_jobs:
+ *
+ * Starts fetching any keys that are wanted, once we've logged in.
+ **/
+static void
+start_key_jobs (void)
+{
+	int i;
+
+	if (! relay_state->cookie)
+		return;
+
+	for (i = 0; i < KEY_CACHE; i++) {
+		if (keys[i].status != CACHE_WANTED)
+			continue;
+
+		if (start_job (relay_state, key_run, key_done,
+			       keys[i].event_no))
+			keys[i].status = CACHE_FETCHING;
+	}
+}
+
+/**
+ * key_run:
+ * @job: job being run.
+ *
+ * Fetches a decryption key from upstream, in the background thread,
+ * leaving it in @job.
+ **/
+static void
+key_run (Job *job)
+{
+	job->result = obtain_decryption_key (job->state->host, job->arg,
+					     job->state->cookie);
+}
+
+/**
+ * key_done:
+ * @job: job that has finished.
+ *
+ * Keeps the key in the cache and answers the requests waiting for it,
+ * or tells them it couldn't be fetched.
+ **/
+static void
+key_done (Job *job)
+{
+	CachedKey *ck;
+	char       body[16];
+
+	ck = find_key (job->arg, FALSE);
+	if ((! ck) || (ck->status != CACHE_FETCHING))
+		return;
+
+	if (! job->result) {
+		ck->status = CACHE_EMPTY;
+		http_respond_deferred (WAIT_KEY, job->arg, 502, NULL, NULL, 0);
+		return;
+	}
+
+	ck->status = CACHE_VALID;
+	ck->key = job->result;
+
+	sprintf (body, "%08x", ck->key);
+	http_respond_deferred (WAIT_KEY, job->arg, 200, NULL,
+			       (unsigned char *) body, strlen (body));
+}
@@ -0,0 +1,892 @@
+/* live-f1
+ *
+ * replay.c - playing back a recorded session
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "archive.h"
+#include "checkpoint.h"
+#include "clock.h"
+#include "display.h"
+#include "job.h"
+#include "record.h"
+#include "seek.h"
+#include "stream.h"
+#include "replay.h"
+
+
+/* Most times a second the screen is updated when replaying flat out */
+#define REPLAY_FRAME_RATE 25
+
+/* Most memory used for checkpoints of the state (MiB) */
+#define REPLAY_CHECKPOINT_MEMORY 4
+
+
+/**
+ * ReplayFrame:
+ * @frame: frame header,
+ * @offset: offset of the frame's data in the file.
+ *
+ * Every frame in the recording is indexed when it's opened, so key
+ * frames and keys can be found when they're asked for.
+ **/
+typedef struct {
+	Frame frame;
+	off_t offset;
+} ReplayFrame;
+
+/**
+ * KeyIndex:
+ * @source: SOURCE_KEY or SOURCE_KEY_FRAME,
+ * @arg: event number of a key, or key frame number,
+ * @frame: index into frames.
+ *
+ * Each key and the first chunk of each key frame in the recording,
+ * sorted by what it's for and then where it is, so that the one asked
+ * for can be found by binary search.
+ **/
+typedef struct {
+	RecordSource source;
+	unsigned int arg;
+	size_t       frame;
+} KeyIndex;
+
+/* Data of a frame, where it is in the mapping */
+#define FRAME_DATA(_rf) (replay_map + (_rf)->offset)
+
+
+/* Forward prototypes */
+static void           index_frames      (size_t end);
+static int            index_archive     (void);
+static ReplayFrame   *add_frame         (void);
+static void           index_keys        (void);
+static int            compare_keys      (const void *a, const void *b);
+static size_t         find_key          (RecordSource source,
+					 unsigned int arg, size_t from);
+static void           index_seek_points (const char *filename, off_t size);
+static int            have_key_frame    (unsigned int frame);
+static size_t         find_frame        (off_t offset);
+static size_t         replay_frame      (CurrentState *state);
+static void           skip_frame        (CurrentState *state);
+static void           wait_jobs         (long ms);
+static long           elapsed_ms        (unsigned long long since);
+static void           tick_clock        (CurrentState *state,
+					 unsigned long long timestamp);
+
+
+/* Recording being replayed, mapped into memory, and its index */
+static const unsigned char *replay_map = NULL;
+static off_t           replay_size = 0;
+static ReplayFrame    *frames = NULL;
+static size_t          nframes = 0, frames_sz = 0, next_frame = 0;
+
+/* Keys and key frames in the recording */
+static KeyIndex       *keys = NULL;
+static size_t          nkeys = 0, keys_sz = 0;
+
+/* Whether it's an archive made with --compact rather than a recording */
+static int             replay_archive = 0;
+
+/* Bytes of the next frame already replayed, after seeking into it */
+static size_t          next_skip = 0;
+
+/* Places we can seek to */
+static SeekPoint      *points = NULL;
+static size_t          npoints = 0;
+
+/* Checkpoints of the state taken as we go, the position of each is the
+ * index of the frame after
+ */
+static Checkpoints     checkpoints;
+
+/* Speed to replay at, 0 for as fast as possible */
+static double          replay_speed = 1.0;
+
+/* When we started, and the timestamp of the first block then */
+static unsigned long long replay_start, last_draw;
+static unsigned long long first_timestamp = 0;
+
+/* Timestamp of the last block replayed */
+static unsigned long long last_timestamp = 0;
+
+/* How much we've replayed */
+static unsigned long long replay_bytes = 0;
+static unsigned int    replay_blocks = 0;
+static int             replay_ended = 0;
+
+
+/**
+ * open_replay:
+ * @filename: recording to replay,
+ * @speed: multiple of real time to replay at, 0 for as fast as possible.
+ *
+ * Opens a recording made with --record and indexes the frames within
+ * it; the data stream is then read from it by replay_stream() instead
+ * of from the network, and key frames and keys are taken from it too.
+ * An archive made with --compact can be opened instead, its groups of
+ * changes are indexed as though they were frames.
+ *
+ * Returns: 0 on success, non-zero on failure with errno set.
+ **/
+int
+open_replay (const char *filename,
+	     double      speed)
+{
+	struct stat  st;
+	size_t       end, i;
+	int          fd;
+
+	fd = open (filename, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	if (fstat (fd, &st) < 0) {
+		close (fd);
+		return 1;
+	} else if (st.st_size < RECORD_HEADER_LEN) {
+		close (fd);
+		errno = EINVAL;
+		return 1;
+	}
+
+	/* The mapping stays valid once the file is closed */
+	replay_map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (replay_map == MAP_FAILED) {
+		replay_map = NULL;
+		return 1;
+	}
+	replay_size = st.st_size;
+
+	madvise ((void *) replay_map, replay_size, MADV_SEQUENTIAL);
+
+	if (! memcmp (replay_map, ARCHIVE_MAGIC, 8)) {
+		if (index_archive ()) {
+			munmap ((void *) replay_map, replay_size);
+			replay_map = NULL;
+			errno = EINVAL;
+			return 1;
+		}
+	} else if (memcmp (replay_map, RECORD_MAGIC, 8)
+		   || (get_le (replay_map + 8, 4) != RECORD_VERSION)) {
+		munmap ((void *) replay_map, replay_size);
+		replay_map = NULL;
+		errno = EINVAL;
+		return 1;
+	} else {
+		/* A recording cut short by a crash is replayed up to the
+		 * damage
+		 */
+		end = recover_record (replay_map, replay_size);
+		if (end < (size_t) replay_size)
+			info (1, _("Ignoring %lu damaged bytes at end of "
+				   "recording\n"),
+			      (unsigned long) (replay_size - end));
+
+		index_frames (end);
+		index_keys ();
+		index_seek_points (filename, replay_size);
+	}
+
+	info (1, _("Replaying %lu frames\n"), (unsigned long) nframes);
+
+	for (i = 0; i < nframes; i++) {
+		if (frames[i].frame.source == SOURCE_STREAM) {
+			first_timestamp = frames[i].frame.timestamp;
+			break;
+		}
+	}
+	last_timestamp = first_timestamp;
+
+	/* The session's clock is the recording's, however fast it goes */
+	use_virtual_clock ();
+
+	init_checkpoints (&checkpoints, CHECKPOINT_SECONDS, CHECKPOINT_PACKETS,
+			  REPLAY_CHECKPOINT_MEMORY * 1024 * 1024);
+
+	replay_speed = speed;
+	if (! replay_speed)
+		hold_display (TRUE);
+
+	replay_start = real_ns ();
+	last_draw = replay_start;
+
+	return 0;
+}
+
+/**
+ * replaying:
+ *
+ * Returns: TRUE if we're replaying a recording.
+ **/
+int
+replaying (void)
+{
+	return (replay_map != NULL);
+}
+
+/**
+ * replay_stream:
+ * @state: application state structure.
+ *
+ * Replays the next block of the data stream from the recording once
+ * it's due, keeping the gaps between blocks as they were received (or
+ * scaled); otherwise waits a little while so keys can be handled.
+ * When replaying as fast as possible, the screen is only updated
+ * REPLAY_FRAME_RATE times a second.
+ *
+ * Returns: 0 at the end of the recording when replaying as fast as
+ * possible, > 0 otherwise.
+ **/
+int
+replay_stream (CurrentState *state)
+{
+	ReplayFrame *rf;
+	size_t       len;
+
+	while ((next_frame < nframes)
+	       && (frames[next_frame].frame.source != SOURCE_STREAM))
+		skip_frame (state);
+
+	if (next_frame == nframes) {
+		if (! replay_speed)
+			return 0;
+
+		if (! replay_ended) {
+			popup_message (_("End of replay"));
+			replay_ended = 1;
+		}
+
+		wait_jobs (100);
+		return 1;
+	}
+
+	rf = &frames[next_frame];
+	if (replay_speed) {
+		long due, ms;
+
+		ms = elapsed_ms (replay_start);
+		due = (long) ((rf->frame.timestamp - first_timestamp)
+			      / 1000000 / replay_speed) - ms;
+		if (due > 0) {
+			tick_clock (state, (first_timestamp
+					    + ms * replay_speed * 1000000));
+			wait_jobs (MIN (due, 100));
+			return 1;
+		}
+	}
+
+	len = replay_frame (state);
+	replay_bytes += len;
+	replay_blocks++;
+
+	if ((! replay_speed)
+	    && (elapsed_ms (last_draw) >= 1000 / REPLAY_FRAME_RATE)) {
+		flush_display ();
+		last_draw = real_ns ();
+	}
+
+	return len ? len : 1;
+}
+
+/**
+ * replay_seek:
+ * @state: application state structure,
+ * @ms: milliseconds into the recording to seek to.
+ *
+ * Jumps to a different point in the recording.  Rather than parsing
+ * everything up to it, we find the last key frame marker before it (by
+ * binary search of the seek index) whose key frame the recording has,
+ * restart the stream parser there so the key frame is loaded, and then
+ * replay only the blocks between the marker and the point we wanted;
+ * so the time taken doesn't depend on how far into the session it is.
+ * The event start packet before the marker is parsed first, so that
+ * we have the right key and an empty board.
+ *
+ * Anywhere we've already replayed has a checkpoint of the state not
+ * far before it; when that's nearer than the marker, it's restored
+ * instead and only the few blocks since are replayed.
+ *
+ * If there's no such marker, we start again from the beginning.
+ **/
+void
+replay_seek (CurrentState *state,
+	     long          ms)
+{
+	unsigned long long started, target;
+	const Checkpoint  *cp;
+	size_t             i;
+
+	started = real_ns ();
+
+	if (ms < 0)
+		ms = 0;
+	target = first_timestamp + ms * 1000000ULL;
+
+	/* The jump is random access, though replaying from there isn't */
+	madvise ((void *) replay_map, replay_size, MADV_RANDOM);
+
+	/* An archive has the whole state every so often instead */
+	if (replay_archive) {
+		next_frame = find_frame (find_archive_point (target / 1000000));
+		next_skip = 0;
+		goto catch_up;
+	}
+
+	i = find_seek_point (points, npoints, target);
+	while ((i < npoints) && (! have_key_frame (points[i].frame)))
+		i = i ? i - 1 : npoints;
+
+	cp = find_checkpoint (&checkpoints, target, 0);
+	if (cp && ((cp->timestamp > target)
+		   || ((i < npoints) && (cp->timestamp < points[i].timestamp))))
+		cp = NULL;
+
+	restart_stream (state);
+	if (cp) {
+		StreamContext ctx;
+
+		restore_checkpoint (&checkpoints, cp, state, &ctx);
+		restore_stream (&ctx);
+		next_frame = cp->position;
+		next_skip = 0;
+	} else if (i < npoints) {
+		/* Begin the event again, which also resets the board */
+		next_frame = find_frame (points[i].offset);
+		next_skip = points[i].offset - frames[next_frame].offset;
+		parse_stream_block (state, points[i].event,
+				    points[i].event_len);
+	} else {
+		next_frame = next_skip = 0;
+	}
+
+catch_up:
+	replay_ended = 0;
+
+	/* Catch up without drawing every block on the way */
+	hold_display (TRUE);
+	while (next_frame < nframes) {
+		if (frames[next_frame].frame.source != SOURCE_STREAM) {
+			skip_frame (state);
+		} else if (frames[next_frame].frame.timestamp > target) {
+			break;
+		} else {
+			replay_frame (state);
+		}
+	}
+	clear_board (state);
+	hold_display (! replay_speed);
+
+	madvise ((void *) replay_map, replay_size, MADV_SEQUENTIAL);
+
+	/* Carry on in real time from here */
+	if (replay_speed) {
+		replay_start = started - (unsigned long long) (
+			(target - first_timestamp) / replay_speed);
+	}
+	last_timestamp = MAX (target, first_timestamp);
+	tick_clock (state, last_timestamp);
+
+	info (2, _("Seeking to %ld s took %ld ms\n"),
+	      ms / 1000, elapsed_ms (started));
+}
+
+/**
+ * replay_position:
+ *
+ * Returns: milliseconds into the recording we've replayed up to.
+ **/
+long
+replay_position (void)
+{
+	return (long) ((last_timestamp - first_timestamp) / 1000000);
+}
+
+/**
+ * replay_key:
+ * @event_no: event number.
+ *
+ * Returns: decryption key for the event saved in the recording, or 0 if
+ * there isn't one.
+ **/
+unsigned int
+replay_key (unsigned int event_no)
+{
+	unsigned int key = 0;
+	size_t       i;
+
+	i = find_key (SOURCE_KEY, event_no, 0);
+	if (i < nkeys)
+		key = get_le (FRAME_DATA (&frames[keys[i].frame]), 4);
+
+	if (! key)
+		info (0, _("No key for event %u in recording\n"), event_no);
+
+	return key;
+}
+
+/**
+ * replay_key_frame:
+ * @frame: key frame number,
+ * @userdata: pointer to pass to stream parser.
+ *
+ * Parses the key frame from the recording; the one fetched when this
+ * marker was reached is recorded just after it, but any copy will do.
+ *
+ * A key frame may itself cause another to be fetched (if decryption
+ * failed part way through), which is recorded after the chunks already
+ * parsed, so while parsing one we only search forwards from there;
+ * that also means a recording can never have us recurse forever.
+ *
+ * Returns: 0 on success, non-zero if the recording doesn't have it.
+ **/
+int
+replay_key_frame (unsigned int  frame,
+		  void         *userdata)
+{
+	static int    depth = 0;
+	static size_t cursor = 0;
+	size_t        start, i;
+
+	i = find_key (SOURCE_KEY_FRAME, frame, depth ? cursor : next_frame);
+	if ((i == nkeys) && (! depth))
+		i = find_key (SOURCE_KEY_FRAME, frame, 0);
+	if (i == nkeys)
+		return 1;
+	start = keys[i].frame;
+
+	depth++;
+	for (i = start; i < nframes; i++) {
+		if ((frames[i].frame.source != SOURCE_KEY_FRAME)
+		    || (frames[i].frame.arg != frame)
+		    || ((i > start) && (frames[i].frame.flags & FRAME_FIRST)))
+			break;
+
+		cursor = i + 1;
+		if (! frames[i].frame.len)
+			continue;
+
+		parse_stream_block (userdata, FRAME_DATA (&frames[i]),
+				    frames[i].frame.len);
+	}
+	depth--;
+
+	return 0;
+}
+
+/**
+ * replay_summary:
+ *
+ * Reports how much was replayed, and how quickly.
+ **/
+void
+replay_summary (void)
+{
+	long ms;
+
+	ms = elapsed_ms (replay_start);
+	info (0, _("Replayed %llu bytes in %u blocks in %ld ms (%.1f KiB/s)\n"),
+	      replay_bytes, replay_blocks, ms,
+	      (ms ? replay_bytes * 1000.0 / 1024.0 / ms : 0.0));
+}
+
+
+/**
+ * index_frames:
+ * @end: end of the intact part of the recording.
+ *
+ * Indexes the frames of a recording; frames cut short by the end of the
+ * file are simply ignored.
+ **/
+static void
+index_frames (size_t end)
+{
+	off_t offset = RECORD_HEADER_LEN;
+
+	while (offset + FRAME_HEADER_LEN <= end) {
+		ReplayFrame *rf;
+
+		rf = add_frame ();
+		decode_frame (&rf->frame, replay_map + offset);
+		rf->offset = offset + FRAME_HEADER_LEN;
+
+		if (rf->frame.len > end - rf->offset) {
+			nframes--;
+			break;
+		}
+		offset = rf->offset + rf->frame.len;
+	}
+}
+
+/**
+ * index_archive:
+ *
+ * Indexes the groups of changes in an archive, each as a frame of the
+ * data stream with the time of the group.
+ *
+ * Returns: 0 on success, non-zero if it's not an archive we can read.
+ **/
+static int
+index_archive (void)
+{
+	unsigned long long ms = 0;
+	size_t             offset = ARCHIVE_HEADER_LEN, start, len, end;
+
+	if (load_archive (replay_map, replay_size, &end))
+		return 1;
+
+	for (start = offset;
+	     next_archive_group (replay_map, end, &offset, &len, &ms);
+	     start = offset) {
+		ReplayFrame *rf;
+
+		rf = add_frame ();
+		memset (&rf->frame, 0, sizeof (Frame));
+		rf->frame.source = SOURCE_STREAM;
+		rf->frame.len = len;
+		rf->frame.timestamp = ms * 1000000ULL;
+		rf->offset = start;
+	}
+
+	replay_archive = TRUE;
+	return 0;
+}
+
+/**
+ * add_frame:
+ *
+ * Returns: new frame at the end of the index.
+ **/
+static ReplayFrame *
+add_frame (void)
+{
+	if (nframes == frames_sz) {
+		frames_sz = frames_sz ? frames_sz * 2 : 1024;
+		frames = realloc (frames, sizeof (ReplayFrame) * frames_sz);
+		if (! frames)
+			abort ();
+	}
+
+	return &frames[nframes++];
+}
+
+/**
+ * index_keys:
+ *
+ * Indexes the keys and key frames in the recording, so that finding
+ * the one asked for doesn't take longer the longer the recording.
+ **/
+static void
+index_keys (void)
+{
+	size_t i;
+
+	for (i = 0; i < nframes; i++) {
+		const Frame *frame = &frames[i].frame;
+
+		if (((frame->source != SOURCE_KEY) || (frame->len < 4))
+		    && ((frame->source != SOURCE_KEY_FRAME)
+			|| (! (frame->flags & FRAME_FIRST))))
+			continue;
+
+		if (nkeys == keys_sz) {
+			keys_sz = keys_sz ? keys_sz * 2 : 64;
+			keys = realloc (keys, sizeof (KeyIndex) * keys_sz);
+			if (! keys)
+				abort ();
+		}
+
+		keys[nkeys].source = frame->source;
+		keys[nkeys].arg = frame->arg;
+		keys[nkeys].frame = i;
+		nkeys++;
+	}
+
+	qsort (keys, nkeys, sizeof (KeyIndex), compare_keys);
+}
+
+/**
+ * compare_keys:
+ * @a: first entry,
+ * @b: second entry.
+ *
+ * Returns: less than, equal to or greater than zero as @a sorts before,
+ * with or after @b.
+ **/
+static int
+compare_keys (const void *a,
+	      const void *b)
+{
+	const KeyIndex *ka = a, *kb = b;
+
+	if (ka->source != kb->source)
+		return (ka->source < kb->source) ? -1 : 1;
+	if (ka->arg != kb->arg)
+		return (ka->arg < kb->arg) ? -1 : 1;
+	if (ka->frame != kb->frame)
+		return (ka->frame < kb->frame) ? -1 : 1;
+
+	return 0;
+}
+
+/**
+ * find_key:
+ * @source: SOURCE_KEY or SOURCE_KEY_FRAME,
+ * @arg: event number of the key, or key frame number,
+ * @from: index into frames to search from.
+ *
+ * Finds the first key or key frame in the recording for @arg at or
+ * after @from by binary search.
+ *
+ * Returns: index into keys, or nkeys if there isn't one.
+ **/
+static size_t
+find_key (RecordSource  source,
+	  unsigned int  arg,
+	  size_t        from)
+{
+	KeyIndex want;
+	size_t   lo = 0, hi = nkeys;
+
+	want.source = source;
+	want.arg = arg;
+	want.frame = from;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (compare_keys (&keys[mid], &want) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if ((lo == nkeys) || (keys[lo].source != source)
+	    || (keys[lo].arg != arg))
+		return nkeys;
+
+	return lo;
+}
+
+/**
+ * index_seek_points:
+ * @filename: recording being replayed,
+ * @size: size of the recording.
+ *
+ * Loads the seek index saved alongside the recording; if there isn't
+ * one, or it's out of date, one is made by looking for key frame
+ * markers in the data stream and saved for next time.
+ **/
+static void
+index_seek_points (const char *filename,
+		   off_t       size)
+{
+	SeekScanner scanner;
+	size_t      i;
+
+	points = load_seek_index (filename, replay_map, size, &npoints);
+	if (points)
+		return;
+
+	memset (&scanner, 0, sizeof (scanner));
+	for (i = 0; i < nframes; i++) {
+		if (frames[i].frame.source != SOURCE_STREAM)
+			continue;
+
+		scan_seek_points (&scanner, FRAME_DATA (&frames[i]),
+				  frames[i].frame.len, frames[i].offset,
+				  frames[i].frame.timestamp);
+	}
+
+	points = scanner.points;
+	npoints = scanner.npoints;
+
+	if (save_seek_index (filename, replay_map, size, points, npoints))
+		info (2, _("Unable to save seek index for %s\n"), filename);
+}
+
+/**
+ * have_key_frame:
+ * @frame: key frame number.
+ *
+ * Returns: TRUE if the recording has the key frame numbered.
+ **/
+static int
+have_key_frame (unsigned int frame)
+{
+	return (find_key (SOURCE_KEY_FRAME, frame, 0) < nkeys);
+}
+
+/**
+ * find_frame:
+ * @offset: offset in the recording.
+ *
+ * Finds the frame whose data contains @offset by binary search, since
+ * the frames are indexed in the order they're stored.
+ *
+ * Returns: index into frames.
+ **/
+static size_t
+find_frame (off_t offset)
+{
+	size_t lo = 0, hi = nframes;
+
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (frames[mid].offset <= offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/**
+ * replay_frame:
+ * @state: application state structure.
+ *
+ * Parses the next frame of the recording, which must be part of the
+ * data stream, and moves on to the one after.  The data is parsed
+ * straight out of the mapping, after which a checkpoint of the state
+ * is taken if one's due.
+ *
+ * Returns: number of bytes parsed.
+ **/
+static size_t
+replay_frame (CurrentState *state)
+{
+	ReplayFrame *rf;
+	size_t       skip;
+
+	rf = &frames[next_frame];
+	skip = MIN (next_skip, rf->frame.len);
+	next_frame++;
+	next_skip = 0;
+	last_timestamp = rf->frame.timestamp;
+	tick_clock (state, last_timestamp);
+
+	if (replay_archive) {
+		apply_archive (state, FRAME_DATA (rf), rf->frame.len);
+		return rf->frame.len;
+	}
+
+	parse_stream_block (state, FRAME_DATA (rf) + skip,
+			    rf->frame.len - skip);
+
+	if (checkpoint_due (&checkpoints, last_timestamp)
+	    && state->key && (! state->key_pending) && state->num_cars)
+		take_checkpoint (&checkpoints, state, last_timestamp,
+				 next_frame);
+
+	return rf->frame.len - skip;
+}
+
+/**
+ * skip_frame:
+ * @state: application state structure.
+ *
+ * Moves on past the next frame of the recording, which isn't part of
+ * the data stream.  Key frames and keys are found when they're asked
+ * for, but a crypt frame's key and salt are used from here on.
+ **/
+static void
+skip_frame (CurrentState *state)
+{
+	ReplayFrame *rf;
+
+	rf = &frames[next_frame++];
+	if ((rf->frame.source == SOURCE_CRYPT) && (rf->frame.len >= 8)) {
+		state->key = get_le (FRAME_DATA (rf), 4);
+		state->salt = get_le (FRAME_DATA (rf) + 4, 4);
+	}
+}
+
+/**
+ * wait_jobs:
+ * @ms: longest time to wait, in milliseconds.
+ *
+ * Waits for a background job to finish, or for the time to pass.
+ **/
+static void
+wait_jobs (long ms)
+{
+	struct pollfd poll_fd;
+
+	poll_fd.fd = job_fd ();
+	poll_fd.events = POLLIN;
+	poll_fd.revents = 0;
+
+	if ((poll (&poll_fd, 1, ms) > 0) && (poll_fd.revents & POLLIN))
+		finish_jobs ();
+}
+
+/**
+ * tick_clock:
+ * @state: application state structure,
+ * @timestamp: time in the recording we've reached.
+ *
+ * Moves the session's virtual clock on to @timestamp, and redraws the
+ * time remaining whenever another second has passed.
+ **/
+static void
+tick_clock (CurrentState       *state,
+	    unsigned long long  timestamp)
+{
+	time_t before;
+
+	before = now_seconds ();
+	set_virtual_clock (timestamp > first_timestamp
+			   ? timestamp - first_timestamp : 0);
+	if (now_seconds () != before)
+		update_time (state);
+}
+
+/**
+ * elapsed_ms:
+ * @since: earlier time.
+ *
+ * Returns: number of milliseconds since @since.
+ **/
+static long
+elapsed_ms (unsigned long long since)
+{
+	return (long) ((real_ns () - since) / 1000000);
+}
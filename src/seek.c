@@ -0,0 +1,351 @@
+/* live-f1
+ *
+ * seek.c - index of places a recording can be replayed from
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "crc32c.h"
+#include "packet.h"
+#include "record.h"
+#include "wire.h"
+#include "seek.h"
+
+
+/* Forward prototypes */
+static char         *index_filename (const char *filename,
+				     const char *suffix);
+static unsigned int  check_ends     (const unsigned char *map, off_t size);
+
+
+/**
+ * scan_seek_points:
+ * @scanner: scanner state,
+ * @buf: block of the data stream,
+ * @len: length of @buf,
+ * @offset: offset of @buf in the recording,
+ * @timestamp: time @buf was received.
+ *
+ * Looks through the block for key frame markers, adding a seek point
+ * for each to @scanner; the blocks must be passed in the order they
+ * were received, since packets may cross from one into the next.
+ **/
+void
+scan_seek_points (SeekScanner         *scanner,
+		  const unsigned char *buf,
+		  size_t               len,
+		  off_t                offset,
+		  unsigned long long   timestamp)
+{
+	while (len) {
+		Packet packet;
+		size_t needed;
+
+		if (! scanner->pbuf_len) {
+			scanner->offset = offset;
+			scanner->timestamp = timestamp;
+		}
+
+		if (scanner->pbuf_len < 2) {
+			needed = MIN (len, 2 - scanner->pbuf_len);
+		} else {
+			decode_header (&packet, scanner->pbuf);
+			needed = MIN (len, (MAX (packet.len, 0) + 2)
+				      - scanner->pbuf_len);
+		}
+
+		memcpy (scanner->pbuf + scanner->pbuf_len, buf, needed);
+		scanner->pbuf_len += needed;
+		buf += needed;
+		offset += needed;
+		len -= needed;
+
+		if (scanner->pbuf_len < 2)
+			break;
+
+		decode_header (&packet, scanner->pbuf);
+		if (scanner->pbuf_len < MAX (packet.len, 0) + 2)
+			continue;
+
+		scanner->pbuf_len = 0;
+		if (packet.car) {
+			continue;
+		} else if (packet.type == SYS_EVENT_ID) {
+			scanner->event_len = MAX (packet.len, 0) + 2;
+			memcpy (scanner->event, scanner->pbuf,
+				scanner->event_len);
+			continue;
+		} else if (packet.type != SYS_KEY_FRAME) {
+			continue;
+		}
+
+		if (scanner->npoints == scanner->sz) {
+			scanner->sz = scanner->sz ? scanner->sz * 2 : 64;
+			scanner->points = realloc (scanner->points,
+						   (sizeof (SeekPoint)
+						    * scanner->sz));
+			if (! scanner->points)
+				abort ();
+		}
+
+		scanner->points[scanner->npoints].offset = scanner->offset;
+		scanner->points[scanner->npoints].timestamp = scanner->timestamp;
+		scanner->points[scanner->npoints].frame
+			= get_le (scanner->pbuf + 2, MAX (packet.len, 0));
+		memcpy (scanner->points[scanner->npoints].event,
+			scanner->event, sizeof (scanner->event));
+		scanner->points[scanner->npoints].event_len
+			= scanner->event_len;
+		scanner->npoints++;
+	}
+}
+
+
+/**
+ * load_seek_index:
+ * @filename: recording the index is for,
+ * @map: recording, mapped into memory,
+ * @size: size of @map,
+ * @npoints: pointer to store number of seek points in.
+ *
+ * Reads the index saved alongside the recording, if there is one and
+ * it was made from this recording: the same size (one still being
+ * recorded to will have grown since) with the same bytes at each end.
+ * The seek points must be in order and within the recording, so that
+ * a damaged index is made again rather than trusted.
+ *
+ * Returns: newly allocated array of seek points, or NULL if there's no
+ * usable index.
+ **/
+SeekPoint *
+load_seek_index (const char          *filename,
+		 const unsigned char *map,
+		 off_t                size,
+		 size_t              *npoints)
+{
+	unsigned char  hdr[SEEK_HEADER_LEN], entry[SEEK_ENTRY_LEN];
+	SeekPoint     *points;
+	char          *name;
+	FILE          *idx;
+	size_t         i;
+
+	name = index_filename (filename, SEEK_SUFFIX);
+	idx = fopen (name, "r");
+	free (name);
+	if (! idx)
+		return NULL;
+
+	if ((fread (hdr, 1, sizeof (hdr), idx) != sizeof (hdr))
+	    || memcmp (hdr, SEEK_MAGIC, 8)
+	    || (get_le (hdr + 8, 4) != SEEK_VERSION)
+	    || (get_le (hdr + 16, 8) != (unsigned long long) size)
+	    || (get_le (hdr + 24, 4) != check_ends (map, size))) {
+		fclose (idx);
+		return NULL;
+	}
+
+	*npoints = get_le (hdr + 12, 4);
+	points = malloc (sizeof (SeekPoint) * (*npoints + 1));
+	if (! points)
+		abort ();
+
+	for (i = 0; i < *npoints; i++) {
+		if (fread (entry, 1, sizeof (entry), idx) != sizeof (entry)) {
+			free (points);
+			fclose (idx);
+			return NULL;
+		}
+
+		points[i].offset = get_le (entry, 8);
+		points[i].timestamp = get_le (entry + 8, 8);
+		points[i].frame = get_le (entry + 16, 4);
+		points[i].event_len = get_le (entry + 20, 4);
+		memcpy (points[i].event, entry + 24, SEEK_EVENT_LEN);
+
+		if ((points[i].offset < RECORD_HEADER_LEN)
+		    || (points[i].offset >= size)
+		    || (points[i].event_len > SEEK_EVENT_LEN)
+		    || (i && ((points[i].offset <= points[i - 1].offset)
+			      || (points[i].timestamp
+				  < points[i - 1].timestamp)))) {
+			free (points);
+			fclose (idx);
+			return NULL;
+		}
+	}
+
+	fclose (idx);
+	return points;
+}
+
+/**
+ * save_seek_index:
+ * @filename: recording the index is for,
+ * @map: recording, mapped into memory,
+ * @size: size of @map,
+ * @points: seek points,
+ * @npoints: number of @points.
+ *
+ * Saves the index alongside the recording so that it needn't be made
+ * again next time.  It's written to a temporary file first and renamed
+ * over the top, so we never leave a partial index behind.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+save_seek_index (const char          *filename,
+		 const unsigned char *map,
+		 off_t                size,
+		 const SeekPoint     *points,
+		 size_t               npoints)
+{
+	unsigned char  hdr[SEEK_HEADER_LEN], entry[SEEK_ENTRY_LEN];
+	char          *name, *tmpname;
+	FILE          *idx;
+	size_t         i;
+	int            ret = 0;
+
+	name = index_filename (filename, SEEK_SUFFIX);
+	tmpname = index_filename (filename, SEEK_SUFFIX ".tmp");
+
+	idx = fopen (tmpname, "w");
+	if (! idx) {
+		free (tmpname);
+		free (name);
+		return 1;
+	}
+
+	memcpy (hdr, SEEK_MAGIC, 8);
+	put_le (hdr + 8, SEEK_VERSION, 4);
+	put_le (hdr + 12, npoints, 4);
+	put_le (hdr + 16, size, 8);
+	put_le (hdr + 24, check_ends (map, size), 4);
+	put_le (hdr + 28, 0, 4);
+	if (fwrite (hdr, 1, sizeof (hdr), idx) != sizeof (hdr))
+		ret = 1;
+
+	memset (entry, 0, sizeof (entry));
+	for (i = 0; (! ret) && (i < npoints); i++) {
+		put_le (entry, points[i].offset, 8);
+		put_le (entry + 8, points[i].timestamp, 8);
+		put_le (entry + 16, points[i].frame, 4);
+		put_le (entry + 20, points[i].event_len, 4);
+		memcpy (entry + 24, points[i].event, SEEK_EVENT_LEN);
+
+		if (fwrite (entry, 1, sizeof (entry), idx) != sizeof (entry))
+			ret = 1;
+	}
+
+	if (fclose (idx))
+		ret = 1;
+
+	if (ret || rename (tmpname, name)) {
+		unlink (tmpname);
+		ret = 1;
+	}
+
+	free (tmpname);
+	free (name);
+	return ret;
+}
+
+/**
+ * index_filename:
+ * @filename: recording filename,
+ * @suffix: suffix to append.
+ *
+ * Returns: newly allocated filename of the index for @filename.
+ **/
+static char *
+index_filename (const char *filename,
+		const char *suffix)
+{
+	char *name;
+
+	name = malloc (strlen (filename) + strlen (suffix) + 1);
+	if (! name)
+		abort ();
+
+	strcpy (name, filename);
+	strcat (name, suffix);
+
+	return name;
+}
+
+/**
+ * check_ends:
+ * @map: recording, mapped into memory,
+ * @size: size of @map.
+ *
+ * Returns: CRC-32C of the first and last SEEK_CHECK_LEN bytes of the
+ * recording, which tells it apart from another of the same size
+ * without reading the whole thing.
+ **/
+static unsigned int
+check_ends (const unsigned char *map,
+	    off_t                size)
+{
+	size_t len;
+
+	len = MIN ((size_t) size, SEEK_CHECK_LEN);
+
+	return crc32c (crc32c (0, map, len), map + size - len, len);
+}
+
+
+/**
+ * find_seek_point:
+ * @points: seek points, in the order they were received,
+ * @npoints: number of @points,
+ * @timestamp: time to seek to.
+ *
+ * Finds the last seek point at or before @timestamp.
+ *
+ * Returns: index into @points, or @npoints if they're all later.
+ **/
+size_t
+find_seek_point (const SeekPoint    *points,
+		 size_t              npoints,
+		 unsigned long long  timestamp)
+{
+	size_t lo = 0, hi = npoints;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (points[mid].timestamp <= timestamp) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo ? lo - 1 : npoints;
+}
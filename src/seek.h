@@ -0,0 +1,120 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_SEEK_H
+#define LIVE_F1_SEEK_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/* Identifies a seek index, followed by the version */
+#define SEEK_MAGIC      "LIVEF1IX"
+#define SEEK_VERSION    2
+
+/* Appended to the recording's filename for its seek index */
+#define SEEK_SUFFIX     ".idx"
+
+/* Sizes of the index header and each entry */
+#define SEEK_HEADER_LEN 32
+#define SEEK_ENTRY_LEN  48
+
+/* Bytes at each end of the recording the index's checksum covers */
+#define SEEK_CHECK_LEN  4096
+
+/* Longest event packet kept with each seek point */
+#define SEEK_EVENT_LEN  24
+
+
+/**
+ * SeekPoint:
+ * @offset: offset of the key frame marker packet in the recording,
+ * @timestamp: time the block containing it was received, in nanoseconds,
+ * @frame: key frame number,
+ * @event: event start packet before the marker,
+ * @event_len: length of @event.
+ *
+ * Each key frame marker in the data stream is a point we can begin
+ * parsing from again, so long as we have the key frame it names; the
+ * key frame doesn't say which event it's for, so the last event start
+ * packet is kept too and parsed first.  They're stored little-endian as
+ * an eight byte offset and timestamp, then a four byte frame number and
+ * event packet length, and the event packet padded to SEEK_EVENT_LEN;
+ * the index begins with the magic, a four byte version and count, the
+ * eight byte size of the recording it was made from and the four byte
+ * CRC-32C of the first and last SEEK_CHECK_LEN bytes of it, then four
+ * bytes padding.
+ **/
+typedef struct {
+	off_t              offset;
+	unsigned long long timestamp;
+	unsigned int       frame;
+	unsigned char      event[SEEK_EVENT_LEN];
+	size_t             event_len;
+} SeekPoint;
+
+/**
+ * SeekScanner:
+ * @pbuf: packet seen so far,
+ * @pbuf_len: length of @pbuf,
+ * @offset: offset of the start of the packet in @pbuf,
+ * @timestamp: timestamp of the block it started in,
+ * @event: last event start packet seen,
+ * @event_len: length of @event,
+ * @points: seek points found,
+ * @npoints: number of @points,
+ * @sz: number of @points allocated.
+ *
+ * Holds what we know about the data stream while looking for key frame
+ * markers in it, which is only how far we are into the current packet;
+ * the headers aren't encrypted, so that's all we need.
+ **/
+typedef struct {
+	unsigned char       pbuf[129];
+	size_t              pbuf_len;
+	off_t               offset;
+	unsigned long long  timestamp;
+	unsigned char       event[SEEK_EVENT_LEN];
+	size_t              event_len;
+
+	SeekPoint          *points;
+	size_t              npoints, sz;
+} SeekScanner;
+
+
+SJR_BEGIN_EXTERN
+
+void       scan_seek_points (SeekScanner *scanner, const unsigned char *buf,
+			     size_t len, off_t offset,
+			     unsigned long long timestamp);
+
+SeekPoint *load_seek_index  (const char *filename,
+			     const unsigned char *map, off_t size,
+			     size_t *npoints);
+int        save_seek_index  (const char *filename,
+			     const unsigned char *map, off_t size,
+			     const SeekPoint *points, size_t npoints);
+
+size_t     find_seek_point  (const SeekPoint *points, size_t npoints,
+			     unsigned long long timestamp);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_SEEK_H */
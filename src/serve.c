@@ -0,0 +1,916 @@
+/* live-f1
+ *
+ * serve.c - serving the data stream and key frames to other clients
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/poll.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "serve.h"
+
+
+/* Size of the ring holding the stream; a quarter of it must cover a key
+ * frame interval for new clients to join straight away
+ */
+#define RING_SIZE (1024 * 1024)
+
+/* Clients further behind than this are evicted */
+#define MAX_LAG (RING_SIZE / 2)
+
+/* New clients join at the last mark if it's no further behind than
+ * this, leaving them room to catch up before they would be evicted
+ */
+#define MAX_JOIN (MAX_LAG / 2)
+
+/* Clients that haven't pinged for this many seconds are evicted, as are
+ * HTTP connections that have got nowhere for as long
+ */
+#define MAX_IDLE 120
+
+/* Longest HTTP request we accept (headers and body) */
+#define MAX_REQUEST 4096
+
+
+/**
+ * StreamClient:
+ * @next: next client in list,
+ * @fd: connected socket,
+ * @pos: position in the stream of the next byte to send,
+ * @waiting: client is waiting for the next mark to join at,
+ * @pinged: client has asked for a burst we've not yet sent,
+ * @last_ping: time of last ping,
+ * @pre: copy of the preamble still to be sent,
+ * @pre_len: number of bytes of @pre still to send,
+ * @idx: index in the poll array, or -1.
+ *
+ * A client of our data stream; data is sent straight out of the shared
+ * ring from @pos, so there's nothing to copy per client.
+ **/
+typedef struct stream_client {
+	struct stream_client *next;
+
+	int                   fd;
+	unsigned long long    pos;
+	int                   waiting;
+	int                   pinged;
+	time_t                last_ping;
+
+	unsigned char         pre[16];
+	size_t                pre_len;
+
+	int                   idx;
+} StreamClient;
+
+/**
+ * http_conn:
+ * @next: next connection in list,
+ * @fd: connected socket,
+ * @req: request received so far,
+ * @req_len: length of @req,
+ * @wait_kind: what the request is waiting for, or 0,
+ * @wait_arg: argument to @wait_kind,
+ * @resp: response to send,
+ * @resp_len: length of @resp,
+ * @resp_sent: number of bytes of @resp sent,
+ * @last_active: time anything was last read or sent,
+ * @idx: index in the poll array, or -1.
+ *
+ * A connection to our HTTP server, only one request is handled on each
+ * and the connection is closed after the response.
+ **/
+struct http_conn {
+	struct http_conn *next;
+
+	int               fd;
+	char              req[MAX_REQUEST + 1];
+	size_t            req_len;
+
+	int               wait_kind;
+	unsigned int      wait_arg;
+
+	unsigned char    *resp;
+	size_t            resp_len, resp_sent;
+	time_t            last_active;
+
+	int               idx;
+};
+
+
+/* Forward prototypes */
+static int  open_listener      (unsigned int port);
+static void accept_stream      (void);
+static void read_stream_client (StreamClient *client);
+static int  send_stream_client (StreamClient *client);
+static void close_stream_client (StreamClient *client);
+static void accept_http        (void);
+static void read_http_conn     (HttpConn *conn);
+static int  send_http_conn     (HttpConn *conn);
+static void close_http_conn    (HttpConn *conn);
+
+
+/* Stream ring, and absolute positions within the stream */
+static unsigned char      *ring = NULL;
+static unsigned long long  head = 0, join = 0;
+
+/* Sent to new clients before anything in the ring */
+static unsigned char       preamble[16];
+static size_t              preamble_len = 0;
+
+/* Listening sockets */
+static int                 stream_fd = -1, http_fd = -1;
+static int                 stream_idx = -1, http_idx = -1;
+
+/* Connected clients */
+static StreamClient       *clients = NULL;
+static unsigned int        nclients = 0;
+static HttpConn           *conns = NULL;
+static HttpHandler         http_handler = NULL;
+
+
+/**
+ * open_listener:
+ * @port: port to listen on.
+ *
+ * Creates a non-blocking socket listening for connections on @port on
+ * all addresses.
+ *
+ * Returns: listening socket or -1 on failure.
+ **/
+static int
+open_listener (unsigned int port)
+{
+	struct sockaddr_in addr;
+	int                sock, opt = 1;
+
+	sock = socket (PF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+
+	setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof (opt));
+	fcntl (sock, F_SETFL, O_NONBLOCK);
+	fcntl (sock, F_SETFD, FD_CLOEXEC);
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_ANY);
+	addr.sin_port = htons (port);
+
+	if ((bind (sock, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+	    || (listen (sock, 64) < 0)) {
+		close (sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/**
+ * serve_stream:
+ * @port: port to serve the data stream on.
+ *
+ * Begins listening for clients of the data stream, which is fed with
+ * stream_append().
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+serve_stream (unsigned int port)
+{
+	ring = malloc (RING_SIZE);
+	if (! ring)
+		abort ();
+
+	stream_fd = open_listener (port);
+	if (stream_fd < 0)
+		return 1;
+
+	info (1, _("Serving data stream on port %u\n"), port);
+
+	return 0;
+}
+
+/**
+ * stream_head:
+ *
+ * Returns: position in the stream of the next byte to be appended.
+ **/
+unsigned long long
+stream_head (void)
+{
+	return head;
+}
+
+/**
+ * stream_append:
+ * @buf: data to add,
+ * @len: length of @buf.
+ *
+ * Adds data to the end of the stream, it's sent to each client the next
+ * time they ping us.  Clients that have fallen too far behind to catch
+ * up before their data is overwritten are evicted.
+ **/
+void
+stream_append (const unsigned char *buf,
+	       size_t               len)
+{
+	StreamClient *client, *next;
+	size_t        off, chunk;
+
+	for (client = clients; client; client = next) {
+		next = client->next;
+
+		if ((! client->waiting)
+		    && ((head + len) - client->pos > MAX_LAG)) {
+			info (2, _("Evicting slow client\n"));
+			close_stream_client (client);
+		}
+	}
+
+	while (len) {
+		off = head % RING_SIZE;
+		chunk = MIN (len, RING_SIZE - off);
+
+		memcpy (ring + off, buf, chunk);
+		head += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+
+	for (client = clients; client; client = next) {
+		next = client->next;
+
+		if (client->pinged && send_stream_client (client))
+			close_stream_client (client);
+	}
+}
+
+/**
+ * stream_mark:
+ * @pos: position in the stream.
+ *
+ * Marks the position that new clients should begin receiving the
+ * stream from; this should be the start of a key frame marker since
+ * decryption begins again at that point.  Clients waiting for a mark
+ * begin here too.
+ **/
+void
+stream_mark (unsigned long long pos)
+{
+	StreamClient *client;
+
+	join = pos;
+
+	for (client = clients; client; client = client->next) {
+		if (! client->waiting)
+			continue;
+
+		client->waiting = 0;
+		client->pos = join;
+		memcpy (client->pre, preamble, preamble_len);
+		client->pre_len = preamble_len;
+	}
+}
+
+/**
+ * stream_restart:
+ *
+ * Disconnects all clients of the data stream, which will have to join
+ * again from the next mark; used when the source of the stream has
+ * restarted and what we've sent them can no longer be continued.
+ **/
+void
+stream_restart (void)
+{
+	while (clients)
+		close_stream_client (clients);
+
+	join = head;
+	preamble_len = 0;
+}
+
+/**
+ * stream_preamble:
+ * @buf: data to send,
+ * @len: length of @buf.
+ *
+ * Sets the data sent to new clients before the stream itself, usually
+ * the event start packet.
+ **/
+void
+stream_preamble (const unsigned char *buf,
+		 size_t               len)
+{
+	preamble_len = MIN (len, sizeof (preamble));
+	memcpy (preamble, buf, preamble_len);
+}
+
+/**
+ * stream_clients:
+ *
+ * Returns: number of clients connected to the data stream.
+ **/
+unsigned int
+stream_clients (void)
+{
+	return nclients;
+}
+
+/**
+ * serve_http:
+ * @port: port to serve on,
+ * @handler: function to call for each request.
+ *
+ * Begins listening for HTTP requests.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+serve_http (unsigned int port,
+	    HttpHandler  handler)
+{
+	http_fd = open_listener (port);
+	if (http_fd < 0)
+		return 1;
+
+	http_handler = handler;
+	info (1, _("Serving key frames on port %u\n"), port);
+
+	return 0;
+}
+
+/**
+ * http_respond:
+ * @conn: connection to respond on,
+ * @code: HTTP status code,
+ * @headers: additional headers, each terminated by CRLF, or NULL,
+ * @body: response body,
+ * @len: length of @body.
+ *
+ * Queues the response to be sent, after which the connection is closed.
+ **/
+void
+http_respond (HttpConn            *conn,
+	      int                  code,
+	      const char          *headers,
+	      const unsigned char *body,
+	      size_t               len)
+{
+	char hdr[512];
+	int  hdr_len;
+
+	hdr_len = snprintf (hdr, sizeof (hdr),
+			    "HTTP/1.0 %d %s\r\n"
+			    "Content-Type: application/octet-stream\r\n"
+			    "Content-Length: %lu\r\n"
+			    "Connection: close\r\n"
+			    "%s\r\n",
+			    code, (code < 400 ? "OK" : "Error"),
+			    (unsigned long) len, headers ? headers : "");
+	if (hdr_len >= sizeof (hdr))
+		hdr_len = sizeof (hdr) - 1;
+
+	conn->resp = malloc (hdr_len + len);
+	if (! conn->resp)
+		abort ();
+
+	memcpy (conn->resp, hdr, hdr_len);
+	if (len)
+		memcpy (conn->resp + hdr_len, body, len);
+
+	conn->resp_len = hdr_len + len;
+	conn->resp_sent = 0;
+	conn->wait_kind = 0;
+}
+
+/**
+ * http_defer:
+ * @conn: connection to defer,
+ * @kind: what the request is waiting for,
+ * @arg: argument to @kind.
+ *
+ * Puts the request aside until a call to http_respond_deferred() with
+ * the same @kind and @arg; @kind must be non-zero.
+ **/
+void
+http_defer (HttpConn     *conn,
+	    int           kind,
+	    unsigned int  arg)
+{
+	conn->wait_kind = kind;
+	conn->wait_arg = arg;
+}
+
+/**
+ * http_respond_deferred:
+ * @kind: what the requests were waiting for,
+ * @arg: argument to @kind,
+ * @code: HTTP status code,
+ * @headers: additional headers, each terminated by CRLF, or NULL,
+ * @body: response body,
+ * @len: length of @body.
+ *
+ * Responds to all requests deferred with @kind and @arg.
+ **/
+void
+http_respond_deferred (int                  kind,
+		       unsigned int         arg,
+		       int                  code,
+		       const char          *headers,
+		       const unsigned char *body,
+		       size_t               len)
+{
+	HttpConn *conn;
+
+	for (conn = conns; conn; conn = conn->next)
+		if ((conn->wait_kind == kind) && (conn->wait_arg == arg))
+			http_respond (conn, code, headers, body, len);
+}
+
+/**
+ * serve_nfds:
+ *
+ * Returns: number of entries serve_fill() needs in the poll array.
+ **/
+int
+serve_nfds (void)
+{
+	StreamClient *client;
+	HttpConn     *conn;
+	int           n = 2;
+
+	for (client = clients; client; client = client->next)
+		n++;
+	for (conn = conns; conn; conn = conn->next)
+		n++;
+
+	return n;
+}
+
+/**
+ * serve_fill:
+ * @fds: poll array to fill.
+ *
+ * Fills @fds with the sockets we need to watch, and the events we need
+ * to watch them for; the array must have serve_nfds() entries and be
+ * passed to serve_events() after polling.
+ **/
+void
+serve_fill (struct pollfd *fds)
+{
+	StreamClient *client;
+	HttpConn     *conn;
+	int           n = 0;
+
+	stream_idx = http_idx = -1;
+
+	if (stream_fd >= 0) {
+		fds[n].fd = stream_fd;
+		fds[n].events = POLLIN;
+		stream_idx = n++;
+	}
+	if (http_fd >= 0) {
+		fds[n].fd = http_fd;
+		fds[n].events = POLLIN;
+		http_idx = n++;
+	}
+
+	for (client = clients; client; client = client->next) {
+		fds[n].fd = client->fd;
+		fds[n].events = POLLIN;
+		if (client->pre_len
+		    || (client->pinged && (! client->waiting)
+			&& (client->pos < head)))
+			fds[n].events |= POLLOUT;
+		client->idx = n++;
+	}
+
+	for (conn = conns; conn; conn = conn->next) {
+		fds[n].fd = conn->fd;
+		if (conn->resp) {
+			fds[n].events = POLLOUT;
+		} else if (conn->wait_kind) {
+			fds[n].events = 0;
+		} else {
+			fds[n].events = POLLIN;
+		}
+		conn->idx = n++;
+	}
+
+	while (n < serve_nfds ())
+		fds[n++].fd = -1;
+}
+
+/**
+ * serve_events:
+ * @fds: poll array filled by serve_fill().
+ *
+ * Handles any events on our sockets, accepting new clients, answering
+ * pings and requests, and evicting idle clients.
+ **/
+void
+serve_events (const struct pollfd *fds)
+{
+	StreamClient *client, *cnext;
+	HttpConn     *conn, *hnext;
+	time_t        now;
+
+	now = time (NULL);
+
+	for (client = clients; client; client = cnext) {
+		cnext = client->next;
+
+		if (client->idx < 0)
+			continue;
+
+		if (fds[client->idx].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			close_stream_client (client);
+			continue;
+		}
+
+		if (fds[client->idx].revents & POLLIN)
+			read_stream_client (client);
+
+		if ((client->fd < 0)
+		    || (client->pinged && send_stream_client (client))) {
+			close_stream_client (client);
+		} else if (now - client->last_ping > MAX_IDLE) {
+			info (2, _("Evicting idle client\n"));
+			close_stream_client (client);
+		}
+	}
+
+	for (conn = conns; conn; conn = hnext) {
+		hnext = conn->next;
+
+		if (now - conn->last_active > MAX_IDLE) {
+			info (2, _("Evicting idle HTTP connection\n"));
+			close_http_conn (conn);
+			continue;
+		}
+
+		if (conn->idx < 0)
+			continue;
+
+		if (fds[conn->idx].revents & (POLLERR | POLLNVAL)) {
+			close_http_conn (conn);
+		} else if (conn->wait_kind) {
+			if (fds[conn->idx].revents & POLLHUP)
+				close_http_conn (conn);
+		} else if (conn->resp) {
+			if (send_http_conn (conn))
+				close_http_conn (conn);
+		} else if (fds[conn->idx].revents & (POLLIN | POLLHUP)) {
+			read_http_conn (conn);
+			if (conn->fd < 0) {
+				close_http_conn (conn);
+			} else if (conn->resp && send_http_conn (conn)) {
+				close_http_conn (conn);
+			}
+		}
+	}
+
+	if ((stream_idx >= 0) && (fds[stream_idx].revents & POLLIN))
+		accept_stream ();
+	if ((http_idx >= 0) && (fds[http_idx].revents & POLLIN))
+		accept_http ();
+}
+
+/**
+ * accept_stream:
+ *
+ * Accepts a new client of the data stream, sending it the preamble and
+ * everything since the last mark as its initial burst.  If the mark is
+ * too far behind for the client to catch up, the client waits for the
+ * next one instead; it can't join anywhere else because the data can
+ * only be decrypted from a mark onwards.
+ **/
+static void
+accept_stream (void)
+{
+	StreamClient *client;
+	int           sock;
+
+	sock = accept (stream_fd, NULL, NULL);
+	if (sock < 0)
+		return;
+
+	fcntl (sock, F_SETFL, O_NONBLOCK);
+	fcntl (sock, F_SETFD, FD_CLOEXEC);
+
+	client = malloc (sizeof (StreamClient));
+	if (! client)
+		abort ();
+
+	memset (client, 0, sizeof (StreamClient));
+	client->fd = sock;
+	client->pinged = 1;
+	client->last_ping = time (NULL);
+	client->idx = -1;
+
+	if (head - join > MAX_JOIN) {
+		client->waiting = 1;
+		client->pos = head;
+	} else {
+		client->pos = join;
+		memcpy (client->pre, preamble, preamble_len);
+		client->pre_len = preamble_len;
+	}
+
+	client->next = clients;
+	clients = client;
+	nclients++;
+
+	info (2, _("New stream client (%u connected)\n"), nclients);
+}
+
+/**
+ * read_stream_client:
+ * @client: client to read from.
+ *
+ * Reads pings from the client; any byte counts.  Sets the fd to -1 if
+ * the client has gone away.
+ **/
+static void
+read_stream_client (StreamClient *client)
+{
+	unsigned char buf[64];
+	ssize_t       len;
+
+	len = read (client->fd, buf, sizeof (buf));
+	if (len > 0) {
+		client->pinged = 1;
+		client->last_ping = time (NULL);
+	} else if ((len == 0)
+		   || ((errno != EAGAIN) && (errno != EINTR))) {
+		close (client->fd);
+		client->fd = -1;
+	}
+}
+
+/**
+ * send_stream_client:
+ * @client: client to send to.
+ *
+ * Sends the client the preamble if it's still due, and then as much of
+ * the stream as it hasn't had yet, straight from the ring; nothing is
+ * sent to a client still waiting for a mark.
+ *
+ * Returns: 0 on success, non-zero if the client should be closed.
+ **/
+static int
+send_stream_client (StreamClient *client)
+{
+	struct msghdr msg;
+	struct iovec  iov[3];
+	size_t        off, len;
+	ssize_t       sent;
+	int           niov = 0;
+
+	if (client->waiting)
+		return 0;
+
+	if (client->pre_len) {
+		iov[niov].iov_base = client->pre;
+		iov[niov].iov_len = client->pre_len;
+		niov++;
+	}
+
+	len = head - client->pos;
+	if (len) {
+		off = client->pos % RING_SIZE;
+
+		iov[niov].iov_base = ring + off;
+		iov[niov].iov_len = MIN (len, RING_SIZE - off);
+		len -= iov[niov++].iov_len;
+		if (len) {
+			iov[niov].iov_base = ring;
+			iov[niov].iov_len = len;
+			niov++;
+		}
+	}
+
+	if (! niov)
+		return 0;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+
+	sent = sendmsg (client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (sent < 0)
+		return ((errno != EAGAIN) && (errno != EINTR));
+
+	if (client->pre_len) {
+		len = MIN ((size_t) sent, client->pre_len);
+		memmove (client->pre, client->pre + len, client->pre_len - len);
+		client->pre_len -= len;
+		sent -= len;
+	}
+
+	client->pos += sent;
+	if ((! client->pre_len) && (client->pos == head))
+		client->pinged = 0;
+
+	return 0;
+}
+
+/**
+ * close_stream_client:
+ * @client: client to close.
+ *
+ * Disconnects the client and frees it.
+ **/
+static void
+close_stream_client (StreamClient *client)
+{
+	StreamClient **ptr;
+
+	for (ptr = &clients; *ptr; ptr = &(*ptr)->next) {
+		if (*ptr == client) {
+			*ptr = client->next;
+			break;
+		}
+	}
+
+	if (client->fd >= 0)
+		close (client->fd);
+	free (client);
+
+	nclients--;
+	info (2, _("Stream client gone (%u connected)\n"), nclients);
+}
+
+/**
+ * accept_http:
+ *
+ * Accepts a new HTTP connection.
+ **/
+static void
+accept_http (void)
+{
+	HttpConn *conn;
+	int       sock;
+
+	sock = accept (http_fd, NULL, NULL);
+	if (sock < 0)
+		return;
+
+	fcntl (sock, F_SETFL, O_NONBLOCK);
+	fcntl (sock, F_SETFD, FD_CLOEXEC);
+
+	conn = malloc (sizeof (HttpConn));
+	if (! conn)
+		abort ();
+
+	memset (conn, 0, sizeof (HttpConn));
+	conn->fd = sock;
+	conn->resp = NULL;
+	conn->last_active = time (NULL);
+	conn->idx = -1;
+
+	conn->next = conns;
+	conns = conn;
+}
+
+/**
+ * read_http_conn:
+ * @conn: connection to read from.
+ *
+ * Reads more of the request, once the headers and any body have been
+ * received the handler is called.  Sets the fd to -1 if the client has
+ * gone away or sent something we can't handle.
+ **/
+static void
+read_http_conn (HttpConn *conn)
+{
+	char    *end, *ptr, method[8], path[1024];
+	size_t   body_len = 0;
+	ssize_t  len;
+
+	if (conn->wait_kind)
+		return;
+
+	len = read (conn->fd, conn->req + conn->req_len,
+		    MAX_REQUEST - conn->req_len);
+	if (len <= 0) {
+		if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+			return;
+
+		close (conn->fd);
+		conn->fd = -1;
+		return;
+	}
+
+	conn->req_len += len;
+	conn->req[conn->req_len] = '\0';
+	conn->last_active = time (NULL);
+
+	end = strstr (conn->req, "\r\n\r\n");
+	if (! end) {
+		if (conn->req_len == MAX_REQUEST) {
+			close (conn->fd);
+			conn->fd = -1;
+		}
+		return;
+	}
+
+	for (ptr = conn->req; ptr < end; ptr = strstr (ptr, "\r\n") + 2)
+		if (! strncasecmp (ptr, "Content-Length:", 15))
+			body_len = strtoul (ptr + 15, NULL, 10);
+
+	if (conn->req_len < (end - conn->req) + 4 + body_len)
+		return;
+
+	if (sscanf (conn->req, "%7s %1023s", method, path) != 2) {
+		close (conn->fd);
+		conn->fd = -1;
+		return;
+	}
+
+	info (3, _("HTTP request: %s %s\n"), method, path);
+	http_handler (conn, method, path);
+}
+
+/**
+ * send_http_conn:
+ * @conn: connection to send to.
+ *
+ * Sends as much of the response as we can.
+ *
+ * Returns: 0 if more is to be sent, non-zero if finished or failed.
+ **/
+static int
+send_http_conn (HttpConn *conn)
+{
+	ssize_t sent;
+
+	sent = send (conn->fd, conn->resp + conn->resp_sent,
+		     conn->resp_len - conn->resp_sent,
+		     MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (sent < 0)
+		return ((errno != EAGAIN) && (errno != EINTR));
+
+	conn->resp_sent += sent;
+	conn->last_active = time (NULL);
+
+	return (conn->resp_sent == conn->resp_len);
+}
+
+/**
+ * close_http_conn:
+ * @conn: connection to close.
+ *
+ * Closes the connection and frees it.
+ **/
+static void
+close_http_conn (HttpConn *conn)
+{
+	HttpConn **ptr;
+
+	for (ptr = &conns; *ptr; ptr = &(*ptr)->next) {
+		if (*ptr == conn) {
+			*ptr = conn->next;
+			break;
+		}
+	}
+
+	if (conn->fd >= 0)
+		close (conn->fd);
+	if (conn->resp)
+		free (conn->resp);
+	free (conn);
+}
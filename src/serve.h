@@ -0,0 +1,82 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_SERVE_H
+#define LIVE_F1_SERVE_H
+
+#include <sys/poll.h>
+
+#include "live-f1.h"
+
+
+/* Port the data stream is served on */
+#define STREAM_PORT 4321
+
+/* Port key frames and keys are served on */
+#define HTTP_PORT   80
+
+
+/**
+ * HttpConn:
+ *
+ * Opaque structure for a connection to our HTTP server.
+ **/
+typedef struct http_conn HttpConn;
+
+/**
+ * HttpHandler:
+ * @conn: connection the request arrived on,
+ * @method: request method,
+ * @path: request path, including any query string.
+ *
+ * Called for each complete request, the handler must either answer it
+ * with http_respond() or put it aside with http_defer().
+ **/
+typedef void (*HttpHandler) (HttpConn *conn, const char *method,
+			     const char *path);
+
+
+SJR_BEGIN_EXTERN
+
+int                serve_stream    (unsigned int port);
+unsigned long long stream_head     (void);
+void               stream_append   (const unsigned char *buf, size_t len);
+void               stream_mark     (unsigned long long pos);
+void               stream_restart  (void);
+void               stream_preamble (const unsigned char *buf, size_t len);
+unsigned int       stream_clients  (void);
+
+int                serve_http      (unsigned int port, HttpHandler handler);
+void               http_respond    (HttpConn *conn, int code,
+				    const char *headers,
+				    const unsigned char *body, size_t len);
+void               http_defer      (HttpConn *conn, int kind,
+				    unsigned int arg);
+void               http_respond_deferred (int kind, unsigned int arg,
+					  int code, const char *headers,
+					  const unsigned char *body,
+					  size_t len);
+
+int                serve_nfds      (void);
+void               serve_fill      (struct pollfd *fds);
+void               serve_events    (const struct pollfd *fds);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_SERVE_H */
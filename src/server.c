@@ -0,0 +1,812 @@
+/* live-f1
+ *
+ * server.c - stand-in for the live timing server
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#if HAVE_GETOPT_H
+# include <getopt.h>
+#else /* HAVE_GETOPT_H */
+# include <unistd.h>
+# define getopt_long(argc, argv, optstring, longopts, longindex) \
+		getopt ((argc), (argv), (optstring))
+#endif /* HAVE_GETOPT_H */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "http.h"
+#include "packet.h"
+#include "record.h"
+#include "serve.h"
+#include "wire.h"
+
+
+/* Rate at which the stream is released when there's nothing better */
+#define DEFAULT_RATE 2048
+
+/* How often we release more of the stream, in milliseconds */
+#define TICK 100
+
+/* What a deferred response is waiting for */
+#define WAIT_LATENCY 1
+
+
+/**
+ * MarkKind:
+ *
+ * Kinds of packet we need to know the position of in the stream.
+ **/
+typedef enum {
+	MARK_EVENT,
+	MARK_KEY_FRAME,
+	MARK_TIMESTAMP
+} MarkKind;
+
+/**
+ * Mark:
+ * @kind: kind of packet,
+ * @offset: offset of the packet in the stream,
+ * @len: length of the packet including header,
+ * @value: event or frame number, or timestamp in seconds.
+ *
+ * Position of an interesting packet, found when the stream is loaded so
+ * we needn't parse it again as it's served.
+ **/
+typedef struct {
+	MarkKind     kind;
+	size_t       offset, len;
+	unsigned int value;
+} Mark;
+
+/**
+ * Delayed:
+ * @next: next response in list,
+ * @id: identifier passed to http_defer(),
+ * @due: time the response should be sent,
+ * @code: HTTP status code,
+ * @headers: additional headers,
+ * @body: response body,
+ * @len: length of @body.
+ *
+ * Response held back to simulate a slow server.
+ **/
+typedef struct delayed {
+	struct delayed  *next;
+	unsigned int     id;
+	struct timespec  due;
+
+	int              code;
+	const char      *headers;
+	unsigned char   *body;
+	size_t           len;
+} Delayed;
+
+
+/* Forward prototypes */
+static void print_version  (void);
+static void print_usage    (void);
+static int  load_stream    (const char *filename);
+static int  unframe_stream (unsigned int *salt);
+static void release_stream (void);
+static long elapsed_ms     (const struct timespec *since);
+static void server_request (HttpConn *conn, const char *method,
+			    const char *path);
+static void respond        (HttpConn *conn, int code, const char *headers,
+			    const unsigned char *body, size_t len);
+static void send_delayed   (void);
+
+
+/* Program name */
+const char *program_name = NULL;
+
+/* How verbose to be */
+static int verbosity = 0;
+
+/* Command-line options */
+static const char opts[] = "vk:l:";
+static const struct option longopts[] = {
+	{ "key",	required_argument, NULL, 'k' },
+	{ "laps",	required_argument, NULL, 'l' },
+	{ "latency",	required_argument, NULL, 0400 + 'l' },
+	{ "rate",	required_argument, NULL, 0400 + 'r' },
+	{ "speed",	required_argument, NULL, 0400 + 's' },
+	{ "loop",	no_argument, NULL, 0400 + 'o' },
+	{ "verbose",	no_argument, NULL, 'v' },
+	{ "help",	no_argument, NULL, 0400 + 'h' },
+	{ "version",	no_argument, NULL, 0400 + 'v' },
+	{ NULL,		no_argument, NULL, 0 }
+};
+
+/* Settings */
+static unsigned int  key = 0;
+static unsigned int  total_laps = 0;
+static unsigned int  latency = 0;
+static unsigned int  rate = 0;
+static double        speed = 1.0;
+static int           loop = 0;
+
+/* Stream being served, and the interesting packets within it */
+static unsigned char *stream = NULL;
+static size_t         stream_len = 0;
+static Mark          *marks = NULL;
+static size_t         nmarks = 0;
+static int            have_timestamps = 0;
+static unsigned int   first_timestamp = 0;
+
+/* How much of the stream has been released, and when we started */
+static size_t          released = 0, next_mark = 0;
+static struct timespec started;
+
+/* Most recently released event number and key frame mark */
+static unsigned int    event_no = 0;
+static Mark           *latest_frame = NULL;
+
+/* Responses waiting for their latency to pass */
+static Delayed        *delayed = NULL;
+static unsigned int    next_delayed = 0;
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	struct pollfd *fds = NULL;
+	int            opt, nfds;
+
+	setlocale (LC_ALL, "");
+	bindtextdomain (PACKAGE, LOCALEDIR);
+	textdomain (PACKAGE);
+
+	program_name = argv[0];
+
+	while ((opt = getopt_long (argc, argv, opts, longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'k':
+			key = strtoul (optarg, NULL, 16);
+			break;
+		case 'l':
+			total_laps = strtoul (optarg, NULL, 10);
+			break;
+		case 0400 + 'l':
+			latency = strtoul (optarg, NULL, 10);
+			break;
+		case 0400 + 'r':
+			rate = strtoul (optarg, NULL, 10);
+			break;
+		case 0400 + 's':
+			speed = strtod (optarg, NULL);
+			if (speed <= 0.0)
+				speed = 1.0;
+			break;
+		case 0400 + 'o':
+			loop = 1;
+			break;
+		case 'v':
+			verbosity++;
+			break;
+		case 0400 + 'h':
+			print_usage ();
+			return 0;
+		case 0400 + 'v':
+			print_version ();
+			return 0;
+		case '?':
+			fprintf (stderr,
+				 _("Try `%s --help' for more information.\n"),
+				 program_name);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("expected name of stream file"));
+		fprintf (stderr,
+			 _("Try `%s --help' for more information.\n"),
+			 program_name);
+		return 1;
+	}
+
+	if (load_stream (argv[optind]))
+		return 1;
+
+	if (serve_stream (STREAM_PORT)
+	    || serve_http (HTTP_PORT, server_request)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("unable to listen for clients"), strerror (errno));
+		return 1;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &started);
+
+	for (;;) {
+		int ret;
+
+		release_stream ();
+		send_delayed ();
+
+		nfds = serve_nfds ();
+		fds = realloc (fds, sizeof (struct pollfd) * nfds);
+		if (! fds)
+			abort ();
+
+		serve_fill (fds);
+
+		ret = poll (fds, nfds, TICK);
+		if ((ret < 0) && (errno != EINTR)) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 _("error waiting for clients"),
+				 strerror (errno));
+			return 2;
+		} else if (ret < 0) {
+			continue;
+		}
+
+		serve_events (fds);
+	}
+}
+
+/**
+ * info:
+ * @irrelevance: minimum verbosity level to output the message,
+ * @format: format string for vprintf.
+ *
+ * Print the formatted message to standard output if verbosity is high
+ * enough.
+ **/
+int
+info (int         irrelevance,
+      const char *format, ...)
+{
+	va_list ap;
+	int     ret;
+
+	if (verbosity < irrelevance)
+		return 0;
+
+	va_start (ap, format);
+	ret = vprintf (format, ap);
+	va_end (ap);
+
+	fflush (stdout);
+
+	return ret;
+}
+
+/**
+ * print_version:
+ *
+ * Print the program version to standard output.
+ **/
+static void
+print_version (void)
+{
+	printf ("%s-server %s\n", PACKAGE, VERSION);
+}
+
+/**
+ * print_usage:
+ *
+ * Print the program usage to standard output.
+ **/
+static void
+print_usage (void)
+{
+	printf (_("Usage: %s [OPTION]... FILE\n"), program_name);
+	printf (_("Serves a data stream saved in FILE as if it were the live timing\n"
+		  "server, for testing clients without the real thing.  FILE may be\n"
+		  "a raw dump of the stream, or a recording made with --record.\n"));
+	printf ("\n");
+	printf (_("Options:\n"
+		  "  -k, --key=KEY              decryption key the stream was encrypted\n"
+		  "                             with, in hexadecimal.\n"
+		  "  -l, --laps=LAPS            number of laps in the race.\n"
+		  "      --latency=MS           delay each HTTP response by MS milliseconds.\n"
+		  "      --rate=BYTES           release the stream at BYTES per second\n"
+		  "                             rather than following its timestamps.\n"
+		  "      --speed=FACTOR         follow the timestamps FACTOR times faster\n"
+		  "                             than real time.\n"
+		  "      --loop                 start again from the beginning when the\n"
+		  "                             end of the stream is reached.\n"
+		  "  -v, --verbose              increase verbosity for each time repeated.\n"
+		  "      --help                 display this help and exit.\n"
+		  "      --version              output version information and exit.\n"));
+	printf ("\n");
+	printf (_("Report bugs to <%s>\n"), PACKAGE_BUGREPORT);
+}
+
+
+/**
+ * load_stream:
+ * @filename: file to load.
+ *
+ * Reads the data stream from @filename and splits it into packets,
+ * noting where the event start, key frame and timestamp packets are;
+ * the timestamps can only be used if we know the key.  @filename may
+ * be a raw dump of the stream, or a recording made with --record.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+load_stream (const char *filename)
+{
+	struct stat   statbuf;
+	unsigned int  salt = CRYPTO_SEED;
+	size_t        off = 0;
+	int           fd;
+
+	fd = open (filename, O_RDONLY);
+	if ((fd < 0) || (fstat (fd, &statbuf) < 0)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 strerror (errno));
+		if (fd >= 0)
+			close (fd);
+		return 1;
+	}
+
+	stream = malloc (statbuf.st_size + 1);
+	if (! stream)
+		abort ();
+
+	while (stream_len < statbuf.st_size) {
+		ssize_t len;
+
+		len = read (fd, stream + stream_len,
+			    statbuf.st_size - stream_len);
+		if ((len < 0) && (errno == EINTR)) {
+			continue;
+		} else if (len <= 0) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 filename, (len < 0 ? strerror (errno)
+					    : _("file truncated")));
+			close (fd);
+			return 1;
+		}
+
+		stream_len += len;
+	}
+
+	close (fd);
+
+	if ((stream_len >= RECORD_HEADER_LEN)
+	    && (! memcmp (stream, RECORD_MAGIC, 8))
+	    && unframe_stream (&salt)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 _("not a recording"));
+		return 1;
+	}
+
+	while (off + 2 <= stream_len) {
+		unsigned char  payload[128];
+		Packet         packet;
+		Mark          *mark = NULL;
+		unsigned int   number, i;
+		int            encrypted;
+
+		encrypted = decode_header (&packet, stream + off);
+		if (packet.len < 0)
+			packet.len = 0;
+		if (off + 2 + packet.len > stream_len)
+			break;
+
+		memcpy (payload, stream + off + 2, packet.len);
+		if (encrypted > 0)
+			crypt_bytes (key, &salt, payload, packet.len);
+
+		if (! packet.car) {
+			switch ((SystemPacketType) packet.type) {
+			case SYS_EVENT_ID:
+				number = 0;
+				for (i = 1; i < packet.len; i++) {
+					number *= 10;
+					number += payload[i] - '0';
+				}
+
+				salt = CRYPTO_SEED;
+				marks = realloc (marks, sizeof (Mark) * (nmarks + 1));
+				mark = &marks[nmarks++];
+				mark->kind = MARK_EVENT;
+				mark->value = number;
+				break;
+			case SYS_KEY_FRAME:
+				number = 0;
+				i = packet.len;
+				while (i) {
+					number <<= 8;
+					number |= payload[--i];
+				}
+
+				salt = CRYPTO_SEED;
+				marks = realloc (marks, sizeof (Mark) * (nmarks + 1));
+				mark = &marks[nmarks++];
+				mark->kind = MARK_KEY_FRAME;
+				mark->value = number;
+				break;
+			case SYS_TIMESTAMP:
+				if (! key)
+					break;
+
+				marks = realloc (marks, sizeof (Mark) * (nmarks + 1));
+				mark = &marks[nmarks++];
+				mark->kind = MARK_TIMESTAMP;
+				mark->value = payload[0] | (payload[1] << 8);
+				if (! have_timestamps)
+					first_timestamp = mark->value;
+				have_timestamps = 1;
+				break;
+			default:
+				break;
+			}
+		}
+
+		if (mark) {
+			mark->offset = off;
+			mark->len = packet.len + 2;
+		}
+
+		off += packet.len + 2;
+	}
+
+	/* Don't serve a partial packet at the end */
+	stream_len = off;
+
+	info (1, _("Loaded %lu bytes, %lu marks\n"),
+	      (unsigned long) stream_len, (unsigned long) nmarks);
+	if (! have_timestamps && ! rate)
+		rate = DEFAULT_RATE;
+
+	return 0;
+}
+
+/**
+ * unframe_stream:
+ * @salt: pointer to the salt to begin decrypting with.
+ *
+ * Replaces a recording loaded into the stream with just the data stream
+ * frames from it, up to any damage at the end.  The key is taken from
+ * the recording if we weren't given one; a flight recorder dump begins
+ * in the middle of the stream, so its crypt frame gives the key and
+ * the salt to start with as well.  Key frames fetched by the client
+ * are left out, we serve them from the stream as always.
+ *
+ * Returns: 0 on success, non-zero if it's not a recording we can read.
+ **/
+static int
+unframe_stream (unsigned int *salt)
+{
+	size_t end, off = RECORD_HEADER_LEN, len = 0;
+
+	if (get_le (stream + 8, 4) != RECORD_VERSION)
+		return 1;
+
+	end = recover_record (stream, stream_len);
+	if (end < stream_len)
+		info (1, _("Ignoring %lu damaged bytes at end of recording\n"),
+		      (unsigned long) (stream_len - end));
+
+	while (off + FRAME_HEADER_LEN <= end) {
+		unsigned char *data;
+		Frame          frame;
+
+		decode_frame (&frame, stream + off);
+		data = stream + off + FRAME_HEADER_LEN;
+		if (frame.len > end - off - FRAME_HEADER_LEN)
+			break;
+
+		switch (frame.source) {
+		case SOURCE_STREAM:
+			memmove (stream + len, data, frame.len);
+			len += frame.len;
+			break;
+		case SOURCE_KEY:
+			if ((! key) && (frame.len >= 4))
+				key = get_le (data, 4);
+			break;
+		case SOURCE_CRYPT:
+			if ((! len) && (frame.len >= 8)) {
+				if (! key)
+					key = get_le (data, 4);
+				*salt = get_le (data + 4, 4);
+			}
+			break;
+		default:
+			break;
+		}
+
+		off += FRAME_HEADER_LEN + frame.len;
+	}
+
+	stream_len = len;
+	return 0;
+}
+
+/**
+ * release_stream:
+ *
+ * Adds as much of the stream as is now due to the data sent to clients,
+ * either following the timestamps in the stream or at a fixed rate.
+ **/
+static void
+release_stream (void)
+{
+	size_t target;
+	long   ms;
+
+	ms = elapsed_ms (&started);
+
+	if (rate) {
+		target = MIN (stream_len, (unsigned long long) rate * ms / 1000);
+	} else {
+		unsigned int now;
+		size_t       i;
+
+		/* Release up to, but not including, the first timestamp
+		 * that is still in the future.
+		 */
+		now = first_timestamp + (unsigned int) (ms * speed / 1000);
+		target = stream_len;
+		for (i = next_mark; i < nmarks; i++) {
+			if ((marks[i].kind == MARK_TIMESTAMP)
+			    && (marks[i].value > now)) {
+				target = marks[i].offset;
+				break;
+			}
+		}
+	}
+
+	while (released < target) {
+		size_t end = target;
+
+		/* Stop at each interesting packet so new clients join at
+		 * the right place, and know which event it is.
+		 */
+		if ((next_mark < nmarks) && (marks[next_mark].offset < end))
+			end = marks[next_mark].offset;
+
+		if (end > released) {
+			stream_append (stream + released, end - released);
+			released = end;
+			continue;
+		}
+
+		switch (marks[next_mark].kind) {
+		case MARK_EVENT:
+			info (2, _("Event #%u begins\n"), marks[next_mark].value);
+			event_no = marks[next_mark].value;
+			stream_preamble (stream + released, marks[next_mark].len);
+			break;
+		case MARK_KEY_FRAME:
+			info (3, _("Key frame %u\n"), marks[next_mark].value);
+			latest_frame = &marks[next_mark];
+			stream_mark (stream_head ());
+			break;
+		default:
+			break;
+		}
+
+		end = released + marks[next_mark].len;
+		stream_append (stream + released, end - released);
+		released = end;
+		next_mark++;
+	}
+
+	if ((released == stream_len) && loop) {
+		info (2, _("Starting again from the beginning\n"));
+		released = 0;
+		next_mark = 0;
+		clock_gettime (CLOCK_MONOTONIC, &started);
+	}
+}
+
+/**
+ * elapsed_ms:
+ * @since: earlier time.
+ *
+ * Returns: number of milliseconds since @since.
+ **/
+static long
+elapsed_ms (const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return ((now.tv_sec - since->tv_sec) * 1000
+		+ (now.tv_nsec - since->tv_nsec) / 1000000);
+}
+
+
+/**
+ * server_request:
+ * @conn: connection the request arrived on,
+ * @method: request method,
+ * @path: request path.
+ *
+ * Answers the HTTP requests the client makes; any login succeeds, and
+ * key frames are the part of the stream from the key frame marker to
+ * the next one (or as far as has been released).
+ **/
+static void
+server_request (HttpConn   *conn,
+		const char *method,
+		const char *path)
+{
+	unsigned int  number;
+	char          body[16];
+	Mark         *frame = NULL;
+	size_t        i, end;
+
+	if (! strncmp (path, LOGIN_URL, strlen (LOGIN_URL))) {
+		respond (conn, 200, "Set-Cookie: USER=stand-in; path=/\r\n",
+			 NULL, 0);
+
+	} else if ((sscanf (path, KEY_URL_BASE "%u.asp", &number) == 1)
+		   && (number == event_no)) {
+		sprintf (body, "%08x", key);
+		respond (conn, 200, NULL, (unsigned char *) body,
+			 strlen (body));
+
+	} else if (! strncmp (path, LAPS_URL, strlen (LAPS_URL))) {
+		sprintf (body, "%u", total_laps);
+		respond (conn, 200, NULL, (unsigned char *) body,
+			 strlen (body));
+
+	} else if (! strcmp (path, KEYFRAME_URL_PREFIX ".bin")) {
+		frame = latest_frame;
+		if (! frame) {
+			respond (conn, 404, NULL, NULL, 0);
+			return;
+		}
+
+	} else if (sscanf (path, KEYFRAME_URL_PREFIX "_%u.bin",
+			   &number) == 1) {
+		for (i = 0; i < next_mark; i++)
+			if ((marks[i].kind == MARK_KEY_FRAME)
+			    && (marks[i].value == number))
+				frame = &marks[i];
+
+		if (! frame) {
+			respond (conn, 404, NULL, NULL, 0);
+			return;
+		}
+
+	} else {
+		respond (conn, 404, NULL, NULL, 0);
+	}
+
+	if (! frame)
+		return;
+
+	end = released;
+	for (i = frame - marks + 1; i < nmarks; i++) {
+		if ((marks[i].kind == MARK_KEY_FRAME)
+		    || (marks[i].kind == MARK_EVENT)) {
+			end = MIN (end, marks[i].offset);
+			break;
+		}
+	}
+
+	/* Don't give the client half a packet */
+	for (i = frame->offset; i < end; ) {
+		Packet packet;
+
+		decode_header (&packet, stream + i);
+		if (i + 2 + MAX (packet.len, 0) > end)
+			break;
+
+		i += 2 + MAX (packet.len, 0);
+	}
+	end = i;
+
+	respond (conn, 200, NULL, stream + frame->offset,
+		 end - frame->offset);
+}
+
+/**
+ * respond:
+ * @conn: connection to respond on,
+ * @code: HTTP status code,
+ * @headers: additional headers or NULL,
+ * @body: response body,
+ * @len: length of @body.
+ *
+ * Responds to the request, after the configured latency has passed.
+ **/
+static void
+respond (HttpConn            *conn,
+	 int                  code,
+	 const char          *headers,
+	 const unsigned char *body,
+	 size_t               len)
+{
+	Delayed **ptr, *resp;
+
+	if (! latency) {
+		http_respond (conn, code, headers, body, len);
+		return;
+	}
+
+	resp = malloc (sizeof (Delayed));
+	if (! resp)
+		abort ();
+
+	resp->id = next_delayed++;
+	clock_gettime (CLOCK_MONOTONIC, &resp->due);
+	resp->due.tv_sec += latency / 1000;
+	resp->due.tv_nsec += (latency % 1000) * 1000000;
+	if (resp->due.tv_nsec >= 1000000000) {
+		resp->due.tv_sec++;
+		resp->due.tv_nsec -= 1000000000;
+	}
+
+	resp->code = code;
+	resp->headers = headers;
+	resp->body = malloc (len + 1);
+	if (! resp->body)
+		abort ();
+	memcpy (resp->body, body, len);
+	resp->len = len;
+
+	/* Latency is constant, so the list stays in order */
+	resp->next = NULL;
+	for (ptr = &delayed; *ptr; ptr = &(*ptr)->next)
+		;
+	*ptr = resp;
+
+	http_defer (conn, WAIT_LATENCY, resp->id);
+}
+
+/**
+ * send_delayed:
+ *
+ * Sends the delayed responses that are now due.
+ **/
+static void
+send_delayed (void)
+{
+	Delayed *resp;
+
+	while ((resp = delayed) != NULL) {
+		if (elapsed_ms (&resp->due) < 0)
+			break;
+
+		http_respond_deferred (WAIT_LATENCY, resp->id, resp->code,
+				       resp->headers, resp->body, resp->len);
+
+		delayed = resp->next;
+		free (resp->body);
+		free (resp);
+	}
+}
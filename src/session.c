@@ -0,0 +1,401 @@
+/* live-f1
+ *
+ * session.c - memory for the state of an event
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "intern.h"
+#include "packet.h"
+#include "session.h"
+#include "trend.h"
+
+
+/* Rounds @_n up so that anything can be stored after it */
+#define ARENA_ALIGN(_n) (((_n) + 15) & ~(size_t) 15)
+
+/* Size of everything an event's state can need */
+#define ARENA_SIZE (ARENA_ALIGN (FL_CAR_LEN) + ARENA_ALIGN (FL_TIME_LEN) \
+		    + ARENA_ALIGN (FL_LAP_LEN)				    \
+		    + ARENA_ALIGN (sizeof (int) * CAR_SLOTS)		    \
+		    + ARENA_ALIGN (sizeof (CarTable)))
+
+
+/**
+ * Arena:
+ * @used: bytes handed out since the last reset,
+ * @mem: memory handed out from.
+ *
+ * Memory for the state of an event, handed out in order and all taken
+ * back at once when the next event begins.  It's sized for the most
+ * cars there can be, so never runs out.
+ **/
+struct Arena {
+	size_t        used;
+	unsigned char mem[ARENA_SIZE] __attribute__ ((aligned (16)));
+};
+
+
+/* Forward prototypes */
+static void *arena_alloc     (Arena *arena, size_t size);
+static void  recycle_strings (CurrentState *state);
+
+
+/* Number of times we've gone to the heap for an event's state, been
+ * asked to forget it, and had a car join
+ */
+static unsigned long heap_allocs = 0, resets = 0, joined = 0;
+
+/* Atoms that changed something, and those that were repeats */
+static unsigned long applied = 0, suppressed = 0;
+
+
+/**
+ * reset_session:
+ * @state: application state structure.
+ *
+ * Forgets the fastest lap, the cars and the strings of the event in
+ * @state, ready for the next one.  The memory they're kept in is
+ * allocated from the heap the first time, and after that only taken
+ * back and handed out again, which takes the same time however many
+ * cars there were.
+ **/
+void
+reset_session (CurrentState *state)
+{
+	Arena *arena;
+
+	if (! state->arena) {
+		state->arena = malloc (sizeof (Arena));
+		if (! state->arena)
+			abort ();
+
+		heap_allocs++;
+	}
+
+	if (state->strings) {
+		clear_string_pool (state->strings);
+	} else {
+		state->strings = new_string_pool (SESSION_STRINGS);
+	}
+
+	arena = state->arena;
+	arena->used = 0;
+	resets++;
+
+	state->fl_car = arena_alloc (arena, FL_CAR_LEN);
+	state->fl_time = arena_alloc (arena, FL_TIME_LEN);
+	state->fl_lap = arena_alloc (arena, FL_LAP_LEN);
+	memset (state->fl_car, 0, FL_CAR_LEN);
+	memset (state->fl_time, 0, FL_TIME_LEN);
+	memset (state->fl_lap, 0, FL_LAP_LEN);
+
+	state->fl_driver = EMPTY_STRING;
+
+	state->num_cars = 0;
+	state->car_position = arena_alloc (arena, sizeof (int) * CAR_SLOTS);
+	state->cars = arena_alloc (arena, sizeof (CarTable));
+}
+
+/**
+ * free_session:
+ * @state: application state structure.
+ *
+ * Frees the memory the state of the event in @state is kept in, and
+ * the histories kept for it, before @state itself is freed.
+ **/
+void
+free_session (CurrentState *state)
+{
+	if (state->strings)
+		free_string_pool (state->strings);
+	free (state->arena);
+	free_trends (state);
+
+	state->strings = NULL;
+	state->arena = NULL;
+	state->cars = NULL;
+	state->car_position = NULL;
+	state->num_cars = 0;
+}
+
+/**
+ * set_num_cars:
+ * @state: application state structure,
+ * @num_cars: number of cars there now are.
+ *
+ * Grows or shrinks the table of information about each car, new cars
+ * having nothing known about them; there can't be more than MAX_CARS.
+ **/
+void
+set_num_cars (CurrentState *state,
+	      int           num_cars)
+{
+	CarTable *cars;
+	int       i, j;
+
+	if (! state->arena)
+		reset_session (state);
+
+	cars = state->cars;
+	num_cars = MIN (MAX (num_cars, 0), MAX_CARS);
+	for (i = state->num_cars; i < num_cars; i++) {
+		state->car_position[i] = 0;
+		for (j = 0; j < LAST_CAR_PACKET; j++) {
+			cars->value[j][i] = NO_VALUE;
+			cars->colour[j][i] = 0;
+			cars->text[j][i] = EMPTY_STRING;
+		}
+
+		joined++;
+	}
+
+	state->num_cars = num_cars;
+}
+
+/**
+ * set_atom:
+ * @state: application state structure,
+ * @car: car number,
+ * @type: atom type,
+ * @colour: colour of the atom,
+ * @text: text of the atom, or NULL to only change the colour.
+ *
+ * Stores an atom in the table of information about each car, working
+ * out what number its text reads as.  @car must be one the table has
+ * room for, and text longer than the atoms have room for is cut short.
+ *
+ * The server sends the same atoms over and over again, so the text is
+ * interned and only its handle kept; an atom with the same handle and
+ * colour as before changes nothing, and is counted and otherwise
+ * ignored.
+ *
+ * Returns: TRUE if the atom changed, FALSE if it was the same.
+ **/
+int
+set_atom (CurrentState *state,
+	  int           car,
+	  int           type,
+	  int           colour,
+	  const char   *text)
+{
+	CarTable    *cars = state->cars;
+	unsigned int handle;
+
+	handle = (text ? intern_text (state, text, ATOM_TEXT_LEN)
+		  : cars->text[type][car - 1]);
+
+	if ((cars->colour[type][car - 1] == colour)
+	    && (cars->text[type][car - 1] == handle)) {
+		suppressed++;
+		return FALSE;
+	}
+
+	cars->colour[type][car - 1] = colour;
+	cars->text[type][car - 1] = handle;
+	cars->value[type][car - 1] = string_value (state->strings, handle);
+
+	applied++;
+	return TRUE;
+}
+
+/**
+ * get_atom:
+ * @state: application state structure,
+ * @car: car number,
+ * @type: atom type,
+ * @atom: structure to fill.
+ *
+ * Copies the colour and text of an atom out of the table of
+ * information about each car.
+ **/
+void
+get_atom (const CurrentState *state,
+	  int                 car,
+	  int                 type,
+	  CarAtom            *atom)
+{
+	atom->data = state->cars->colour[type][car - 1];
+	memcpy (atom->text, atom_text (state, car, type), ATOM_TEXT_LEN);
+}
+
+/**
+ * atom_text:
+ * @state: application state structure,
+ * @car: car number,
+ * @type: atom type.
+ *
+ * Returns: text of the atom, which is padded with zeros to
+ * ATOM_TEXT_LEN and only good until the next atom is set.
+ **/
+const char *
+atom_text (const CurrentState *state,
+	   int                 car,
+	   int                 type)
+{
+	return string_text (state->strings, state->cars->text[type][car - 1]);
+}
+
+/**
+ * intern_text:
+ * @state: application state structure,
+ * @text: string to look up,
+ * @len: most characters of @text to use.
+ *
+ * Interns @text in the strings of @state, see intern_string(); if
+ * there's no room left, the strings no longer in @state are forgotten
+ * first, so the pool never goes back to the heap however many
+ * different times and gaps an event has.  Handles not kept in @state
+ * aren't good after this is called.
+ *
+ * Returns: handle of the string.
+ **/
+unsigned int
+intern_text (CurrentState *state,
+	     const char   *text,
+	     size_t        len)
+{
+	if (string_pool_full (state->strings))
+		recycle_strings (state);
+
+	return intern_string (state->strings, text, len);
+}
+
+/**
+ * atom_value:
+ * @text: text of an atom.
+ *
+ * Works out what number @text reads as, if it's made up only of
+ * digits with perhaps a decimal point and minutes before a colon, as
+ * positions, laps and times are; "1:24.460" reads as 84.46 seconds.
+ *
+ * Returns: the number in thousandths, or NO_VALUE.
+ **/
+int
+atom_value (const char *text)
+{
+	long long whole = 0;
+	int       frac = 0, scale = 1000, digits = 0, point = 0;
+
+	for (; *text; text++) {
+		if ((*text >= '0') && (*text <= '9')) {
+			if (point) {
+				if (scale > 1) {
+					scale /= 10;
+					frac += (*text - '0') * scale;
+				}
+			} else {
+				whole = whole * 10 + (*text - '0');
+			}
+			digits++;
+		} else if ((*text == ':') && digits && (! point)) {
+			whole *= 60;
+		} else if ((*text == '.') && digits && (! point)) {
+			point = 1;
+		} else {
+			return NO_VALUE;
+		}
+	}
+
+	if ((! digits) || (whole > INT_MAX / 1000 - 1))
+		return NO_VALUE;
+
+	return whole * 1000 + frac;
+}
+
+/**
+ * session_stats:
+ * @stats: structure to fill.
+ *
+ * Reports how much work keeping the state of events has taken; there
+ * should be one heap allocation for the arena of each state structure,
+ * however many events and cars there have been.  Its pool of strings
+ * takes two more, counted by string_stats().
+ **/
+void
+session_stats (SessionStats *stats)
+{
+	stats->allocs = heap_allocs;
+	stats->resets = resets;
+	stats->cars = joined;
+	stats->applied = applied;
+	stats->suppressed = suppressed;
+}
+
+/**
+ * recycle_strings:
+ * @state: application state structure.
+ *
+ * Sweeps the strings of @state, keeping those of the cars' atoms and the
+ * fastest lap driver, and changes their handles to where they've been
+ * moved.
+ **/
+static void
+recycle_strings (CurrentState *state)
+{
+	StringPool *pool = state->strings;
+	CarTable   *cars = state->cars;
+	int         i, j;
+
+	for (j = 0; j < LAST_CAR_PACKET; j++)
+		for (i = 0; i < state->num_cars; i++)
+			mark_string (pool, cars->text[j][i]);
+	mark_string (pool, state->fl_driver);
+
+	sweep_strings (pool);
+
+	for (j = 0; j < LAST_CAR_PACKET; j++)
+		for (i = 0; i < state->num_cars; i++)
+			cars->text[j][i] = moved_string (pool, cars->text[j][i]);
+	state->fl_driver = moved_string (pool, state->fl_driver);
+}
+
+/**
+ * arena_alloc:
+ * @arena: arena to allocate from,
+ * @size: bytes needed.
+ *
+ * Hands out the next @size bytes of @arena, which aren't cleared.
+ *
+ * Returns: pointer to the memory.
+ **/
+static void *
+arena_alloc (Arena  *arena,
+	     size_t  size)
+{
+	void *ptr;
+
+	size = ARENA_ALIGN (size);
+	if (arena->used + size > ARENA_SIZE)
+		abort ();
+
+	ptr = arena->mem + arena->used;
+	arena->used += size;
+
+	return ptr;
+}
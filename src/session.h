@@ -0,0 +1,106 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_SESSION_H
+#define LIVE_F1_SESSION_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+#include "packet.h"
+
+
+/* Most cars there can be, the car number is five bits */
+#define MAX_CARS 31
+
+/* Lengths of the fastest lap strings */
+#define FL_CAR_LEN    3
+#define FL_DRIVER_LEN 15
+#define FL_TIME_LEN   9
+#define FL_LAP_LEN    3
+
+/* Room for the text of an atom, including the terminator */
+#define ATOM_TEXT_LEN 16
+
+/* Length of each column of the car table, the most cars there can be
+ * rounded up to a power of two
+ */
+#define CAR_SLOTS 32
+
+/* What an atom's value is when its text isn't a number */
+#define NO_VALUE -1
+
+/* Strings the pool of each state has room for; when it's full, those
+ * no longer in the state are forgotten, so it never grows
+ */
+#define SESSION_STRINGS 4096
+
+
+/**
+ * CarTable:
+ * @value: number each atom's text reads as, in thousandths, or NO_VALUE,
+ * @colour: colour of each atom,
+ * @text: handle of the text of each atom in the state's strings (see
+ *   atom_text()).
+ *
+ * Everything known about the cars, indexed by atom type and then by
+ * car number less one, so that each column of the board is an array of
+ * its own; finding the quickest of a column of lap or sector times is
+ * a walk along CAR_SLOTS ints rather than from one car to the next.
+ **/
+struct CarTable {
+	int           value[LAST_CAR_PACKET][CAR_SLOTS];
+	unsigned char colour[LAST_CAR_PACKET][CAR_SLOTS];
+	unsigned int  text[LAST_CAR_PACKET][CAR_SLOTS];
+};
+
+/**
+ * SessionStats:
+ * @allocs: heap allocations made for the state of events,
+ * @resets: times the state of an event has been forgotten,
+ * @cars: cars that have joined events,
+ * @applied: atoms that changed the state of a car,
+ * @suppressed: atoms ignored because they changed nothing.
+ *
+ * How much work keeping the state of events has taken.
+ **/
+typedef struct {
+	unsigned long allocs, resets, cars;
+	unsigned long applied, suppressed;
+} SessionStats;
+
+
+SJR_BEGIN_EXTERN
+
+void        reset_session (CurrentState *state);
+void        free_session  (CurrentState *state);
+void        set_num_cars  (CurrentState *state, int num_cars);
+int         set_atom      (CurrentState *state, int car, int type,
+			   int colour, const char *text);
+void        get_atom      (const CurrentState *state, int car, int type,
+			   CarAtom *atom);
+const char *atom_text     (const CurrentState *state, int car, int type);
+unsigned int intern_text  (CurrentState *state, const char *text,
+			   size_t len);
+int         atom_value    (const char *text);
+void        session_stats (SessionStats *stats);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_SESSION_H */
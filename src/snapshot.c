@@ -0,0 +1,522 @@
+/* live-f1
+ *
+ * snapshot.c - state saved to disk to restart from
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "clock.h"
+#include "crc32c.h"
+#include "display.h"
+#include "intern.h"
+#include "job.h"
+#include "packet.h"
+#include "publish.h"
+#include "record.h"
+#include "session.h"
+#include "snapshot.h"
+
+
+/* Most a snapshot can hold: the numbers, fastest lap and positions,
+ * and then every atom of every car with the longest text
+ */
+#define SNAPSHOT_BODY_LEN (64 + FL_CAR_LEN + FL_DRIVER_LEN + FL_TIME_LEN \
+			   + FL_LAP_LEN + MAX_CARS			 \
+			   + (MAX_CARS * LAST_CAR_PACKET * (3 + ATOM_TEXT_LEN)))
+
+
+/* Forward prototypes */
+static void   save_job      (Job *job);
+static void   saved_job     (Job *job);
+static int    save_snapshot (const StateView *view);
+static size_t encode_state  (const StateView *view, unsigned char *buf);
+static int    decode_state  (CurrentState *state, const unsigned char *buf,
+			     size_t len);
+static int    state_ready   (const CurrentState *state);
+static void   live_again    (CurrentState *state);
+
+
+/* Snapshot file, and the temporary file it's written to first */
+static char *snapshot_name = NULL, *snapshot_tmp = NULL;
+
+/* State restored from the snapshot, shown until the live one is ready */
+static CurrentState *restored = NULL;
+
+/* Whether the live state has been given the restored event and key */
+static int resumed = 0;
+
+/* Session time the last snapshot was taken, and whether it's still
+ * being saved
+ */
+static time_t last_snapshot = 0;
+static int    saving = 0;
+
+/* Snapshot as it's read */
+static unsigned char body[SNAPSHOT_BODY_LEN];
+
+
+/**
+ * open_snapshot:
+ * @filename: file to keep the snapshot in.
+ *
+ * Begins taking snapshots of the state, every SNAPSHOT_INTERVAL seconds
+ * of the session while it's complete, so that restore_snapshot() can
+ * put the board straight back after a restart.
+ **/
+void
+open_snapshot (const char *filename)
+{
+	snapshot_name = strdup (filename);
+	snapshot_tmp = malloc (strlen (filename) + 5);
+	if ((! snapshot_name) || (! snapshot_tmp))
+		abort ();
+
+	sprintf (snapshot_tmp, "%s.tmp", filename);
+}
+
+/**
+ * restore_snapshot:
+ * @state: application state structure.
+ *
+ * Reads the snapshot, if there is one less than SNAPSHOT_MAX_AGE
+ * seconds old, and shows the board from it straight away.  It stays on
+ * the board until the live state has caught up (see snapshot_state()),
+ * and resume_snapshot() gives the live state its event and key.
+ *
+ * Returns: 0 if the board was restored, non-zero if not.
+ **/
+int
+restore_snapshot (const CurrentState *state)
+{
+	unsigned char hdr[SNAPSHOT_HEADER_LEN];
+	size_t        len;
+	time_t        age;
+	int           fd, ret = 1;
+
+	if (! snapshot_name)
+		return 1;
+
+	fd = open (snapshot_name, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	if (read (fd, hdr, sizeof (hdr)) != sizeof (hdr))
+		goto error;
+	if (memcmp (hdr, SNAPSHOT_MAGIC, 8)
+	    || (get_le (hdr + 8, 4) != SNAPSHOT_VERSION))
+		goto error;
+
+	len = get_le (hdr + 12, 4);
+	age = time (NULL) - (time_t) get_le (hdr + 20, 8);
+	if ((len > sizeof (body)) || (age < 0) || (age > SNAPSHOT_MAX_AGE))
+		goto error;
+
+	if ((read (fd, body, len) != len)
+	    || (crc32c (0, body, len) != get_le (hdr + 16, 4)))
+		goto error;
+
+	restored = calloc (1, sizeof (CurrentState));
+	if (! restored)
+		abort ();
+
+	if (decode_state (restored, body, len)) {
+		free_session (restored);
+		free (restored);
+		restored = NULL;
+		goto error;
+	}
+
+	/* The session clock carries on from when it was saved */
+	if (restored->remaining_time > age) {
+		restored->remaining_time -= age;
+	} else {
+		restored->remaining_time = 0;
+	}
+
+	show_state (restored);
+	clear_board (restored);
+	update_status (restored);
+	flush_display ();
+
+	info (1, _("Restored the board from %ld seconds ago in %ld ms\n"),
+	      (long) age, (long) ((real_ns () - state->start_time) / 1000000));
+	ret = 0;
+error:
+	close (fd);
+	return ret;
+}
+
+/**
+ * resume_snapshot:
+ * @state: application state structure.
+ *
+ * Gives the live state the event and decryption key of the restored
+ * one, the first time it connects after restoring; if the data stream
+ * is still on the same event the key needn't be asked for again.
+ **/
+void
+resume_snapshot (CurrentState *state)
+{
+	if ((! restored) || resumed)
+		return;
+
+	state->event_no = restored->event_no;
+	state->key = restored->key;
+	resumed = 1;
+}
+
+/**
+ * snapshot_state:
+ * @state: application state structure,
+ * @now: take a snapshot now, rather than only when one is due.
+ *
+ * Called after each block of the data stream, once it's been published
+ * (see publish_state()).  Until the live state has caught up with the
+ * restored one, which is when it has a key frame and the key (or has
+ * moved on to another event), the restored one is left on the board;
+ * after that a snapshot of the published state is saved every
+ * SNAPSHOT_INTERVAL seconds, in the background so that the disk never
+ * holds up the data stream.  When @now is given, it's saved before
+ * returning, unless one is being saved already.
+ **/
+void
+snapshot_state (CurrentState *state,
+		int           now)
+{
+	if (! snapshot_name)
+		return;
+
+	if (restored) {
+		if ((state->event_no && (state->event_no != restored->event_no))
+		    || state_ready (state))
+			live_again (state);
+		return;
+	}
+
+	if (saving || (! state_ready (state))
+	    || ((! now) && (now_seconds () - last_snapshot
+			    < SNAPSHOT_INTERVAL)))
+		return;
+
+	last_snapshot = now_seconds ();
+
+	if (now) {
+		const StateView *view;
+		int              err = 0;
+
+		view = acquire_state ();
+		if (view) {
+			err = save_snapshot (view);
+			release_state (view);
+		}
+
+		if (err)
+			info (1, _("Unable to save snapshot: %s\n"),
+			      strerror (err));
+	} else if (start_job (state, save_job, saved_job, 0)) {
+		saving = 1;
+	}
+}
+
+
+/**
+ * save_job:
+ * @job: job structure.
+ *
+ * Saves a snapshot of the published state in the background.
+ **/
+static void
+save_job (Job *job)
+{
+	const StateView *view;
+
+	view = acquire_state ();
+	if (! view)
+		return;
+
+	job->result = save_snapshot (view);
+	release_state (view);
+}
+
+/**
+ * saved_job:
+ * @job: job structure.
+ *
+ * Called from the main loop once a snapshot has been saved.
+ **/
+static void
+saved_job (Job *job)
+{
+	saving = 0;
+	if (job->result)
+		info (1, _("Unable to save snapshot: %s\n"),
+		      strerror (job->result));
+}
+
+/**
+ * save_snapshot:
+ * @view: published copy of the state.
+ *
+ * Writes a snapshot of @view to a temporary file and renames it over
+ * the old one, so there's always a whole snapshot to restore.  It isn't
+ * synced to disk; the checksum catches one that didn't make it.
+ *
+ * Returns: 0 on success, or an errno value.
+ **/
+static int
+save_snapshot (const StateView *view)
+{
+	unsigned char hdr[SNAPSHOT_HEADER_LEN], buf[SNAPSHOT_BODY_LEN];
+	size_t        len;
+	int           fd, err = 0;
+
+	len = encode_state (view, buf);
+
+	memset (hdr, 0, sizeof (hdr));
+	memcpy (hdr, SNAPSHOT_MAGIC, 8);
+	put_le (hdr + 8, SNAPSHOT_VERSION, 4);
+	put_le (hdr + 12, len, 4);
+	put_le (hdr + 16, crc32c (0, buf, len), 4);
+	put_le (hdr + 20, time (NULL), 8);
+
+	/* It holds the decryption key, so is only for us to read */
+	fd = open (snapshot_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return errno;
+
+	if ((write (fd, hdr, sizeof (hdr)) != sizeof (hdr))
+	    || (write (fd, buf, len) != len))
+		err = errno ? errno : EIO;
+	if (close (fd) && (! err))
+		err = errno;
+
+	if ((! err) && rename (snapshot_tmp, snapshot_name))
+		err = errno;
+	if (err)
+		unlink (snapshot_tmp);
+
+	return err;
+}
+
+/**
+ * encode_state:
+ * @view: published copy of the state,
+ * @buf: buffer of SNAPSHOT_BODY_LEN bytes to fill.
+ *
+ * Encodes the event, key and key frame, the numbers on the status
+ * window, the fastest lap and the positions, and then each atom there's
+ * anything in as its car, type, colour, length and text.
+ *
+ * Returns: number of bytes used.
+ **/
+static size_t
+encode_state (const StateView *view,
+	      unsigned char   *buf)
+{
+	unsigned char *ptr = buf, *count_ptr;
+	time_t         remaining = view->remaining_time;
+	unsigned int   count = 0;
+	int            i, j;
+
+	if (view->epoch_time)
+		remaining -= now_seconds () - view->epoch_time;
+
+	put_le (ptr, view->event_no, 4);
+	put_le (ptr + 4, view->event_type, 1);
+	put_le (ptr + 5, view->flag, 1);
+	put_le (ptr + 6, view->key, 4);
+	put_le (ptr + 10, view->frame, 4);
+	put_le (ptr + 14, MAX (remaining, 0), 4);
+	put_le (ptr + 18, view->epoch_time ? 1 : 0, 1);
+	put_le (ptr + 19, view->laps_completed, 2);
+	put_le (ptr + 21, view->total_laps, 2);
+	put_le (ptr + 23, view->track_temp, 4);
+	put_le (ptr + 27, view->air_temp, 4);
+	put_le (ptr + 31, view->humidity, 4);
+	put_le (ptr + 35, view->wind_speed, 4);
+	put_le (ptr + 39, view->wind_direction, 4);
+	put_le (ptr + 43, view->pressure, 4);
+	ptr += 47;
+
+	memcpy (ptr, view->fl_car, FL_CAR_LEN);
+	ptr += FL_CAR_LEN;
+	memcpy (ptr, view->fl_driver, FL_DRIVER_LEN);
+	ptr += FL_DRIVER_LEN;
+	memcpy (ptr, view->fl_time, FL_TIME_LEN);
+	ptr += FL_TIME_LEN;
+	memcpy (ptr, view->fl_lap, FL_LAP_LEN);
+	ptr += FL_LAP_LEN;
+
+	*(ptr++) = view->num_cars;
+	for (i = 0; i < view->num_cars; i++)
+		*(ptr++) = view->car_position[i];
+
+	/* Filled in once we know how many atoms there are */
+	count_ptr = ptr;
+	ptr += 2;
+
+	for (j = 0; j < LAST_CAR_PACKET; j++) {
+		for (i = 0; i < view->num_cars; i++) {
+			const char *text = view->text[j][i];
+			size_t      len = strlen (text);
+
+			if ((! len) && (! view->colour[j][i]))
+				continue;
+
+			*(ptr++) = i + 1;
+			*(ptr++) = j;
+			*(ptr++) = view->colour[j][i];
+			*(ptr++) = len;
+			memcpy (ptr, text, len);
+			ptr += len;
+			count++;
+		}
+	}
+
+	put_le (count_ptr, count, 2);
+
+	return ptr - buf;
+}
+
+/**
+ * decode_state:
+ * @state: state structure to fill,
+ * @buf: snapshot encoded by encode_state(),
+ * @len: length of @buf.
+ *
+ * Fills @state from a snapshot, its session clock carrying on from
+ * now if it was running.
+ *
+ * Returns: 0 on success, non-zero if the snapshot doesn't make sense.
+ **/
+static int
+decode_state (CurrentState        *state,
+	      const unsigned char *buf,
+	      size_t               len)
+{
+	const unsigned char *ptr = buf, *end = buf + len;
+	char                 text[ATOM_TEXT_LEN];
+	unsigned int         count;
+	int                  i;
+
+	if (len < 47 + FL_CAR_LEN + FL_DRIVER_LEN + FL_TIME_LEN + FL_LAP_LEN
+	    + 1)
+		return 1;
+
+	reset_session (state);
+
+	state->event_no = get_le (ptr, 4);
+	state->event_type = get_le (ptr + 4, 1);
+	state->flag = get_le (ptr + 5, 1);
+	state->key = get_le (ptr + 6, 4);
+	state->frame = get_le (ptr + 10, 4);
+	state->remaining_time = get_le (ptr + 14, 4);
+	state->epoch_time = get_le (ptr + 18, 1) ? now_seconds () : 0;
+	state->laps_completed = get_le (ptr + 19, 2);
+	state->total_laps = get_le (ptr + 21, 2);
+	state->track_temp = (int) get_le (ptr + 23, 4);
+	state->air_temp = (int) get_le (ptr + 27, 4);
+	state->humidity = (int) get_le (ptr + 31, 4);
+	state->wind_speed = (int) get_le (ptr + 35, 4);
+	state->wind_direction = (int) get_le (ptr + 39, 4);
+	state->pressure = (int) get_le (ptr + 43, 4);
+	ptr += 47;
+
+	memcpy (state->fl_car, ptr, FL_CAR_LEN);
+	ptr += FL_CAR_LEN;
+	state->fl_driver = intern_text (state, (const char *) ptr,
+					FL_DRIVER_LEN);
+	ptr += FL_DRIVER_LEN;
+	memcpy (state->fl_time, ptr, FL_TIME_LEN);
+	ptr += FL_TIME_LEN;
+	memcpy (state->fl_lap, ptr, FL_LAP_LEN);
+	ptr += FL_LAP_LEN;
+
+	if ((*ptr > MAX_CARS) || (end - ptr < 1 + *ptr + 2))
+		return 1;
+
+	set_num_cars (state, *(ptr++));
+	for (i = 0; i < state->num_cars; i++)
+		state->car_position[i] = *(ptr++);
+
+	count = get_le (ptr, 2);
+	ptr += 2;
+
+	while (count--) {
+		if ((end - ptr < 4) || (end - ptr < 4 + ptr[3])
+		    || (ptr[0] < 1) || (ptr[0] > state->num_cars)
+		    || (ptr[1] >= LAST_CAR_PACKET)
+		    || (ptr[3] >= ATOM_TEXT_LEN))
+			return 1;
+
+		memcpy (text, ptr + 4, ptr[3]);
+		text[ptr[3]] = 0;
+		set_atom (state, ptr[0], ptr[1], ptr[2], text);
+		ptr += 4 + ptr[3];
+	}
+
+	return 0;
+}
+
+/**
+ * state_ready:
+ * @state: application state structure.
+ *
+ * Returns: TRUE if @state has had a key frame and can be decrypted.
+ **/
+static int
+state_ready (const CurrentState *state)
+{
+	return (state->frame && state->key && (! state->key_pending)
+		&& state->num_cars);
+}
+
+/**
+ * live_again:
+ * @state: application state structure.
+ *
+ * Replaces the restored state on the board with the live one, and
+ * forgets the restored one.
+ **/
+static void
+live_again (CurrentState *state)
+{
+	info (2, _("Live board caught up with the restored one\n"));
+
+	show_state (state);
+
+	free_session (restored);
+	free (restored);
+	restored = NULL;
+	last_snapshot = now_seconds ();
+}
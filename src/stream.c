@@ -31,46 +31,65 @@
 #include <errno.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "live-f1.h"
+#include "clock.h"
 #include "display.h"
+#include "export.h"
+#include "flight.h"
+#include "job.h"
 #include "packet.h"
+#include "record.h"
 #include "stream.h"
+#include "timeshift.h"
+#include "wire.h"
 
 
-/* Encryption seed */
-#define CRYPTO_SEED 0x55555555
+/* Maximum number of packets queued while waiting for the key */
+#define PACKET_QUEUE_SIZE 2048
 
-/* Which car the packet is for */
-#define PACKET_CAR(_p) ((_p)[0] & 0x1f)
+/* Milliseconds without data before pinging the server */
+#define PING_INTERVAL 1000
 
-/* Which type of packet it is */
-#define PACKET_TYPE(_p) (((_p)[0] >> 5) | (((_p)[1] & 0x01) << 3))
 
-/* Data from a long packet */
-#define LONG_PACKET_DATA(_p) 0
+/**
+ * QueuedPacket:
+ * @offset: number of encrypted bytes since the salt was reset,
+ * @packet: packet with encrypted payload.
+ *
+ * Encrypted packet received while we didn't have the decryption key.
+ **/
+typedef struct {
+	unsigned int offset;
+	Packet       packet;
+} QueuedPacket;
 
-/* Data from a short packet */
-#define SHORT_PACKET_DATA(_p) (((_p)[1] & 0x0e) >> 1)
 
-/* Data from a special packet */
-#define SPECIAL_PACKET_DATA(_p) ((_p)[1] >> 1)
+/* Forward prototypes */
+static int  next_packet  (CurrentState *state, Packet *packet,
+			  int *encrypted, const unsigned char **buf,
+			  size_t *buf_len);
+static void queue_packet (CurrentState *state, const Packet *packet);
+static int  recv_block   (int sock, unsigned char *buf, size_t len,
+			  struct timespec *ts);
 
-/* Length of the packet if it's one of the long ones */
-#define LONG_PACKET_LEN(_p) ((_p)[1] >> 1)
 
-/* Length of the packet if it's one of the short ones */
-#define SHORT_PACKET_LEN(_p) (((_p)[1] & 0xf0) == 0xf0 ? -1 : ((_p)[1] >> 4))
+/* Number of encrypted bytes since the salt was reset */
+static unsigned int crypt_offset = 0;
 
-/* Length of the packet if it's a special one */
-#define SPECIAL_PACKET_LEN(_p) 0
+/* Packet being put together from the blocks it arrived in */
+static unsigned char pbuf[129];
+static size_t        pbuf_len = 0;
 
+/* Packets waiting for the decryption key */
+static QueuedPacket *queue = NULL;
+static unsigned int  queue_start = 0, queue_len = 0, queue_dropped = 0;
 
-/* Forward prototypes */
-static int next_packet (CurrentState *state, Packet *packet,
-			const unsigned char **buf, size_t *buf_len);
+/* Number of packets parsed, for deciding when to take a checkpoint */
+static unsigned long long packets = 0;
 
 
 /**
@@ -131,6 +150,16 @@ open_stream (const char   *hostname,
 	if (sock >= 0)
 		info (2, _("Connected to %s.\n"), addr->ai_canonname);
 
+#ifdef SO_TIMESTAMPNS
+	/* Have the kernel tell us when each block arrived */
+	if ((sock >= 0) && recording ()) {
+		int opt = 1;
+
+		setsockopt (sock, SOL_SOCKET, SO_TIMESTAMPNS,
+			    &opt, sizeof (opt));
+	}
+#endif /* SO_TIMESTAMPNS */
+
 	freeaddrinfo (res);
 	return sock;
 }
@@ -150,22 +179,40 @@ open_stream (const char   *hostname,
 int
 read_stream (CurrentState *state, int sock)
 {
-	struct pollfd poll_fd;
-	static int    timer = 0;
-	int           numr, len;
-
-	poll_fd.fd = sock;
-	poll_fd.events = POLLIN;
-	poll_fd.revents = 0;
+	static unsigned long long last_active = 0;
+	struct pollfd             poll_fd[2];
+	int                       numr, len;
+
+	if (! last_active)
+		last_active = now_ns ();
+
+	poll_fd[0].fd = sock;
+	poll_fd[0].events = POLLIN;
+	poll_fd[0].revents = 0;
+
+	/* Background jobs finishing */
+	poll_fd[1].fd = job_fd ();
+	poll_fd[1].events = POLLIN;
+	poll_fd[1].revents = 0;
+
+	numr = poll (poll_fd, 2, 100);
+	if ((numr > 0) && (poll_fd[1].revents & POLLIN)) {
+		finish_jobs ();
+		if (! (poll_fd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			return 1;
+	}
 
-	numr = poll (&poll_fd, 1, 100);
 	if (numr > 0) {
-		unsigned char buf[512];
+		unsigned char   buf[512];
+		struct timespec ts;
 
-		len = read (sock, buf, sizeof (buf));
+		len = recv_block (sock, buf, sizeof (buf), &ts);
 		if (len > 0) {
+			flight_frame (state, SOURCE_STREAM, 0, 0, &ts, buf, len);
+			record_frame (SOURCE_STREAM, 0, 0, &ts, buf, len);
 			parse_stream_block (state, buf, len);
-			timer = 0;
+			timeshift_block (&ts, buf, len);
+			last_active = now_ns ();
 			return len;
 		} else if ((len < 0) && (errno != ECONNRESET)) {
 			if (errno == EINTR)
@@ -183,7 +230,12 @@ read_stream (CurrentState *state, int sock)
 	} else {
 		char buf[1];
 
-		if (timer++ < 10)
+		/* Nothing's happening, so now's the time to hand
+		 * whatever we've recorded to be written out.
+		 */
+		flush_record ();
+
+		if (now_ns () - last_active < PING_INTERVAL * 1000000ULL)
 			return 1;
 
 		/* Wake the server up */
@@ -191,7 +243,7 @@ read_stream (CurrentState *state, int sock)
 		len = write (sock, buf, sizeof (buf));
 		if (len > 0) {
 			update_time (state);
-			timer = 0;
+			last_active = now_ns ();
 			return len;
 		} else if ((len < 0) && (errno != EPIPE)) {
 			if (errno == EINTR)
@@ -204,6 +256,83 @@ read_stream (CurrentState *state, int sock)
 	}
 }
 
+/**
+ * recv_block:
+ * @sock: socket to read from,
+ * @buf: buffer to read into,
+ * @len: size of @buf,
+ * @ts: pointer to store the receive time in.
+ *
+ * Reads a block from the data stream along with the monotonic time it
+ * was received; where the kernel can tell us when the data arrived we
+ * use that, converted from the real-time clock, rather than when we got
+ * round to reading it.
+ *
+ * Returns: number of bytes read, 0 if the socket was closed or < 0 on
+ * error.
+ **/
+static int
+recv_block (int              sock,
+	    unsigned char   *buf,
+	    size_t           len,
+	    struct timespec *ts)
+{
+#ifdef SO_TIMESTAMPNS
+	struct msghdr    msg;
+	struct iovec     iov;
+	struct cmsghdr  *cmsg;
+	char             control[CMSG_SPACE (sizeof (struct timespec))];
+	struct timespec  arrived, real;
+	long long        ns;
+	int              ret;
+
+	if (! recording ()) {
+		clock_gettime (CLOCK_MONOTONIC, ts);
+		return read (sock, buf, len);
+	}
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+
+	ret = recvmsg (sock, &msg, 0);
+	clock_gettime (CLOCK_MONOTONIC, ts);
+	if (ret <= 0)
+		return ret;
+
+	for (cmsg = CMSG_FIRSTHDR (&msg); cmsg;
+	     cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+		if ((cmsg->cmsg_level != SOL_SOCKET)
+		    || (cmsg->cmsg_type != SCM_TIMESTAMPNS))
+			continue;
+
+		/* Take off however long it's been waiting for us */
+		memcpy (&arrived, CMSG_DATA (cmsg), sizeof (arrived));
+		clock_gettime (CLOCK_REALTIME, &real);
+
+		ns = ((real.tv_sec - arrived.tv_sec) * 1000000000LL
+		      + (real.tv_nsec - arrived.tv_nsec));
+		if ((ns > 0) && (ns < ts->tv_sec * 1000000000LL)) {
+			ns = (ts->tv_sec * 1000000000LL + ts->tv_nsec) - ns;
+			ts->tv_sec = ns / 1000000000LL;
+			ts->tv_nsec = ns % 1000000000LL;
+		}
+		break;
+	}
+
+	return ret;
+#else /* SO_TIMESTAMPNS */
+	clock_gettime (CLOCK_MONOTONIC, ts);
+
+	return read (sock, buf, len);
+#endif /* SO_TIMESTAMPNS */
+}
+
 /**
  * parse_stream_block:
  * @state: application state structure,
@@ -213,6 +342,10 @@ read_stream (CurrentState *state, int sock)
  * Parse a data stream block obtained either from the data server or a
  * key frame.  Calls either handle_car_packet() or handle_system_packet(),
  * and is safe for those to result in further stream parsing calls.
+ *
+ * While we're waiting for the decryption key, encrypted packets are
+ * queued instead; they're handled by release_queued_packets() once the
+ * key arrives.  Packets in the clear are handled straight away.
  **/
 int
 parse_stream_block (CurrentState        *state,
@@ -220,45 +353,194 @@ parse_stream_block (CurrentState        *state,
 		    size_t               buf_len)
 {
 	Packet packet;
+	int    encrypted;
+
+	while (next_packet (state, &packet, &encrypted, &buf, &buf_len)) {
+		packets++;
+
+		if (encrypted && (packet.len > 0)) {
+			if (state->key_pending) {
+				queue_packet (state, &packet);
+				crypt_offset += packet.len;
+				continue;
+			}
+
+			decrypt_bytes (state, packet.payload, packet.len);
+			crypt_offset += packet.len;
+		}
 
-	while (next_packet (state, &packet, &buf, &buf_len)) {
 		if (packet.car) {
-			handle_car_packet (state, &packet);
+			if (! handle_car_packet (state, &packet))
+				continue;
 		} else {
 			handle_system_packet (state, &packet);
 		}
+		export_packet (state, &packet);
 	}
 
 	return 0;
 }
 
+/**
+ * queue_packet:
+ * @state: application state structure,
+ * @packet: packet with payload still encrypted.
+ *
+ * Adds the packet to the end of the queue along with the number of bytes
+ * since the decryption was last reset, which is all we need to decrypt
+ * it once we have the key.  If the queue is full the oldest packet is
+ * dropped, and a key frame requested at the next marker to make up for
+ * whatever it contained.
+ **/
+static void
+queue_packet (CurrentState *state,
+	      const Packet *packet)
+{
+	QueuedPacket *qp;
+
+	if (! queue) {
+		queue = malloc (sizeof (QueuedPacket) * PACKET_QUEUE_SIZE);
+		if (! queue)
+			abort ();
+	}
+
+	if (queue_len == PACKET_QUEUE_SIZE) {
+		queue_start = (queue_start + 1) % PACKET_QUEUE_SIZE;
+		queue_len--;
+
+		if (! queue_dropped++)
+			info (2, _("Packet queue full, dropping packets\n"));
+		state->frame = 0;
+	}
+
+	qp = &queue[(queue_start + queue_len++) % PACKET_QUEUE_SIZE];
+	qp->offset = crypt_offset;
+	qp->packet.car = packet->car;
+	qp->packet.type = packet->type;
+	qp->packet.data = packet->data;
+	qp->packet.len = packet->len;
+	memcpy (qp->packet.payload, packet->payload, packet->len + 1);
+}
+
+/**
+ * release_queued_packets:
+ * @state: application state structure.
+ *
+ * Decrypts and handles any packets that were queued while waiting for
+ * the decryption key, in the order they were received; then brings the
+ * salt up to date with the stream.  If we failed to get a key, the
+ * packets are thrown away.
+ **/
+void
+release_queued_packets (CurrentState *state)
+{
+	unsigned int offset;
+
+	if (queue_dropped)
+		info (2, _("Dropped %u packets waiting for the key\n"),
+		      queue_dropped);
+
+	if (! state->key) {
+		discard_queued_packets ();
+		return;
+	}
+
+	state->salt = CRYPTO_SEED;
+	offset = 0;
+
+	while (queue_len) {
+		QueuedPacket *qp;
+
+		qp = &queue[queue_start];
+		queue_start = (queue_start + 1) % PACKET_QUEUE_SIZE;
+		queue_len--;
+
+		/* Offsets go backwards where the salt was reset */
+		if (qp->offset < offset) {
+			state->salt = CRYPTO_SEED;
+			offset = 0;
+		}
+		for (; offset < qp->offset; offset++)
+			state->salt = next_salt (state->salt, state->key);
+
+		decrypt_bytes (state, qp->packet.payload, qp->packet.len);
+		offset += qp->packet.len;
+
+		if (qp->packet.car) {
+			handle_car_packet (state, &qp->packet);
+		} else {
+			handle_system_packet (state, &qp->packet);
+		}
+	}
+
+	/* Catch up with the stream */
+	if (crypt_offset < offset) {
+		state->salt = CRYPTO_SEED;
+		offset = 0;
+	}
+	for (; offset < crypt_offset; offset++)
+		state->salt = next_salt (state->salt, state->key);
+
+	queue_dropped = 0;
+}
+
+/**
+ * discard_queued_packets:
+ *
+ * Throws away any packets that were queued while waiting for the
+ * decryption key, used when the connection to the server is lost or a
+ * different event begins.
+ **/
+void
+discard_queued_packets (void)
+{
+	queue_start = queue_len = 0;
+	queue_dropped = 0;
+}
+
 /**
  * next_packet:
  * @state: application state structure,
  * @packet: packet structure to fill,
+ * @encrypted: set to whether the payload is encrypted,
  * @buf: buffer to copy packet from,
  * @buf_len: length of @buf.
  *
  * Takes bytes from @buf until a complete raw packet has been seen,
  * at which point if fills @packet with the decoded information about
- * it.
+ * it and sets @encrypted if the payload still needs decrypting.
  *
  * @buf_len is decreased and @buf moved upwards each time bytes are
- * taken from it.  The bytes are copied into an internal buffer so
- * there's no need to worry about packets crossing block boundaries.
+ * taken from it.  Packets that are whole within @buf are read from it
+ * where they are; otherwise the bytes are copied into an internal
+ * buffer so there's no need to worry about packets crossing block
+ * boundaries.  Either way only the payload is copied into @packet,
+ * where the caller decrypts it.
  *
  * Returns: 0 if the packet was not complete, 1 if it is complete
  **/
 static int
 next_packet (CurrentState         *state,
 	     Packet               *packet,
+	     int                  *encrypted,
 	     const unsigned char **buf,
 	     size_t               *buf_len)
 {
-	static unsigned char pbuf[129];
-	static size_t        pbuf_len = 0;
+	const unsigned char *raw;
 	int                  decrypt = 0;
 
+	if ((! pbuf_len) && (*buf_len >= 2)) {
+		decrypt = decode_header (packet, *buf);
+		if ((packet->len <= 0) || (*buf_len >= packet->len + 2)) {
+			size_t len = MAX (packet->len, 0) + 2;
+
+			raw = *buf;
+			*buf += len;
+			*buf_len -= len;
+			goto complete;
+		}
+	}
+
 	/* We need a minimum of two bytes to figure out how long the rest
 	 * of it's supposed to be; copy those now if we have room.
 	 */
@@ -283,73 +565,7 @@ next_packet (CurrentState         *state,
 	 * Fill in some of the fields now, ok we'll rewrite these every
 	 * time we come through, but that's not really that bad.
 	 */
-	packet->car = PACKET_CAR (pbuf);
-	packet->type = PACKET_TYPE (pbuf);
-
-	if (packet->car) {
-		switch ((CarPacketType) packet->type) {
-		case CAR_POSITION_UPDATE:
-			packet->len = SPECIAL_PACKET_LEN (pbuf);
-			packet->data = SPECIAL_PACKET_DATA (pbuf);
-			decrypt = 0;
-			break;
-		case CAR_POSITION_HISTORY:
-			packet->len = LONG_PACKET_LEN (pbuf);
-			packet->data = LONG_PACKET_DATA (pbuf);
-			decrypt = 1;
-			break;
-		default:
-			packet->len = SHORT_PACKET_LEN (pbuf);
-			packet->data = SHORT_PACKET_DATA (pbuf);
-			decrypt = 1;
-			break;
-		}
-	} else {
-		switch ((SystemPacketType) packet->type) {
-		case SYS_EVENT_ID:
-		case SYS_KEY_FRAME:
-			packet->len = SHORT_PACKET_LEN (pbuf);
-			packet->data = SHORT_PACKET_DATA (pbuf);
-			decrypt = 0;
-			break;
-		case SYS_TIMESTAMP:
-			packet->len = 2;
-			packet->data = 0;
-			decrypt = 1;
-			break;
-		case SYS_WEATHER:
-		case SYS_TRACK_STATUS:
-			packet->len = SHORT_PACKET_LEN (pbuf);
-			packet->data = SHORT_PACKET_DATA (pbuf);
-			decrypt = 1;
-			break;
-		case SYS_COMMENTARY:
-		case SYS_NOTICE:
-		case SYS_SPEED:
-			packet->len = LONG_PACKET_LEN (pbuf);
-			packet->data = LONG_PACKET_DATA (pbuf);
-			decrypt = 1;
-			break;
-		case SYS_COPYRIGHT:
-			packet->len = LONG_PACKET_LEN (pbuf);
-			packet->data = LONG_PACKET_DATA (pbuf);
-			decrypt = 0;
-			break;
-		case SYS_VALID_MARKER:
-		case SYS_REFRESH_RATE:
-			packet->len = 0;
-			packet->data = 0;
-			decrypt = 0;
-			break;
-		default:
-			info (3, _("Unknown system packet type: %d\n"),
-			      packet->type);
-			packet->len = 0;
-			packet->data = 0;
-			decrypt = 0;
-			break;
-		}
-	}
+	decrypt = decode_header (packet, pbuf);
 
 	/* Copy as much as we can of the rest of the packet */
 	if (packet->len > 0) {
@@ -366,27 +582,144 @@ next_packet (CurrentState         *state,
 			return 0;
 	}
 
-	/* We have a full packet, reset our static cache length so we
+	/* We have a full packet, reset our cache length so we
 	 * can re-use it for the next packet (which might happen before
 	 * this one has finished being handled when key frames are being
 	 * fetched).
 	 */
+	raw = pbuf;
 	pbuf_len = 0;
 
-	/* Copy the payload and decrypt it */
+complete:
+	if (decrypt < 0) {
+		info (3, _("Unknown system packet type: %d\n"),
+		      packet->type);
+		if (! reparsing ())
+			dump_flight (_("unknown packet"), FALSE);
+		decrypt = 0;
+	}
+
+	/* Copy the payload, the caller decrypts it */
 	if (packet->len > 0) {
-		memcpy (packet->payload, pbuf + 2, packet->len);
+		memcpy (packet->payload, raw + 2, packet->len);
 		packet->payload[packet->len] = 0;
-
-		if (decrypt)
-			decrypt_bytes (state, packet->payload, packet->len);
 	} else {
 		packet->payload[0] = 0;
 	}
 
+	*encrypted = decrypt;
 	return 1;
 }
 
+/**
+ * restart_stream:
+ * @state: application state structure.
+ *
+ * Forgets everything about where we were in the data stream: any
+ * packet only partly seen, any packets waiting for the key, and the
+ * decryption salt; and clears the key frame so that the next marker
+ * fetches it.  Used when jumping to somewhere else in a recording,
+ * which must be the start of a packet.
+ **/
+void
+restart_stream (CurrentState *state)
+{
+	pbuf_len = 0;
+	discard_queued_packets ();
+	reset_decryption (state);
+
+	state->decryption_failure = 0;
+	state->frame = 0;
+}
+
+/**
+ * stream_packets:
+ *
+ * Returns: number of packets parsed so far, from any data stream.
+ **/
+unsigned long long
+stream_packets (void)
+{
+	return packets;
+}
+
+/**
+ * stream_partial:
+ * @buf: block about to be parsed,
+ * @len: length of @buf,
+ * @crypt_len: pointer to store number of bytes decrypted in.
+ *
+ * Works out how much of @buf finishes off a packet begun in an earlier
+ * block, so that parsing could be picked up from the first whole packet
+ * in it instead; and by how many bytes the salt moves on once that
+ * packet has been decrypted.  All of @buf if no packet begins in it.
+ *
+ * Returns: number of bytes.
+ **/
+size_t
+stream_partial (const unsigned char *buf,
+		size_t               len,
+		size_t              *crypt_len)
+{
+	unsigned char hdr[2];
+	Packet        packet;
+	size_t        needed;
+	int           decrypt;
+
+	*crypt_len = 0;
+	if (! pbuf_len)
+		return 0;
+
+	hdr[0] = pbuf[0];
+	if (pbuf_len > 1) {
+		hdr[1] = pbuf[1];
+	} else if (len) {
+		hdr[1] = buf[0];
+	} else {
+		return 0;
+	}
+
+	decrypt = decode_header (&packet, hdr);
+	needed = MAX (packet.len, 0) + 2 - pbuf_len;
+	if (needed >= len)
+		return len;
+
+	if (decrypt > 0)
+		*crypt_len = packet.len;
+	return needed;
+}
+
+/**
+ * save_stream:
+ * @ctx: context to fill.
+ *
+ * Saves where the parser is in the data stream, so it can be put back
+ * with restore_stream() after parsing something else.  The queue of
+ * packets waiting for the key isn't included; nothing else should be
+ * parsed while there's one.
+ **/
+void
+save_stream (StreamContext *ctx)
+{
+	memcpy (ctx->pbuf, pbuf, pbuf_len);
+	ctx->pbuf_len = pbuf_len;
+	ctx->crypt_offset = crypt_offset;
+}
+
+/**
+ * restore_stream:
+ * @ctx: context saved by save_stream().
+ *
+ * Puts the parser back where it was when @ctx was saved.
+ **/
+void
+restore_stream (const StreamContext *ctx)
+{
+	memcpy (pbuf, ctx->pbuf, ctx->pbuf_len);
+	pbuf_len = ctx->pbuf_len;
+	crypt_offset = ctx->crypt_offset;
+}
+
 /**
  * reset_decryption:
  * @state: application state structure.
@@ -398,6 +731,7 @@ void
 reset_decryption (CurrentState *state)
 {
 	state->salt = CRYPTO_SEED;
+	crypt_offset = 0;
 }
 
 /**
@@ -417,9 +751,5 @@ decrypt_bytes (CurrentState  *state,
 	if (! state->key)
 		return;
 
-	while (len--) {
-		state->salt = ((state->salt >> 1)
-			       ^ (state->salt & 0x01 ? state->key : 0));
-		*(buf++) ^= (state->salt & 0xff);
-	}
+	crypt_bytes (state->key, &state->salt, buf, len);
 }
@@ -23,6 +23,24 @@
 #include "live-f1.h"
 
 
+/**
+ * StreamContext:
+ * @pbuf: packet only partly received,
+ * @pbuf_len: length of @pbuf,
+ * @crypt_offset: number of encrypted bytes since the salt was reset.
+ *
+ * Where the parser is in the data stream, beyond what's kept in the
+ * state structure; saved and restored with save_stream() and
+ * restore_stream() so that a second copy of the state can be brought
+ * up to date from the same blocks.
+ **/
+typedef struct {
+	unsigned char pbuf[129];
+	size_t        pbuf_len;
+	unsigned int  crypt_offset;
+} StreamContext;
+
+
 SJR_BEGIN_EXTERN
 
 int  open_stream        (const char *hostname, unsigned int port);
@@ -30,6 +48,15 @@ int  read_stream        (CurrentState *state, int sock);
 int  parse_stream_block (CurrentState *state, const unsigned char *buf,
 			 size_t buf_len);
 
+void release_queued_packets (CurrentState *state);
+void discard_queued_packets (void);
+
+void restart_stream     (CurrentState *state);
+unsigned long long stream_packets (void);
+size_t stream_partial   (const unsigned char *buf, size_t len,
+			 size_t *crypt_len);
+void save_stream        (StreamContext *ctx);
+void restore_stream     (const StreamContext *ctx);
 void reset_decryption   (CurrentState *state);
 void decrypt_bytes      (CurrentState *state, unsigned char *buf, size_t len);
 
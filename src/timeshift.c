@@ -0,0 +1,508 @@
+/* live-f1
+ *
+ * timeshift.c - pausing and rewinding the live data stream
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "checkpoint.h"
+#include "clock.h"
+#include "display.h"
+#include "packet.h"
+#include "stream.h"
+#include "timeshift.h"
+
+
+/* Space taken in the buffer by a record with @_len bytes of data */
+#define RECORD_SIZE(_len) ((sizeof (ShiftRecord) + (_len) + 7) & ~7)
+
+
+/**
+ * ShiftKind:
+ *
+ * What a record in the buffer holds; padding fills the space at the end
+ * of the buffer when the next record won't fit there.
+ **/
+typedef enum {
+	SHIFT_PAD,
+	SHIFT_BLOCK
+} ShiftKind;
+
+/**
+ * ShiftRecord:
+ * @kind: what the record holds,
+ * @len: length of the data following,
+ * @timestamp: monotonic time the block was received, in nanoseconds.
+ *
+ * Header of each record in the buffer, a block is the data exactly as
+ * it was received.
+ **/
+typedef struct {
+	unsigned int       kind;
+	unsigned int       len;
+	unsigned long long timestamp;
+} ShiftRecord;
+
+
+/* Forward prototypes */
+static void          append         (ShiftKind kind,
+				     unsigned long long timestamp,
+				     const unsigned char *buf, size_t len);
+static void          make_room      (unsigned long long len);
+static unsigned long long next_record (unsigned long long pos);
+static ShiftRecord  *record_at      (unsigned long long pos);
+static int           seek_to        (unsigned long long target);
+static void          advance_to     (unsigned long long target);
+
+
+/* Buffer of the blocks received, positions in it count up for ever and
+ * are wrapped to find the record
+ */
+static unsigned char     *ring = NULL;
+static size_t             ring_size = 0;
+static unsigned long long head = 0, tail = 0;
+
+/* How long blocks are kept for, in nanoseconds */
+static unsigned long long keep_time = 0;
+
+/* Timestamp of the latest block */
+static unsigned long long latest = 0;
+
+/* Checkpoints of the live state, the position of each is that of the
+ * record after the block it was taken after
+ */
+static Checkpoints        checkpoints;
+
+/* Live state, and the one shown while time shifted */
+static CurrentState      *live = NULL, *shadow = NULL;
+static StreamContext      shadow_ctx;
+
+/* Whether the board is time shifted, and whether it's paused; when
+ * not, it plays @delay behind the live stream
+ */
+static int                shifted = 0, paused = 0;
+static unsigned long long delay = 0;
+
+/* Next record to parse into the shadow state, and how far it's got */
+static unsigned long long shadow_pos = 0, shadow_time = 0;
+
+/* Whether blocks are being parsed into the shadow state */
+static int                in_advance = 0;
+
+
+/**
+ * open_timeshift:
+ * @state: application state structure,
+ * @memory: most memory to use, in bytes,
+ * @minutes: most minutes of the data stream to keep.
+ *
+ * Begins keeping the blocks received in a buffer in memory, so that
+ * the board can be paused, rewound and fast-forwarded while the data
+ * stream carries on being received.  The buffer is a fixed size and
+ * the oldest blocks are forgotten to make room for new ones, as are
+ * those older than @minutes.  A quarter of @memory is kept for the
+ * checkpoints of the state that rewinding re-parses from.
+ **/
+void
+open_timeshift (CurrentState *state,
+		size_t        memory,
+		unsigned int  minutes)
+{
+	if ((! memory) || (! minutes))
+		return;
+
+	ring_size = (memory - memory / 4) & ~7;
+	ring = malloc (ring_size);
+	if (! ring)
+		abort ();
+
+	init_checkpoints (&checkpoints, CHECKPOINT_SECONDS, CHECKPOINT_PACKETS,
+			  memory / 4);
+
+	keep_time = minutes * 60ULL * 1000000000ULL;
+
+	live = state;
+	show_state (live);
+}
+
+/**
+ * timeshifting:
+ *
+ * Returns: TRUE if the data stream is being kept for pausing.
+ **/
+int
+timeshifting (void)
+{
+	return (ring != NULL);
+}
+
+/**
+ * reparsing:
+ *
+ * The packet handlers ask this so that blocks parsed again into the
+ * time shifted state don't repeat what the live state already did for
+ * them: fetching keys and key frames, writing to the recording, and
+ * adding to the trends.
+ *
+ * Returns: the live state while blocks are being parsed into the time
+ * shifted one, NULL otherwise.
+ **/
+const CurrentState *
+reparsing (void)
+{
+	return (in_advance ? live : NULL);
+}
+
+/**
+ * timeshift_block:
+ * @ts: monotonic time the block was received,
+ * @buf: data received,
+ * @len: length of @buf.
+ *
+ * Adds the block to the buffer once the live state has been updated
+ * from it, and takes a checkpoint of the live state when one is due.
+ **/
+void
+timeshift_block (const struct timespec *ts,
+		 const unsigned char   *buf,
+		 size_t                 len)
+{
+	unsigned long long timestamp;
+
+	if (! ring)
+		return;
+
+	timestamp = (ts->tv_sec * 1000000000ULL) + ts->tv_nsec;
+	append (SHIFT_BLOCK, timestamp, buf, len);
+	latest = timestamp;
+
+	if (checkpoint_due (&checkpoints, timestamp)
+	    && live->key && (! live->key_pending) && live->num_cars)
+		take_checkpoint (&checkpoints, live, timestamp, head);
+
+	/* Forget anything older than we're meant to keep */
+	while ((tail < head) && (record_at (tail)->timestamp + keep_time
+				 < timestamp))
+		tail = next_record (tail);
+
+	drop_checkpoints (&checkpoints, tail);
+
+	/* If we've forgotten where the board is up to, skip forwards to
+	 * the oldest point we can still show
+	 */
+	if (shifted && (shadow_pos < tail)
+	    && seek_to (record_at (tail)->timestamp))
+		live_timeshift ();
+}
+
+
+/**
+ * pause_timeshift:
+ *
+ * Pauses the board, which carries on from where it was when this is
+ * called again; the live data stream is still received meanwhile.
+ **/
+void
+pause_timeshift (void)
+{
+	if (! ring)
+		return;
+
+	if ((! shifted) && seek_to (latest))
+		return;
+
+	paused = ! paused;
+	if (paused) {
+		popup_message (_("Paused"));
+	} else {
+		close_popup ();
+		delay = real_ns () - shadow_time;
+	}
+}
+
+/**
+ * shift_timeshift:
+ * @ms: milliseconds to move by, negative to rewind.
+ *
+ * Rewinds or fast-forwards the board.  Rewinding restores the nearest
+ * checkpoint before the point wanted and re-parses only the blocks from
+ * there; fast-forwarding parses only the blocks skipped over.  Going
+ * past the end of the buffer returns to the live data stream.
+ **/
+void
+shift_timeshift (long ms)
+{
+	unsigned long long from, target;
+
+	if (! ring)
+		return;
+
+	from = shifted ? shadow_time : latest;
+	if ((ms < 0) && ((unsigned long long) -ms * 1000000ULL > from)) {
+		target = 0;
+	} else {
+		target = from + ms * 1000000LL;
+	}
+
+	if ((ms > 0) && (target >= latest)) {
+		live_timeshift ();
+		return;
+	} else if ((ms > 0) && shifted) {
+		hold_display (TRUE);
+		advance_to (target);
+		if (paused)
+			popup_message (_("Paused"));
+		hold_display (FALSE);
+	} else {
+		seek_to (target);
+	}
+
+	delay = real_ns () - shadow_time;
+}
+
+/**
+ * live_timeshift:
+ *
+ * Returns the board to the live data stream.
+ **/
+void
+live_timeshift (void)
+{
+	if (! shifted)
+		return;
+
+	shifted = paused = 0;
+	show_state (live);
+}
+
+/**
+ * play_timeshift:
+ *
+ * Called from the main loop to keep a time shifted board playing,
+ * parsing any blocks that are now due; once it catches up, the board
+ * goes back to the live data stream.
+ **/
+void
+play_timeshift (void)
+{
+	if ((! shifted) || paused)
+		return;
+
+	advance_to (real_ns () - delay);
+	if (shadow_pos >= head)
+		live_timeshift ();
+}
+
+
+/**
+ * append:
+ * @kind: kind of record,
+ * @timestamp: time for the record,
+ * @buf: data for the record,
+ * @len: length of @buf.
+ *
+ * Adds a record to the buffer, forgetting the oldest to make room; a
+ * record never wraps around the end of the buffer, padding fills the
+ * space left there instead.
+ **/
+static void
+append (ShiftKind            kind,
+	unsigned long long   timestamp,
+	const unsigned char *buf,
+	size_t               len)
+{
+	ShiftRecord *rec;
+	size_t       room;
+
+	if (RECORD_SIZE (len) > ring_size / 2)
+		return;
+
+	room = ring_size - (head % ring_size);
+	if (room < RECORD_SIZE (len)) {
+		make_room (room);
+		if (room >= sizeof (ShiftRecord)) {
+			rec = (ShiftRecord *) (ring + (head % ring_size));
+			rec->kind = SHIFT_PAD;
+			rec->len = room - sizeof (ShiftRecord);
+			rec->timestamp = timestamp;
+		}
+		head += room;
+	}
+
+	make_room (RECORD_SIZE (len));
+
+	rec = (ShiftRecord *) (ring + (head % ring_size));
+	rec->kind = kind;
+	rec->len = len;
+	rec->timestamp = timestamp;
+	if (buf)
+		memcpy (rec + 1, buf, len);
+
+	head += RECORD_SIZE (len);
+}
+
+/**
+ * make_room:
+ * @len: space needed.
+ *
+ * Forgets the oldest records until there's @len bytes free at the
+ * head of the buffer.
+ **/
+static void
+make_room (unsigned long long len)
+{
+	while (head + len - tail > ring_size)
+		tail = next_record (tail);
+}
+
+/**
+ * next_record:
+ * @pos: position of a record.
+ *
+ * Returns: position of the record after the one at @pos.
+ **/
+static unsigned long long
+next_record (unsigned long long pos)
+{
+	size_t room;
+
+	room = ring_size - (pos % ring_size);
+	if (room < sizeof (ShiftRecord))
+		return pos + room;
+
+	return pos + RECORD_SIZE (record_at (pos)->len);
+}
+
+/**
+ * record_at:
+ * @pos: position of a record.
+ *
+ * Returns: the record at @pos; if that's too near the end of the buffer
+ * for one to fit, it's the one at the start.
+ **/
+static ShiftRecord *
+record_at (unsigned long long pos)
+{
+	size_t room;
+
+	room = ring_size - (pos % ring_size);
+	if (room < sizeof (ShiftRecord))
+		pos += room;
+
+	return (ShiftRecord *) (ring + (pos % ring_size));
+}
+
+
+/**
+ * seek_to:
+ * @target: time to show the board as at.
+ *
+ * Restores the last checkpoint taken at or before @target (or the
+ * oldest there is, if they're all after it) into the shadow state and
+ * parses the blocks from there up to @target, then shows the shadow
+ * state.
+ *
+ * Returns: 0 on success, non-zero if there's no checkpoint to use.
+ **/
+static int
+seek_to (unsigned long long target)
+{
+	const Checkpoint *cp;
+
+	cp = find_checkpoint (&checkpoints, target, tail);
+	if (! cp)
+		return 1;
+
+	/* The host, e-mail address and so on are the live state's, but
+	 * those never change
+	 */
+	if (! shadow) {
+		shadow = calloc (1, sizeof (CurrentState));
+		if (! shadow)
+			abort ();
+
+		shadow->host = live->host;
+		shadow->auth_host = live->auth_host;
+		shadow->email = live->email;
+		shadow->password = live->password;
+		shadow->cookie = live->cookie;
+	}
+
+	hold_display (TRUE);
+
+	restore_checkpoint (&checkpoints, cp, shadow, &shadow_ctx);
+	shadow_pos = cp->position;
+	shadow_time = cp->timestamp;
+
+	advance_to (target);
+
+	shifted = 1;
+	show_state (shadow);
+	if (paused)
+		popup_message (_("Paused"));
+
+	hold_display (FALSE);
+	return 0;
+}
+
+/**
+ * advance_to:
+ * @target: time to bring the shadow state up to.
+ *
+ * Parses the blocks received up until @target into the shadow state,
+ * swapping the stream parser's context for the shadow's while doing so;
+ * reparsing() is true meanwhile.
+ **/
+static void
+advance_to (unsigned long long target)
+{
+	StreamContext live_ctx;
+
+	save_stream (&live_ctx);
+	restore_stream (&shadow_ctx);
+	in_advance = 1;
+
+	while (shadow_pos < head) {
+		ShiftRecord *rec = record_at (shadow_pos);
+
+		if (rec->timestamp > target)
+			break;
+
+		if (rec->kind == SHIFT_BLOCK)
+			parse_stream_block (shadow, (unsigned char *) (rec + 1),
+					    rec->len);
+
+		shadow_pos = next_record (shadow_pos);
+	}
+
+	in_advance = 0;
+	save_stream (&shadow_ctx);
+	restore_stream (&live_ctx);
+
+	shadow_time = MAX (shadow_time, MIN (target, latest));
+}
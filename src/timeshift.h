@@ -0,0 +1,51 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_TIMESHIFT_H
+#define LIVE_F1_TIMESHIFT_H
+
+#include <time.h>
+
+#include "live-f1.h"
+
+
+/* Default minutes of the data stream kept for pausing, and the most
+ * memory (in MiB) that may be used to keep it
+ */
+#define TIMESHIFT_MINUTES 30
+#define TIMESHIFT_MEMORY  8
+
+
+SJR_BEGIN_EXTERN
+
+void open_timeshift  (CurrentState *state, size_t memory,
+		      unsigned int minutes);
+int  timeshifting    (void);
+const CurrentState *reparsing (void);
+void timeshift_block (const struct timespec *ts,
+		      const unsigned char *buf, size_t len);
+
+void pause_timeshift (void);
+void shift_timeshift (long ms);
+void live_timeshift  (void);
+void play_timeshift  (void);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_TIMESHIFT_H */
@@ -0,0 +1,247 @@
+/* live-f1
+ *
+ * trend.c - histories of the weather and lap times
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdlib.h>
+
+#include "live-f1.h"
+#include "clock.h"
+#include "history.h"
+#include "packet.h"
+#include "session.h"
+#include "timeshift.h"
+#include "trend.h"
+
+
+/* Number of weather readings there are, indexed by WeatherPacketType */
+#define TREND_WEATHER (WEATHER_WIND_DIRECTION + 1)
+
+
+/**
+ * Trends:
+ * @event_no: event the histories are from,
+ * @weather: history of each weather reading,
+ * @lap_time: history of each car's lap times.
+ *
+ * Everything we keep a history of, indexed by session time.  All of it
+ * is forgotten when the event changes, since the next one may be at
+ * another track or on another day.  It's a fixed size, however long we
+ * watch for.
+ **/
+struct Trends {
+	unsigned int event_no;
+	History      weather[TREND_WEATHER];
+	History      lap_time[CAR_SLOTS];
+};
+
+
+/* Forward prototypes */
+static Trends *get_trends (CurrentState *state);
+static int     same_event (const CurrentState *state);
+
+
+/**
+ * record_weather:
+ * @state: application state structure,
+ * @type: which reading it is,
+ * @value: reading.
+ *
+ * Adds a weather reading to its history, unless it's one the live
+ * state already added being parsed again for the time shifted board.
+ **/
+void
+record_weather (CurrentState *state,
+		int           type,
+		int           value)
+{
+	Trends *trends;
+
+	if ((type < 0) || (type >= TREND_WEATHER) || reparsing ())
+		return;
+
+	trends = get_trends (state);
+	append_history (&trends->weather[type], now_seconds (), value);
+}
+
+/**
+ * record_lap_time:
+ * @state: application state structure,
+ * @car: car number,
+ * @value: lap time in thousandths of a second.
+ *
+ * Adds a lap time to the history of the car, unless it's being parsed
+ * again as for record_weather().
+ **/
+void
+record_lap_time (CurrentState *state,
+		 int           car,
+		 int           value)
+{
+	Trends *trends;
+
+	if ((car < 1) || (car > CAR_SLOTS) || reparsing ())
+		return;
+
+	trends = get_trends (state);
+	append_history (&trends->lap_time[car - 1], now_seconds (), value);
+}
+
+/**
+ * weather_trend:
+ * @state: application state structure,
+ * @type: which reading,
+ * @span: seconds to look back over,
+ * @summary: structure to fill.
+ *
+ * Summarises a weather reading over the last @span seconds.
+ *
+ * Returns: number of readings summarised.
+ **/
+int
+weather_trend (const CurrentState *state,
+	       int                 type,
+	       int                 span,
+	       HistoryBucket      *summary)
+{
+	if ((! same_event (state)) || (type < 0) || (type >= TREND_WEATHER)) {
+		summary->count = 0;
+		return 0;
+	}
+
+	return summary_history (&state->trends->weather[type],
+				now_seconds () - span, summary);
+}
+
+/**
+ * lap_time_trend:
+ * @state: application state structure,
+ * @span: seconds to look back over,
+ * @summary: structure to fill.
+ *
+ * Summarises the lap times of every car over the last @span seconds,
+ * giving the pace of the event.
+ *
+ * Returns: number of lap times summarised.
+ **/
+int
+lap_time_trend (const CurrentState *state,
+		int                 span,
+		HistoryBucket      *summary)
+{
+	int from, i;
+
+	summary->count = 0;
+	if (! same_event (state))
+		return 0;
+
+	from = now_seconds () - span;
+	for (i = 0; i < CAR_SLOTS; i++) {
+		HistoryBucket car;
+
+		if (! summary_history (&state->trends->lap_time[i], from, &car))
+			continue;
+
+		if (! summary->count) {
+			*summary = car;
+		} else {
+			summary->min = MIN (summary->min, car.min);
+			summary->max = MAX (summary->max, car.max);
+			summary->count += car.count;
+		}
+	}
+
+	return summary->count;
+}
+
+/**
+ * free_trends:
+ * @state: application state structure.
+ *
+ * Frees the histories kept for @state.
+ **/
+void
+free_trends (CurrentState *state)
+{
+	free (state->trends);
+	state->trends = NULL;
+}
+
+
+/**
+ * get_trends:
+ * @state: application state structure.
+ *
+ * Returns: the histories kept for @state, allocated and emptied the
+ * first time, and emptied again whenever the event has changed since
+ * they were recorded.
+ **/
+static Trends *
+get_trends (CurrentState *state)
+{
+	Trends *trends;
+	int     i;
+
+	if (state->trends) {
+		trends = state->trends;
+		if (trends->event_no != state->event_no) {
+			for (i = 0; i < TREND_WEATHER; i++)
+				clear_history (&trends->weather[i]);
+			for (i = 0; i < CAR_SLOTS; i++)
+				clear_history (&trends->lap_time[i]);
+
+			trends->event_no = state->event_no;
+		}
+
+		return trends;
+	}
+
+	trends = malloc (sizeof (Trends));
+	if (! trends)
+		abort ();
+
+	trends->event_no = state->event_no;
+	for (i = 0; i < TREND_WEATHER; i++)
+		init_history (&trends->weather[i], TREND_WEATHER_WINDOW,
+			      TREND_WEATHER_WIDTH);
+	for (i = 0; i < CAR_SLOTS; i++)
+		init_history (&trends->lap_time[i], TREND_LAP_WINDOW,
+			      TREND_LAP_WIDTH);
+
+	state->trends = trends;
+	return trends;
+}
+
+/**
+ * same_event:
+ * @state: application state structure.
+ *
+ * Returns: TRUE if there are histories for @state from the event it's
+ * showing.
+ **/
+static int
+same_event (const CurrentState *state)
+{
+	return (state->trends && (state->trends->event_no == state->event_no));
+}
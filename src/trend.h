@@ -0,0 +1,50 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_TREND_H
+#define LIVE_F1_TREND_H
+
+#include "live-f1.h"
+#include "history.h"
+
+
+/* Seconds each weather reading is kept for, and each summary of older
+ * ones covers; with HISTORY_BUCKETS of those that's most of a day
+ */
+#define TREND_WEATHER_WINDOW 1800
+#define TREND_WEATHER_WIDTH  300
+
+/* Seconds each lap time is kept for, and each summary covers */
+#define TREND_LAP_WINDOW 600
+#define TREND_LAP_WIDTH  60
+
+
+SJR_BEGIN_EXTERN
+
+void record_weather  (CurrentState *state, int type, int value);
+void record_lap_time (CurrentState *state, int car, int value);
+int  weather_trend   (const CurrentState *state, int type, int span,
+		      HistoryBucket *summary);
+int  lap_time_trend  (const CurrentState *state, int span,
+		      HistoryBucket *summary);
+void free_trends     (CurrentState *state);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_TREND_H */
@@ -0,0 +1,156 @@
+/* live-f1
+ *
+ * wire.c - packet header layout and stream encryption
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include "live-f1.h"
+#include "packet.h"
+#include "wire.h"
+
+
+/**
+ * decode_header:
+ * @packet: packet structure to fill,
+ * @hdr: two byte packet header.
+ *
+ * Fills in the car, type, data and length fields of @packet from the
+ * raw header; this is all that's needed to find the end of the packet
+ * in the stream, so is shared by everything that has to split it up
+ * (even without being able to decrypt it).  See PROTOCOL for the
+ * gory details.
+ *
+ * Returns: 1 if the payload is encrypted, 0 if in the clear, -1 if the
+ * packet is an unknown system packet (treated as having no payload).
+ **/
+int
+decode_header (Packet              *packet,
+	       const unsigned char *hdr)
+{
+	packet->car = PACKET_CAR (hdr);
+	packet->type = PACKET_TYPE (hdr);
+
+	if (packet->car) {
+		switch ((CarPacketType) packet->type) {
+		case CAR_POSITION_UPDATE:
+			packet->len = SPECIAL_PACKET_LEN (hdr);
+			packet->data = SPECIAL_PACKET_DATA (hdr);
+			return 0;
+		case CAR_POSITION_HISTORY:
+			packet->len = LONG_PACKET_LEN (hdr);
+			packet->data = LONG_PACKET_DATA (hdr);
+			return 1;
+		default:
+			packet->len = SHORT_PACKET_LEN (hdr);
+			packet->data = SHORT_PACKET_DATA (hdr);
+			return 1;
+		}
+	} else {
+		switch ((SystemPacketType) packet->type) {
+		case SYS_EVENT_ID:
+		case SYS_KEY_FRAME:
+			packet->len = SHORT_PACKET_LEN (hdr);
+			packet->data = SHORT_PACKET_DATA (hdr);
+			return 0;
+		case SYS_TIMESTAMP:
+			packet->len = 2;
+			packet->data = 0;
+			return 1;
+		case SYS_WEATHER:
+		case SYS_TRACK_STATUS:
+			packet->len = SHORT_PACKET_LEN (hdr);
+			packet->data = SHORT_PACKET_DATA (hdr);
+			return 1;
+		case SYS_COMMENTARY:
+		case SYS_NOTICE:
+		case SYS_SPEED:
+			packet->len = LONG_PACKET_LEN (hdr);
+			packet->data = LONG_PACKET_DATA (hdr);
+			return 1;
+		case SYS_COPYRIGHT:
+			packet->len = LONG_PACKET_LEN (hdr);
+			packet->data = LONG_PACKET_DATA (hdr);
+			return 0;
+		case SYS_VALID_MARKER:
+		case SYS_REFRESH_RATE:
+			packet->len = 0;
+			packet->data = 0;
+			return 0;
+		default:
+			packet->len = 0;
+			packet->data = 0;
+			return -1;
+		}
+	}
+}
+
+/**
+ * encode_header:
+ * @hdr: two byte buffer to fill,
+ * @car: index of car, or zero for system packets,
+ * @type: type of packet,
+ * @data: data field; the length and colour for short packets, or the
+ * length for long ones.
+ *
+ * Builds the raw header for a packet, the inverse of decode_header();
+ * it's up to the caller to pack @data correctly for the type.
+ **/
+void
+encode_header (unsigned char *hdr,
+	       int            car,
+	       int            type,
+	       int            data)
+{
+	unsigned int value;
+
+	value = (car & 0x1f) | ((type & 0x0f) << 5) | ((data & 0x7f) << 9);
+	hdr[0] = value & 0xff;
+	hdr[1] = value >> 8;
+}
+
+/**
+ * crypt_bytes:
+ * @key: decryption key,
+ * @salt: pointer to current salt,
+ * @buf: buffer to decrypt,
+ * @len: number of bytes in @buf to decrypt.
+ *
+ * Decrypts the initial @len bytes of @buf modifying the buffer given,
+ * advancing the salt as it goes.  The cipher is a simple XOR so this
+ * also encrypts.
+ **/
+void
+crypt_bytes (unsigned int   key,
+	     unsigned int  *salt,
+	     unsigned char *buf,
+	     size_t         len)
+{
+	unsigned int s = *salt;
+
+	while (len--) {
+		s = next_salt (s, key);
+		*(buf++) ^= (s & 0xff);
+	}
+
+	*salt = s;
+}
@@ -0,0 +1,81 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_WIRE_H
+#define LIVE_F1_WIRE_H
+
+#include "live-f1.h"
+#include "packet.h"
+
+
+/* Encryption seed */
+#define CRYPTO_SEED 0x55555555
+
+/* Which car the packet is for */
+#define PACKET_CAR(_p) ((_p)[0] & 0x1f)
+
+/* Which type of packet it is */
+#define PACKET_TYPE(_p) (((_p)[0] >> 5) | (((_p)[1] & 0x01) << 3))
+
+/* Data from a long packet */
+#define LONG_PACKET_DATA(_p) 0
+
+/* Data from a short packet */
+#define SHORT_PACKET_DATA(_p) (((_p)[1] & 0x0e) >> 1)
+
+/* Data from a special packet */
+#define SPECIAL_PACKET_DATA(_p) ((_p)[1] >> 1)
+
+/* Length of the packet if it's one of the long ones */
+#define LONG_PACKET_LEN(_p) ((_p)[1] >> 1)
+
+/* Length of the packet if it's one of the short ones */
+#define SHORT_PACKET_LEN(_p) (((_p)[1] & 0xf0) == 0xf0 ? -1 : ((_p)[1] >> 4))
+
+/* Length of the packet if it's a special one */
+#define SPECIAL_PACKET_LEN(_p) 0
+
+
+/**
+ * next_salt:
+ * @salt: salt to advance,
+ * @key: decryption key.
+ *
+ * Advances the salt by one byte of the stream.
+ *
+ * Returns: new salt.
+ **/
+static inline unsigned int
+next_salt (unsigned int salt,
+	   unsigned int key)
+{
+	return (salt >> 1) ^ (salt & 0x01 ? key : 0);
+}
+
+
+SJR_BEGIN_EXTERN
+
+int  decode_header (Packet *packet, const unsigned char *hdr);
+void encode_header (unsigned char *hdr, int car, int type, int data);
+void crypt_bytes   (unsigned int key, unsigned int *salt,
+		    unsigned char *buf, size_t len);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_WIRE_H */